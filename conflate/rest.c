@@ -7,13 +7,14 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #define strdup _strdup
-#define sleep(a) Sleep(a * 1000)
 #else
 #include <unistd.h>
 #include <sys/socket.h>
 #endif
 
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <curl/curl.h>
 
 #include <libconflate/conflate.h>
@@ -24,113 +25,69 @@ long curl_init_flags = CURL_GLOBAL_ALL;
 
 static int g_tot_process_new_configs = 0;
 
+/* Bytes received from the REST server that aren't yet part of a */
+/* processed config.  A streaming endpoint sends configs one after */
+/* another on one connection, each followed by END_OF_CONFIG, and */
+/* each is processed as soon as its END_OF_CONFIG arrives. */
+
 struct response_buffer {
     char *data;
     size_t bytes_used;
     size_t buffer_size;
-    struct response_buffer *next;
+    size_t bytes_scanned; /* Already searched for END_OF_CONFIG. */
 };
 
-struct response_buffer *response_buffer_head = NULL;
-struct response_buffer *cur_response_buffer = NULL;
-
-static struct response_buffer *mk_response_buffer(size_t size) {
-    struct response_buffer *r =
-      (struct response_buffer *) calloc(1, sizeof(struct response_buffer));
-    cb_assert(r);
-    r->data = malloc(size);
-    cb_assert(r->data);
-    r->bytes_used = 0;
-    r->buffer_size = size;
-    r->next = NULL;
-    return r;
-}
+static struct response_buffer response;
 
-static void free_response(struct response_buffer *response) {
-    if (!response) {
-        return;
-    }
-    if (response->next) {
-        free_response(response->next);
-    }
-    if (response->data) {
-        free(response->data);
-    }
-    free(response);
+static void reset_response(void) {
+    free(response.data);
+    response.data = malloc(RESPONSE_BUFFER_SIZE);
+    cb_assert(response.data);
+    response.bytes_used = 0;
+    response.buffer_size = RESPONSE_BUFFER_SIZE;
+    response.bytes_scanned = 0;
 }
 
-static struct response_buffer *write_data_to_buffer(struct response_buffer *buffer,
-                                                    const char *data, size_t len) {
-    size_t bytes_written = 0;
-    while (bytes_written < len) {
-        size_t bytes_to_write = (len - bytes_written);
-        size_t space = buffer->buffer_size - buffer->bytes_used;
-        if (space == 0) {
-            struct response_buffer *new_buffer = mk_response_buffer(buffer->buffer_size);
-            buffer->next = new_buffer;
-            buffer = new_buffer;
-        } else {
-            char *d;
-            if (bytes_to_write > space) {
-                bytes_to_write = space;
-            }
-            d = buffer->data;
-            d = &d[buffer->bytes_used];
-            memcpy(d,&data[bytes_written], bytes_to_write);
-            bytes_written += bytes_to_write;
-            buffer->bytes_used += bytes_to_write;
+static void write_data_to_buffer(const char *data, size_t len) {
+    if (response.buffer_size - response.bytes_used < len + 1) {
+        size_t size = response.buffer_size;
+        while (size - response.bytes_used < len + 1) {
+            size *= 2;
         }
-    }
-    return buffer;
-}
-
-static char *assemble_complete_response(struct response_buffer *response_head) {
-    struct response_buffer *cur_buffer = response_head;
-    size_t response_size = 0;
-    char *response = NULL;
-    char *ptr;
-
-    if (response_head == NULL) {
-        return NULL;
-    }
-
-    /* figure out how big the message is */
-    while (cur_buffer) {
-        response_size += cur_buffer->bytes_used;
-        cur_buffer = cur_buffer->next;
+        response.data = realloc(response.data, size);
+        cb_assert(response.data);
+        response.buffer_size = size;
     }
 
-    /* create buffer */
-    response = malloc(response_size + 1);
-    cb_assert(response);
-
-    /* populate buffer */
-    cur_buffer = response_head;
-    ptr = response;
-    while (cur_buffer) {
-        memcpy(ptr, cur_buffer->data, cur_buffer->bytes_used);
-        ptr += cur_buffer->bytes_used;
-        cur_buffer = cur_buffer->next;
-    }
+    memcpy(&response.data[response.bytes_used], data, len);
+    response.bytes_used += len;
+    response.data[response.bytes_used] = '\0';
+}
 
-    response[response_size] = '\0';
+/* Removes the first len bytes, the ones of a processed config.
+ */
+static void consume_response(size_t len) {
+    cb_assert(len <= response.bytes_used);
 
-    return response;
+    memmove(response.data, &response.data[len], response.bytes_used - len);
+    response.bytes_used -= len;
+    response.data[response.bytes_used] = '\0';
+    response.bytes_scanned = 0;
 }
 
-static bool pattern_ends_with(const char *pattern, const char *target, size_t target_size) {
-    size_t pattern_size;
-    cb_assert(target);
-    cb_assert(pattern);
-
-    pattern_size = strlen(pattern);
-    if (target_size < pattern_size) {
-        return false;
+static bool response_is_blank(void) {
+    size_t i;
+    for (i = 0; i < response.bytes_used; i++) {
+        if (!isspace((unsigned char) response.data[i])) {
+            return false;
+        }
     }
-    return memcmp(&target[target_size - pattern_size], pattern, pattern_size) == 0;
+    return true;
 }
 
-static conflate_result process_new_config(long http_code, conflate_handle_t *conf_handle) {
+static conflate_result process_new_config(long http_code,
+                                          conflate_handle_t *conf_handle,
+                                          char *config) {
     char *values[2];
     kvpair_t *kv;
     conflate_result (*call_back)(void *, kvpair_t *);
@@ -145,17 +102,7 @@ static conflate_result process_new_config(long http_code, conflate_handle_t *con
 
     kv = mk_kvpair(HTTP_CODE_KEY, values);
 
-    /* construct the new config from its components */
-    values[0] = assemble_complete_response(response_buffer_head);
-
-    free_response(response_buffer_head);
-    response_buffer_head = NULL;
-    cur_response_buffer = NULL;
-
-    if (values[0] == NULL) {
-        fprintf(stderr, "ERROR: invalid response from REST server\n");
-        return CONFLATE_ERROR;
-    }
+    values[0] = config;
 
     kv->next = mk_kvpair(CONFIG_KEY, values);
 
@@ -172,10 +119,6 @@ static conflate_result process_new_config(long http_code, conflate_handle_t *con
 
     /* clean up */
     free_kvpair(kv);
-    free(values[0]);
-
-    response_buffer_head = mk_response_buffer(RESPONSE_BUFFER_SIZE);
-    cur_response_buffer = response_buffer_head;
 
     return r;
 }
@@ -183,11 +126,39 @@ static conflate_result process_new_config(long http_code, conflate_handle_t *con
 static size_t handle_response(void *data, size_t s, size_t num, void *cb) {
     conflate_handle_t *c_handle = (conflate_handle_t *) cb;
     size_t size = s * num;
-    bool end_of_message = pattern_ends_with(END_OF_CONFIG, data, size);
-    cur_response_buffer = write_data_to_buffer(cur_response_buffer, data, size);
-    if (end_of_message) {
-        process_new_config(200, c_handle);
+    size_t eoc_len = strlen(END_OF_CONFIG);
+
+    write_data_to_buffer(data, size);
+
+    /* A chunk may hold several configs, or end in the middle */
+    /* of one, or even in the middle of an END_OF_CONFIG. */
+
+    while (response.bytes_used >= eoc_len) {
+        char *end = NULL;
+        size_t i;
+
+        for (i = response.bytes_scanned;
+             i + eoc_len <= response.bytes_used; i++) {
+            if (memcmp(&response.data[i], END_OF_CONFIG, eoc_len) == 0) {
+                end = &response.data[i];
+                break;
+            }
+        }
+
+        if (end == NULL) {
+            response.bytes_scanned = response.bytes_used - (eoc_len - 1);
+            break;
+        }
+
+        *end = '\0';
+
+        if (end > response.data) {
+            process_new_config(200, c_handle, response.data);
+        }
+
+        consume_response((end - response.data) + eoc_len);
     }
+
     return size;
 }
 
@@ -247,6 +218,30 @@ static char *strsep(char **stringp, char *pattern) {
 }
 #endif
 
+#ifdef WIN32
+/* A small LCG standing in for the missing rand_r(). */
+static int rand_r(unsigned int *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (int) ((*seed >> 16) & 0x7fff);
+}
+#endif
+
+/* Sleeps for a random time between half of and all of ms, so many
+ * clients backing off from the same REST servers spread out.  The
+ * jitter comes from the caller's own seed, leaving the process-wide
+ * rand() state alone.
+ */
+static void backoff_sleep(unsigned int ms, unsigned int *seed) {
+    unsigned int half = ms / 2;
+    unsigned int jittered = half + (unsigned int) (rand_r(seed) % (half + 1));
+
+#ifdef WIN32
+    Sleep(jittered);
+#else
+    usleep(jittered * 1000);
+#endif
+}
+
 void run_rest_conflate(void *arg) {
     conflate_handle_t *handle = (conflate_handle_t *) arg;
     char curl_error_string[CURL_ERROR_SIZE];
@@ -254,12 +249,18 @@ void run_rest_conflate(void *arg) {
     CURLcode c;
     CURL *curl_handle;
     bool always_retry = true;
+    unsigned int backoff_ms = REST_BACKOFF_MIN_MS;
+    unsigned int backoff_seed;
 
+    /* prep the buffer used to hold the config */
+    reset_response();
 
-
-    /* prep the buffers used to hold the config */
-    response_buffer_head = mk_response_buffer(RESPONSE_BUFFER_SIZE);
-    cur_response_buffer = response_buffer_head;
+    /* Mix in the pid, so moxi's started together don't jitter alike. */
+#ifdef WIN32
+    backoff_seed = (unsigned int) time(NULL) ^ (unsigned int) GetCurrentProcessId();
+#else
+    backoff_seed = (unsigned int) time(NULL) ^ (unsigned int) getpid();
+#endif
 
     /* Before connecting and all that, load the stored config */
     conf = load_kvpairs(handle, handle->conf->save_path);
@@ -297,6 +298,8 @@ void run_rest_conflate(void *arg) {
 
             while (next != NULL) {
                 char *url = strsep(&next, "|");
+                int stream_tot_process_new_configs = g_tot_process_new_configs;
+                bool streamed;
 
                 handle->url = url;
 
@@ -305,7 +308,19 @@ void run_rest_conflate(void *arg) {
                              userpass, /* The auth user and password. */
                              handle, handle_response);
 
-                if (curl_easy_perform(curl_handle) == 0) {
+                reset_response();
+
+                /* On a streaming endpoint, this only returns once */
+                /* the server closes the connection, and the configs */
+                /* are processed by handle_response() as they arrive. */
+
+                c = curl_easy_perform(curl_handle);
+
+                streamed = stream_tot_process_new_configs !=
+                           g_tot_process_new_configs;
+
+                if (c == CURLE_OK &&
+                    (streamed == false || response_is_blank() == false)) {
                     long http_code = 0;
                     if (curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code) != CURLE_OK) {
                         http_code = 0;
@@ -313,7 +328,8 @@ void run_rest_conflate(void *arg) {
                     /* We reach here if the REST server didn't provide a
                        streaming JSON response and so we need to process
                        the just-one-JSON response */
-                    conflate_result r = process_new_config(http_code, handle);
+                    conflate_result r = process_new_config(http_code, handle,
+                                                           response.data);
                     if (r == CONFLATE_SUCCESS ||
                         r == CONFLATE_ERROR) {
                       /* Restart at the beginning of the urls list */
@@ -324,13 +340,36 @@ void run_rest_conflate(void *arg) {
                       succeeding = true;
                       next = NULL;
                     }
-                } else {
+                } else if (c != CURLE_OK) {
                     fprintf(stderr, "WARNING: curl error: %s from: %s\n",
                             curl_error_string, url);
                 }
+
+                if (streamed) {
+                    /* A stream that delivered configs before it ended */
+                    /* counts as a success, even if it ended in error. */
+
+                    succeeding = true;
+                    next = NULL;
+                }
+            }
+
+            /* Don't overload the REST servers with tons of retries. */
+            /* Back off exponentially while none of them answer, and */
+            /* only briefly before reconnecting to one that did. */
+
+            if (succeeding) {
+                backoff_ms = REST_BACKOFF_MIN_MS;
             }
 
-            sleep(1);  /* Don't overload the REST servers with tons of retries. */
+            backoff_sleep(backoff_ms, &backoff_seed);
+
+            if (succeeding == false) {
+                backoff_ms *= 2;
+                if (backoff_ms > REST_BACKOFF_MAX_MS) {
+                    backoff_ms = REST_BACKOFF_MAX_MS;
+                }
+            }
 
             free(urls);
             free(userpass);
@@ -355,9 +394,8 @@ void run_rest_conflate(void *arg) {
         }
     }
 
-    free_response(response_buffer_head);
-    response_buffer_head = NULL;
-    cur_response_buffer = NULL;
+    free(response.data);
+    response.data = NULL;
 
     curl_easy_cleanup(curl_handle);
 
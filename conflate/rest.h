@@ -6,6 +6,10 @@
 #define CONFIG_KEY "contents"
 #define HTTP_CODE_KEY "http_code"
 
+/* Bounds of the backoff between passes over the REST server URL's. */
+#define REST_BACKOFF_MIN_MS 1000
+#define REST_BACKOFF_MAX_MS 30000
+
 void run_rest_conflate(void *arg);
 
 #endif	/* REST_H */
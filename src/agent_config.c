@@ -1247,8 +1247,13 @@ void cproxy_on_config_pool(proxy_main *m,
         cb_mutex_enter(&m->proxy_main_lock);
 
         /* Turn off the front_cache while we're reconfiguring. */
+        /* Workers may still be checking the stopped matchers, so */
+        /* their tries are only freed by a later reconfiguration, */
+        /* after every worker has seen the quiesce_gen bumped below. */
 
-        mcache_stop(&p->front_cache);
+        cproxy_reclaim_matchers(p);
+
+        cproxy_front_cache_stop(p);
         matcher_stop(&p->front_cache_matcher);
         matcher_stop(&p->front_cache_unmatcher);
 
@@ -1256,6 +1261,8 @@ void cproxy_on_config_pool(proxy_main *m,
 
         cb_mutex_enter(&p->proxy_lock);
 
+        p->quiesce_gen++;
+
         if (settings.verbose > 2) {
             if (p->config && config &&
                 strcmp(p->config, config) != 0) {
@@ -1309,8 +1316,7 @@ void cproxy_on_config_pool(proxy_main *m,
         if (shutdown_flag == false) {
             if (behavior_pool->base.front_cache_max > 0 &&
                 behavior_pool->base.front_cache_lifespan > 0) {
-                mcache_start(&p->front_cache,
-                             behavior_pool->base.front_cache_max);
+                cproxy_front_cache_start(p, &behavior_pool->base);
 
                 if (strlen(behavior_pool->base.front_cache_spec) > 0) {
                     matcher_start(&p->front_cache_matcher,
@@ -1378,6 +1384,11 @@ static void update_ptd_config(void *data0, void *data1) {
     port = p->port;
     prev = ptd->config_ver;
 
+    /* As a work item, this runs between requests, so the worker */
+    /* isn't in the middle of checking any of the proxy's matchers. */
+
+    ptd->quiesce_gen = p->quiesce_gen;
+
     if (ptd->config_ver != p->config_ver) {
         ptd->config_ver = p->config_ver;
 
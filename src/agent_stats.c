@@ -464,6 +464,7 @@ static void proxy_stats_dump_behavior(ADD_STAT add_stats,
     if (level >= 1) {
         APPEND_PREFIX_STAT("downstream_max", "%u", b->downstream_max);
         APPEND_PREFIX_STAT("downstream_conn_max", "%u", b->downstream_conn_max);
+        APPEND_PREFIX_STAT("downstream_conn_mux", "%u", b->downstream_conn_mux);
     }
 
     APPEND_PREFIX_STAT("downstream_weight",   "%u", b->downstream_weight);
@@ -487,13 +488,29 @@ static void proxy_stats_dump_behavior(ADD_STAT add_stats,
         APPEND_PREFIX_STAT("wait_queue_timeout", "%ld", /* In millisecs. */
               (b->wait_queue_timeout.tv_sec * 1000 +
                b->wait_queue_timeout.tv_usec / 1000));
+        APPEND_PREFIX_STAT("multiget_squash", "%d", b->multiget_squash);
+        APPEND_PREFIX_STAT("multiget_batch_max", "%u", b->multiget_batch_max);
+        APPEND_PREFIX_STAT("multiget_batch_delay", "%ld", /* In millisecs. */
+              (b->multiget_batch_delay.tv_sec * 1000 +
+               b->multiget_batch_delay.tv_usec / 1000));
+        APPEND_PREFIX_STAT("replica_read", "%d", b->replica_read);
+        APPEND_PREFIX_STAT("hedge_max_pct", "%u", b->hedge_max_pct);
+        APPEND_PREFIX_STAT("hedge_delay", "%ld", /* In millisecs. */
+              (b->hedge_delay.tv_sec * 1000 +
+               b->hedge_delay.tv_usec / 1000));
         APPEND_PREFIX_STAT("time_stats", "%d", b->time_stats);
         APPEND_PREFIX_STAT("connect_max_errors", "%d", b->connect_max_errors);
         APPEND_PREFIX_STAT("connect_retry_interval", "%d", b->connect_retry_interval);
+        APPEND_PREFIX_STAT("breaker_max_failures", "%u", b->breaker_max_failures);
+        APPEND_PREFIX_STAT("breaker_slow_time", "%u", b->breaker_slow_time);
+        APPEND_PREFIX_STAT("breaker_eject_time", "%u", b->breaker_eject_time);
+        APPEND_PREFIX_STAT("item_cache_max", "%u", b->item_cache_max);
+        APPEND_PREFIX_STAT("cut_through_min", "%u", b->cut_through_min);
         APPEND_PREFIX_STAT("front_cache_max", "%u", b->front_cache_max);
         APPEND_PREFIX_STAT("front_cache_lifespan", "%u", b->front_cache_lifespan);
         APPEND_PREFIX_STAT("front_cache_spec", "%s", b->front_cache_spec);
         APPEND_PREFIX_STAT("front_cache_unspec", "%s", b->front_cache_unspec);
+        APPEND_PREFIX_STAT("front_cache_sharded", "%d", b->front_cache_sharded);
         APPEND_PREFIX_STAT("key_stats_max", "%u", b->key_stats_max);
         APPEND_PREFIX_STAT("key_stats_lifespan", "%u", b->key_stats_lifespan);
         APPEND_PREFIX_STAT("key_stats_spec", "%s", b->key_stats_spec);
@@ -514,36 +531,39 @@ static void proxy_stats_dump_behavior(ADD_STAT add_stats,
 
 static void proxy_stats_dump_frontcache(ADD_STAT add_stats, conn *c,
                                         const char *prefix, proxy *p) {
-    cb_mutex_enter(p->front_cache.lock);
+    mcache fc;
+    uint32_t size;
 
-    if (p->front_cache.map != NULL) {
-        APPEND_PREFIX_STAT("size", "%u", genhash_size(p->front_cache.map));
+    /* Rolled up across all the front cache shards, if sharded. */
+
+    cproxy_front_cache_stats(p, &fc, &size);
+
+    if (fc.max > 0) {
+        APPEND_PREFIX_STAT("size", "%u", size);
     }
 
-    APPEND_PREFIX_STAT("max", "%u", p->front_cache.max);
-    APPEND_PREFIX_STAT("oldest_live", "%u", p->front_cache.oldest_live);
+    APPEND_PREFIX_STAT("max", "%u", fc.max);
+    APPEND_PREFIX_STAT("oldest_live", "%u", fc.oldest_live);
     APPEND_PREFIX_STAT("tot_get_hits",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_get_hits);
+           "%"PRIu64, (uint64_t) fc.tot_get_hits);
     APPEND_PREFIX_STAT("tot_get_expires",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_get_expires);
+           "%"PRIu64, (uint64_t) fc.tot_get_expires);
     APPEND_PREFIX_STAT("tot_get_misses",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_get_misses);
+           "%"PRIu64, (uint64_t) fc.tot_get_misses);
     APPEND_PREFIX_STAT("tot_get_bytes",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_get_bytes);
+           "%"PRIu64, (uint64_t) fc.tot_get_bytes);
     APPEND_PREFIX_STAT("tot_adds",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_adds);
+           "%"PRIu64, (uint64_t) fc.tot_adds);
     APPEND_PREFIX_STAT("tot_add_skips",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_add_skips);
+           "%"PRIu64, (uint64_t) fc.tot_add_skips);
     APPEND_PREFIX_STAT("tot_add_fails",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_add_fails);
+           "%"PRIu64, (uint64_t) fc.tot_add_fails);
     APPEND_PREFIX_STAT("tot_add_bytes",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_add_bytes);
+           "%"PRIu64, (uint64_t) fc.tot_add_bytes);
     APPEND_PREFIX_STAT("tot_deletes",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_deletes);
+           "%"PRIu64, (uint64_t) fc.tot_deletes);
     APPEND_PREFIX_STAT("tot_evictions",
-           "%"PRIu64, (uint64_t) p->front_cache.tot_evictions);
-
-    cb_mutex_exit(p->front_cache.lock);
+           "%"PRIu64, (uint64_t) fc.tot_evictions);
 }
 
 static void proxy_stats_dump_pstd_stats(ADD_STAT add_stats,
@@ -563,6 +583,8 @@ static void proxy_stats_dump_pstd_stats(ADD_STAT add_stats,
               "%"PRIu64, (uint64_t) pstats->tot_downstream_conn_acquired);
     APPEND_PREFIX_STAT("tot_downstream_conn_released",
               "%"PRIu64, (uint64_t) pstats->tot_downstream_conn_released);
+    APPEND_PREFIX_STAT("tot_downstream_conn_mux",
+              "%"PRIu64, (uint64_t) pstats->tot_downstream_conn_mux);
     APPEND_PREFIX_STAT("tot_downstream_released",
               "%"PRIu64, (uint64_t) pstats->tot_downstream_released);
     APPEND_PREFIX_STAT("tot_downstream_reserved",
@@ -633,6 +655,26 @@ static void proxy_stats_dump_pstd_stats(ADD_STAT add_stats,
               "%"PRIu64, (uint64_t) pstats->tot_multiget_keys_dedupe);
     APPEND_PREFIX_STAT("tot_multiget_bytes_dedupe",
               "%"PRIu64, (uint64_t) pstats->tot_multiget_bytes_dedupe);
+    APPEND_PREFIX_STAT("tot_multiget_stream",
+              "%"PRIu64, (uint64_t) pstats->tot_multiget_stream);
+    APPEND_PREFIX_STAT("tot_multiget_stream_abort",
+              "%"PRIu64, (uint64_t) pstats->tot_multiget_stream_abort);
+    APPEND_PREFIX_STAT("tot_multiget_batch",
+              "%"PRIu64, (uint64_t) pstats->tot_multiget_batch);
+    APPEND_PREFIX_STAT("tot_multiget_partial",
+              "%"PRIu64, (uint64_t) pstats->tot_multiget_partial);
+    APPEND_PREFIX_STAT("tot_replica_read",
+              "%"PRIu64, (uint64_t) pstats->tot_replica_read);
+    APPEND_PREFIX_STAT("tot_hedge_sent",
+              "%"PRIu64, (uint64_t) pstats->tot_hedge_sent);
+    APPEND_PREFIX_STAT("tot_hedge_won",
+              "%"PRIu64, (uint64_t) pstats->tot_hedge_won);
+    APPEND_PREFIX_STAT("tot_downstream_ejected",
+              "%"PRIu64, (uint64_t) pstats->tot_downstream_ejected);
+    APPEND_PREFIX_STAT("tot_downstream_ejected_fail",
+              "%"PRIu64, (uint64_t) pstats->tot_downstream_ejected_fail);
+    APPEND_PREFIX_STAT("tot_downstream_ejected_probe",
+              "%"PRIu64, (uint64_t) pstats->tot_downstream_ejected_probe);
     APPEND_PREFIX_STAT("tot_optimize_sets",
               "%"PRIu64, (uint64_t) pstats->tot_optimize_sets);
     APPEND_PREFIX_STAT("tot_retry",
@@ -792,6 +834,17 @@ void proxy_stats_dump_proxy_main(ADD_STAT add_stats, conn *c,
         APPEND_PREFIX_STAT("stat_proxy_shutdowns",
                     "%"PRIu64, (uint64_t) pm->stat_proxy_shutdowns);
     }
+
+    if (pscip->do_stats) {
+        const char *prefix = "proxy_main:item_cache:";
+        item_cache ic;
+        item_cache_stats_aggregate(&ic);
+        APPEND_PREFIX_STAT("max", "%"PRIu64, (uint64_t) item_cache_max);
+        APPEND_PREFIX_STAT("bytes", "%"PRIu64, ic.bytes);
+        APPEND_PREFIX_STAT("hits", "%"PRIu64, ic.hits);
+        APPEND_PREFIX_STAT("misses", "%"PRIu64, ic.misses);
+        APPEND_PREFIX_STAT("overflows", "%"PRIu64, ic.overflows);
+    }
 }
 
 void xpassword(char *p) {
@@ -1059,49 +1112,50 @@ static void main_stats_collect(void *data0, void *data1) {
         /* Emit front_cache stats. */
 
         if (msci->do_stats) {
-            cb_mutex_enter(p->front_cache.lock);
+            mcache fc;
+            uint32_t size;
 
-            if (p->front_cache.map != NULL) {
-                emit_f("front_cache_size", "%u", genhash_size(p->front_cache.map));
+            cproxy_front_cache_stats(p, &fc, &size);
+
+            if (fc.max > 0) {
+                emit_f("front_cache_size", "%u", size);
             }
 
             emit_f("front_cache_max",
-                   "%u", p->front_cache.max);
+                   "%u", fc.max);
             emit_f("front_cache_oldest_live",
-                   "%u", p->front_cache.oldest_live);
+                   "%u", fc.oldest_live);
 
             emit_f("front_cache_tot_get_hits",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_get_hits);
+                   (uint64_t) fc.tot_get_hits);
             emit_f("front_cache_tot_get_expires",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_get_expires);
+                   (uint64_t) fc.tot_get_expires);
             emit_f("front_cache_tot_get_misses",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_get_misses);
+                   (uint64_t) fc.tot_get_misses);
             emit_f("front_cache_tot_get_bytes",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_get_bytes);
+                   (uint64_t) fc.tot_get_bytes);
             emit_f("front_cache_tot_adds",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_adds);
+                   (uint64_t) fc.tot_adds);
             emit_f("front_cache_tot_add_skips",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_add_skips);
+                   (uint64_t) fc.tot_add_skips);
             emit_f("front_cache_tot_add_fails",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_add_fails);
+                   (uint64_t) fc.tot_add_fails);
             emit_f("front_cache_tot_add_bytes",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_add_bytes);
+                   (uint64_t) fc.tot_add_bytes);
             emit_f("front_cache_tot_deletes",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_deletes);
+                   (uint64_t) fc.tot_deletes);
             emit_f("front_cache_tot_evictions",
                    "%"PRIu64,
-                   (uint64_t) p->front_cache.tot_evictions);
-
-            cb_mutex_exit(p->front_cache.lock);
+                   (uint64_t) fc.tot_evictions);
         }
     }
 
@@ -1282,6 +1336,7 @@ static void add_proxy_stats(proxy_stats *agg, proxy_stats *x) {
     agg->tot_downstream_conn += x->tot_downstream_conn;
     agg->tot_downstream_conn_acquired += x->tot_downstream_conn_acquired;
     agg->tot_downstream_conn_released += x->tot_downstream_conn_released;
+    agg->tot_downstream_conn_mux += x->tot_downstream_conn_mux;
     agg->tot_downstream_released += x->tot_downstream_released;
     agg->tot_downstream_reserved += x->tot_downstream_reserved;
     agg->tot_downstream_reserved_time  += x->tot_downstream_reserved_time;
@@ -1326,6 +1381,18 @@ static void add_proxy_stats(proxy_stats *agg, proxy_stats *x) {
     agg->tot_multiget_keys        += x->tot_multiget_keys;
     agg->tot_multiget_keys_dedupe += x->tot_multiget_keys_dedupe;
     agg->tot_multiget_bytes_dedupe += x->tot_multiget_bytes_dedupe;
+    agg->tot_multiget_stream      += x->tot_multiget_stream;
+    agg->tot_multiget_stream_abort += x->tot_multiget_stream_abort;
+    agg->tot_multiget_batch       += x->tot_multiget_batch;
+    agg->tot_multiget_partial     += x->tot_multiget_partial;
+    agg->tot_replica_read         += x->tot_replica_read;
+    agg->tot_hedge_sent           += x->tot_hedge_sent;
+    agg->tot_hedge_won            += x->tot_hedge_won;
+    agg->tot_downstream_ejected   += x->tot_downstream_ejected;
+    agg->tot_downstream_ejected_fail +=
+        x->tot_downstream_ejected_fail;
+    agg->tot_downstream_ejected_probe +=
+        x->tot_downstream_ejected_probe;
     agg->tot_optimize_sets        += x->tot_optimize_sets;
     agg->tot_retry                += x->tot_retry;
     agg->tot_retry_time           += x->tot_retry_time;
@@ -1537,6 +1604,8 @@ void map_pstd_foreach_emit(const void *k,
               pstd->stats.tot_downstream_conn_acquired);
     more_stat("tot_downstream_conn_released",
               pstd->stats.tot_downstream_conn_released);
+    more_stat("tot_downstream_conn_mux",
+              pstd->stats.tot_downstream_conn_mux);
     more_stat("tot_downstream_released",
               pstd->stats.tot_downstream_released);
     more_stat("tot_downstream_reserved",
@@ -1607,6 +1676,26 @@ void map_pstd_foreach_emit(const void *k,
               pstd->stats.tot_multiget_keys_dedupe);
     more_stat("tot_multiget_bytes_dedupe",
               pstd->stats.tot_multiget_bytes_dedupe);
+    more_stat("tot_multiget_stream",
+              pstd->stats.tot_multiget_stream);
+    more_stat("tot_multiget_stream_abort",
+              pstd->stats.tot_multiget_stream_abort);
+    more_stat("tot_multiget_batch",
+              pstd->stats.tot_multiget_batch);
+    more_stat("tot_multiget_partial",
+              pstd->stats.tot_multiget_partial);
+    more_stat("tot_replica_read",
+              pstd->stats.tot_replica_read);
+    more_stat("tot_hedge_sent",
+              pstd->stats.tot_hedge_sent);
+    more_stat("tot_hedge_won",
+              pstd->stats.tot_hedge_won);
+    more_stat("tot_downstream_ejected",
+              pstd->stats.tot_downstream_ejected);
+    more_stat("tot_downstream_ejected_fail",
+              pstd->stats.tot_downstream_ejected_fail);
+    more_stat("tot_downstream_ejected_probe",
+              pstd->stats.tot_downstream_ejected_probe);
     more_stat("tot_optimize_sets",
               pstd->stats.tot_optimize_sets);
     more_stat("tot_retry",
@@ -1760,7 +1849,7 @@ static void main_stats_reset(void *data0, void *data1) {
 
         p->listening_failed = 0;
 
-        mcache_reset_stats(&p->front_cache);
+        cproxy_front_cache_reset_stats(p);
     }
 
     cb_mutex_exit(&m->proxy_main_lock);
@@ -0,0 +1,133 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef ATOMICS_H
+#define ATOMICS_H
+
+#include "src/config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Thread locals, and the few atomic operations that moxi's lock-free
+ * paths need, for GCC-compatible compilers and MSVC.
+ *
+ * Pointer loads and stores are acquire and release, for publishing
+ * a struct to other threads.  The _relaxed ones only promise a load
+ * or store that doesn't tear, for counters with a single writer.
+ * The rest are sequentially consistent.
+ *
+ * The pointer functions take the address of any pointer variable,
+ * such as &head for a work_item *head.
+ */
+
+#if defined(__GNUC__)
+
+#define THREAD_LOCAL __thread
+
+static inline int atomic_load_int(int *p) {
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomic_xchg_int(int *p, int v) {
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomic_add_int(int *p, int v) {
+    return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t atomic_load_u64(uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static inline void atomic_store_u64(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t atomic_load_u64_relaxed(uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_store_u64_relaxed(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_add_u64_relaxed(uint64_t *p, int64_t v) {
+    __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+}
+
+static inline void *atomic_load_ptr(void *p) {
+    return __atomic_load_n((void **) p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store_ptr(void *p, void *v) {
+    __atomic_store_n((void **) p, v, __ATOMIC_RELEASE);
+}
+
+static inline void *atomic_xchg_ptr(void *p, void *v) {
+    return __atomic_exchange_n((void **) p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline bool atomic_cas_ptr(void *p, void *o, void *v) {
+    return __atomic_compare_exchange_n((void **) p, &o, v, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#elif defined(_MSC_VER)
+
+#define THREAD_LOCAL __declspec(thread)
+
+static inline int atomic_load_int(int *p) {
+    return InterlockedCompareExchange((LONG volatile *) p, 0, 0);
+}
+
+static inline int atomic_xchg_int(int *p, int v) {
+    return InterlockedExchange((LONG volatile *) p, v);
+}
+
+static inline int atomic_add_int(int *p, int v) {
+    return InterlockedExchangeAdd((LONG volatile *) p, v);
+}
+
+static inline uint64_t atomic_load_u64(uint64_t *p) {
+    return InterlockedCompareExchange64((LONGLONG volatile *) p, 0, 0);
+}
+
+static inline void atomic_store_u64(uint64_t *p, uint64_t v) {
+    InterlockedExchange64((LONGLONG volatile *) p, v);
+}
+
+static inline uint64_t atomic_load_u64_relaxed(uint64_t *p) {
+    return *(volatile uint64_t *) p;
+}
+
+static inline void atomic_store_u64_relaxed(uint64_t *p, uint64_t v) {
+    *(volatile uint64_t *) p = v;
+}
+
+static inline void atomic_add_u64_relaxed(uint64_t *p, int64_t v) {
+    InterlockedExchangeAdd64((LONGLONG volatile *) p, v);
+}
+
+static inline void *atomic_load_ptr(void *p) {
+    return InterlockedCompareExchangePointer((PVOID volatile *) p,
+                                             NULL, NULL);
+}
+
+static inline void atomic_store_ptr(void *p, void *v) {
+    InterlockedExchangePointer((PVOID volatile *) p, v);
+}
+
+static inline void *atomic_xchg_ptr(void *p, void *v) {
+    return InterlockedExchangePointer((PVOID volatile *) p, v);
+}
+
+static inline bool atomic_cas_ptr(void *p, void *o, void *v) {
+    return InterlockedCompareExchangePointer((PVOID volatile *) p, v, o) == o;
+}
+
+#else
+#error "moxi needs thread locals and atomic operations"
+#endif
+
+#endif
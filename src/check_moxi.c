@@ -320,7 +320,7 @@ START_TEST(test_matcher)
 {
     matcher m;
 
-    matcher_init(&m, false);
+    matcher_init(&m, 1);
     fail_if(true == matcher_check(&m, s_len("hi"), false),
             "when unstarted");
     fail_if(false == matcher_check(&m, s_len("hi"), true),
@@ -438,6 +438,22 @@ START_TEST(test_matcher)
                 "match");
     fail_unless(true == matcher_check(&m, s_len("pre3:foo"), false),
                 "match");
+
+    matcher_stop(&m);
+    matcher_start(&m, "a|ab|abc|b");
+    fail_if(matcher_started(&m) == false, "started");
+
+    fail_unless(true == matcher_check(&m, s_len("abcd"), false),
+                "match");
+    fail_unless(true == matcher_check_ex(&m, 1, s_len("ab"), false),
+                "match with out of range slot");
+    fail_if(true == matcher_check(&m, s_len("c"), false),
+            "no match");
+    fail_unless(matcher_hits(&m, 0) == 2, "hits of nested prefix");
+    fail_unless(matcher_hits(&m, 1) == 2, "hits of nested prefix");
+    fail_unless(matcher_hits(&m, 2) == 1, "hits of nested prefix");
+    fail_unless(matcher_hits(&m, 3) == 0, "hits of unmatched prefix");
+    fail_unless(matcher_hits(&m, -1) == 1, "misses");
 }
 END_TEST
 
@@ -146,6 +146,7 @@ struct field_description proxy_stats_description[] = {
   describe_field(struct proxy_stats, tot_upstream),
   describe_field(struct proxy_stats, num_downstream_conn),
   describe_field(struct proxy_stats, tot_downstream_conn),
+  describe_field(struct proxy_stats, tot_downstream_conn_mux),
   describe_field(struct proxy_stats, tot_downstream_released),
   describe_field(struct proxy_stats, tot_downstream_reserved),
   describe_field(struct proxy_stats, tot_downstream_freed),
@@ -170,6 +171,16 @@ struct field_description proxy_stats_description[] = {
   describe_field(struct proxy_stats, tot_multiget_keys),
   describe_field(struct proxy_stats, tot_multiget_keys_dedupe),
   describe_field(struct proxy_stats, tot_multiget_bytes_dedupe),
+  describe_field(struct proxy_stats, tot_multiget_stream),
+  describe_field(struct proxy_stats, tot_multiget_stream_abort),
+  describe_field(struct proxy_stats, tot_multiget_batch),
+  describe_field(struct proxy_stats, tot_multiget_partial),
+  describe_field(struct proxy_stats, tot_replica_read),
+  describe_field(struct proxy_stats, tot_hedge_sent),
+  describe_field(struct proxy_stats, tot_hedge_won),
+  describe_field(struct proxy_stats, tot_downstream_ejected),
+  describe_field(struct proxy_stats, tot_downstream_ejected_fail),
+  describe_field(struct proxy_stats, tot_downstream_ejected_probe),
   describe_field(struct proxy_stats, tot_optimize_sets),
   describe_field(struct proxy_stats, err_oom),
   describe_field(struct proxy_stats, err_upstream_write_prep),
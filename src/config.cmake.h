@@ -4,6 +4,7 @@
 
 #cmakedefine HAVE_UMEM_H ${HAVE_UMEM_H}
 #cmakedefine HAVE_SYSEXITS_H ${HAVE_SYSEXITS_H}
+#cmakedefine HAVE_SYS_EVENTFD_H ${HAVE_SYS_EVENTFD_H}
 
 #include <platform/platform.h>
 
@@ -72,6 +73,8 @@ typedef long long int64_t;
 #cmakedefine HAVE_GETRLIMIT ${HAVE_GETRLIMIT}
 #cmakedefine HAVE_MLOCKALL ${HAVE_MLOCKALL}
 #cmakedefine HAVE_GETPAGESIZES ${HAVE_GETPAGESIZES}
+#cmakedefine HAVE_RECVMMSG ${HAVE_RECVMMSG}
+#cmakedefine HAVE_SENDMMSG ${HAVE_SENDMMSG}
 
 
 #include <sys/wait.h>
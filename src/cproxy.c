@@ -12,6 +12,7 @@
 #include "cproxy.h"
 #include "work.h"
 #include "log.h"
+#include "strscan.h"
 
 #ifndef MOXI_BLOCKING_CONNECT
 #define MOXI_BLOCKING_CONNECT false
@@ -20,6 +21,9 @@
 /* Internal forward declarations. */
 
 downstream *downstream_list_remove(downstream *head, downstream *d);
+
+static void downstream_alloc_reset(downstream *d);
+static void downstream_alloc_free(downstream *d);
 downstream *downstream_list_waiting_remove(downstream *head,
                                            downstream **tail,
                                            downstream *d);
@@ -30,6 +34,9 @@ static void downstream_timeout(evutil_socket_t fd,
 static void wait_queue_timeout(evutil_socket_t fd,
                         const short which,
                         void *arg);
+static void batch_timeout(evutil_socket_t fd,
+                          const short which,
+                          void *arg);
 
 conn *conn_list_remove(conn *head, conn **tail,
                        conn *c, bool *found);
@@ -58,8 +65,6 @@ conn *zstored_acquire_downstream_conn(downstream *d,
                                       proxy_behavior *behavior,
                                       bool *downstream_conn_max_reached);
 
-void zstored_release_downstream_conn(conn *dc, bool closing);
-
 void zstored_error_count(LIBEVENT_THREAD *thread,
                          const char *host_ident,
                          bool has_error);
@@ -83,14 +88,27 @@ typedef struct {
 
     downstream *downstream_waiting_head;
     downstream *downstream_waiting_tail;
+
+    /* Binary downstream conn shared by many downstreams, when */
+    /* downstream_conn_mux > 0.  See cproxy_mux.c. */
+
+    conn *mux_dc;
+
+    /* Circuit breaker, when breaker_max_failures > 0.  The server */
+    /* is ejected while breaker_eject_time is non-zero, and lets */
+    /* one probe request through every breaker_eject_time msecs. */
+
+    uint32_t   breaker_failures;   /* Failed or slow requests in a row. */
+    uint64_t   breaker_eject_time; /* When last ejected or probed, or 0. */
 } zstored_downstream_conns;
 
 zstored_downstream_conns *zstored_get_downstream_conns(LIBEVENT_THREAD *thread,
                                                        const char *host_ident);
 
+void zstored_breaker_record(downstream *d, conn *dc, bool ok);
+
 bool cproxy_forward_or_error(downstream *d);
 
-int delink_from_downstream_conns(conn *c);
 
 int cproxy_num_active_proxies(proxy_main *m);
 
@@ -107,6 +125,7 @@ conn_funcs cproxy_listen_funcs = {
     .conn_pause                  = NULL,
     .conn_realtime               = NULL,
     .conn_state_change           = NULL,
+    .conn_nread_progress         = NULL,
     .conn_binary_command_magic   = 0
 };
 
@@ -121,6 +140,7 @@ conn_funcs cproxy_upstream_funcs = {
     .conn_pause                  = NULL,
     .conn_realtime               = cproxy_realtime,
     .conn_state_change           = cproxy_upstream_state_change,
+    .conn_nread_progress         = NULL,
     .conn_binary_command_magic   = PROTOCOL_BINARY_REQ
 };
 
@@ -135,6 +155,7 @@ conn_funcs cproxy_downstream_funcs = {
     .conn_pause                  = cproxy_on_pause_downstream_conn,
     .conn_realtime               = cproxy_realtime,
     .conn_state_change           = NULL,
+    .conn_nread_progress         = cproxy_on_nread_progress_downstream_conn,
     .conn_binary_command_magic   = PROTOCOL_BINARY_RES
 };
 
@@ -180,16 +201,13 @@ proxy *cproxy_create(proxy_main *main,
         cb_mutex_initialize(&p->proxy_lock);
 
         mcache_init(&p->front_cache, true, &mcache_item_funcs, true);
-        matcher_init(&p->front_cache_matcher, true);
-        matcher_init(&p->front_cache_unmatcher, true);
+        matcher_init(&p->front_cache_matcher, nthreads);
+        matcher_init(&p->front_cache_unmatcher, nthreads);
 
-        matcher_init(&p->optimize_set_matcher, true);
+        matcher_init(&p->optimize_set_matcher, nthreads);
 
         if (behavior_pool->base.front_cache_max > 0 &&
             behavior_pool->base.front_cache_lifespan > 0) {
-            mcache_start(&p->front_cache,
-                         behavior_pool->base.front_cache_max);
-
             if (strlen(behavior_pool->base.front_cache_spec) > 0) {
                 matcher_start(&p->front_cache_matcher,
                               behavior_pool->base.front_cache_spec);
@@ -240,15 +258,21 @@ proxy *cproxy_create(proxy_main *main,
                 ptd->downstream_assigns = 0;
                 ptd->timeout_tv.tv_sec = 0;
                 ptd->timeout_tv.tv_usec = 0;
+                ptd->batch_pending = false;
+                ptd->batch_held = 0;
+                ptd->hedge_credit = 0;
                 ptd->stats.stats.num_upstream = 0;
                 ptd->stats.stats.num_downstream_conn = 0;
 
                 cproxy_reset_stats_td(&ptd->stats);
 
+                mcache_init(&ptd->front_cache, true,
+                            &mcache_item_funcs, true);
+
                 mcache_init(&ptd->key_stats, true,
                             &mcache_key_stats_funcs, false);
-                matcher_init(&ptd->key_stats_matcher, false);
-                matcher_init(&ptd->key_stats_unmatcher, false);
+                matcher_init(&ptd->key_stats_matcher, 1);
+                matcher_init(&ptd->key_stats_unmatcher, 1);
 
                 if (behavior_pool->base.key_stats_max > 0 &&
                     behavior_pool->base.key_stats_lifespan > 0) {
@@ -267,6 +291,8 @@ proxy *cproxy_create(proxy_main *main,
                 }
             }
 
+            cproxy_front_cache_start(p, &behavior_pool->base);
+
             return p;
         }
 
@@ -280,6 +306,22 @@ proxy *cproxy_create(proxy_main *main,
     return NULL;
 }
 
+/* Ports that the worker threads accept on themselves, through */
+/* SO_REUSEPORT listeners.  Those conns aren't on the listen_conn */
+/* list, so this is how a later proxy on the same port finds them. */
+/* Only used on the main listener thread. */
+
+typedef struct worker_listener worker_listener;
+
+struct worker_listener {
+    int              port;
+    conn_funcs      *funcs;
+    int              listening;
+    worker_listener *next;
+};
+
+static worker_listener *worker_listeners = NULL;
+
 /* Must be called on the main listener thread.
  */
 int cproxy_listen(proxy *p) {
@@ -394,6 +436,40 @@ int cproxy_listen_port(int port,
 
         return listening;
     }
+
+    if (settings.reuseport &&
+        settings.socketpath == NULL) {
+        worker_listener *wl;
+
+        for (wl = worker_listeners; wl != NULL; wl = wl->next) {
+            if (wl->port == port && wl->funcs == funcs) {
+                return wl->listening;
+            }
+        }
+
+        listening = server_socket_workers(port, transport, protocol,
+                                          funcs, conn_extra);
+        if (listening > 0) {
+            if (settings.verbose > 1) {
+                moxi_log_write("cproxy listening on port %d"
+                               " with %d worker listeners\n",
+                               port, listening);
+            }
+
+            wl = calloc(1, sizeof(worker_listener));
+            if (wl != NULL) {
+                wl->port = port;
+                wl->funcs = funcs;
+                wl->listening = listening;
+                wl->next = worker_listeners;
+                worker_listeners = wl;
+            }
+
+            return listening;
+        }
+
+        /* Fall back to accepting on this thread. */
+    }
 #ifdef HAVE_SYS_UN_H
     if (settings.socketpath ?
         (server_socket_unix(settings.socketpath, settings.access) == 0) :
@@ -455,6 +531,16 @@ proxy_td *cproxy_find_thread_data(proxy *p, cb_thread_t thread_id) {
     return NULL;
 }
 
+/* Returns the index of the ptd in its proxy, which is also the index
+ * of its worker thread.
+ */
+int cproxy_thread_data_index(proxy_td *ptd) {
+    cb_assert(ptd != NULL);
+    cb_assert(ptd->proxy != NULL);
+
+    return (int) (ptd - ptd->proxy->thread_data);
+}
+
 bool cproxy_init_upstream_conn(conn *c) {
     char *default_name;
     proxy *p;
@@ -612,7 +698,8 @@ void cproxy_on_close_upstream_conn(conn *c) {
             /* half written. */
 
             /* The safest, but inefficient, thing to do then is */
-            /* to close any conn_mwrite downstream conns. */
+            /* to close any conn_mwrite downstream conns.  A shared */
+            /* (mux) conn only writes copies and item refs, though. */
 
             ptd->stats.stats.tot_downstream_close_on_upstream_close++;
 
@@ -622,12 +709,13 @@ void cproxy_on_close_upstream_conn(conn *c) {
                 conn *downstream_conn = d->downstream_conns[i];
                 if (downstream_conn != NULL &&
                     downstream_conn != NULL_CONN &&
-                    downstream_conn->state == conn_mwrite) {
+                    downstream_conn->state == conn_mwrite &&
+                    downstream_conn->mux == NULL) {
                     downstream_conn->msgcurr = 0;
                     downstream_conn->msgused = 0;
                     downstream_conn->iovused = 0;
 
-                    cproxy_close_conn(downstream_conn);
+                    cproxy_close_conn_local(downstream_conn);
                 }
             }
         }
@@ -678,62 +766,15 @@ int delink_from_downstream_conns(conn *c) {
     return k;
 }
 
-void cproxy_on_close_downstream_conn(conn *c) {
+/* Propagates an error or sets up a retry for the downstream, whose
+ * conn c (at index k) has closed, and releases the downstream conn.
+ */
+static void cproxy_downstream_conn_closed(conn *c, downstream *d, int k) {
     conn *uc_retry = NULL;
-    downstream *d;
-    int k;
-    proxy_td *ptd;
-
-    cb_assert(c != NULL);
-    cb_assert(c->sfd >= 0);
-    cb_assert(c->state == conn_closing);
-
-    if (settings.verbose > 2) {
-        moxi_log_write("<%d cproxy_on_close_downstream_conn\n", c->sfd);
-    }
-
-    d = c->extra;
-
-    /* Might have been set to NULL during cproxy_free_downstream(). */
-    /* Or, when a downstream conn is in the thread-based free pool, it */
-    /* is not associated with any particular downstream. */
-
-    if (d == NULL) {
-        /* TODO: See if we need to remove the downstream conn from the */
-        /* thread-based free pool.  This shouldn't happen, but we */
-        /* should then figure out how to put an cb_assert() here. */
-
-        return;
-    }
-
-    k = delink_from_downstream_conns(c);
+    proxy_td *ptd = d->ptd;
 
-    c->extra = NULL;
-
-    if (c->thread != NULL &&
-        c->host_ident != NULL) {
-        zstored_error_count(c->thread, c->host_ident, true);
-    }
-
-    ptd = d->ptd;
-    cb_assert(ptd);
-
-    if (ptd->stats.stats.num_downstream_conn > 0) {
-        ptd->stats.stats.num_downstream_conn--;
-    }
-
-    if (k < 0) {
-        /* If this downstream conn wasn't linked into the */
-        /* downstream, it was delinked already during connect error */
-        /* handling (where its slot was set to NULL_CONN already), */
-        /* or during downstream_timeout/conn_queue_timeout. */
-
-        if (settings.verbose > 2) {
-            moxi_log_write("%d: skipping release dc in on_close_dc\n",
-                           c->sfd);
-        }
-
-        return;
+    if (d->hedge_conn == c) {
+        d->hedge_conn = NULL;
     }
 
     if (d->upstream_conn != NULL &&
@@ -797,16 +838,29 @@ void cproxy_on_close_downstream_conn(conn *c) {
 
         /* TODO: Reconsider retry behavior, is it right in all situations? */
 
+        /* Squashed upstream conns are retried together, each */
+        /* on its own, so long as they all have retries left. */
+
         if (c->rcurr != NULL &&
             c->rbytes == 0 &&
             d->downstream_used_start == d->downstream_used &&
             d->downstream_used_start == 1 &&
-            d->upstream_conn->next == NULL &&
             d->behaviors_arr != NULL) {
             if (k >= 0 && k < d->behaviors_num) {
                 int retry_max = d->behaviors_arr[k].downstream_retry;
-                if (d->upstream_conn->cmd_retries < retry_max) {
-                    d->upstream_conn->cmd_retries++;
+                conn *uc;
+
+                for (uc = d->upstream_conn; uc != NULL; uc = uc->next) {
+                    if (uc->cmd_retries >= retry_max) {
+                        break;
+                    }
+                }
+
+                if (uc == NULL) {
+                    for (uc = d->upstream_conn; uc != NULL; uc = uc->next) {
+                        uc->cmd_retries++;
+                    }
+
                     uc_retry = d->upstream_conn;
                     d->upstream_suffix = NULL;
                     d->upstream_suffix_len = 0;
@@ -848,14 +902,21 @@ void cproxy_on_close_downstream_conn(conn *c) {
     /* is closed concurrently.  We then move to conn_pause, */
     /* and same as Case 1. */
 
-    cproxy_release_downstream_conn(d, c);
-
     /* Setup a retry after unwinding the call stack. */
     /* We use the work_queue, because our caller, conn_close(), */
     /* is likely to blow away our fd if we try to reconnect */
-    /* right now. */
+    /* right now.  The work is queued before releasing the */
+    /* downstream, which delinks any squashed upstream conns. */
+
+    /* Without a retry, the keys that were waiting on a closed */
+    /* conn of a get become misses. */
 
-    if (uc_retry != NULL) {
+    if (uc_retry == NULL &&
+        d->upstream_conn != NULL) {
+        multiget_ascii_downstream_partial(d);
+    }
+
+    while (uc_retry != NULL) {
         if (settings.verbose > 2) {
             moxi_log_write("%d cproxy retrying\n", uc_retry->sfd);
         }
@@ -867,7 +928,144 @@ void cproxy_on_close_downstream_conn(conn *c) {
 
         work_send(uc_retry->thread->work_queue,
                   upstream_retry, ptd, uc_retry);
+
+        uc_retry = uc_retry->next;
+    }
+
+    cproxy_release_downstream_conn(d, c);
+}
+
+/* A shared (mux) downstream conn that closes takes down the request
+ * of every downstream still waiting on it.
+ */
+static void cproxy_on_close_mux_conn(conn *c) {
+    zstored_downstream_conns *conns;
+    downstream *d;
+    bool counted = false;
+
+    if (c->thread != NULL &&
+        c->host_ident != NULL) {
+        conns = zstored_get_downstream_conns(c->thread, c->host_ident);
+        if (conns != NULL &&
+            conns->mux_dc == c) {
+            conns->mux_dc = NULL;
+        }
+
+        if (!c->close_local) {
+            zstored_error_count(c->thread, c->host_ident, true);
+        }
+    }
+
+    d = c->extra;
+    if (d != NULL &&
+        c->stream_item != NULL) {
+        multiget_ascii_downstream_stream_abort(d, c);
+    }
+
+    c->stream_item = NULL;
+    c->extra = NULL;
+
+    while ((d = cproxy_mux_take(c)) != NULL) {
+        int k;
+
+        if (counted == false &&
+            d->ptd->stats.stats.num_downstream_conn > 0) {
+            d->ptd->stats.stats.num_downstream_conn--;
+            counted = true;
+        }
+
+        if (!c->close_local) {
+            zstored_breaker_record(d, c, false);
+        }
+
+        c->extra = d;
+        k = delink_from_downstream_conns(c);
+        c->extra = NULL;
+
+        if (k >= 0) {
+            cproxy_downstream_conn_closed(c, d, k);
+        }
+    }
+
+    cproxy_mux_free(c);
+}
+
+void cproxy_on_close_downstream_conn(conn *c) {
+    downstream *d;
+    int k;
+    proxy_td *ptd;
+
+    cb_assert(c != NULL);
+    cb_assert(c->sfd >= 0);
+    cb_assert(c->state == conn_closing);
+
+    if (settings.verbose > 2) {
+        moxi_log_write("<%d cproxy_on_close_downstream_conn\n", c->sfd);
+    }
+
+    if (c->mux != NULL) {
+        cproxy_on_close_mux_conn(c);
+        return;
+    }
+
+    d = c->extra;
+
+    /* Might have been set to NULL during cproxy_free_downstream(). */
+    /* Or, when a downstream conn is in the thread-based free pool, it */
+    /* is not associated with any particular downstream. */
+
+    if (d == NULL) {
+        /* TODO: See if we need to remove the downstream conn from the */
+        /* thread-based free pool.  This shouldn't happen, but we */
+        /* should then figure out how to put an cb_assert() here. */
+
+        c->stream_item = NULL;
+        return;
+    }
+
+    /* A value that was being cut-through to upstream conns is now */
+    /* only partly written to them. */
+
+    if (c->stream_item != NULL) {
+        multiget_ascii_downstream_stream_abort(d, c);
+    }
+
+    k = delink_from_downstream_conns(c);
+
+    c->extra = NULL;
+
+    /* Only a close that the server caused, by an error, a hang up */
+    /* or a timeout, counts against it. */
+
+    if (c->thread != NULL &&
+        c->host_ident != NULL &&
+        !c->close_local) {
+        zstored_error_count(c->thread, c->host_ident, true);
+        zstored_breaker_record(d, c, false);
+    }
+
+    ptd = d->ptd;
+    cb_assert(ptd);
+
+    if (ptd->stats.stats.num_downstream_conn > 0) {
+        ptd->stats.stats.num_downstream_conn--;
+    }
+
+    if (k < 0) {
+        /* If this downstream conn wasn't linked into the */
+        /* downstream, it was delinked already during connect error */
+        /* handling (where its slot was set to NULL_CONN already), */
+        /* or during downstream_timeout/conn_queue_timeout. */
+
+        if (settings.verbose > 2) {
+            moxi_log_write("%d: skipping release dc in on_close_dc\n",
+                           c->sfd);
+        }
+
+        return;
     }
+
+    cproxy_downstream_conn_closed(c, d, k);
 }
 
 void upstream_retry(void *data0, void *data1) {
@@ -962,6 +1160,9 @@ downstream *cproxy_reserve_downstream(proxy_td *ptd) {
         d->merger = NULL;
         d->timeout_tv.tv_sec = 0;
         d->timeout_tv.tv_usec = 0;
+        d->hedge_tv.tv_sec = 0;
+        d->hedge_tv.tv_usec = 0;
+        d->hedge_conn = NULL;
         d->next_waiting = NULL;
 
         if (cproxy_check_downstream_config(d)) {
@@ -1019,6 +1220,7 @@ bool cproxy_release_downstream(downstream *d, bool force) {
     /* to avoid pegging CPU with leaked timeout_events. */
 
     cproxy_clear_timeout(d);
+    cproxy_clear_hedge(d);
 
     /* If we need to retry the command, we do so here, */
     /* keeping the same downstream that would otherwise */
@@ -1046,9 +1248,14 @@ bool cproxy_release_downstream(downstream *d, bool force) {
 
             if (cproxy_forward(d) == true) {
                 return true;
-            } else {
-                d->ptd->stats.stats.tot_downstream_propagate_failed++;
+            }
+
+            d->ptd->stats.stats.tot_downstream_propagate_failed++;
 
+            /* A get that already has hits from other servers */
+            /* keeps them, and the keys it couldn't retry are misses. */
+
+            if (multiget_ascii_downstream_partial(d) == false) {
                 propagate_error_msg(d, NULL, d->upstream_status);
             }
         } else {
@@ -1059,6 +1266,8 @@ bool cproxy_release_downstream(downstream *d, bool force) {
                                d->upstream_retry,
                                d->upstream_retries, max_retries);
             }
+
+            multiget_ascii_downstream_partial(d);
         }
     }
 
@@ -1105,6 +1314,11 @@ bool cproxy_release_downstream(downstream *d, bool force) {
             }
         }
 
+        if (d->multiget_partial &&
+            d->upstream_suffix != NULL) {
+            d->ptd->stats.stats.tot_multiget_partial++;
+        }
+
         if (settings.verbose > 2) {
             moxi_log_write("%d: release_downstream upstream_suffix %s status %x\n",
                            d->upstream_conn->sfd,
@@ -1166,6 +1380,13 @@ bool cproxy_release_downstream(downstream *d, bool force) {
         d->multiget = NULL;
     }
 
+    d->multiget_opaque = 0;
+    d->multiget_partial = false;
+
+    /* After the multiget map, whose keys might live in the arena. */
+
+    downstream_alloc_reset(d);
+
     if (d->merger != NULL) {
         genhash_iter(d->merger, protocol_stats_foreach_free, NULL);
         genhash_free(d->merger);
@@ -1184,6 +1405,7 @@ bool cproxy_release_downstream(downstream *d, bool force) {
     d->downstream_used_start = 0;
     d->multiget = NULL;
     d->merger = NULL;
+    d->hedge_conn = NULL;
 
     /* TODO: Consider adding a downstream->prev backpointer */
     /*       or doubly-linked list to save on this scan. */
@@ -1202,7 +1424,13 @@ bool cproxy_release_downstream(downstream *d, bool force) {
         conn *dc = d->downstream_conns[i];
         d->downstream_conns[i] = NULL;
         if (dc != NULL) {
-            zstored_release_downstream_conn(dc, false);
+            if (dc != NULL_CONN && dc->mux != NULL) {
+                if (cproxy_mux_detach(dc, d)) {
+                    cproxy_close_conn(dc);
+                }
+            } else {
+                zstored_release_downstream_conn(dc, false);
+            }
         }
     }
 
@@ -1262,7 +1490,11 @@ void cproxy_free_downstream(downstream *d) {
         for (i = 0; i < n; i++) {
             if (d->downstream_conns[i] != NULL &&
                 d->downstream_conns[i] != NULL_CONN) {
-                d->downstream_conns[i]->extra = NULL;
+                if (d->downstream_conns[i]->mux != NULL) {
+                    cproxy_mux_detach(d->downstream_conns[i], d);
+                } else {
+                    d->downstream_conns[i]->extra = NULL;
+                }
             }
         }
     }
@@ -1275,6 +1507,8 @@ void cproxy_free_downstream(downstream *d) {
 
     cproxy_clear_timeout(d);
 
+    downstream_alloc_free(d);
+
     if (d->downstream_conns != NULL) {
         free(d->downstream_conns);
     }
@@ -1423,7 +1657,7 @@ bool cproxy_check_downstream_config(downstream *d) {
 
 /* Returns -1 if the connections aren't fully assigned and ready. */
 /* In that case, the downstream has to wait for a downstream connection */
-/* to get out of the conn_connecting state. */
+/* to get out of the conn_connecting or conn_authenticating states. */
 
 /* The downstream connection might leave the conn_connecting state */
 /* with an error (unable to connect).  That case is handled by */
@@ -1515,7 +1749,8 @@ int cproxy_connect_downstream(downstream *d, LIBEVENT_THREAD *thread,
 
             if (d->downstream_conns[i] != NULL &&
                 d->downstream_conns[i] != NULL_CONN &&
-                d->downstream_conns[i]->state == conn_connecting) {
+                (d->downstream_conns[i]->state == conn_connecting ||
+                 d->downstream_conns[i]->state == conn_authenticating)) {
                 return -1;
             }
 
@@ -1638,10 +1873,23 @@ conn *cproxy_connect_downstream_conn(downstream *d,
     return NULL;
 }
 
+/* Flags for conn->auth_pending. */
+
+#define DOWNSTREAM_AUTH_SASL   0x01
+#define DOWNSTREAM_AUTH_BUCKET 0x02
+
+/* Called once a downstream conn is connected.  If the downstream */
+/* needs SASL auth or bucket selection, the requests are queued and */
+/* the conn moves to the conn_authenticating state, where the replies */
+/* are handled by cproxy_on_auth_downstream_conn() without blocking */
+/* the worker thread.  Otherwise, the conn is ready right away. */
+
 bool downstream_connect_init(downstream *d, mcs_server_st *msst,
                              proxy_behavior *behavior, conn *c) {
     char *host_ident;
-    int rv;
+    char buf[3000];
+    int auth_len;
+    int bucket_len;
 
     cb_assert(c->thread != NULL);
 
@@ -1656,29 +1904,71 @@ bool downstream_connect_init(downstream *d, mcs_server_st *msst,
                                        usec_now() - c->cmd_start_time);
     }
 
-    rv = cproxy_auth_downstream(msst, behavior, c->sfd);
-    if (rv == 0) {
+    auth_len = cproxy_auth_request(msst, behavior, buf, sizeof(buf));
+    if (auth_len < 0) {
+        d->ptd->stats.stats.tot_downstream_auth_failed++;
+        goto error;
+    }
+
+    bucket_len = cproxy_bucket_request(behavior, buf + auth_len,
+                                       sizeof(buf) - auth_len);
+    if (bucket_len < 0) {
+        d->ptd->stats.stats.tot_downstream_bucket_failed++;
+        goto error;
+    }
+
+    if (auth_len == 0) {
         d->ptd->stats.stats.tot_downstream_auth++;
+    }
+    if (bucket_len == 0) {
+        d->ptd->stats.stats.tot_downstream_bucket++;
+    }
 
-        rv = cproxy_bucket_downstream(msst, behavior, c->sfd);
-        if (rv == 0) {
-            d->ptd->stats.stats.tot_downstream_bucket++;
+    if (auth_len + bucket_len > 0) {
+        struct timeval *timeout = NULL;
 
-            zstored_error_count(c->thread, host_ident, false);
+        /* Both requests are pipelined, as a failed auth also fails */
+        /* the bucket selection. */
 
-            d->ptd->stats.stats.tot_downstream_connect++;
+        if (c->wsize < auth_len + bucket_len) {
+            char *wbuf = realloc(c->wbuf, auth_len + bucket_len);
+            if (wbuf == NULL) {
+                d->ptd->stats.stats.err_oom++;
+                return false;
+            }
+            c->wbuf = wbuf;
+            c->wsize = auth_len + bucket_len;
+        }
 
-            return true;
-        } else {
-            d->ptd->stats.stats.tot_downstream_bucket_failed++;
+        memcpy(c->wbuf, buf, auth_len + bucket_len);
+        c->wcurr = c->wbuf;
+        c->wbytes = auth_len + bucket_len;
+        c->rcurr = c->rbuf;
+        c->rbytes = 0;
+        c->auth_pending = (auth_len > 0 ? DOWNSTREAM_AUTH_SASL : 0) |
+                          (bucket_len > 0 ? DOWNSTREAM_AUTH_BUCKET : 0);
+
+        if (behavior->auth_timeout.tv_sec != 0 ||
+            behavior->auth_timeout.tv_usec != 0) {
+            timeout = &behavior->auth_timeout;
         }
-    } else {
-        d->ptd->stats.stats.tot_downstream_auth_failed++;
-        if (rv == 1) {
-            d->ptd->stats.stats.tot_auth_timeout++;
+
+        if (update_event_timed(c, EV_WRITE | EV_PERSIST, timeout)) {
+            conn_set_state(c, conn_authenticating);
+            return true;
         }
+
+        d->ptd->stats.stats.err_oom++;
+        return false;
     }
 
+    zstored_error_count(c->thread, host_ident, false);
+
+    d->ptd->stats.stats.tot_downstream_connect++;
+
+    return true;
+
+ error:
     /* Treat a auth/bucket error as a blacklistable error. */
 
     zstored_error_count(c->thread, host_ident, true);
@@ -1801,17 +2091,106 @@ int cproxy_server_index(downstream *d, char *key, size_t key_length,
         return -1;
     }
 
+    /* A get that's moved on to a replica read skips its master. */
+
+    if (d->upstream_conn != NULL &&
+        d->upstream_conn->next == NULL &&
+        d->upstream_conn->cmd_replica > 0) {
+        return mcs_key_replica(&d->mst, key, key_length,
+                               d->upstream_conn->cmd_replica - 1, vbucket);
+    }
+
     return (int) mcs_key_hash(&d->mst, key, key_length, vbucket);
 }
 
-void cproxy_assign_downstream(proxy_td *ptd) {
-    uint64_t da;
-    conn *tail;
-    bool stop = false;
+/* Returns true if the waiting upstream conn is a plain, single-key
+ * ascii get that may be batched with other single-key gets.
+ */
+static bool cproxy_batchable_get(proxy_td *ptd, conn *uc) {
+    return uc != NULL &&
+        ptd->behavior_pool.base.multiget_batch_max > 1 &&
+        IS_ASCII(uc->protocol) &&
+        uc->cmd == -1 &&
+        uc->cmd_curr == PROTOCOL_BINARY_CMD_GETK &&
+        uc->cmd_retries <= 0 &&
+        !uc->noreply &&
+        uc->peer_host == NULL &&
+        strncmp(uc->cmd_start, "get ", 4) == 0;
+}
 
-    cb_assert(ptd != NULL);
+static int cproxy_batchable_server_index(downstream *d, conn *uc) {
+    char *key;
+    int   key_len;
 
-    if (settings.verbose > 2) {
+    if (ascii_scan_key(uc->cmd_start, &key, &key_len)) {
+        return cproxy_server_index(d, key, (size_t) key_len, NULL);
+    }
+
+    return -1;
+}
+
+/* Moves waiting single-key gets whose keys live on the same server
+ * as the get at d->upstream_conn onto d's upstream conn list, so they
+ * all go down as one multiget.  Returns true if the caller's
+ * remembered wait list tail was taken along with the batch.
+ */
+static bool cproxy_batch_gets(proxy_td *ptd, downstream *d, conn **tail) {
+    conn    *uc_last = d->upstream_conn;
+    conn    *prev = NULL;
+    conn    *curr;
+    uint32_t num = 1;
+    bool     took_tail = false;
+    int      server_index = cproxy_batchable_server_index(d, uc_last);
+
+    if (server_index < 0) {
+        return false;
+    }
+
+    curr = ptd->waiting_any_downstream_head;
+    while (curr != NULL &&
+           num < ptd->behavior_pool.base.multiget_batch_max) {
+        conn *next = curr->next;
+
+        if (cproxy_batchable_get(ptd, curr) &&
+            cproxy_batchable_server_index(d, curr) == server_index) {
+            if (prev != NULL) {
+                prev->next = next;
+            } else {
+                ptd->waiting_any_downstream_head = next;
+            }
+            if (ptd->waiting_any_downstream_tail == curr) {
+                ptd->waiting_any_downstream_tail = prev;
+            }
+            if (*tail == curr) {
+                *tail = prev;
+                took_tail = (prev == NULL);
+            }
+
+            uc_last->next = curr;
+            uc_last = curr;
+            uc_last->next = NULL;
+            num++;
+
+            ptd->stats.stats.tot_assign_upstream++;
+            ptd->stats.stats.tot_multiget_batch++;
+        } else {
+            prev = curr;
+        }
+
+        curr = next;
+    }
+
+    return took_tail;
+}
+
+void cproxy_assign_downstream(proxy_td *ptd) {
+    uint64_t da;
+    conn *tail;
+    bool stop = false;
+
+    cb_assert(ptd != NULL);
+
+    if (settings.verbose > 2) {
         moxi_log_write("assign_downstream\n");
     }
 
@@ -1889,23 +2268,41 @@ void cproxy_assign_downstream(proxy_td *ptd) {
         /* different upstreams so we can de-deplicate get keys. */
         uc_last = d->upstream_conn;
 
-        while (is_compatible_request(uc_last,
-                                     ptd->waiting_any_downstream_head)) {
-            uc_last->next = ptd->waiting_any_downstream_head;
+        if (cproxy_batchable_get(ptd, uc_last)) {
+            /* Single-key gets for the same server are batched */
+            /* ahead of any squashing, wherever they are queued. */
 
-            ptd->waiting_any_downstream_head =
-                ptd->waiting_any_downstream_head->next;
-            if (ptd->waiting_any_downstream_head == NULL) {
-                ptd->waiting_any_downstream_tail = NULL;
+            if (cproxy_batch_gets(ptd, d, &tail)) {
+                stop = true;
             }
+        } else {
+            while (ptd->behavior_pool.base.multiget_squash &&
+                   is_compatible_request(uc_last,
+                                         ptd->waiting_any_downstream_head)) {
+                uc_last->next = ptd->waiting_any_downstream_head;
 
-            uc_last = uc_last->next;
-            uc_last->next = NULL;
+                ptd->waiting_any_downstream_head =
+                    ptd->waiting_any_downstream_head->next;
+                if (ptd->waiting_any_downstream_head == NULL) {
+                    ptd->waiting_any_downstream_tail = NULL;
+                }
 
-            /* Note: tot_assign_upstream - tot_assign_downstream */
-            /* should get us how many requests we've piggybacked together. */
+                uc_last = uc_last->next;
+                uc_last->next = NULL;
 
-            ptd->stats.stats.tot_assign_upstream++;
+                /* Note: tot_assign_upstream - tot_assign_downstream */
+                /* should get us how many requests we've piggybacked */
+                /* together. */
+
+                ptd->stats.stats.tot_assign_upstream++;
+            }
+        }
+
+        /* A squashed single-key get has to go down the multiget */
+        /* (broadcast) path, as the other keys might live elsewhere. */
+
+        if (d->upstream_conn->next != NULL) {
+            d->upstream_conn->cmd_curr = PROTOCOL_BINARY_CMD_GETKQ;
         }
 
         if (settings.verbose > 2) {
@@ -2193,6 +2590,10 @@ void cproxy_release_downstream_conn(downstream *d, conn *c) {
                         d->upstream_conn->sfd : 0));
     }
 
+    if (c->state != conn_closing) {
+        zstored_breaker_record(d, c, true);
+    }
+
     d->downstream_used--;
     if (d->downstream_used <= 0) {
         /* The downstream_used count might go < 0 when if there's */
@@ -2205,6 +2606,18 @@ void cproxy_release_downstream_conn(downstream *d, conn *c) {
     }
 }
 
+/* Called when a downstream conn would block during an nread, */
+/* so a streamed value can be written upstream as it arrives. */
+void cproxy_on_nread_progress_downstream_conn(conn *c) {
+    downstream *d = c->extra;
+
+    if (d != NULL &&
+        c->stream_item != NULL &&
+        c->stream_item == c->item) {
+        multiget_ascii_downstream_stream(d, c);
+    }
+}
+
 void cproxy_on_pause_downstream_conn(conn *c) {
     downstream *d;
     cb_assert(c != NULL);
@@ -2214,6 +2627,11 @@ void cproxy_on_pause_downstream_conn(conn *c) {
                 c->sfd);
     }
 
+    if (c->mux != NULL) {
+        cproxy_mux_on_pause(c);
+        return;
+    }
+
     d = c->extra;
 
     if (!d || c->rbytes > 0) {
@@ -2279,6 +2697,58 @@ void cproxy_pause_upstream_for_downstream(proxy_td *ptd, conn *upstream) {
         cproxy_start_wait_queue_timeout(ptd, upstream);
     }
 
+    if (cproxy_batchable_get(ptd, upstream) &&
+        (ptd->behavior_pool.base.multiget_batch_delay.tv_sec != 0 ||
+         ptd->behavior_pool.base.multiget_batch_delay.tv_usec != 0)) {
+        /* Hold single-key gets briefly so that more of them can */
+        /* join the batch, unless there's already a full batch. */
+        /* Only the held gets are counted, rather than scanning */
+        /* the whole wait_queue on every get. */
+
+        if (!ptd->batch_pending) {
+            ptd->batch_held = 0;
+        }
+
+        if (++ptd->batch_held < ptd->behavior_pool.base.multiget_batch_max) {
+            if (!ptd->batch_pending) {
+                struct timeval tv = ptd->behavior_pool.base.multiget_batch_delay;
+
+                evtimer_set(&ptd->batch_event, batch_timeout, ptd);
+                event_base_set(upstream->thread->base, &ptd->batch_event);
+
+                ptd->batch_pending =
+                    evtimer_add(&ptd->batch_event, &tv) == 0;
+                if (ptd->batch_pending) {
+                    return;
+                }
+            } else {
+                return;
+            }
+        }
+
+        if (ptd->batch_pending) {
+            evtimer_del(&ptd->batch_event);
+            ptd->batch_pending = false;
+        }
+    }
+
+    cproxy_assign_downstream(ptd);
+}
+
+static void batch_timeout(evutil_socket_t fd,
+                          const short which,
+                          void *arg) {
+    proxy_td *ptd = arg;
+    cb_assert(ptd != NULL);
+    (void)fd;
+    (void)which;
+
+    if (settings.verbose > 2) {
+        moxi_log_write("batch_timeout\n");
+    }
+
+    ptd->batch_pending = false;
+
     cproxy_assign_downstream(ptd);
 }
 
@@ -2443,6 +2913,22 @@ void cproxy_close_conn(conn *c) {
     drive_machine(c);
 }
 
+/* Closes a downstream conn for a reason of moxi's own, such as
+ * running out of memory or its upstream conn going away, so the
+ * close isn't counted against the server.
+ */
+void cproxy_close_conn_local(conn *c) {
+    cb_assert(c != NULL);
+
+    if (c == NULL_CONN) {
+        return;
+    }
+
+    c->close_local = true;
+
+    cproxy_close_conn(c);
+}
+
 bool add_conn_item(conn *c, item *it) {
     cb_assert(it != NULL);
     cb_assert(c != NULL);
@@ -2470,6 +2956,97 @@ bool add_conn_item(conn *c, item *it) {
     return false;
 }
 
+/* Default and largest retained size of a downstream arena chunk. */
+
+#define DOWNSTREAM_CHUNK_SIZE     4096
+#define DOWNSTREAM_CHUNK_SIZE_MAX 65536
+
+/* Returns size bytes that stay valid until the downstream is released, */
+/* or NULL on out of memory.  The memory is not zeroed. */
+
+void *downstream_alloc(downstream *d, size_t size) {
+    downstream_chunk *chunk;
+    void *rv;
+
+    cb_assert(d != NULL);
+
+    size = (size + 7) & ~((size_t) 7);
+
+    chunk = d->chunks;
+    if (chunk == NULL ||
+        chunk->size - chunk->used < size) {
+        /* Double the chunk size as the arena grows, so a large */
+        /* multiget only needs a few chunks. */
+
+        size_t chunk_size = DOWNSTREAM_CHUNK_SIZE;
+        if (chunk != NULL) {
+            chunk_size = chunk->size * 2;
+        }
+        if (chunk_size < size) {
+            chunk_size = size;
+        }
+
+        chunk = malloc(sizeof(downstream_chunk) + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        chunk->next = d->chunks;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        d->chunks = chunk;
+    }
+
+    rv = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return rv;
+}
+
+/* Releases everything handed out by downstream_alloc() in one shot. */
+/* The memory is kept for the next request on this downstream, */
+/* merged into a single chunk if the arena had to grow. */
+
+static void downstream_alloc_reset(downstream *d) {
+    downstream_chunk *chunk = d->chunks;
+    size_t total = 0;
+
+    if (chunk == NULL) {
+        return;
+    }
+
+    if (chunk->next == NULL) {
+        chunk->used = 0;
+        return;
+    }
+
+    for (; chunk != NULL; chunk = chunk->next) {
+        total += chunk->size;
+    }
+
+    downstream_alloc_free(d);
+
+    if (total > DOWNSTREAM_CHUNK_SIZE_MAX) {
+        total = DOWNSTREAM_CHUNK_SIZE_MAX;
+    }
+
+    chunk = malloc(sizeof(downstream_chunk) + total);
+    if (chunk != NULL) {
+        chunk->next = NULL;
+        chunk->size = total;
+        chunk->used = 0;
+        d->chunks = chunk;
+    }
+}
+
+static void downstream_alloc_free(downstream *d) {
+    while (d->chunks != NULL) {
+        downstream_chunk *next = d->chunks->next;
+        free(d->chunks);
+        d->chunks = next;
+    }
+}
+
 char *add_conn_suffix(conn *c) {
     cb_assert(c != NULL);
     cb_assert(c->suffixlist != NULL);
@@ -2554,21 +3131,22 @@ size_t scan_tokens(char *command, token_t *tokens,
 
     cb_assert(command != NULL && tokens != NULL && max_tokens > 1);
 
-    for (s = e = command; ntokens < max_tokens - 1; ++e) {
-        if (*e == '\0' || *e == ' ') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-            }
-            if (*e == '\0') {
-                if (command_len != NULL) {
-                    *command_len = (int)(e - command);
-                }
-                break; /* string end */
+    s = e = command;
+    while (ntokens < max_tokens - 1) {
+        s = strscan_skip_spaces(s);
+        e = strscan_token_end(s);
+        if (s != e) {
+            tokens[ntokens].value = s;
+            tokens[ntokens].length = e - s;
+            ntokens++;
+        }
+        if (*e == '\0') {
+            if (command_len != NULL) {
+                *command_len = (int)(e - command);
             }
-            s = e + 1;
+            break; /* string end */
         }
+        s = ++e;
     }
 
     /* If we scanned the whole string, the terminal value pointer is null,
@@ -2692,35 +3270,35 @@ downstream *downstream_list_waiting_remove(downstream *head,
  * save on network hops.
  */
 bool is_compatible_request(conn *existing, conn *candidate) {
-    (void)existing;
-    (void)candidate;
-
-    /* The not-my-vbucket error handling requires us to not */
-    /* squash ascii multi-GET requests, due to reusing the */
-    /* multiget-deduplication machinery during retries and */
-    /* to simplify the later codepaths. */
-    /*
     cb_assert(existing);
     cb_assert(existing->state == conn_pause);
     cb_assert(IS_PROXY(existing->protocol));
 
     if (IS_BINARY(existing->protocol)) {
-        // TODO: Revisit multi-get squashing for binary another day.
+        /* TODO: Revisit multi-get squashing for binary another day. */
 
         return false;
     }
 
     cb_assert(IS_ASCII(existing->protocol));
 
-    if (candidate != NULL) {
-        cb_assert(IS_ASCII(candidate->protocol));
+    if (candidate != NULL &&
+        IS_ASCII(candidate->protocol)) {
         cb_assert(IS_PROXY(candidate->protocol));
         cb_assert(candidate->state == conn_pause);
 
-        // TODO: Allow gets (CAS) for de-duplication.
+        /* TODO: Allow gets (CAS) for de-duplication. */
+
+        /* Conns that are being retried aren't squashed, so a */
+        /* not-my-vbucket or downstream close retry can be */
+        /* attempted again for each upstream on its own. */
 
         if (existing->cmd == -1 &&
             candidate->cmd == -1 &&
+            (existing->cmd_curr == PROTOCOL_BINARY_CMD_GETK ||
+             existing->cmd_curr == PROTOCOL_BINARY_CMD_GETKQ) &&
+            (candidate->cmd_curr == PROTOCOL_BINARY_CMD_GETK ||
+             candidate->cmd_curr == PROTOCOL_BINARY_CMD_GETKQ) &&
             existing->cmd_retries <= 0 &&
             candidate->cmd_retries <= 0 &&
             !existing->noreply &&
@@ -2733,7 +3311,6 @@ bool is_compatible_request(conn *existing, conn *candidate) {
             return true;
         }
     }
-    */
 
     return false;
 }
@@ -2756,6 +3333,8 @@ void downstream_timeout(evutil_socket_t fd,
 
     if (cproxy_clear_timeout(d)) {
         char *m;
+        conn *uc_retry;
+        bool partial;
         int n;
         int i;
         /* The downstream_timeout() callback is invoked for */
@@ -2779,9 +3358,40 @@ void downstream_timeout(evutil_socket_t fd,
             ptd->stats.stats.tot_downstream_timeout++;
         }
 
-        m = "SERVER_ERROR proxy downstream timeout\r\n";
+        m = NULL;
+        uc_retry = NULL;
+
+        /* A multiget fanned out to several servers keeps the hits */
+        /* from the servers that did answer, and the END suffix then */
+        /* reports the slow servers' keys as misses. */
+
+        partial = was_conn_queue_waiting == false &&
+            d->downstream_used_start > 1 &&
+            multiget_ascii_downstream_partial(d);
+
+        /* A get whose master is too slow might instead be */
+        /* answered by a replica, so it's retried on its own */
+        /* after unwinding, like a downstream close retry. */
+
+        if (cproxy_replica_next(d)) {
+            uc_retry = d->upstream_conn;
+            d->upstream_suffix = NULL;
+            d->upstream_suffix_len = 0;
+            d->upstream_status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+            d->upstream_retry = 0;
+            d->target_host_ident = NULL;
+
+            ptd->stats.stats.tot_retry++;
 
-        if (d->target_host_ident != NULL) {
+            work_send(uc_retry->thread->work_queue,
+                      upstream_retry, ptd, uc_retry);
+        } else if (partial) {
+            if (settings.verbose > 2) {
+                moxi_log_write("downstream_timeout partial, %d of %d\n",
+                               d->downstream_used_start - d->downstream_used,
+                               d->downstream_used_start);
+            }
+        } else if (d->target_host_ident != NULL) {
             m = add_conn_suffix(d->upstream_conn);
             if (m != NULL) {
                 char *s;
@@ -2799,20 +3409,41 @@ void downstream_timeout(evutil_socket_t fd,
             }
         }
 
-        propagate_error_msg(d, m, PROTOCOL_BINARY_RESPONSE_EBUSY);
+        if (uc_retry == NULL &&
+            partial == false) {
+            if (m == NULL) {
+                m = "SERVER_ERROR proxy downstream timeout\r\n";
+            }
+
+            propagate_error_msg(d, m, PROTOCOL_BINARY_RESPONSE_EBUSY);
+        }
+
         n = mcs_server_count(&d->mst);
 
+        /* Only the conns still waiting on a slow server are */
+        /* abandoned.  Conns that already answered are paused, and */
+        /* go back to the pool in cproxy_release_downstream(), so */
+        /* one slow server doesn't cost reconnects to the others. */
+
         for (i = 0; i < n; i++) {
             conn *dc = d->downstream_conns[i];
             if (dc != NULL &&
                 dc != NULL_CONN) {
-                /* We have to de-link early, because we don't want */
-                /* to have cproxy_close_conn() release the downstream */
-                /* while we're in the middle of this loop. */
+                if (dc->mux != NULL) {
+                    /* A shared mux conn drops the late response */
+                    /* instead, unless it's already reading it. */
 
-                delink_from_downstream_conns(dc);
+                    if (cproxy_mux_detach(dc, d)) {
+                        cproxy_close_conn(dc);
+                    }
+                } else if (dc->state != conn_pause) {
+                    /* We have to de-link early, because we don't want */
+                    /* to have cproxy_close_conn() release the downstream */
+                    /* while we're in the middle of this loop. */
 
-                cproxy_close_conn(dc);
+                    delink_from_downstream_conns(dc);
+                    cproxy_close_conn(dc);
+                }
             }
         }
 
@@ -2871,26 +3502,21 @@ bool cproxy_start_downstream_timeout_ex(downstream *d, conn *c,
     return (evtimer_add(&d->timeout_event, &d->timeout_tv) == 0);
 }
 
-/* Return 0 on success, -1 on general failure, 1 on timeout failure. */
+/* Fills buf with a SASL PLAIN auth request for the downstream. */
+/* Returns the request length, 0 if no auth is needed, or -1 on error. */
 
-int cproxy_auth_downstream(mcs_server_st *server,
-                           proxy_behavior *behavior,
-                           SOCKET fd) {
+int cproxy_auth_request(mcs_server_st *server,
+                        proxy_behavior *behavior,
+                        char *buf, int buf_size) {
     protocol_binary_request_header req;
-    protocol_binary_response_header res;
-    struct timeval *timeout = NULL;
-    char buf[3000];
     const char *usr;
     const char *pwd;
     int usr_len;
     int pwd_len;
-    int buf_len;
-    mcs_return mr;
+    int body_len;
 
     cb_assert(server);
     cb_assert(behavior);
-    cb_assert(fd != INVALID_SOCKET);
-
 
     if (!IS_BINARY(behavior->downstream_protocol)) {
         return 0;
@@ -2915,7 +3541,8 @@ int cproxy_auth_downstream(mcs_server_st *server,
 
     if (usr_len <= 0 ||
         !IS_PROXY(behavior->downstream_protocol) ||
-        (usr_len + pwd_len + 50 > (int) sizeof(buf))) {
+        (usr_len + pwd_len + 50 +
+         (int) sizeof(req.bytes) > buf_size)) {
         if (settings.verbose > 1) {
             moxi_log_write("auth failure args\n");
         }
@@ -2929,27 +3556,80 @@ int cproxy_auth_downstream(mcs_server_st *server,
 
     /* TODO: Allow binary passwords. */
 
-    buf_len = snprintf(buf, sizeof(buf), "PLAIN%c%s%c%s",
-                       0, usr,
-                       0, pwd);
-    cb_assert(buf_len == 7 + usr_len + pwd_len);
+    body_len = snprintf(buf + sizeof(req.bytes),
+                        buf_size - sizeof(req.bytes),
+                        "PLAIN%c%s%c%s",
+                        0, usr,
+                        0, pwd);
+    cb_assert(body_len == 7 + usr_len + pwd_len);
 
     memset(req.bytes, 0, sizeof(req.bytes));
-    memset(res.bytes, 0, sizeof(res.bytes));
     req.request.magic    = PROTOCOL_BINARY_REQ;
     req.request.opcode   = PROTOCOL_BINARY_CMD_SASL_AUTH;
     req.request.keylen   = htons((uint16_t) 5); /* 5 == strlen("PLAIN"). */
     req.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-    req.request.bodylen  = htonl(buf_len);
+    req.request.bodylen  = htonl(body_len);
+
+    memcpy(buf, req.bytes, sizeof(req.bytes));
+
+    return sizeof(req.bytes) + body_len;
+}
+
+/* Fills buf with a SELECT_BUCKET request for the downstream. */
+/* Returns the request length, 0 if no bucket, or -1 on error. */
+
+int cproxy_bucket_request(proxy_behavior *behavior,
+                          char *buf, int buf_size) {
+    protocol_binary_request_header req;
+    int bucket_len;
+
+    cb_assert(behavior);
+    cb_assert(IS_PROXY(behavior->downstream_protocol));
+
+    if (!IS_BINARY(behavior->downstream_protocol)) {
+        return 0;
+    }
+
+    bucket_len = (int)strlen(behavior->bucket);
+    if (bucket_len <= 0) {
+        return 0; /* When no bucket. */
+    }
+
+    if (bucket_len + (int) sizeof(req.bytes) > buf_size) {
+        return -1;
+    }
+
+    memset(req.bytes, 0, sizeof(req.bytes));
+    req.request.magic    = PROTOCOL_BINARY_REQ;
+    req.request.opcode   = PROTOCOL_BINARY_CMD_BUCKET;
+    req.request.keylen   = htons((uint16_t) bucket_len);
+    req.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    req.request.bodylen  = htonl(bucket_len);
+
+    memcpy(buf, req.bytes, sizeof(req.bytes));
+    memcpy(buf + sizeof(req.bytes), behavior->bucket, bucket_len);
+
+    return sizeof(req.bytes) + bucket_len;
+}
+
+/* Synchronously sends a request built by cproxy_auth_request() or */
+/* cproxy_bucket_request() and waits for its response, for callers */
+/* that can block, like the ping tool.  Return 0 on success, -1 on */
+/* general failure, 1 on timeout failure. */
 
-    if (mcs_io_write(fd, (const char *) req.bytes,
-                     sizeof(req.bytes)) != sizeof(req.bytes) ||
-        mcs_io_write(fd, buf, buf_len) == -1) {
+static int cproxy_sync_request(proxy_behavior *behavior, SOCKET fd,
+                               char *buf, int buf_len, int buf_size,
+                               const char *what) {
+    protocol_binary_response_header res;
+    struct timeval *timeout = NULL;
+    mcs_return mr;
+
+    if (mcs_io_write(fd, buf, buf_len) != buf_len) {
         mcs_io_reset(fd);
 
         if (settings.verbose > 1) {
-            moxi_log_write("auth failure during write for %s (%d)\n",
-                           usr, buf_len);
+            moxi_log_write("%s failure during write (%d)\n",
+                           what, buf_len);
         }
 
         return -1;
@@ -2960,6 +3640,8 @@ int cproxy_auth_downstream(mcs_server_st *server,
         timeout = &behavior->auth_timeout;
     }
 
+    memset(res.bytes, 0, sizeof(res.bytes));
+
     mr = mcs_io_read(fd, &res.bytes, sizeof(res.bytes), timeout);
     if (mr == MCS_SUCCESS && res.response.magic == PROTOCOL_BINARY_RES) {
         int len;
@@ -2970,13 +3652,13 @@ int cproxy_auth_downstream(mcs_server_st *server,
         /* Swallow whatever body comes. */
         len = res.response.bodylen;
         while (len > 0) {
-            int amt = (len > (int) sizeof(buf) ? (int) sizeof(buf) : len);
+            int amt = (len > buf_size ? buf_size : len);
 
             mr = mcs_io_read(fd, buf, amt, timeout);
             if (mr != MCS_SUCCESS) {
                 if (settings.verbose > 1) {
-                    moxi_log_write("auth could not read response body (%d) %d\n",
-                                   usr, amt, mr);
+                    moxi_log_write("%s could not read response body (%d) %d\n",
+                                   what, amt, mr);
                 }
 
                 if (mr == MCS_TIMEOUT) {
@@ -2989,27 +3671,22 @@ int cproxy_auth_downstream(mcs_server_st *server,
             len -= amt;
         }
 
-        /* The res status should be either... */
-        /* - SUCCESS         - sasl aware server and good credentials. */
-        /* - AUTH_ERROR      - wrong credentials. */
-        /* - UNKNOWN_COMMAND - sasl-unaware server. */
-
         if (res.response.status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
             if (settings.verbose > 2) {
-                moxi_log_write("auth_downstream success for %s\n", usr);
+                moxi_log_write("%s_downstream success\n", what);
             }
 
             return 0;
         }
 
         if (settings.verbose > 1) {
-            moxi_log_write("auth_downstream failure for %s (%x)\n",
-                           usr, res.response.status);
+            moxi_log_write("%s_downstream failure (%x)\n",
+                           what, res.response.status);
         }
     } else {
         if (settings.verbose > 1) {
-            moxi_log_write("auth_downstream response error for %s, %d\n",
-                           usr, mr);
+            moxi_log_write("%s_downstream response error, %d\n",
+                           what, mr);
         }
     }
 
@@ -3022,113 +3699,104 @@ int cproxy_auth_downstream(mcs_server_st *server,
 
 /* Return 0 on success, -1 on general failure, 1 on timeout failure. */
 
-int cproxy_bucket_downstream(mcs_server_st *server,
-                             proxy_behavior *behavior,
-                             SOCKET fd) {
-    protocol_binary_request_header req;
-    protocol_binary_response_header res;
-    struct timeval *timeout = NULL;
-    int bucket_len;
-    mcs_return mr;
+int cproxy_auth_downstream(mcs_server_st *server,
+                           proxy_behavior *behavior,
+                           SOCKET fd) {
+    char buf[3000];
+    int buf_len;
 
-    cb_assert(server);
-    cb_assert(behavior);
-    cb_assert(IS_PROXY(behavior->downstream_protocol));
     cb_assert(fd != INVALID_SOCKET);
 
-    if (!IS_BINARY(behavior->downstream_protocol)) {
-        return 0;
+    buf_len = cproxy_auth_request(server, behavior, buf, sizeof(buf));
+    if (buf_len <= 0) {
+        return buf_len;
     }
 
-    bucket_len = (int)strlen(behavior->bucket);
-    if (bucket_len <= 0) {
-        return 0; /* When no bucket. */
-    }
+    /* The res status should be either... */
+    /* - SUCCESS         - sasl aware server and good credentials. */
+    /* - AUTH_ERROR      - wrong credentials. */
+    /* - UNKNOWN_COMMAND - sasl-unaware server. */
 
-    memset(req.bytes, 0, sizeof(req.bytes));
-    memset(res.bytes, 0, sizeof(res.bytes));
+    return cproxy_sync_request(behavior, fd, buf, buf_len, sizeof(buf),
+                               "auth");
+}
 
-    req.request.magic    = PROTOCOL_BINARY_REQ;
-    req.request.opcode   = PROTOCOL_BINARY_CMD_BUCKET;
-    req.request.keylen   = htons((uint16_t) bucket_len);
-    req.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-    req.request.bodylen  = htonl(bucket_len);
+/* Return 0 on success, -1 on general failure, 1 on timeout failure. */
 
-    if (mcs_io_write(fd, (const char *) req.bytes,
-                     sizeof(req.bytes)) != sizeof(req.bytes) ||
-        mcs_io_write(fd, behavior->bucket, bucket_len) == -1) {
-        mcs_io_reset(fd);
+int cproxy_bucket_downstream(mcs_server_st *server,
+                             proxy_behavior *behavior,
+                             SOCKET fd) {
+    char buf[300];
+    int buf_len;
 
-        if (settings.verbose > 1) {
-            moxi_log_write("bucket failure during write (%d)\n",
-                    bucket_len);
-        }
+    cb_assert(server);
+    cb_assert(fd != INVALID_SOCKET);
 
-        return -1;
+    buf_len = cproxy_bucket_request(behavior, buf, sizeof(buf));
+    if (buf_len <= 0) {
+        return buf_len;
     }
 
+    /* The res status should be either... */
+    /* - SUCCESS         - we got the bucket. */
+    /* - AUTH_ERROR      - not allowed to use that bucket. */
+    /* - UNKNOWN_COMMAND - bucket-unaware server. */
 
-    if (behavior->auth_timeout.tv_sec != 0 ||
-        behavior->auth_timeout.tv_usec != 0) {
-        timeout = &behavior->auth_timeout;
-    }
+    return cproxy_sync_request(behavior, fd, buf, buf_len, sizeof(buf),
+                               "bucket");
+}
 
-    mr = mcs_io_read(fd, &res.bytes, sizeof(res.bytes), timeout);
-    if (mr == MCS_SUCCESS && res.response.magic == PROTOCOL_BINARY_RES) {
-        char buf[300];
-        int len;
-
-        res.response.status  = ntohs(res.response.status);
-        res.response.keylen  = ntohs(res.response.keylen);
-        res.response.bodylen = ntohl(res.response.bodylen);
+int cproxy_max_retries(downstream *d) {
+    return mcs_server_count(&d->mst) * 2;
+}
 
-        /* Swallow whatever body comes. */
-        len = res.response.bodylen;
-        while (len > 0) {
-            int amt = (len > (int) sizeof(buf) ? (int) sizeof(buf) : len);
+/* Moves a downstream's lone single-key get on to the next replica
+ * of its key, when the replica_read behavior is on.  Returns false
+ * if the request doesn't qualify or the replicas are used up.
+ */
+bool cproxy_replica_next(downstream *d) {
+    conn *uc;
 
-            mr = mcs_io_read(fd, buf, amt, timeout);
-            if (mr != MCS_SUCCESS) {
-                if (mr == MCS_TIMEOUT) {
-                    return 1;
-                }
+    cb_assert(d != NULL);
+    cb_assert(d->ptd != NULL);
 
-                return -1;
-            }
+    uc = d->upstream_conn;
+    if (!d->ptd->behavior_pool.base.replica_read ||
+        uc == NULL ||
+        uc->next != NULL ||
+        uc->noreply) {
+        return false;
+    }
 
-            len -= amt;
+    if (IS_ASCII(uc->protocol)) {
+        if (uc->cmd != -1 ||
+            uc->cmd_curr != PROTOCOL_BINARY_CMD_GETK) {
+            return false;
         }
+    } else if (uc->cmd != PROTOCOL_BINARY_CMD_GET &&
+               uc->cmd != PROTOCOL_BINARY_CMD_GETK) {
+        return false;
+    }
 
-        /* The res status should be either... */
-        /* - SUCCESS         - we got the bucket. */
-        /* - AUTH_ERROR      - not allowed to use that bucket. */
-        /* - UNKNOWN_COMMAND - bucket-unaware server. */
-
-        if (res.response.status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
-            if (settings.verbose > 2) {
-                moxi_log_write("bucket_downstream success, %s\n",
-                        behavior->bucket);
-            }
-
-            return 0;
-        }
+    /* A replica read needs the binary GET_REPLICA command. */
 
-        if (settings.verbose > 1) {
-            moxi_log_write("bucket_downstream failure, %s (%x)\n",
-                    behavior->bucket,
-                    res.response.status);
-        }
+    if (!IS_BINARY(d->ptd->behavior_pool.base.downstream_protocol)) {
+        return false;
     }
 
-    if (mr == MCS_TIMEOUT) {
-        return 1;
+    if (uc->cmd_replica >= (int) mcs_replica_count(&d->mst)) {
+        return false;
     }
 
-    return -1;
-}
+    uc->cmd_replica++;
 
-int cproxy_max_retries(downstream *d) {
-    return mcs_server_count(&d->mst) * 2;
+    d->ptd->stats.stats.tot_replica_read++;
+
+    if (settings.verbose > 2) {
+        moxi_log_write("%d: replica_next %d\n", uc->sfd, uc->cmd_replica);
+    }
+
+    return true;
 }
 
 int downstream_conn_index(downstream *d, conn *c) {
@@ -3187,6 +3855,184 @@ void cproxy_upstream_state_change(conn *c, enum conn_states next_state) {
 
 /* ------------------------------------------------- */
 
+static bool downstream_auth_would_block(void) {
+#ifdef WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Drives the conn_authenticating state, writing out the queued auth */
+/* and bucket requests and then parsing their replies, as libevent */
+/* reports the downstream conn is ready, or when auth_timeout fires. */
+
+static bool cproxy_on_auth_downstream_conn(conn *c) {
+    downstream *d;
+    int k;
+
+    cb_assert(c != NULL);
+    cb_assert(c->host_ident);
+    cb_assert(c->state == conn_authenticating);
+
+    d = c->extra;
+    cb_assert(d != NULL);
+
+    if (c->which == EV_TIMEOUT) {
+        d->ptd->stats.stats.tot_auth_timeout++;
+
+        if (settings.verbose) {
+            moxi_log_write("%d: auth timed out: %s\n",
+                           c->sfd, c->host_ident);
+        }
+        goto failed;
+    }
+
+    if (c->wbytes > 0) {
+        struct timeval *timeout = NULL;
+        ssize_t res = send(c->sfd, c->wcurr, c->wbytes, 0);
+        if (res > 0) {
+            c->wcurr += res;
+            c->wbytes -= (int) res;
+        } else if (res == -1 && downstream_auth_would_block()) {
+            return true;
+        } else {
+            goto failed;
+        }
+
+        if (c->wbytes > 0) {
+            return true;
+        }
+
+        /* Everything's sent, so wait for the replies. */
+
+        k = downstream_conn_index(d, c);
+        if (k < 0) {
+            goto failed;
+        }
+
+        if (d->behaviors_arr[k].auth_timeout.tv_sec != 0 ||
+            d->behaviors_arr[k].auth_timeout.tv_usec != 0) {
+            timeout = &d->behaviors_arr[k].auth_timeout;
+        }
+
+        if (!update_event_timed(c, EV_READ | EV_PERSIST, timeout)) {
+            goto failed;
+        }
+
+        return true;
+    }
+
+    if (c->rbytes < c->rsize) {
+        ssize_t res = recv(c->sfd, c->rbuf + c->rbytes,
+                           c->rsize - c->rbytes, 0);
+        if (res > 0) {
+            c->rbytes += (int) res;
+        } else if (res == -1 && downstream_auth_would_block()) {
+            return true;
+        } else {
+            goto failed;
+        }
+    }
+
+    while (c->auth_pending != 0 &&
+           c->rbytes >= (int) sizeof(protocol_binary_response_header)) {
+        protocol_binary_response_header res;
+        int which;
+        int total;
+
+        memcpy(res.bytes, c->rbuf, sizeof(res.bytes));
+        if (res.response.magic != PROTOCOL_BINARY_RES) {
+            goto failed;
+        }
+
+        /* The replies come back in the order of the requests. */
+
+        which = (c->auth_pending & DOWNSTREAM_AUTH_SASL) ?
+            DOWNSTREAM_AUTH_SASL : DOWNSTREAM_AUTH_BUCKET;
+
+        total = (int) sizeof(res.bytes) + (int) ntohl(res.response.bodylen);
+        if (total > c->rbytes) {
+            if (total > c->rsize) {
+                goto failed; /* Unexpectedly large reply body. */
+            }
+            return true;
+        }
+
+        if (ntohs(res.response.status) != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            if (settings.verbose > 1) {
+                moxi_log_write("%d: %s_downstream failure (%x)\n",
+                               c->sfd,
+                               which == DOWNSTREAM_AUTH_SASL ? "auth" : "bucket",
+                               ntohs(res.response.status));
+            }
+
+            if (which == DOWNSTREAM_AUTH_SASL) {
+                d->ptd->stats.stats.tot_downstream_auth_failed++;
+            } else {
+                d->ptd->stats.stats.tot_downstream_bucket_failed++;
+            }
+            goto failed;
+        }
+
+        if (which == DOWNSTREAM_AUTH_SASL) {
+            d->ptd->stats.stats.tot_downstream_auth++;
+        } else {
+            d->ptd->stats.stats.tot_downstream_bucket++;
+        }
+
+        c->auth_pending &= ~which;
+        c->rbytes -= total;
+        if (c->rbytes > 0) {
+            memmove(c->rbuf, c->rbuf + total, c->rbytes);
+        }
+    }
+
+    if (c->auth_pending != 0) {
+        return true;
+    }
+
+    c->rcurr = c->rbuf;
+    c->rbytes = 0;
+
+    zstored_error_count(c->thread, c->host_ident, false);
+
+    d->ptd->stats.stats.tot_downstream_connect++;
+
+    if (settings.verbose > 2) {
+        moxi_log_write("%d: authenticated to: %s\n",
+                       c->sfd, c->host_ident);
+    }
+
+    conn_set_state(c, conn_pause);
+    update_event(c, 0);
+    cproxy_forward_or_error(d);
+
+    return true;
+
+ failed:
+    /* Treat a auth/bucket error as a blacklistable error. */
+
+    zstored_error_count(c->thread, c->host_ident, true);
+
+    d->ptd->stats.stats.tot_downstream_connect_failed++;
+
+    c->auth_pending = 0;
+
+    k = delink_from_downstream_conns(c);
+    if (k >= 0) {
+        cb_assert(d->downstream_conns[k] == NULL);
+
+        d->downstream_conns[k] = NULL_CONN;
+    }
+
+    conn_set_state(c, conn_closing);
+    update_event(c, 0);
+    cproxy_forward_or_error(d);
+
+    return false;
+}
+
 bool cproxy_on_connect_downstream_conn(conn *c) {
     int error;
     socklen_t errsz = sizeof(error);
@@ -3199,6 +4045,10 @@ bool cproxy_on_connect_downstream_conn(conn *c) {
     d = c->extra;
     cb_assert(d != NULL);
 
+    if (c->state == conn_authenticating) {
+        return cproxy_on_auth_downstream_conn(c);
+    }
+
     if (settings.verbose > 2) {
         moxi_log_write("%d: cproxy_on_connect_downstream_conn for %s\n",
                        c->sfd, c->host_ident);
@@ -3236,6 +4086,10 @@ bool cproxy_on_connect_downstream_conn(conn *c) {
     if (k >= 0) {
         if (downstream_connect_init(d, mcs_server_index(&d->mst, k),
                                     &d->behaviors_arr[k], c)) {
+            if (c->state == conn_authenticating) {
+                return true;
+            }
+
             /* We are connected to the server now */
             if (settings.verbose > 2) {
                 moxi_log_write("%d: connected to: %s\n",
@@ -3394,6 +4248,119 @@ void zstored_error_count(LIBEVENT_THREAD *thread,
     }
 }
 
+/* Only a request with exactly one, non-quiet response can share */
+/* a binary downstream conn.  Multi-gets, broadcasts and quiet */
+/* commands still reserve a conn of their own. */
+
+static bool zstored_mux_eligible(downstream *d) {
+    conn *uc = d->upstream_conn;
+
+    if (uc == NULL ||
+        uc->next != NULL ||
+        uc->noreply) {
+        return false;
+    }
+
+    if (IS_ASCII(uc->protocol)) {
+        return uc->cmd_curr != PROTOCOL_BINARY_CMD_GETKQ &&
+               cproxy_is_broadcast_cmd(uc->cmd_curr) == false;
+    }
+
+    return uc->corked == NULL &&
+           cproxy_is_broadcast_cmd(uc->cmd) == false;
+}
+
+/* Returns true if requests to an ejected server should fail fast.
+ * Once breaker_eject_time has passed since the ejection or the last
+ * probe, one request is let through to probe the server, and its
+ * success closes the breaker.
+ */
+static bool zstored_breaker_open(downstream *d,
+                                 zstored_downstream_conns *conns) {
+    proxy_behavior *b = &d->ptd->behavior_pool.base;
+
+    if (b->breaker_max_failures == 0 ||
+        conns->breaker_eject_time == 0) {
+        return false;
+    }
+
+    if (msec_current_time - conns->breaker_eject_time <
+        b->breaker_eject_time) {
+        d->ptd->stats.stats.tot_downstream_ejected_fail++;
+
+        return true;
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("breaker probe, %s, %u\n",
+                       conns->host_ident, conns->breaker_failures);
+    }
+
+    conns->breaker_eject_time = msec_current_time;
+
+    d->ptd->stats.stats.tot_downstream_ejected_probe++;
+
+    return false;
+}
+
+/* Tracks the outcome of a request on downstream conn dc, for its
+ * server's circuit breaker.  A request slower than breaker_slow_time
+ * counts as a failure, even when it succeeds.
+ */
+void zstored_breaker_record(downstream *d, conn *dc, bool ok) {
+    proxy_behavior *b;
+    zstored_downstream_conns *conns;
+
+    cb_assert(d != NULL);
+    cb_assert(d->ptd != NULL);
+    cb_assert(dc != NULL);
+
+    b = &d->ptd->behavior_pool.base;
+    if (b->breaker_max_failures == 0 ||
+        dc == NULL_CONN ||
+        dc->thread == NULL ||
+        dc->host_ident == NULL) {
+        return;
+    }
+
+    conns = zstored_get_downstream_conns(dc->thread, dc->host_ident);
+    if (conns == NULL) {
+        return;
+    }
+
+    /* Slowness is timed from when the request was forwarded, */
+    /* so time spent queued inside moxi isn't blamed on the server. */
+
+    if (ok &&
+        b->breaker_slow_time > 0 &&
+        d->usec_start > 0 &&
+        usec_now() - d->usec_start >
+        (uint64_t) b->breaker_slow_time * 1000) {
+        ok = false;
+    }
+
+    if (ok) {
+        conns->breaker_failures = 0;
+        conns->breaker_eject_time = 0;
+        return;
+    }
+
+    conns->breaker_failures++;
+
+    if (conns->breaker_failures >= b->breaker_max_failures) {
+        if (conns->breaker_eject_time == 0) {
+            if (settings.verbose > 1) {
+                moxi_log_write("breaker ejecting, %s, %u\n",
+                               conns->host_ident, conns->breaker_failures);
+            }
+
+            d->ptd->stats.stats.tot_downstream_ejected++;
+        }
+
+        conns->breaker_eject_time = msec_current_time;
+    }
+}
+
 conn *zstored_acquire_downstream_conn(downstream *d,
                                       LIBEVENT_THREAD *thread,
                                       mcs_server_st *msst,
@@ -3426,6 +4393,23 @@ conn *zstored_acquire_downstream_conn(downstream *d,
     host_ident = mcs_server_st_ident(msst, IS_ASCII(downstream_protocol));
     conns = zstored_get_downstream_conns(thread, host_ident);
     if (conns != NULL) {
+        if (zstored_breaker_open(d, conns)) {
+            return NULL;
+        }
+
+        dc = conns->mux_dc;
+        if (dc != NULL &&
+            dc->state != conn_closing &&
+            behavior->downstream_conn_mux > 0 &&
+            zstored_mux_eligible(d) &&
+            cproxy_mux_full(dc) == false) {
+            cb_assert(dc->thread == thread);
+
+            /* The shared conn's extra is per response, not per d. */
+
+            return dc;
+        }
+
         dc = conns->dc;
         if (dc != NULL) {
             cb_assert(dc->thread == thread);
@@ -3479,7 +4463,8 @@ conn *zstored_acquire_downstream_conn(downstream *d,
         if (conns != NULL) {
             conns->dc_acquired++;
 
-            if (dc->state != conn_connecting) {
+            if (dc->state != conn_connecting &&
+                dc->state != conn_authenticating) {
                 conns->error_count = 0;
                 conns->error_time = 0;
             }
@@ -3494,6 +4479,44 @@ conn *zstored_acquire_downstream_conn(downstream *d,
     return dc;
 }
 
+/* Like zstored_acquire_downstream_conn(), but only hands out an idle,
+ * already connected conn from the pool, never a new or shared one.
+ */
+conn *zstored_acquire_idle_downstream_conn(downstream *d,
+                                           LIBEVENT_THREAD *thread,
+                                           mcs_server_st *msst) {
+    zstored_downstream_conns *conns;
+    conn *dc;
+
+    cb_assert(d);
+    cb_assert(d->ptd);
+    cb_assert(d->upstream_conn);
+    cb_assert(thread);
+    cb_assert(msst);
+
+    conns = zstored_get_downstream_conns(thread,
+                mcs_server_st_ident(msst,
+                    IS_ASCII(d->ptd->behavior_pool.base.downstream_protocol)));
+    if (conns == NULL ||
+        conns->dc == NULL) {
+        return NULL;
+    }
+
+    dc = conns->dc;
+    cb_assert(dc->thread == thread);
+
+    d->ptd->stats.stats.tot_downstream_conn_acquired++;
+
+    conns->dc_acquired++;
+    conns->dc = dc->next;
+    dc->next = NULL;
+
+    cb_assert(dc->extra == NULL);
+    dc->extra = d;
+
+    return dc;
+}
+
 /* new fn by jsh */
 void zstored_release_downstream_conn(conn *dc, bool closing) {
     bool keep;
@@ -3532,9 +4555,22 @@ void zstored_release_downstream_conn(conn *dc, bool closing) {
 
         if (keep) {
             downstream *d_head;
+            uint32_t mux = d->ptd->behavior_pool.base.downstream_conn_mux;
+
             cb_assert(dc->next == NULL);
-            dc->next = conns->dc;
-            conns->dc = dc;
+
+            /* The first idle binary conn becomes the shared conn. */
+
+            if (mux > 0 &&
+                conns->mux_dc == NULL &&
+                dc->skip_replies == 0 &&
+                IS_BINARY(dc->protocol) &&
+                cproxy_mux_init(dc, mux)) {
+                conns->mux_dc = dc;
+            } else {
+                dc->next = conns->dc;
+                conns->dc = dc;
+            }
 
             /* Since one downstream conn was released, process a single */
             /* waiting downstream, if any. */
@@ -3802,16 +4838,168 @@ bool cproxy_front_cache_key(proxy_td *ptd, char *key, int key_len) {
     return (key != NULL &&
             key_len > 0 &&
             ptd->behavior_pool.base.front_cache_lifespan > 0 &&
-            matcher_check(&ptd->proxy->front_cache_matcher, key, key_len, false) == true &&
-            matcher_check(&ptd->proxy->front_cache_unmatcher, key, key_len, false) == false);
+            matcher_check_ex(&ptd->proxy->front_cache_matcher,
+                             cproxy_thread_data_index(ptd),
+                             key, key_len, false) == true &&
+            matcher_check_ex(&ptd->proxy->front_cache_unmatcher,
+                             cproxy_thread_data_index(ptd),
+                             key, key_len, false) == false);
 }
 
 void cproxy_front_cache_delete(proxy_td *ptd, char *key, int key_len) {
     if (cproxy_front_cache_key(ptd, key, key_len) == true) {
-        mcache_delete(&ptd->proxy->front_cache, key, key_len);
+        proxy *p = ptd->proxy;
+
+        if (ptd->behavior_pool.base.front_cache_sharded) {
+            /* Any shard might be holding a copy of the item. */
+
+            int i;
+            for (i = 1; i < p->thread_data_num; i++) {
+                mcache_delete(&p->thread_data[i].front_cache, key, key_len);
+            }
+        } else {
+            mcache_delete(&p->front_cache, key, key_len);
+        }
 
         if (settings.verbose > 1) {
             moxi_log_write("front_cache del %s\n", key);
         }
     }
 }
+
+/* Returns the front cache that the worker thread of the ptd */
+/* should use for its gets and sets.
+ */
+mcache *cproxy_front_cache(proxy_td *ptd) {
+    cb_assert(ptd);
+    cb_assert(ptd->proxy);
+
+    if (ptd->behavior_pool.base.front_cache_sharded) {
+        return &ptd->front_cache;
+    }
+
+    return &ptd->proxy->front_cache;
+}
+
+bool cproxy_front_cache_started(proxy_td *ptd) {
+    return mcache_started(cproxy_front_cache(ptd));
+}
+
+/* Must be called on the main listener thread, or during proxy
+ * creation before any worker thread sees the proxy.
+ */
+void cproxy_front_cache_start(proxy *p, proxy_behavior *base) {
+    cb_assert(p);
+    cb_assert(base);
+
+    if (base->front_cache_max > 0 &&
+        base->front_cache_lifespan > 0) {
+        if (base->front_cache_sharded) {
+            /* Split front_cache_max across the worker threads, */
+            /* so the memory bound stays the same as unsharded. */
+
+            int nworkers = p->thread_data_num - 1;
+            uint32_t max = base->front_cache_max;
+            int i;
+
+            if (nworkers > 1) {
+                max = (max + nworkers - 1) / nworkers;
+            }
+
+            for (i = 1; i < p->thread_data_num; i++) {
+                mcache_start(&p->thread_data[i].front_cache, max);
+            }
+        } else {
+            mcache_start(&p->front_cache, base->front_cache_max);
+        }
+    }
+}
+
+void cproxy_front_cache_stop(proxy *p) {
+    int i;
+
+    cb_assert(p);
+
+    mcache_stop(&p->front_cache);
+
+    for (i = 1; i < p->thread_data_num; i++) {
+        mcache_stop(&p->thread_data[i].front_cache);
+    }
+}
+
+void cproxy_front_cache_flush_all(proxy_td *ptd) {
+    proxy *p;
+    int i;
+
+    cb_assert(ptd);
+
+    p = ptd->proxy;
+    cb_assert(p);
+
+    mcache_flush_all(&p->front_cache, 0);
+
+    for (i = 1; i < p->thread_data_num; i++) {
+        mcache_flush_all(&p->thread_data[i].front_cache, 0);
+    }
+}
+
+/* Frees the proxy's retired matcher tries that every worker thread
+ * has passed a quiescent point after, and stamps the tries retired
+ * next with the current quiesce_gen.  Must be called on the main
+ * listener thread.
+ */
+void cproxy_reclaim_matchers(proxy *p) {
+    uint64_t gen;
+    uint64_t safe_gen;
+    int i;
+
+    cb_assert(p);
+
+    cb_mutex_enter(&p->proxy_lock);
+
+    gen = p->quiesce_gen;
+    safe_gen = gen;
+
+    for (i = 1; i < p->thread_data_num; i++) {
+        if (safe_gen > p->thread_data[i].quiesce_gen) {
+            safe_gen = p->thread_data[i].quiesce_gen;
+        }
+    }
+
+    cb_mutex_exit(&p->proxy_lock);
+
+    matcher_reclaim(&p->front_cache_matcher, gen, safe_gen);
+    matcher_reclaim(&p->front_cache_unmatcher, gen, safe_gen);
+    matcher_reclaim(&p->optimize_set_matcher, gen, safe_gen);
+}
+
+void cproxy_front_cache_reset_stats(proxy *p) {
+    int i;
+
+    cb_assert(p);
+
+    mcache_reset_stats(&p->front_cache);
+
+    for (i = 1; i < p->thread_data_num; i++) {
+        mcache_reset_stats(&p->thread_data[i].front_cache);
+    }
+}
+
+/* Rolls up the stats of the front cache and all its shards. */
+
+void cproxy_front_cache_stats(proxy *p, mcache *sum, uint32_t *size) {
+    int i;
+
+    cb_assert(p);
+    cb_assert(sum);
+    cb_assert(size);
+
+    memset(sum, 0, sizeof(mcache));
+    *size = 0;
+
+    mcache_add_stats(&p->front_cache, sum, size);
+
+    for (i = 1; i < p->thread_data_num; i++) {
+        mcache_add_stats(&p->thread_data[i].front_cache, sum, size);
+    }
+}
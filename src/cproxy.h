@@ -96,6 +96,7 @@ typedef struct proxy_stats         proxy_stats;
 typedef struct proxy_behavior      proxy_behavior;
 typedef struct proxy_behavior_pool proxy_behavior_pool;
 typedef struct downstream          downstream;
+typedef struct downstream_chunk    downstream_chunk;
 typedef struct key_stats           key_stats;
 
 struct proxy_behavior {
@@ -108,6 +109,9 @@ struct proxy_behavior {
     uint32_t       downstream_max;      /* PL: Downstream concurrency. */
     uint32_t       downstream_conn_max; /* PL: Max # of conns per thread */
                                         /* and per host_ident. */
+    uint32_t       downstream_conn_mux; /* PL: Max # of requests in flight */
+                                        /* on a shared binary conn per */
+                                        /* thread and host_ident, or 0. */
     uint32_t       downstream_weight;   /* SL: Server weight. */
     uint32_t       downstream_retry;    /* SL: How many times to retry a cmd. */
     enum protocol  downstream_protocol; /* SL: Favored downstream protocol. */
@@ -116,6 +120,21 @@ struct proxy_behavior {
     struct timeval wait_queue_timeout;  /* PL: Fields of 0 mean no timeout. */
     struct timeval connect_timeout;     /* PL: Fields of 0 mean no timeout. */
     struct timeval auth_timeout;        /* PL: Fields of 0 mean no timeout. */
+    bool           multiget_squash;     /* PL: Squash concurrent ascii gets */
+                                        /* from different upstream conns */
+                                        /* into one downstream request. */
+    uint32_t       multiget_batch_max;  /* PL: Max # of single-key ascii */
+                                        /* gets for one server to batch */
+                                        /* into one downstream request. */
+    struct timeval multiget_batch_delay; /* PL: Max wait for a batch to */
+                                         /* fill, or 0 for no wait. */
+    bool           replica_read;        /* PL: Re-issue a single-key get */
+                                        /* to the key's replicas when its */
+                                        /* master times out or is down. */
+    uint32_t       hedge_max_pct;       /* PL: Max % of single-key gets */
+                                        /* that may be hedged, or 0. */
+    struct timeval hedge_delay;         /* PL: Wait before hedging a get, */
+                                        /* or 0 for the observed p95. */
     bool           time_stats;          /* IL: Capture timing stats. */
     char           mcs_opts[80];        /* PL: Extra options for mcs initialization. */
 
@@ -123,11 +142,27 @@ struct proxy_behavior {
     uint32_t connect_retry_interval;  /* IL: Time in millisecs before retrying */
                                       /* when too many connect() errors, to not */
                                       /* overwhelm the downstream servers. */
+    uint32_t breaker_max_failures;    /* PL: Eject a server after this many */
+                                      /* failed or slow requests in a row, */
+                                      /* or 0 for no ejection. */
+    uint32_t breaker_slow_time;       /* PL: Millisecs after which a request */
+                                      /* counts as failed, or 0. */
+    uint32_t breaker_eject_time;      /* PL: Millisecs an ejected server is */
+                                      /* failed fast between probes, > 0. */
+    uint32_t item_cache_max;          /* IL: Max bytes of free items each */
+                                      /* worker thread keeps for reuse. */
+
+    uint32_t cut_through_min;         /* PL: Min value bytes to stream to */
+                                      /* upstreams while still arriving */
+                                      /* from a downstream, or 0. */
 
     uint32_t front_cache_max;         /* PL: Max # of front cachable items. */
     uint32_t front_cache_lifespan;    /* PL: In millisecs. */
     char     front_cache_spec[300];   /* PL: Matcher prefixes for front caching. */
     char     front_cache_unspec[100]; /* PL: Don't front cache prefixes. */
+    bool     front_cache_sharded;     /* PL: One front cache shard per */
+                                      /* worker thread, to avoid a */
+                                      /* single, contended lock. */
 
     uint32_t key_stats_max;         /* PL: Max # of key stats entries. */
     uint32_t key_stats_lifespan;    /* PL: In millisecs. */
@@ -227,6 +262,13 @@ struct proxy {
 
     uint32_t config_ver;
 
+    /* Mutable, covered by proxy_lock, incremented after each */
+    /* reconfiguration of the matchers below.  Each worker copies */
+    /* it into its proxy_td at its next update_ptd_config(), which */
+    /* is a quiescent point, where it's not checking any matcher. */
+
+    uint64_t quiesce_gen;
+
     /* Mutable, covered by proxy_lock. */
 
     proxy_behavior_pool behavior_pool;
@@ -245,6 +287,9 @@ struct proxy {
 
     proxy *next; /* Modified/accessed only by main listener thread. */
 
+    /* When the front_cache_sharded behavior is on, the front cache */
+    /* lives in the proxy_td's instead, so this one is unused. */
+
     mcache  front_cache;
     matcher front_cache_matcher;
     matcher front_cache_unmatcher;
@@ -267,6 +312,7 @@ struct proxy_stats {
     uint64_t tot_downstream_conn;
     uint64_t tot_downstream_conn_acquired;
     uint64_t tot_downstream_conn_released;
+    uint64_t tot_downstream_conn_mux;
     uint64_t tot_downstream_released;
     uint64_t tot_downstream_reserved;
     uint64_t tot_downstream_reserved_time;
@@ -319,6 +365,16 @@ struct proxy_stats {
     uint64_t tot_multiget_keys;
     uint64_t tot_multiget_keys_dedupe;
     uint64_t tot_multiget_bytes_dedupe;
+    uint64_t tot_multiget_stream;
+    uint64_t tot_multiget_stream_abort;
+    uint64_t tot_multiget_batch;
+    uint64_t tot_multiget_partial;
+    uint64_t tot_replica_read;
+    uint64_t tot_hedge_sent;
+    uint64_t tot_hedge_won;
+    uint64_t tot_downstream_ejected;
+    uint64_t tot_downstream_ejected_fail;
+    uint64_t tot_downstream_ejected_probe;
     uint64_t tot_optimize_sets;
     uint64_t err_oom;
     uint64_t err_upstream_write_prep;
@@ -400,6 +456,8 @@ struct proxy_td { /* Per proxy, per worker-thread data struct. */
 
     proxy_behavior_pool behavior_pool;
 
+    uint64_t quiesce_gen; /* Covered by proxy_lock, see proxy. */
+
     /* Upstream conns that are paused, waiting for */
     /* an available, released downstream. */
 
@@ -422,10 +480,30 @@ struct proxy_td { /* Per proxy, per worker-thread data struct. */
     struct timeval timeout_tv;
     struct event   timeout_event;
 
+    /* A short timer that holds single-key gets in the wait_queue */
+    /* while a batch fills, when multiget_batch_delay is non-zero. */
+    /* batch_held counts the gets held since the timer was armed. */
+
+    bool           batch_pending;
+    uint32_t       batch_held;
+    struct event   batch_event;
+
+    /* Budget for hedged gets, in hundredths of a hedge, earned as */
+    /* gets are sent and spent as hedges are sent. */
+
+    uint32_t       hedge_credit;
+
     mcache  key_stats;
     matcher key_stats_matcher;
     matcher key_stats_unmatcher;
 
+    /* This worker thread's shard of the front cache, used only when */
+    /* the front_cache_sharded behavior is on.  Gets and sets only */
+    /* touch the local shard, so its lock is almost never contended, */
+    /* but invalidations have to visit every shard of the proxy. */
+
+    mcache front_cache;
+
     proxy_stats_td stats;
 };
 
@@ -434,6 +512,17 @@ struct proxy_td { /* Per proxy, per worker-thread data struct. */
  *
  * Owned by worker thread.
  */
+/* A chunk of a downstream's arena, which hands out small buffers, */
+/* like multiget request headers, that only need to live until the */
+/* downstream is released, without a malloc/free for each one. */
+
+struct downstream_chunk {
+    downstream_chunk *next;
+    size_t            size; /* Bytes in data. */
+    size_t            used; /* Bytes of data handed out. */
+    char              data[];
+};
+
 struct downstream {
     /* The following group of fields are immutable or read-only (RO), */
     /* except for config_ver, which gets updated if the downstream's */
@@ -480,12 +569,26 @@ struct downstream {
     char *target_host_ident;
 
     genhash_t *multiget; /* Keyed by string. */
+    uint32_t   multiget_opaque; /* Last key ordinal handed out while */
+                                /* squashing multigets, or 0. */
+    bool       multiget_partial; /* Some keys went unanswered, due to */
+                                 /* a broken, erroring or slow server. */
     genhash_t *merger;   /* Keyed by string, for merging replies like STATS. */
 
+    downstream_chunk *chunks; /* Arena for downstream_alloc(), reset when */
+                              /* the downstream is released. */
+
     /* Timeout is in use when timeout_tv fields are non-zero. */
 
     struct timeval timeout_tv;
     struct event   timeout_event;
+
+    /* A hedge timer is in use when hedge_tv fields are non-zero, */
+    /* and hedge_conn is the conn with the duplicate get, if sent. */
+
+    struct timeval hedge_tv;
+    struct event   hedge_event;
+    conn          *hedge_conn;
 };
 
 /* Sentinel value for downstream->downstream_conns[] array entries, */
@@ -512,11 +615,13 @@ int cproxy_listen_port(int port,
                        conn_funcs *conn_funcs);
 
 proxy_td *cproxy_find_thread_data(proxy *p, cb_thread_t thread_id);
+int       cproxy_thread_data_index(proxy_td *ptd);
 bool      cproxy_init_upstream_conn(conn *c);
 bool      cproxy_init_downstream_conn(conn *c);
 void      cproxy_on_close_upstream_conn(conn *c);
 void      cproxy_on_close_downstream_conn(conn *c);
 void      cproxy_on_pause_downstream_conn(conn *c);
+void      cproxy_on_nread_progress_downstream_conn(conn *c);
 
 void cproxy_upstream_state_change(conn *c, enum conn_states next_state);
 
@@ -551,6 +656,11 @@ int cproxy_auth_downstream(mcs_server_st *server,
                            proxy_behavior *behavior, SOCKET fd);
 int cproxy_bucket_downstream(mcs_server_st *server,
                              proxy_behavior *behavior, SOCKET fd);
+int cproxy_auth_request(mcs_server_st *server,
+                        proxy_behavior *behavior,
+                        char *buf, int buf_size);
+int cproxy_bucket_request(proxy_behavior *behavior,
+                          char *buf, int buf_size);
 
 void  cproxy_pause_upstream_for_downstream(proxy_td *ptd, conn *upstream);
 conn *cproxy_find_downstream_conn(downstream *d, char *key, int key_length,
@@ -572,11 +682,40 @@ void upstream_error_msg(conn *uc, char *ascii_msg,
 void upstream_retry(void *data0, void *data1);
 
 int downstream_conn_index(downstream *d, conn *c);
+int delink_from_downstream_conns(conn *c);
 
 void cproxy_dump_header(SOCKET prefix, char *bb);
 
 int cproxy_max_retries(downstream *d);
 
+bool cproxy_replica_next(downstream *d);
+
+/* Binary downstream conns shared by many downstreams. */
+
+bool        cproxy_mux_init(conn *c, uint32_t size);
+void        cproxy_mux_free(conn *c);
+bool        cproxy_mux_full(conn *c);
+bool        cproxy_mux_send(conn *c, downstream *d,
+                            struct iovec *iov, int iovcnt, int ncopy,
+                            item *it);
+bool        cproxy_mux_recv(conn *c);
+bool        cproxy_mux_recv_nread(conn *c);
+void        cproxy_mux_on_pause(conn *c);
+downstream *cproxy_mux_take(conn *c);
+bool        cproxy_mux_detach(conn *c, downstream *d);
+
+/* Hedged single-key gets, duplicated to a replica when slow. */
+
+bool cproxy_start_hedge_timeout(downstream *d, conn *c);
+void cproxy_clear_hedge(downstream *d);
+void cproxy_hedge_settle(downstream *d, conn *c,
+                         protocol_binary_response_header *header);
+
+conn *zstored_acquire_idle_downstream_conn(downstream *d,
+                                           LIBEVENT_THREAD *thread,
+                                           mcs_server_st *msst);
+void  zstored_release_downstream_conn(conn *dc, bool closing);
+
 /* --------------------------------------------------------------- */
 
 void cproxy_process_upstream_ascii(conn *c, char *line);
@@ -714,6 +853,7 @@ bool cproxy_start_wait_queue_timeout(proxy_td *ptd, conn *uc);
 rel_time_t cproxy_realtime(const time_t exptime);
 
 void cproxy_close_conn(conn *c);
+void cproxy_close_conn_local(conn *c);
 
 void cproxy_reset_stats_td(proxy_stats_td *pstd);
 void cproxy_reset_stats(proxy_stats *ps);
@@ -730,7 +870,7 @@ typedef struct multiget_entry multiget_entry;
 
 struct multiget_entry {
     conn           *upstream_conn;
-    uint32_t        opaque; /* For binary protocol. */
+    uint32_t        opaque; /* Key ordinal, when squashing. */
     uint64_t        hits;
     multiget_entry *next;
 };
@@ -744,6 +884,14 @@ bool multiget_ascii_downstream(
 
 void multiget_ascii_downstream_response(downstream *d, item *it);
 
+bool multiget_ascii_downstream_stream_start(downstream *d, conn *c, item *it);
+void multiget_ascii_downstream_stream(downstream *d, conn *c);
+bool multiget_ascii_downstream_stream_end(downstream *d, conn *c, item *it);
+void multiget_ascii_downstream_stream_abort(downstream *d, conn *c);
+bool multiget_ascii_downstream_partial(downstream *d);
+
+char *multiget_key_for_opaque(downstream *d, uint32_t opaque);
+
 void multiget_foreach_free(const void *key,
                            const void *value,
                            void *user_data);
@@ -797,6 +945,17 @@ void cproxy_front_cache_delete(proxy_td *ptd, char *key, int key_len);
 
 bool cproxy_front_cache_key(proxy_td *ptd, char *key, int key_len);
 
+mcache *cproxy_front_cache(proxy_td *ptd);
+
+bool cproxy_front_cache_started(proxy_td *ptd);
+void cproxy_front_cache_start(proxy *p, proxy_behavior *base);
+void cproxy_front_cache_stop(proxy *p);
+void cproxy_front_cache_flush_all(proxy_td *ptd);
+void cproxy_front_cache_reset_stats(proxy *p);
+void cproxy_front_cache_stats(proxy *p, mcache *sum, uint32_t *size);
+
+void cproxy_reclaim_matchers(proxy *p);
+
 HTGRAM_HANDLE cproxy_create_timing_histogram(void);
 
 typedef void (*mcache_traversal_func)(const void *it, void *userdata);
@@ -818,6 +977,7 @@ void  mcache_set(mcache *m, void *it,
 void  mcache_delete(mcache *m, char *key, int key_len);
 void  mcache_flush_all(mcache *m, uint32_t msec_exp);
 void  mcache_foreach(mcache *m, mcache_traversal_func f, void *userdata);
+void  mcache_add_stats(mcache *m, mcache *sum, uint32_t *size);
 
 /* Functions for key stats. */
 
@@ -840,6 +1000,7 @@ void key_stats_dec_ref(void *it);
 /* TODO: The following generic items should be broken out into util file. */
 
 bool  add_conn_item(conn *c, item *it);
+void *downstream_alloc(downstream *d, size_t size);
 char *add_conn_suffix(conn *c);
 
 void *cproxy_make_bin_header(conn *c, uint8_t magic);
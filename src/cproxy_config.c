@@ -43,6 +43,7 @@ proxy_behavior behavior_default_g = {
     .cycle = 200, /* Clock cycle or quantum, in milliseconds. */
     .downstream_max = 1024,
     .downstream_conn_max = 4, /* Use 0 for unlimited. */
+    .downstream_conn_mux = 0, /* Use 0 to not share conns. */
     .downstream_weight = 0,
     .downstream_retry = 1,
     .downstream_protocol = proxy_downstream_ascii_prot,
@@ -66,14 +67,32 @@ proxy_behavior behavior_default_g = {
         .tv_sec  = 0,
         .tv_usec = 100000
     },
+    .multiget_squash = false,
+    .multiget_batch_max = 0, /* Use 0 for no batching. */
+    .multiget_batch_delay = {
+        .tv_sec  = 0,
+        .tv_usec = 0
+    },
+    .replica_read = false,
+    .hedge_max_pct = 0, /* Use 0 for no hedging. */
+    .hedge_delay = {
+        .tv_sec  = 0,
+        .tv_usec = 0
+    },
     .time_stats = false,
     .mcs_opts = {0},
     .connect_max_errors = 5,         /* In zstored, 10. */
     .connect_retry_interval = 30000, /* In zstored, 30000. */
+    .breaker_max_failures = 0,       /* Use 0 for no ejection. */
+    .breaker_slow_time = 0,
+    .breaker_eject_time = 10000,
+    .item_cache_max = 1048576,
+    .cut_through_min = 0,
     .front_cache_max = 200,
     .front_cache_lifespan = 0,
     .front_cache_spec = {0},
     .front_cache_unspec = {0},
+    .front_cache_sharded = false,
     .key_stats_max = 4000,
     .key_stats_lifespan = 0,
     .key_stats_spec = {0},
@@ -341,6 +360,8 @@ int cproxy_init(char *cfg_str,
         msec_cycle = behavior.cycle;
     }
 
+    item_cache_max = behavior.item_cache_max;
+
     msec_clockevent_base = main_base;
     msec_clock_handler(0, 0, NULL);
 
@@ -647,6 +668,8 @@ void cproxy_parse_behavior_key_val(char *key,
             ok = safe_strtoul(val, &behavior->downstream_max);
         } else if (wordeq(key, "downstream_conn_max")) {
             ok = safe_strtoul(val, &behavior->downstream_conn_max);
+        } else if (wordeq(key, "downstream_conn_mux")) {
+            ok = safe_strtoul(val, &behavior->downstream_conn_mux);
         } else if (wordeq(key, "weight") ||
                    wordeq(key, "downstream_weight")) {
             ok = safe_strtoul(val, &behavior->downstream_weight);
@@ -694,6 +717,24 @@ void cproxy_parse_behavior_key_val(char *key,
             ok = safe_strtoul(val, &ms);
             behavior->auth_timeout.tv_sec  = floor(ms / 1000.0);
             behavior->auth_timeout.tv_usec = (ms % 1000) * 1000;
+        } else if (wordeq(key, "multiget_squash")) {
+            ok = safe_strtoul(val, &x);
+            behavior->multiget_squash = x;
+        } else if (wordeq(key, "multiget_batch_max")) {
+            ok = safe_strtoul(val, &behavior->multiget_batch_max);
+        } else if (wordeq(key, "multiget_batch_delay")) {
+            ok = safe_strtoul(val, &ms);
+            behavior->multiget_batch_delay.tv_sec  = floor(ms / 1000.0);
+            behavior->multiget_batch_delay.tv_usec = (ms % 1000) * 1000;
+        } else if (wordeq(key, "replica_read")) {
+            ok = safe_strtoul(val, &x);
+            behavior->replica_read = x;
+        } else if (wordeq(key, "hedge_max_pct")) {
+            ok = safe_strtoul(val, &behavior->hedge_max_pct);
+        } else if (wordeq(key, "hedge_delay")) {
+            ok = safe_strtoul(val, &ms);
+            behavior->hedge_delay.tv_sec  = floor(ms / 1000.0);
+            behavior->hedge_delay.tv_usec = (ms % 1000) * 1000;
         } else if (wordeq(key, "time_stats")) {
             ok = safe_strtoul(val, &x);
             behavior->time_stats = x;
@@ -706,6 +747,21 @@ void cproxy_parse_behavior_key_val(char *key,
             ok = safe_strtoul(val, &behavior->connect_max_errors);
         } else if (wordeq(key, "connect_retry_interval")) {
             ok = safe_strtoul(val, &behavior->connect_retry_interval);
+        } else if (wordeq(key, "breaker_max_failures")) {
+            ok = safe_strtoul(val, &behavior->breaker_max_failures);
+        } else if (wordeq(key, "breaker_slow_time")) {
+            ok = safe_strtoul(val, &behavior->breaker_slow_time);
+        } else if (wordeq(key, "breaker_eject_time")) {
+            /* With no eject time, every request to an ejected */
+            /* server would be a probe, so 0 is refused. */
+            ok = safe_strtoul(val, &ms) && ms > 0;
+            if (ok) {
+                behavior->breaker_eject_time = ms;
+            }
+        } else if (wordeq(key, "item_cache_max")) {
+            ok = safe_strtoul(val, &behavior->item_cache_max);
+        } else if (wordeq(key, "cut_through_min")) {
+            ok = safe_strtoul(val, &behavior->cut_through_min);
         } else if (wordeq(key, "front_cache_max")) {
             ok = safe_strtoul(val, &behavior->front_cache_max);
         } else if (wordeq(key, "front_cache_lifespan")) {
@@ -720,6 +776,9 @@ void cproxy_parse_behavior_key_val(char *key,
                 strcpy(behavior->front_cache_unspec, val);
                 ok = true;
             }
+        } else if (wordeq(key, "front_cache_sharded")) {
+            ok = safe_strtoul(val, &x);
+            behavior->front_cache_sharded = x;
         } else if (wordeq(key, "key_stats_max")) {
             ok = safe_strtoul(val, &behavior->key_stats_max);
         } else if (wordeq(key, "key_stats_lifespan")) {
@@ -868,6 +927,7 @@ void cproxy_dump_behavior_ex(proxy_behavior *b, char *prefix, int level,
     if (level >= 1) {
         vdump("downstream_max", "%u", b->downstream_max);
         vdump("downstream_conn_max", "%u", b->downstream_conn_max);
+        vdump("downstream_conn_mux", "%u", b->downstream_conn_mux);
     }
 
     vdump("downstream_weight",   "%u", b->downstream_weight);
@@ -890,14 +950,30 @@ void cproxy_dump_behavior_ex(proxy_behavior *b, char *prefix, int level,
         vdump("auth_timeout", "%ld", /* In millisecs. */
               (b->auth_timeout.tv_sec * 1000 +
                b->auth_timeout.tv_usec / 1000));
+        vdump("multiget_squash", "%d", b->multiget_squash);
+        vdump("multiget_batch_max", "%u", b->multiget_batch_max);
+        vdump("multiget_batch_delay", "%ld", /* In millisecs. */
+              (b->multiget_batch_delay.tv_sec * 1000 +
+               b->multiget_batch_delay.tv_usec / 1000));
+        vdump("replica_read", "%d", b->replica_read);
+        vdump("hedge_max_pct", "%u", b->hedge_max_pct);
+        vdump("hedge_delay", "%ld", /* In millisecs. */
+              (b->hedge_delay.tv_sec * 1000 +
+               b->hedge_delay.tv_usec / 1000));
         vdump("time_stats", "%d", b->time_stats);
         vdump("mcs_opts", "%s", b->mcs_opts);
         vdump("connect_max_errors", "%u", b->connect_max_errors);
         vdump("connect_retry_interval", "%u", b->connect_retry_interval);
+        vdump("breaker_max_failures", "%u", b->breaker_max_failures);
+        vdump("breaker_slow_time", "%u", b->breaker_slow_time);
+        vdump("breaker_eject_time", "%u", b->breaker_eject_time);
+        vdump("item_cache_max", "%u", b->item_cache_max);
+        vdump("cut_through_min", "%u", b->cut_through_min);
         vdump("front_cache_max", "%u", b->front_cache_max);
         vdump("front_cache_lifespan", "%u", b->front_cache_lifespan);
         vdump("front_cache_spec", "%s", b->front_cache_spec);
         vdump("front_cache_unspec", "%s", b->front_cache_unspec);
+        vdump("front_cache_sharded", "%d", b->front_cache_sharded);
         vdump("key_stats_max", "%u", b->key_stats_max);
         vdump("key_stats_lifespan", "%u", b->key_stats_lifespan);
         vdump("key_stats_spec", "%s", b->key_stats_spec);
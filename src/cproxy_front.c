@@ -105,7 +105,7 @@ void mcache_start(mcache *m, uint32_t max) {
     hops.freeKey = m->key_alloc ? free : noop_free;
     hops.freeValue = m->funcs->item_dec_ref;
 
-    m->map = genhash_init(128, hops);
+    m->map = genhash_init_open(128, hops);
     if (m->map != NULL) {
         m->max         = max;
         m->lru_head    = NULL;
@@ -466,6 +466,44 @@ void mcache_foreach(mcache *m, mcache_traversal_func f, void *userdata) {
     genhash_iter(m->map, mcache_foreach_trampoline, &data);
 }
 
+/**
+ * Accumulate the stats of m into sum, for rolling up the shards
+ * of a sharded front cache.  The size param is optional.
+ */
+void mcache_add_stats(mcache *m, mcache *sum, uint32_t *size) {
+    cb_assert(m);
+    cb_assert(sum);
+
+    if (m->lock) {
+        cb_mutex_enter(m->lock);
+    }
+
+    if (size != NULL && m->map != NULL) {
+        *size += genhash_size(m->map);
+    }
+
+    sum->max += m->max;
+
+    if (sum->oldest_live < m->oldest_live) {
+        sum->oldest_live = m->oldest_live;
+    }
+
+    sum->tot_get_hits    += m->tot_get_hits;
+    sum->tot_get_expires += m->tot_get_expires;
+    sum->tot_get_misses  += m->tot_get_misses;
+    sum->tot_get_bytes   += m->tot_get_bytes;
+    sum->tot_adds        += m->tot_adds;
+    sum->tot_add_skips   += m->tot_add_skips;
+    sum->tot_add_fails   += m->tot_add_fails;
+    sum->tot_add_bytes   += m->tot_add_bytes;
+    sum->tot_deletes     += m->tot_deletes;
+    sum->tot_evictions   += m->tot_evictions;
+
+    if (m->lock) {
+        cb_mutex_exit(m->lock);
+    }
+}
+
 /* ------------------------------------------------- */
 
 static char *item_key(void *it) {
@@ -0,0 +1,315 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "src/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <platform/cbassert.h>
+#include "memcached.h"
+#include "cproxy.h"
+#include "mcs.h"
+#include "log.h"
+
+/* A hedged get is a single-key ascii get, going to a binary */
+/* downstream, that hasn't been answered after a short delay, and */
+/* so is also sent to the first replica of its vbucket, as a replica */
+/* read, since a replica refuses a normal get.  The first conn to */
+/* start a response wins, and the other conn is closed, the same */
+/* way a downstream_timeout abandons slow conns. */
+
+/* Hedges are only sent over idle, already connected conns, so a */
+/* hedge never waits on a connect or takes the last conn slot. */
+
+#define HEDGE_CREDIT_MAX   1000 /* Hundredths, so a burst of 10 hedges. */
+#define HEDGE_MIN_SAMPLES  100  /* Before trusting the observed p95. */
+
+static void hedge_timeout(evutil_socket_t fd,
+                          const short which,
+                          void *arg);
+
+/* Returns the usec at or below which 95% of the sampled
+ * downstream_reserved_time's fell, or 0 if there's too little data.
+ */
+static uint64_t hedge_p95(proxy_td *ptd) {
+    HTGRAM_HANDLE h = ptd->stats.downstream_reserved_time_htgram;
+    int64_t  start;
+    int64_t  width;
+    uint64_t count;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    int i;
+
+    if (h == NULL) {
+        return 0;
+    }
+
+    for (i = 0; htgram_get_bin_data(h, i, &start, &width, &count); i++) {
+        total += count;
+    }
+
+    if (total < HEDGE_MIN_SAMPLES) {
+        return 0;
+    }
+
+    for (i = 0; htgram_get_bin_data(h, i, &start, &width, &count); i++) {
+        sum += count;
+        if (sum * 100 >= total * 95) {
+            return (uint64_t) (start + width);
+        }
+    }
+
+    return 0;
+}
+
+/* Starts the hedge timer for a single-key get that was just sent
+ * on downstream conn c, if hedging is on and the get qualifies.
+ */
+bool cproxy_start_hedge_timeout(downstream *d, conn *c) {
+    proxy_behavior *b;
+    conn *uc;
+    struct timeval dt;
+
+    cb_assert(d != NULL);
+    cb_assert(d->ptd != NULL);
+    cb_assert(c != NULL);
+
+    b  = &d->ptd->behavior_pool.base;
+    uc = d->upstream_conn;
+
+    if (b->hedge_max_pct == 0 ||
+        uc == NULL ||
+        uc->next != NULL ||
+        uc->noreply ||
+        !IS_ASCII(uc->protocol) ||
+        uc->cmd != -1 ||
+        uc->cmd_curr != PROTOCOL_BINARY_CMD_GETK ||
+        uc->cmd_replica > 0 ||
+        c->mux != NULL ||
+        d->hedge_conn != NULL ||
+        mcs_replica_count(&d->mst) <= 0) {
+        return false;
+    }
+
+    dt = b->hedge_delay;
+    if (dt.tv_sec == 0 &&
+        dt.tv_usec == 0) {
+        uint64_t p95 = hedge_p95(d->ptd);
+        if (p95 == 0) {
+            return false;
+        }
+
+        dt.tv_sec  = p95 / 1000000;
+        dt.tv_usec = p95 % 1000000;
+    }
+
+    /* Every hedgeable get earns hedge_max_pct hundredths of */
+    /* a hedge, which caps hedges at hedge_max_pct of them. */
+
+    d->ptd->hedge_credit += b->hedge_max_pct;
+    if (d->ptd->hedge_credit > HEDGE_CREDIT_MAX) {
+        d->ptd->hedge_credit = HEDGE_CREDIT_MAX;
+    }
+
+    cproxy_clear_hedge(d);
+
+    evtimer_set(&d->hedge_event, hedge_timeout, d);
+
+    event_base_set(uc->thread->base, &d->hedge_event);
+
+    d->hedge_tv = dt;
+
+    return evtimer_add(&d->hedge_event, &d->hedge_tv) == 0;
+}
+
+void cproxy_clear_hedge(downstream *d) {
+    cb_assert(d != NULL);
+
+    if (d->hedge_tv.tv_sec != 0 ||
+        d->hedge_tv.tv_usec != 0) {
+        evtimer_del(&d->hedge_event);
+    }
+
+    d->hedge_tv.tv_sec = 0;
+    d->hedge_tv.tv_usec = 0;
+}
+
+static void hedge_timeout(evutil_socket_t fd,
+                          const short which,
+                          void *arg) {
+    downstream *d = arg;
+    conn *uc;
+    conn *dc;
+    char *key;
+    int   key_len;
+    int   vbucket = -1;
+    int   master;
+    int   replica;
+    protocol_binary_request_header *header;
+
+    cb_assert(d != NULL);
+    cb_assert(d->ptd != NULL);
+    (void)fd;
+    (void)which;
+
+    cproxy_clear_hedge(d);
+
+    uc = d->upstream_conn;
+    if (uc == NULL ||
+        uc->next != NULL ||
+        d->downstream_used != 1 ||
+        d->hedge_conn != NULL ||
+        d->ptd->hedge_credit < 100) {
+        return;
+    }
+
+    if (!ascii_scan_key(uc->cmd_start, &key, &key_len)) {
+        return;
+    }
+
+    master  = cproxy_server_index(d, key, key_len, &vbucket);
+    replica = mcs_key_replica(&d->mst, key, key_len, 0, NULL);
+
+    if (master < 0 ||
+        replica < 0 ||
+        replica == master ||
+        replica >= (int) mcs_server_count(&d->mst) ||
+        d->downstream_conns[replica] != NULL) {
+        return;
+    }
+
+    dc = zstored_acquire_idle_downstream_conn(d, uc->thread,
+             mcs_server_index(&d->mst, replica));
+    if (dc == NULL) {
+        return;
+    }
+
+    if (!IS_BINARY(dc->protocol) ||
+        !cproxy_prep_conn_for_write(dc)) {
+        zstored_release_downstream_conn(dc, false);
+        return;
+    }
+
+    header = (protocol_binary_request_header *) dc->wbuf;
+    memset(header, 0, sizeof(*header));
+
+    header->request.magic    = PROTOCOL_BINARY_REQ;
+    header->request.opcode   = PROTOCOL_BINARY_CMD_GET_REPLICA;
+    header->request.keylen   = htons((uint16_t) key_len);
+    header->request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    header->request.bodylen  = htonl(key_len);
+
+    if (vbucket >= 0) {
+        header->request.reserved = htons(vbucket);
+        header->request.opaque   = htonl(vbucket);
+    }
+
+    if (add_iov(dc, header, sizeof(*header)) != 0 ||
+        add_iov(dc, key, key_len) != 0) {
+        d->ptd->stats.stats.err_oom++;
+        zstored_release_downstream_conn(dc, false);
+        return;
+    }
+
+    conn_set_state(dc, conn_mwrite);
+    dc->write_and_go = conn_new_cmd;
+
+    if (!update_event(dc, EV_WRITE | EV_PERSIST)) {
+        d->ptd->stats.stats.err_oom++;
+        cproxy_close_conn(dc);
+        return;
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("%d: hedge_timeout, hedging to %d, vbucket %d\n",
+                       uc->sfd, dc->sfd, vbucket);
+    }
+
+    d->downstream_conns[replica] = dc;
+    d->downstream_used++;
+    d->hedge_conn = dc;
+
+    d->ptd->hedge_credit -= 100;
+    d->ptd->stats.stats.tot_hedge_sent++;
+}
+
+/* Called when conn c of a hedged get sees the first response header.
+ * The other conn loses and goes back to the pool, which drops the
+ * reply it still owes.  A hedge that the replica
+ * refuses, such as with not-my-vbucket, or misses, which a lagging
+ * replica can't vouch for, instead loses to the master, and its
+ * response is eaten.
+ */
+void cproxy_hedge_settle(downstream *d, conn *c,
+                         protocol_binary_response_header *header) {
+    conn *other = NULL;
+    bool refused;
+    int k = -1;
+    int n;
+    int i;
+
+    cb_assert(d != NULL);
+    cb_assert(c != NULL);
+    cb_assert(header != NULL);
+
+    cproxy_clear_hedge(d);
+
+    if (d->hedge_conn == NULL) {
+        return;
+    }
+
+    n = mcs_server_count(&d->mst);
+
+    for (i = 0; i < n; i++) {
+        if (d->downstream_conns[i] != NULL &&
+            d->downstream_conns[i] != NULL_CONN &&
+            d->downstream_conns[i] != c) {
+            other = d->downstream_conns[i];
+            k = i;
+        }
+    }
+
+    if (c == d->hedge_conn) {
+        refused =
+            header->response.status != PROTOCOL_BINARY_RESPONSE_SUCCESS;
+
+        if (refused && other != NULL) {
+            c->noreply = true;
+            header->response.opaque = htonl(OPAQUE_IGNORE_REPLY);
+
+            d->hedge_conn = NULL;
+            d->downstream_used--;
+
+            return;
+        }
+
+        if (!refused) {
+            d->ptd->stats.stats.tot_hedge_won++;
+        }
+    }
+
+    d->hedge_conn = NULL;
+
+    if (other != NULL) {
+        if (settings.verbose > 2) {
+            moxi_log_write("%d: hedge_settle, releasing %d, %s\n",
+                           c->sfd, other->sfd, state_text(other->state));
+        }
+
+        d->downstream_conns[k] = NULL;
+        d->downstream_used--;
+
+        /* The loser did nothing wrong, so a loser that's only */
+        /* waiting on its reply is kept.  One that's still writing */
+        /* its request is closed by the release, without counting */
+        /* against its server. */
+
+        if (other->state == conn_new_cmd ||
+            other->state == conn_waiting ||
+            other->state == conn_read) {
+            update_event(other, 0);
+            other->skip_replies++;
+            conn_set_state(other, conn_pause);
+        }
+
+        zstored_release_downstream_conn(other, false);
+    }
+}
@@ -8,6 +8,7 @@
 #include "memcached.h"
 #include "cproxy.h"
 #include "log.h"
+#include "strscan.h"
 
 /* Callback to g_hash_table_foreach that frees the multiget_entry list.
  */
@@ -68,10 +69,11 @@ void multiget_remove_upstream(const void *key,
     while (entry != NULL) {
         /* Just clear the slots, because glib hash table API */
         /* doesn't allow for key/value modifications during iteration. */
+        /* The opaque stays, as squashed upstreams might still need */
+        /* a not-my-vbucket retry of the key. */
 
         if (entry->upstream_conn == uc) {
             entry->upstream_conn = NULL;
-            entry->opaque = 0;
         }
 
         entry = entry ->next;
@@ -92,6 +94,7 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
     uint64_t msec_current_time_snapshot;
     int   uc_num = 0;
     conn *uc_cur;
+    bool  squash;
 
     cb_assert(d != NULL);
     cb_assert(d->downstream_conns != NULL);
@@ -110,11 +113,18 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
             d->downstream_conns[i] != NULL_CONN &&
             cproxy_prep_conn_for_write(d->downstream_conns[i]) == false) {
             d->ptd->stats.stats.err_downstream_write_prep++;
-            cproxy_close_conn(d->downstream_conns[i]);
+            cproxy_close_conn_local(d->downstream_conns[i]);
             return false;
         }
     }
 
+    /* When upstream conns were squashed together, the de-duplication */
+    /* map is also what fans replies out to each upstream, so it's */
+    /* needed even for single keys.  A retry stays in squash mode */
+    /* even if only one upstream is left. */
+
+    squash = (uc->next != NULL || d->multiget_opaque > 0);
+
     /* Snapshot the volatile only once. */
     msec_current_time_snapshot = msec_current_time;
     uc_cur = uc;
@@ -134,12 +144,10 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
         command = uc_cur->cmd_start;
         cb_assert(command != NULL);
 
-        while (*command != '\0' && *command == ' ') {
-            command++;
-        }
+        command = strscan_skip_spaces(command);
 
-        space = strchr(command, ' ');
-        cb_assert(space > command);
+        space = strscan_token_end(command);
+        cb_assert(*space == ' ' && space > command);
 
         cmd_len = space - command;
         cb_assert(cmd_len == 3 || cmd_len == 4); /* Either get or gets. */
@@ -153,15 +161,14 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
 
         while (space != NULL) {
             char *key = space + 1;
-            char *next_space = strchr(key, ' ');
-            int   key_len;
+            char *next_space = strscan_token_end(key);
+            int   key_len = next_space - key;
             bool  key_last;
 
-            if (next_space != NULL) {
-                key_len = next_space - key;
+            if (*next_space == ' ') {
                 key_last = false;
             } else {
-                key_len = strlen(key);
+                next_space = NULL;
                 key_last = true;
 
                 /* We've reached the last key. */
@@ -172,6 +179,7 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
             /* This key_len check helps skip consecutive spaces. */
 
             if (key_len > 0) {
+                int key_index = (int) (key - command);
                 int vbucket = -1;
                 conn *c;
                 bool do_key_stats;
@@ -250,9 +258,9 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
                     /* Previously, we used to only have a map when there was more than */
                     /* one upstream conn. */
 
-                    if (key_last == false &&
+                    if ((key_last == false || squash) &&
                         d->multiget == NULL) {
-                        d->multiget = genhash_init(128, skeyhash_ops);
+                        d->multiget = genhash_init_open(128, skeyhash_ops);
                         if (settings.verbose > 1) {
                             moxi_log_write("%d: cproxy multiget hash table new\n", uc->sfd);
                         }
@@ -278,15 +286,51 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
 
                         entry = calloc(1, sizeof(multiget_entry));
                         if (entry != NULL) {
+                            multiget_entry *head = genhash_find(d->multiget, key);
+
                             entry->upstream_conn = uc_cur;
                             entry->opaque = 0;
                             entry->hits = 0;
-                            entry->next = genhash_find(d->multiget, key);
 
-                            genhash_update(d->multiget, key, entry);
+                            if (head != NULL) {
+                                /* Link in behind the head, so the map */
+                                /* keeps its original key. */
+
+                                entry->next = head->next;
+                                head->next = entry;
 
-                            if (entry->next != NULL) {
                                 first_request = false;
+                            } else {
+                                char *map_key = key;
+
+                                /* A squashed upstream might close before */
+                                /* the others are done, so the map gets its */
+                                /* own copy of the key, plus an ordinal */
+                                /* that a2b_not_my_vbucket() can find it by. */
+
+                                if (squash) {
+                                    char *k = downstream_alloc(d, key_len + 1);
+                                    if (k == NULL) {
+                                        /* Without an ordinal, a later */
+                                        /* lookup by opaque could match */
+                                        /* the wrong key, so fail. */
+
+                                        free(entry);
+                                        ptd->stats.stats.err_oom++;
+                                        return false;
+                                    }
+
+                                    memcpy(k, key, key_len);
+                                    k[key_len] = '\0';
+                                    map_key = k;
+
+                                    entry->opaque = ++d->multiget_opaque;
+                                    key_index = (int) entry->opaque;
+                                }
+
+                                entry->next = NULL;
+
+                                genhash_update(d->multiget, map_key, entry);
                             }
                         } else {
                             /* TODO: Handle out of multiget entry memory. */
@@ -308,7 +352,7 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
                         /* Provide the preceding space as optimization */
                         /* for ascii-to-ascii configuration. */
 
-                        emit_skey(c, key - 1, key_len + 1, vbucket, key - command);
+                        emit_skey(c, key - 1, key_len + 1, vbucket, key_index);
                     } else {
                         ptd->stats.stats.tot_multiget_keys_dedupe++;
 
@@ -322,7 +366,11 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
                         }
                     }
                 } else {
-                    /* TODO: Handle when downstream conn is down. */
+                    /* The key's server is down, so the key is */
+                    /* reported as a miss, and the other keys are */
+                    /* still served. */
+
+                    d->multiget_partial = true;
                 }
             }
 
@@ -357,7 +405,7 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
                 }
 
                 d->ptd->stats.stats.err_oom++;
-                cproxy_close_conn(c);
+                cproxy_close_conn_local(c);
             }
         }
     }
@@ -383,42 +431,43 @@ bool multiget_ascii_downstream(downstream *d, conn *uc,
     return nwrite > 0;
 }
 
-void multiget_ascii_downstream_response(downstream *d, item *it) {
-    proxy_td *ptd;
-    proxy_stats_cmd *psc_get_key;
-    proxy *p;
+static multiget_entry *multiget_find(downstream *d, item *it) {
+    /* The ITEM_key is not NULL or space terminated. */
+    char key_buf[KEY_MAX_LENGTH + 10];
 
-    cb_assert(d);
-    cb_assert(it);
-    cb_assert(it->nkey > 0);
-    cb_assert(ITEM_key(it) != NULL);
+    cb_assert(it->nkey <= KEY_MAX_LENGTH);
+    memcpy(key_buf, ITEM_key(it), it->nkey);
+    key_buf[it->nkey] = '\0';
 
-    ptd = d->ptd;
-    cb_assert(ptd);
-
-    psc_get_key = &ptd->stats.stats_cmd[STATS_CMD_TYPE_REGULAR][STATS_CMD_GET_KEY];
+    return genhash_find(d->multiget, key_buf);
+}
 
-    p = ptd->proxy;
-    cb_assert(p);
+static void multiget_front_cache_set(downstream *d, item *it) {
+    proxy_td *ptd = d->ptd;
 
     if (cproxy_front_cache_key(ptd, ITEM_key(it), it->nkey) == true) {
         uint32_t front_cache_lifespan =
             ptd->behavior_pool.base.front_cache_lifespan;
 
-        mcache_set(&p->front_cache, it,
+        mcache_set(cproxy_front_cache(ptd), it,
                    front_cache_lifespan + msec_current_time,
                    true, false);
     }
+}
 
-    if (d->multiget != NULL) {
-        /* The ITEM_key is not NULL or space terminated. */
-        multiget_entry *entry_first;
-        char key_buf[KEY_MAX_LENGTH + 10];
+/* Queues the item for writing on every upstream conn that asked for it.
+ */
+static void multiget_fan_out(downstream *d, item *it) {
+    proxy_td *ptd;
+    proxy_stats_cmd *psc_get_key;
 
-        cb_assert(it->nkey <= KEY_MAX_LENGTH);
-        memcpy(key_buf, ITEM_key(it), it->nkey);
-        key_buf[it->nkey] = '\0';
-        entry_first = genhash_find(d->multiget, key_buf);
+    ptd = d->ptd;
+    cb_assert(ptd);
+
+    psc_get_key = &ptd->stats.stats_cmd[STATS_CMD_TYPE_REGULAR][STATS_CMD_GET_KEY];
+
+    if (d->multiget != NULL) {
+        multiget_entry *entry_first = multiget_find(d, it);
 
         if (entry_first != NULL) {
             multiget_entry *entry = entry_first;
@@ -486,3 +535,363 @@ void multiget_ascii_downstream_response(downstream *d, item *it) {
         }
     }
 }
+
+void multiget_ascii_downstream_response(downstream *d, item *it) {
+    cb_assert(d);
+    cb_assert(d->ptd);
+    cb_assert(d->ptd->proxy);
+    cb_assert(it);
+    cb_assert(it->nkey > 0);
+    cb_assert(ITEM_key(it) != NULL);
+
+    multiget_front_cache_set(d, it);
+    multiget_fan_out(d, it);
+}
+
+/* Cut-through of large get values.
+ *
+ * Rather than waiting for a whole value to arrive from a downstream
+ * conn, a streamed item is queued on its upstream conns as soon as
+ * its header is parsed, and whatever the upstreams have queued is
+ * written as the value arrives.  Each upstream conn can only have one
+ * streamed item in flight, and writes never go past the bytes of it
+ * that have been read so far, so later queued items just wait their
+ * turn.  The upstream conns stay in conn_pause throughout, and the
+ * usual conn_mwrite after the downstream is released writes the rest.
+ */
+
+static bool multiget_stream_mark(conn *uc, item *it) {
+    if (uc->stream_item != NULL ||
+        IS_UDP(uc->transport)) {
+        return false;
+    }
+
+    uc->stream_item = it;
+    return true;
+}
+
+static void multiget_stream_unmark(downstream *d, item *it) {
+    conn *uc;
+
+    for (uc = d->upstream_conn; uc != NULL; uc = uc->next) {
+        if (uc->stream_item == it) {
+            uc->stream_item = NULL;
+        }
+    }
+}
+
+/* Writes what the upstream conn has queued without blocking, but not
+ * past end within the streamed item.  The unsent iovecs are then moved
+ * to the front of uc->iov, because ensure_iov_space() expects that no
+ * msghdr has been partially sent.
+ */
+static void multiget_stream_flush(conn *uc, item *it, char *end) {
+    char *lo = (char *) it;
+    char *hi = ITEM_data(it) + it->nbytes;
+    struct iovec *iov;
+    int niov;
+    int i;
+
+    cb_assert(uc->msgused > 0);
+    cb_assert(uc->msgcurr < uc->msgused);
+
+    iov = uc->msglist[uc->msgcurr].msg_iov;
+    niov = (int) ((uc->iov + uc->iovused) - iov);
+
+    while (niov > 0) {
+        struct msghdr m;
+        size_t want = 0;
+        size_t saved = 0;
+        int clamped = -1;
+        bool limit = false;
+        ssize_t res;
+        int n;
+
+        for (n = 0; n < niov && n < IOV_MAX; n++) {
+            char *base = iov[n].iov_base;
+
+            if (base >= lo && base < hi &&
+                base + iov[n].iov_len > end) {
+                if (end > base) {
+                    clamped = n;
+                    saved = iov[n].iov_len;
+                    iov[n].iov_len = end - base;
+                    want += iov[n].iov_len;
+                    n++;
+                }
+                limit = true;
+                break;
+            }
+
+            want += iov[n].iov_len;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        memset(&m, 0, sizeof(m));
+        m.msg_iov = iov;
+        m.msg_iovlen = n;
+
+        res = sendmsg(uc->sfd, &m, 0);
+
+        if (clamped >= 0) {
+            iov[clamped].iov_len = saved;
+        }
+
+        if (res <= 0) {
+            /* Blocked, or an error that the conn_mwrite */
+            /* after the downstream is released will see. */
+            break;
+        }
+
+        THREAD_STATS_ADD(uc->thread, bytes_written, res);
+
+        if ((size_t) res < want) {
+            limit = true;
+        }
+
+        while (niov > 0 && res >= (ssize_t) iov->iov_len) {
+            res -= (ssize_t) iov->iov_len;
+            iov++;
+            niov--;
+        }
+
+        if (res > 0) {
+            iov->iov_base = (char *) iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+
+        if (limit) {
+            break;
+        }
+    }
+
+    memmove(uc->iov, iov, niov * sizeof(struct iovec));
+
+    /* Rebuilding never needs more msghdrs than before. */
+
+    uc->msgcurr = 0;
+    uc->msgused = 0;
+    uc->iovused = 0;
+
+    add_msghdr(uc);
+
+    for (i = 0; i < niov; i++) {
+        struct msghdr *msg = &uc->msglist[uc->msgused - 1];
+        if (msg->msg_iovlen == IOV_MAX) {
+            add_msghdr(uc);
+            msg = &uc->msglist[uc->msgused - 1];
+        }
+
+        msg->msg_iovlen++;
+        uc->msgbytes += uc->iov[i].iov_len;
+        uc->iovused++;
+    }
+}
+
+static void multiget_stream_flush_all(downstream *d, item *it, char *end) {
+    conn *uc;
+
+    for (uc = d->upstream_conn; uc != NULL; uc = uc->next) {
+        if (uc->stream_item == it) {
+            multiget_stream_flush(uc, it, end);
+        }
+    }
+}
+
+/* Called when downstream conn c has parsed the header of a get value,
+ * and is about to nread it into it.  Returns true if the item is being
+ * streamed, in which case it's already queued on its upstream conns.
+ */
+bool multiget_ascii_downstream_stream_start(downstream *d, conn *c, item *it) {
+    uint32_t min;
+    bool ok = true;
+    int n = 0;
+
+    cb_assert(d != NULL);
+    cb_assert(d->ptd != NULL);
+    cb_assert(c != NULL);
+    cb_assert(c->stream_item == NULL);
+    cb_assert(it != NULL);
+    cb_assert(it->nbytes >= 2);
+
+    min = d->ptd->behavior_pool.base.cut_through_min;
+    if (min == 0 ||
+        (uint32_t) it->nbytes - 2 < min) {
+        return false;
+    }
+
+    /* Every upstream conn that wants the item must be free to take it. */
+
+    if (d->multiget != NULL) {
+        multiget_entry *entry;
+
+        for (entry = multiget_find(d, it); entry != NULL && ok;
+             entry = entry->next) {
+            if (entry->upstream_conn != NULL) {
+                ok = multiget_stream_mark(entry->upstream_conn, it);
+                n++;
+            }
+        }
+    } else {
+        conn *uc;
+
+        for (uc = d->upstream_conn; uc != NULL && ok; uc = uc->next) {
+            ok = multiget_stream_mark(uc, it);
+            n++;
+        }
+    }
+
+    if (!ok || n <= 0) {
+        multiget_stream_unmark(d, it);
+        return false;
+    }
+
+    /* The value's terminating \r\n is in place early, so the */
+    /* fan-out takes the item as-is.  An ascii downstream reads */
+    /* its own \r\n over it. */
+
+    *(ITEM_data(it) + it->nbytes - 2) = '\r';
+    *(ITEM_data(it) + it->nbytes - 1) = '\n';
+
+    multiget_fan_out(d, it);
+
+    c->stream_item = it;
+
+    d->ptd->stats.stats.tot_multiget_stream++;
+
+    multiget_stream_flush_all(d, it, c->ritem);
+
+    return true;
+}
+
+/* Called as more of the streamed item's value arrives on c.
+ */
+void multiget_ascii_downstream_stream(downstream *d, conn *c) {
+    item *it = c->stream_item;
+
+    cb_assert(it != NULL);
+    cb_assert(c->item == it);
+    cb_assert(c->ritem >= ITEM_data(it));
+    cb_assert(c->ritem <= ITEM_data(it) + it->nbytes);
+
+    multiget_stream_flush_all(d, it, c->ritem);
+}
+
+/* Called once c has read all of the item.  Returns true if the item was
+ * streamed, and so has already been queued on its upstream conns.
+ */
+bool multiget_ascii_downstream_stream_end(downstream *d, conn *c, item *it) {
+    if (it == NULL ||
+        c->stream_item != it) {
+        return false;
+    }
+
+    if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
+        if (settings.verbose > 1) {
+            moxi_log_write("ERROR: unexpected downstream data block");
+        }
+
+        multiget_ascii_downstream_stream_abort(d, c);
+        return true;
+    }
+
+    c->stream_item = NULL;
+
+    multiget_front_cache_set(d, it);
+    multiget_stream_flush_all(d, it, ITEM_data(it) + it->nbytes);
+    multiget_stream_unmark(d, it);
+
+    return true;
+}
+
+/* Called when c is going away before all of its streamed item arrived.
+ * The upstream conns have already seen part of the value, so the only
+ * honest thing left is to close them.
+ */
+void multiget_ascii_downstream_stream_abort(downstream *d, conn *c) {
+    item *it = c->stream_item;
+    conn *uc;
+
+    cb_assert(it != NULL);
+
+    c->stream_item = NULL;
+
+    d->ptd->stats.stats.tot_multiget_stream_abort++;
+
+    /* Closing an upstream conn delinks it, so rescan each time. */
+
+    uc = d->upstream_conn;
+    while (uc != NULL) {
+        if (uc->stream_item == it) {
+            uc->stream_item = NULL;
+            cproxy_close_conn(uc);
+
+            uc = d->upstream_conn;
+        } else {
+            uc = uc->next;
+        }
+    }
+}
+
+/* Called when a server of an ascii multiget broke, errored or was
+ * too slow.  Returns true if the multiget's END suffix can report that
+ * server's keys as misses, while the hits from the other servers are
+ * kept.  Squashed or batched gets count as a multiget.
+ */
+bool multiget_ascii_downstream_partial(downstream *d) {
+    cb_assert(d != NULL);
+
+    if (d->upstream_conn == NULL ||
+        !IS_ASCII(d->upstream_conn->protocol) ||
+        (d->upstream_conn->cmd_curr != PROTOCOL_BINARY_CMD_GETKQ &&
+         d->upstream_conn->next == NULL) ||
+        d->upstream_suffix == NULL ||
+        d->upstream_suffix_len != 0 ||
+        strcmp(d->upstream_suffix, "END\r\n") != 0) {
+        return false;
+    }
+
+    d->multiget_partial = true;
+
+    return true;
+}
+
+struct multiget_opaque_match {
+    uint32_t    opaque;
+    const char *key;
+};
+
+static void multiget_match_opaque(const void *key,
+                                  const void *value,
+                                  void *user_data) {
+    struct multiget_opaque_match *m = user_data;
+    const multiget_entry *entry = value;
+
+    for (; entry != NULL; entry = entry->next) {
+        if (entry->opaque == m->opaque) {
+            m->key = key;
+            return;
+        }
+    }
+}
+
+/* Returns the multiget map's key that was sent with the given opaque */
+/* ordinal while squashing, or NULL.  This scans the whole map, but it's */
+/* only used for not-my-vbucket errors, during cluster topology changes. */
+char *multiget_key_for_opaque(downstream *d, uint32_t opaque) {
+    struct multiget_opaque_match m;
+
+    cb_assert(d != NULL);
+
+    m.opaque = opaque;
+    m.key = NULL;
+
+    if (d->multiget != NULL && opaque != 0) {
+        genhash_iter(d->multiget, multiget_match_opaque, &m);
+    }
+
+    return (char *) m.key;
+}
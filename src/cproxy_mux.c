@@ -0,0 +1,501 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "src/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <platform/cbassert.h>
+#include "memcached.h"
+#include "cproxy.h"
+#include "log.h"
+
+/* A mux downstream conn is a binary downstream conn that's shared */
+/* by many downstreams at once, instead of being reserved by one. */
+/* Each request is assigned the next sequence number as its opaque, */
+/* and the memcached server answers in order, so a response's opaque */
+/* tells us which request, and so which downstream, it belongs to. */
+/* The original opaque is put back before the normal a2b/b2b */
+/* response processing sees the response. */
+
+/* Room for a request header plus ext plus key, as copied. */
+
+#define MUX_BUF_SIZE (sizeof(protocol_binary_request_header) + 64 + \
+                      KEY_MAX_LENGTH)
+#define MUX_IOV_MAX  4
+
+typedef struct {
+    downstream  *d;      /* NULL when the downstream has gone away. */
+    uint32_t     opaque; /* Original opaque of the request, as sent. */
+    item        *it;     /* Holds the uncopied iov bytes, or NULL. */
+    struct iovec iov[MUX_IOV_MAX];
+    int          iovcnt;
+    char         buf[MUX_BUF_SIZE];
+} downstream_mux_req;
+
+typedef struct {
+    downstream_mux_req *reqs; /* Ring of reqs, indexed by seq % size. */
+    uint32_t size;     /* A power of 2, so seq % size survives wraparound. */
+    uint32_t max;      /* Most requests in flight, <= size. */
+    uint32_t head;     /* Seq of the oldest request awaiting a response. */
+    uint32_t sent;     /* Seq of the first request not yet written. */
+    uint32_t tail;     /* Seq to assign to the next request. */
+    bool     recv;     /* True while the head's response is processed. */
+    bool     discard;  /* True if that response is just being dropped. */
+    bool     in_pause; /* True while cproxy_mux_on_pause() releases. */
+} downstream_mux;
+
+static downstream_mux_req *mux_req(downstream_mux *mux, uint32_t seq) {
+    return &mux->reqs[seq % mux->size];
+}
+
+/* True if seq is in [from, to), allowing for seq wraparound. */
+
+static bool mux_between(uint32_t seq, uint32_t from, uint32_t to) {
+    return (uint32_t) (seq - from) < (uint32_t) (to - from);
+}
+
+/* Clear the downstream's references to the mux conn, so that */
+/* the downstream no longer thinks it holds the conn. */
+
+static void mux_unlink(conn *c, downstream *d) {
+    int n = mcs_server_count(&d->mst);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (d->downstream_conns[i] == c) {
+            d->downstream_conns[i] = NULL;
+        }
+    }
+}
+
+/* Whether the conn is between reading responses and not writing, */
+/* so that requests can be written right away. */
+
+static bool mux_idle(conn *c, downstream_mux *mux) {
+    if (mux->in_pause || mux->recv) {
+        return false;
+    }
+
+    return c->state == conn_waiting ||
+           c->state == conn_read ||
+           c->state == conn_new_cmd ||
+           c->state == conn_pause;
+}
+
+/* Write all the queued, unsent requests in one go.  The conn comes */
+/* back to cproxy_mux_on_pause() once they're written. */
+
+static bool mux_flush(conn *c, downstream_mux *mux) {
+    if (cproxy_prep_conn_for_write(c) == false) {
+        return false;
+    }
+
+    while (mux->sent != mux->tail) {
+        downstream_mux_req *r = mux_req(mux, mux->sent);
+        int i;
+
+        for (i = 0; i < r->iovcnt; i++) {
+            if (add_iov(c, r->iov[i].iov_base, r->iov[i].iov_len) != 0) {
+                return false;
+            }
+        }
+
+        if (r->it != NULL) {
+            /* The conn_mwrite completion releases the ref. */
+
+            if (add_conn_item(c, r->it) == false) {
+                return false;
+            }
+
+            r->it = NULL;
+        }
+
+        mux->sent++;
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("%d: mux_flush, head %u, sent %u\n",
+                       c->sfd, mux->head, mux->sent);
+    }
+
+    conn_set_state(c, conn_mwrite);
+    c->write_and_go = conn_pause;
+
+    return update_event(c, EV_WRITE | EV_PERSIST);
+}
+
+bool cproxy_mux_init(conn *c, uint32_t size) {
+    downstream_mux *mux;
+    uint32_t slots = 1;
+
+    cb_assert(c != NULL);
+    cb_assert(c->mux == NULL);
+    cb_assert(IS_BINARY(c->protocol));
+    cb_assert(size > 0);
+
+    /* Otherwise, when the 32-bit seq wraps, two requests in flight */
+    /* could land in the same slot. */
+
+    if (size > 0x80000000) {
+        return false;
+    }
+
+    while (slots < size) {
+        slots <<= 1;
+    }
+
+    mux = calloc(1, sizeof(downstream_mux));
+    if (mux == NULL) {
+        return false;
+    }
+
+    mux->reqs = calloc(slots, sizeof(downstream_mux_req));
+    if (mux->reqs == NULL) {
+        free(mux);
+        return false;
+    }
+
+    mux->size = slots;
+    mux->max = size;
+
+    c->mux = mux;
+
+    return true;
+}
+
+void cproxy_mux_free(conn *c) {
+    downstream_mux *mux = c->mux;
+
+    if (mux != NULL) {
+        uint32_t i;
+
+        for (i = 0; i < mux->size; i++) {
+            if (mux->reqs[i].it != NULL) {
+                item_remove(mux->reqs[i].it);
+            }
+        }
+
+        free(mux->reqs);
+        free(mux);
+
+        c->mux = NULL;
+    }
+}
+
+bool cproxy_mux_full(conn *c) {
+    downstream_mux *mux = c->mux;
+    cb_assert(mux != NULL);
+
+    return (uint32_t) (mux->tail - mux->head) >= mux->max;
+}
+
+/* Queue a request onto a mux conn, writing it right away if */
+/* the conn is idle.  The first ncopy iov's, which start with the */
+/* request header, are copied.  The rest must point into the item, */
+/* on which we take our own ref. */
+
+bool cproxy_mux_send(conn *c, downstream *d,
+                     struct iovec *iov, int iovcnt, int ncopy,
+                     item *it) {
+    downstream_mux *mux = c->mux;
+    downstream_mux_req *r;
+    protocol_binary_request_header *req;
+    size_t len = 0;
+    int i;
+
+    cb_assert(mux != NULL);
+    cb_assert(d != NULL);
+    cb_assert(ncopy > 0);
+    cb_assert(ncopy <= iovcnt);
+    cb_assert(it != NULL || ncopy == iovcnt);
+
+    if (cproxy_mux_full(c) ||
+        iovcnt - ncopy + 1 > MUX_IOV_MAX) {
+        return false;
+    }
+
+    r = mux_req(mux, mux->tail);
+    cb_assert(r->d == NULL);
+    cb_assert(r->it == NULL);
+
+    for (i = 0; i < ncopy; i++) {
+        if (len + iov[i].iov_len > MUX_BUF_SIZE) {
+            return false;
+        }
+
+        memcpy(r->buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    if (len < sizeof(protocol_binary_request_header)) {
+        return false;
+    }
+
+    r->iov[0].iov_base = r->buf;
+    r->iov[0].iov_len  = len;
+    r->iovcnt = 1;
+
+    for (; i < iovcnt; i++) {
+        r->iov[r->iovcnt++] = iov[i];
+    }
+
+    req = (protocol_binary_request_header *) r->buf;
+
+    r->opaque = req->request.opaque;
+    req->request.opaque = htonl(mux->tail);
+
+    r->d = d;
+    r->it = it;
+    if (it != NULL) {
+        it->refcount++;
+    }
+
+    mux->tail++;
+
+    d->ptd->stats.stats.tot_downstream_conn_mux++;
+
+    if (settings.verbose > 2) {
+        moxi_log_write("%d: cproxy_mux_send %x, seq %u, state %s\n",
+                       c->sfd, req->request.opcode, mux->tail - 1,
+                       state_text(c->state));
+    }
+
+    if (mux_idle(c, mux) &&
+        mux_flush(c, mux) == false) {
+        /* Closing right now would release the downstream that's */
+        /* still in the middle of forwarding, so close a bit later. */
+
+        conn_set_state(c, conn_closing);
+        update_event(c, EV_WRITE | EV_PERSIST);
+    }
+
+    return true;
+}
+
+/* Called when a response header arrives on a mux conn.  Returns */
+/* true if the response was taken care of here, such as when it */
+/* belongs to a downstream that's gone away. */
+
+bool cproxy_mux_recv(conn *c) {
+    downstream_mux *mux = c->mux;
+    protocol_binary_response_header *header;
+    downstream_mux_req *r;
+    uint32_t seq;
+    uint32_t bodylen;
+
+    cb_assert(mux != NULL);
+
+    header = (protocol_binary_response_header *) c->rcurr;
+    seq = ntohl(header->response.opaque);
+
+    if (mux->recv ||
+        mux->head == mux->sent ||
+        seq != mux->head) {
+        if (settings.verbose > 1) {
+            moxi_log_write("%d: cproxy_mux_recv unexpected seq %u,"
+                           " head %u, sent %u\n",
+                           c->sfd, seq, mux->head, mux->sent);
+        }
+
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+
+    r = mux_req(mux, seq);
+
+    /* Put back the original opaque in both the raw header, which */
+    /* b2b copies upstream, and the parsed header. */
+
+    header->response.opaque = r->opaque;
+    c->binary_header.request.opaque = r->opaque;
+    c->opaque = r->opaque;
+
+    mux->recv = true;
+
+    c->extra = r->d;
+    if (r->d != NULL) {
+        return false;
+    }
+
+    mux->discard = true;
+
+    bodylen = c->binary_header.request.bodylen;
+    if (bodylen == 0) {
+        conn_set_state(c, conn_pause);
+        return true;
+    }
+
+    c->item = item_alloc("q", 1, 0, 0, bodylen);
+    if (c->item == NULL) {
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+
+    c->ritem = ITEM_data((item *) c->item);
+    c->rlbytes = bodylen;
+    c->substate = bin_read_set_value;
+
+    conn_set_state(c, conn_nread);
+
+    return true;
+}
+
+/* Returns true if a dropped response's body was just read. */
+
+bool cproxy_mux_recv_nread(conn *c) {
+    downstream_mux *mux = c->mux;
+
+    if (mux == NULL ||
+        mux->discard == false) {
+        return false;
+    }
+
+    if (c->item != NULL) {
+        item_remove(c->item);
+        c->item = NULL;
+    }
+
+    conn_set_state(c, conn_pause);
+
+    return true;
+}
+
+/* Called when a mux conn is done writing requests or done with */
+/* a response.  Releases the response's downstream, then writes */
+/* whatever got queued meanwhile or goes back to reading. */
+
+void cproxy_mux_on_pause(conn *c) {
+    downstream_mux *mux = c->mux;
+    downstream *d = NULL;
+
+    cb_assert(mux != NULL);
+
+    if (mux->recv) {
+        downstream_mux_req *r = mux_req(mux, mux->head);
+
+        d = r->d;
+        cb_assert(d == NULL || d == c->extra);
+
+        r->d = NULL;
+        mux->head++;
+        mux->recv = false;
+        mux->discard = false;
+    }
+
+    c->extra = NULL;
+
+    if (d != NULL) {
+        /* Any retry of the downstream acquires a conn anew. */
+
+        mux_unlink(c, d);
+
+        mux->in_pause = true;
+        cproxy_release_downstream_conn(d, c);
+        mux->in_pause = false;
+
+        if (c->mux != mux ||
+            c->state != conn_pause) {
+            return;
+        }
+    }
+
+    if (mux->sent != mux->tail) {
+        if (mux_flush(c, mux) == false) {
+            cproxy_close_conn(c);
+        }
+
+        return;
+    }
+
+    conn_set_state(c, conn_new_cmd);
+
+    if (update_event(c, EV_WRITE | EV_PERSIST) == false) {
+        cproxy_close_conn(c);
+    }
+}
+
+/* Removes and returns the next downstream still waiting on a */
+/* response, for when the mux conn is closing. */
+
+downstream *cproxy_mux_take(conn *c) {
+    downstream_mux *mux = c->mux;
+
+    cb_assert(mux != NULL);
+
+    while (mux->head != mux->tail) {
+        downstream_mux_req *r = mux_req(mux, mux->head);
+        downstream *d = r->d;
+
+        r->d = NULL;
+        if (r->it != NULL) {
+            item_remove(r->it);
+            r->it = NULL;
+        }
+
+        mux->head++;
+
+        if (d != NULL) {
+            return d;
+        }
+    }
+
+    mux->sent = mux->tail;
+    mux->recv = false;
+
+    return NULL;
+}
+
+/* Called when a downstream lets go of a mux conn before its */
+/* response arrives.  The response will be dropped when it does, */
+/* and an unsent request is turned into a no-op to keep the seq's */
+/* in step.  Returns true if the response was already being */
+/* processed, in which case the caller must close the conn. */
+
+bool cproxy_mux_detach(conn *c, downstream *d) {
+    downstream_mux *mux = c->mux;
+    bool receiving = false;
+    uint32_t seq;
+
+    cb_assert(mux != NULL);
+    cb_assert(d != NULL);
+
+    mux_unlink(c, d);
+
+    for (seq = mux->head; seq != mux->tail; seq++) {
+        downstream_mux_req *r = mux_req(mux, seq);
+        if (r->d != d) {
+            continue;
+        }
+
+        r->d = NULL;
+
+        if (seq == mux->head && mux->recv) {
+            receiving = true;
+        } else if (mux_between(seq, mux->sent, mux->tail)) {
+            protocol_binary_request_header *req =
+                (protocol_binary_request_header *) r->buf;
+
+            if (r->it != NULL) {
+                item_remove(r->it);
+                r->it = NULL;
+            }
+
+            memset(req, 0, sizeof(*req));
+            req->request.magic  = PROTOCOL_BINARY_REQ;
+            req->request.opcode = PROTOCOL_BINARY_CMD_NOOP;
+            req->request.opaque = htonl(seq);
+
+            r->iov[0].iov_base = r->buf;
+            r->iov[0].iov_len  = sizeof(*req);
+            r->iovcnt = 1;
+        }
+    }
+
+    /* When receiving, c->extra is left as is, for the close. */
+
+    if (settings.verbose > 2) {
+        moxi_log_write("%d: cproxy_mux_detach, receiving %d\n",
+                       c->sfd, receiving);
+    }
+
+    return receiving;
+}
@@ -8,6 +8,7 @@
 #include "cproxy.h"
 #include "work.h"
 #include "log.h"
+#include "strscan.h"
 
 /* Internal declarations. */
 
@@ -39,6 +40,7 @@ void cproxy_process_upstream_ascii(conn *c, char *line) {
     c->cmd_start      = c->rcurr;
     c->cmd_start_time = msec_current_time;
     c->cmd_retries    = 0;
+    c->cmd_replica    = 0;
 
     proxy_td *ptd = c->extra;
     cb_assert(ptd != NULL);
@@ -332,9 +334,7 @@ void cproxy_process_upstream_ascii_nread(conn *c) {
 
     cb_assert(it != NULL);
 
-    /* pthread_mutex_lock(&c->thread->stats.mutex); */
-    /* c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++; */
-    /* pthread_mutex_unlock(&c->thread->stats.mutex); */
+    /* THREAD_STATS_ADD(c->thread, slab_stats[it->slabs_clsid].set_cmds, 1); */
 
     if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) == 0) {
         proxy_td *ptd = c->extra;
@@ -433,7 +433,7 @@ void cproxy_del_front_cache_key_ascii_response(downstream *d,
     cb_assert(d->ptd->proxy);
     cb_assert(response);
 
-    if (!mcache_started(&d->ptd->proxy->front_cache)) {
+    if (!cproxy_front_cache_started(d->ptd)) {
         return;
     }
 
@@ -463,7 +463,7 @@ void cproxy_del_front_cache_key_ascii(downstream *d,
         return;
     }
 
-    if (mcache_started(&d->ptd->proxy->front_cache)) {
+    if (cproxy_front_cache_started(d->ptd)) {
         char *spc = strchr(command, ' ');
         if (spc != NULL) {
             char *key = spc + 1;
@@ -492,8 +492,9 @@ bool cproxy_optimize_set_ascii(downstream *d, conn *uc,
         return false;
     }
 
-    if (matcher_check(&d->ptd->proxy->optimize_set_matcher,
-                      key, key_len, false)) {
+    if (matcher_check_ex(&d->ptd->proxy->optimize_set_matcher,
+                         cproxy_thread_data_index(d->ptd),
+                         key, key_len, false)) {
         d->upstream_conn = NULL;
         d->upstream_suffix = NULL;
         d->upstream_suffix_len = 0;
@@ -550,29 +551,14 @@ bool cproxy_is_broadcast_cmd(int cmd) {
 }
 
 bool ascii_scan_key(char *line, char **key, int *key_len) {
-    char *curr = line;
+    char *curr = strscan_skip_spaces(line);  /* Start of cmd. */
 
-    while (*curr != '\0' &&
-           *curr == ' ') { /* Scan to start of cmd. */
-        curr++;
-    }
-
-    while (*curr != '\0' &&
-           *curr != ' ') { /* Scan to end of cmd. */
-        curr++;
-    }
-
-    while (*curr != '\0' &&
-           *curr == ' ') { /* Scan to start of key. */
-        curr++;
-    }
+    curr = strscan_token_end(curr);          /* End of cmd. */
+    curr = strscan_skip_spaces(curr);        /* Start of key. */
 
     *key = curr;
 
-    while (*curr != '\0' &&
-           *curr != ' ') { /* Scan to end of key. */
-        curr++;
-    }
+    curr = strscan_token_end(curr);          /* End of key. */
 
     *key_len = (int) (curr - *key);
 
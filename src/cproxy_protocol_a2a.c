@@ -74,6 +74,8 @@ void cproxy_process_a2a_downstream(conn *c, char *line) {
 
                     conn_set_state(c, conn_nread);
 
+                    multiget_ascii_downstream_stream_start(d, c, it);
+
                     return; /* Success. */
                 } else {
                     if (settings.verbose > 1) {
@@ -120,7 +122,7 @@ void cproxy_process_a2a_downstream(conn *c, char *line) {
         conn *uc = d->upstream_conn;
         if (uc != NULL &&
             uc->cmd_curr == PROTOCOL_BINARY_CMD_FLUSH) {
-            mcache_flush_all(&d->ptd->proxy->front_cache, 0);
+            cproxy_front_cache_flush_all(d->ptd);
         }
     } else if (strncmp(line, "STAT ", 5) == 0 ||
                strncmp(line, "ITEM ", 5) == 0 ||
@@ -169,6 +171,12 @@ void cproxy_process_a2a_downstream(conn *c, char *line) {
         d->upstream_retry = 0;
         d->target_host_ident = NULL;
 
+        conn_set_state(c, conn_pause);
+    } else if (strncmp(line, "SERVER_ERROR", 12) == 0 &&
+               multiget_ascii_downstream_partial(d)) {
+        /* A server's error would break up a multiget response, */
+        /* so its keys are instead misses. */
+
         conn_set_state(c, conn_pause);
     } else {
         conn_set_state(c, conn_pause);
@@ -221,11 +229,11 @@ void cproxy_process_a2a_downstream_nread(conn *c) {
 
     conn_set_state(c, conn_new_cmd);
 
-    /* pthread_mutex_lock(&c->thread->stats.mutex); */
-    /* c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++; */
-    /* pthread_mutex_unlock(&c->thread->stats.mutex); */
+    /* THREAD_STATS_ADD(c->thread, slab_stats[it->slabs_clsid].set_cmds, 1); */
 
-    multiget_ascii_downstream_response(d, it);
+    if (!multiget_ascii_downstream_stream_end(d, c, it)) {
+        multiget_ascii_downstream_response(d, it);
+    }
 
     item_remove(it);
 }
@@ -273,7 +281,8 @@ bool cproxy_forward_a2a_downstream(downstream *d) {
         cb_assert(d->downstream_conns != NULL);
 
         if (d->usec_start == 0 &&
-            d->ptd->behavior_pool.base.time_stats) {
+            (d->ptd->behavior_pool.base.time_stats ||
+             d->ptd->behavior_pool.base.breaker_slow_time > 0)) {
             d->usec_start = usec_now();
         }
 
@@ -318,7 +327,7 @@ bool cproxy_forward_a2a_simple_downstream(downstream *d,
         /* Only use front_cache for 'get', not for 'gets'. */
 
         mcache *front_cache =
-            (command[3] == ' ') ? &d->ptd->proxy->front_cache : NULL;
+            (command[3] == ' ') ? cproxy_front_cache(d->ptd) : NULL;
 
         return multiget_ascii_downstream(d, uc,
                                          a2a_multiget_start,
@@ -409,10 +418,10 @@ bool cproxy_forward_a2a_simple_downstream(downstream *d,
             }
 
             d->ptd->stats.stats.err_oom++;
-            cproxy_close_conn(c);
+            cproxy_close_conn_local(c);
         } else {
             d->ptd->stats.stats.err_downstream_write_prep++;
-            cproxy_close_conn(c);
+            cproxy_close_conn_local(c);
         }
     }
 
@@ -478,11 +487,11 @@ bool cproxy_broadcast_a2a_downstream(downstream *d,
                     }
 
                     d->ptd->stats.stats.err_oom++;
-                    cproxy_close_conn(c);
+                    cproxy_close_conn_local(c);
                 }
             } else {
                 d->ptd->stats.stats.err_downstream_write_prep++;
-                cproxy_close_conn(c);
+                cproxy_close_conn_local(c);
             }
         }
     }
@@ -509,7 +518,7 @@ bool cproxy_broadcast_a2a_downstream(downstream *d,
             /* the front_cache. */
 
             if (strncmp(command, "flush_all", 9) == 0) {
-                mcache_flush_all(&d->ptd->proxy->front_cache, 0);
+                cproxy_front_cache_flush_all(d->ptd);
             }
         }
 
@@ -613,13 +622,13 @@ bool cproxy_forward_a2a_item_downstream(downstream *d, short cmd,
                 }
 
                 d->ptd->stats.stats.err_oom++;
-                cproxy_close_conn(c);
+                cproxy_close_conn_local(c);
             } else {
                 /* TODO: Handle this weird error case. */
             }
         } else {
             d->ptd->stats.stats.err_downstream_write_prep++;
-            cproxy_close_conn(c);
+            cproxy_close_conn_local(c);
         }
 
         if (settings.verbose > 1) {
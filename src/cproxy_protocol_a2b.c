@@ -426,6 +426,7 @@ bool a2b_fill_request_token(struct A2BSpec *spec,
  * a downstream server, via try_read_command()/drive_machine().
  */
 void cproxy_process_a2b_downstream(conn *c) {
+    downstream *d;
     protocol_binary_response_header *header;
     int extlen;
     int keylen;
@@ -450,6 +451,22 @@ void cproxy_process_a2b_downstream(conn *c) {
 
     process_bin_noreply(c); /* Map quiet c->cmd values into non-quiet. */
 
+    /* A hedge's replica read is answered the same as a GETK. */
+
+    if (c->cmd == PROTOCOL_BINARY_CMD_GET_REPLICA) {
+        c->cmd = PROTOCOL_BINARY_CMD_GETK;
+    }
+
+    /* The first response to a hedged get picks the winning conn. */
+
+    d = c->extra;
+    if (d != NULL &&
+        (d->hedge_conn != NULL ||
+         d->hedge_tv.tv_sec != 0 ||
+         d->hedge_tv.tv_usec != 0)) {
+        cproxy_hedge_settle(d, c, header);
+    }
+
     extlen = header->response.extlen;
     keylen = header->response.keylen;
     bodylen = header->response.bodylen;
@@ -619,9 +636,14 @@ void cproxy_process_a2b_downstream_nread(conn *c) {
             ITEM_set_cas(it, cas);
 
             conn_set_state(c, conn_nread);
+
+            if (c->cmd == PROTOCOL_BINARY_CMD_GET ||
+                c->cmd == PROTOCOL_BINARY_CMD_GETK) {
+                multiget_ascii_downstream_stream_start(d, c, it);
+            }
         } else {
             d->ptd->stats.stats.err_oom++;
-            cproxy_close_conn(c);
+            cproxy_close_conn_local(c);
         }
     } else {
         a2b_process_downstream_response(c);
@@ -696,6 +718,7 @@ void a2b_process_downstream_response(conn *c) {
     downstream *d;
     item *it;
     conn *uc;
+    bool streamed;
 
     cb_assert(c != NULL);
     cb_assert(c->cmd >= 0);
@@ -732,6 +755,10 @@ void a2b_process_downstream_response(conn *c) {
 
     c->item = NULL;
 
+    /* A streamed (cut-through) value was already queued upstream. */
+
+    streamed = multiget_ascii_downstream_stream_end(d, c, it);
+
     if (cproxy_binary_ignore_reply(c, header, it)) {
         return;
     }
@@ -768,7 +795,9 @@ void a2b_process_downstream_response(conn *c) {
                     *(ITEM_data(it) + it->nbytes - 2) = '\r';
                     *(ITEM_data(it) + it->nbytes - 1) = '\n';
 
-                    multiget_ascii_downstream_response(d, it);
+                    if (!streamed) {
+                        multiget_ascii_downstream_response(d, it);
+                    }
                 } else {
                     cb_assert(false); /* TODO. */
                 }
@@ -797,10 +826,15 @@ void a2b_process_downstream_response(conn *c) {
                 return; /* Swallow miss response. */
             }
 
-            /* TODO: Handle error case.  Should we pause the conn */
-            /*       or keep looking for more responses? */
+            /* Any other error is also swallowed, so the key is */
+            /* a miss, and we keep looking for the NOOP. */
+
+            if (settings.verbose > 2) {
+                moxi_log_write("%d: cproxy_process_a2b_downstream_response "
+                               "multiget error %x\n", c->sfd, status);
+            }
 
-            cb_assert(false);
+            multiget_ascii_downstream_partial(d);
             return;
         }
 
@@ -814,7 +848,9 @@ void a2b_process_downstream_response(conn *c) {
             *(ITEM_data(it) + it->nbytes - 2) = '\r';
             *(ITEM_data(it) + it->nbytes - 1) = '\n';
 
-            multiget_ascii_downstream_response(d, it);
+            if (!streamed) {
+                multiget_ascii_downstream_response(d, it);
+            }
         } else {
             cb_assert(false); /* TODO. */
         }
@@ -896,7 +932,7 @@ void a2b_process_downstream_response(conn *c) {
         /* just the last FLUSH response. */
 
         if (uc != NULL) {
-            mcache_flush_all(&d->ptd->proxy->front_cache, 0);
+            cproxy_front_cache_flush_all(d->ptd);
         }
         break;
 
@@ -1125,6 +1161,14 @@ bool cproxy_forward_a2b_downstream(downstream *d) {
             key_len > 0) {
             server_index = cproxy_server_index(d, key, key_len, NULL);
             if (server_index < 0) {
+                /* A replica that's unassigned in the vbucket map */
+                /* is skipped for the next one. */
+
+                if (uc->cmd_replica > 0 &&
+                    cproxy_replica_next(d)) {
+                    return cproxy_forward_a2b_downstream(d);
+                }
+
                 return false;
             }
         }
@@ -1135,11 +1179,20 @@ bool cproxy_forward_a2b_downstream(downstream *d) {
         return true;
     }
 
+    if (nc == 0 &&
+        server_index >= 0 &&
+        cproxy_replica_next(d)) {
+        /* The key's master is down, so try its next replica. */
+
+        return cproxy_forward_a2b_downstream(d);
+    }
+
     if (nc > 0) {
         cb_assert(d->downstream_conns != NULL);
 
         if (d->usec_start == 0 &&
-            d->ptd->behavior_pool.base.time_stats) {
+            (d->ptd->behavior_pool.base.time_stats ||
+             d->ptd->behavior_pool.base.breaker_slow_time > 0)) {
             d->usec_start = usec_now();
         }
 
@@ -1187,7 +1240,7 @@ bool cproxy_forward_a2b_simple_downstream(downstream *d,
     if (uc->cmd_curr == PROTOCOL_BINARY_CMD_GETKQ) {
         /* Only use front_cache for 'get', not for 'gets'. */
         mcache *front_cache =
-            (command[3] == ' ') ? &d->ptd->proxy->front_cache : NULL;
+            (command[3] == ' ') ? cproxy_front_cache(d->ptd) : NULL;
 
         return multiget_ascii_downstream(d, uc,
                                          a2b_multiget_start,
@@ -1320,11 +1373,12 @@ bool cproxy_forward_a2b_simple_downstream(downstream *d,
             uc->hit_local = true;
         }
 
-        if (cproxy_prep_conn_for_write(c)) {
+        if (c->mux != NULL ||
+            cproxy_prep_conn_for_write(c)) {
             protocol_binary_request_header *header;
             int size;
 
-            cb_assert(c->state == conn_pause);
+            cb_assert(c->mux != NULL || c->state == conn_pause);
             cb_assert(c->wbuf);
             cb_assert(c->wsize >= a2b_size_max);
 
@@ -1348,11 +1402,50 @@ bool cproxy_forward_a2b_simple_downstream(downstream *d,
                     header->request.opaque   = htonl(vbucket);
                 }
 
+                /* A replica refuses a normal get, so a get that's */
+                /* moved on to a replica is sent as a replica read. */
+
+                if (uc->cmd_replica > 0 &&
+                    header->request.opcode == PROTOCOL_BINARY_CMD_GETK) {
+                    header->request.opcode = PROTOCOL_BINARY_CMD_GET_REPLICA;
+                }
+
                 header->request.bodylen =
                     htonl(out_keylen + out_extlen);
 
                 a2b_set_opaque(c, header, uc->noreply);
 
+                if (c->mux != NULL) {
+                    /* Copies the header and key, so the wbuf and */
+                    /* upstream buffer are free for reuse. */
+
+                    struct iovec iov[2];
+                    int iovcnt = 1;
+
+                    iov[0].iov_base = header;
+                    iov[0].iov_len  = size;
+
+                    if (out_key != NULL &&
+                        out_keylen > 0) {
+                        iov[1].iov_base = out_key;
+                        iov[1].iov_len  = out_keylen;
+                        iovcnt = 2;
+                    }
+
+                    if (cproxy_mux_send(c, d, iov, iovcnt, iovcnt, NULL)) {
+                        d->downstream_used_start = 1;
+                        d->downstream_used       = 1;
+
+                        cproxy_start_downstream_timeout(d, c);
+
+                        return true;
+                    }
+
+                    d->ptd->stats.stats.err_oom++;
+
+                    return false;
+                }
+
                 add_iov(c, header, size);
 
                 if (out_key != NULL &&
@@ -1376,6 +1469,7 @@ bool cproxy_forward_a2b_simple_downstream(downstream *d,
 
                     if (cproxy_dettach_if_noreply(d, uc) == false) {
                         cproxy_start_downstream_timeout(d, c);
+                        cproxy_start_hedge_timeout(d, c);
                     } else {
                         c->write_and_go = conn_pause;
 
@@ -1416,10 +1510,10 @@ bool cproxy_forward_a2b_simple_downstream(downstream *d,
             }
 
             d->ptd->stats.stats.err_oom++;
-            cproxy_close_conn(c);
+            cproxy_close_conn_local(c);
         } else {
             d->ptd->stats.stats.err_downstream_write_prep++;
-            cproxy_close_conn(c);
+            cproxy_close_conn_local(c);
         }
     }
 
@@ -1439,44 +1533,46 @@ int a2b_multiget_skey(conn *c, char *skey, int skey_length, int vbucket, int key
     char *key     = skey + 1;
     int   key_len = skey_length - 1;
 
-    item *it = item_alloc("b", 1, 0, 0, sizeof(protocol_binary_request_get));
-    if (it != NULL) {
-        if (add_conn_item(c, it)) {
-            protocol_binary_request_getk *req =
-                (protocol_binary_request_getk *) ITEM_data(it);
+    downstream *d = c->extra;
+    protocol_binary_request_getk *req;
+
+    cb_assert(d != NULL);
 
-            memset(req, 0, sizeof(req->bytes));
+    /* The GETKQ headers come from the downstream's arena rather than */
+    /* an item each, as big multigets would otherwise spend their time */
+    /* in malloc/free.  They're written out before d is released. */
 
-            req->message.header.request.magic  = PROTOCOL_BINARY_REQ;
-            req->message.header.request.opcode = PROTOCOL_BINARY_CMD_GETKQ;
-            req->message.header.request.keylen = htons((uint16_t) key_len);
-            req->message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-            req->message.header.request.bodylen  = htonl(key_len);
-            req->message.header.request.opaque   = htonl(key_index);
+    req = downstream_alloc(d, sizeof(req->bytes));
+    if (req == NULL) {
+        return -1;
+    }
 
-            if (vbucket >= 0) {
-                req->message.header.request.reserved = htons(vbucket);
+    memset(req, 0, sizeof(req->bytes));
 
-                if (settings.verbose > 2) {
-                    char key_buf[KEY_MAX_LENGTH + 10];
-                    cb_assert(key_len <= KEY_MAX_LENGTH);
-                    memcpy(key_buf, key, key_len);
-                    key_buf[key_len] = '\0';
+    req->message.header.request.magic  = PROTOCOL_BINARY_REQ;
+    req->message.header.request.opcode = PROTOCOL_BINARY_CMD_GETKQ;
+    req->message.header.request.keylen = htons((uint16_t) key_len);
+    req->message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    req->message.header.request.bodylen  = htonl(key_len);
+    req->message.header.request.opaque   = htonl(key_index);
 
-                    moxi_log_write("<%d a2b_multiget_skey '%s' %d %d\n",
-                            c->sfd, key_buf, vbucket, key_index);
-                }
-            }
+    if (vbucket >= 0) {
+        req->message.header.request.reserved = htons(vbucket);
 
-            if (add_iov(c, ITEM_data(it), sizeof(req->bytes)) == 0 &&
-                add_iov(c, key, key_len) == 0) {
-                return 0; /* Success. */
-            }
+        if (settings.verbose > 2) {
+            char key_buf[KEY_MAX_LENGTH + 10];
+            cb_assert(key_len <= KEY_MAX_LENGTH);
+            memcpy(key_buf, key, key_len);
+            key_buf[key_len] = '\0';
 
-            return -1;
+            moxi_log_write("<%d a2b_multiget_skey '%s' %d %d\n",
+                    c->sfd, key_buf, vbucket, key_index);
         }
+    }
 
-        item_remove(it);
+    if (add_iov(c, req->bytes, sizeof(req->bytes)) == 0 &&
+        add_iov(c, key, key_len) == 0) {
+        return 0; /* Success. */
     }
 
     return -1;
@@ -1549,7 +1645,7 @@ bool cproxy_broadcast_a2b_downstream(downstream *d,
                     }
 
                     d->ptd->stats.stats.err_oom++;
-                    cproxy_close_conn(c);
+                    cproxy_close_conn_local(c);
                 }
             } else {
                 if (settings.verbose > 1) {
@@ -1557,7 +1653,7 @@ bool cproxy_broadcast_a2b_downstream(downstream *d,
                 }
 
                 d->ptd->stats.stats.err_downstream_write_prep++;
-                cproxy_close_conn(c);
+                cproxy_close_conn_local(c);
             }
         }
     }
@@ -1585,7 +1681,7 @@ bool cproxy_broadcast_a2b_downstream(downstream *d,
 
             if (req->request.opcode == PROTOCOL_BINARY_CMD_FLUSH ||
                 req->request.opcode == PROTOCOL_BINARY_CMD_FLUSHQ) {
-                mcache_flush_all(&d->ptd->proxy->front_cache, 0);
+                cproxy_front_cache_flush_all(d->ptd);
             }
         }
 
@@ -1623,7 +1719,8 @@ bool cproxy_forward_a2b_item_downstream(downstream *d, short cmd,
         if (local) {
             uc->hit_local = true;
         }
-        if (cproxy_prep_conn_for_write(c)) {
+        if (c->mux != NULL ||
+            cproxy_prep_conn_for_write(c)) {
             uint8_t  extlen;
             uint32_t hdrlen;
             item *it_hdr;
@@ -1633,7 +1730,7 @@ bool cproxy_forward_a2b_item_downstream(downstream *d, short cmd,
                                c->sfd, state_text(c->state));
             }
 
-            cb_assert(c->state == conn_pause);
+            cb_assert(c->mux != NULL || c->state == conn_pause);
 
             extlen = (cmd == NREAD_APPEND || cmd == NREAD_PREPEND) ? 0 : 8;
             hdrlen = sizeof(protocol_binary_request_header) +
@@ -1641,7 +1738,8 @@ bool cproxy_forward_a2b_item_downstream(downstream *d, short cmd,
 
             it_hdr = item_alloc("i", 1, 0, 0, hdrlen);
             if (it_hdr != NULL) {
-                if (add_conn_item(c, it_hdr)) {
+                if (c->mux != NULL ||
+                    add_conn_item(c, it_hdr)) {
                     protocol_binary_request_header *req =
                         (protocol_binary_request_header *) ITEM_data(it_hdr);
 
@@ -1723,6 +1821,45 @@ bool cproxy_forward_a2b_item_downstream(downstream *d, short cmd,
                     req->request.bodylen =
                         htonl(it->nkey + (it->nbytes - 2) + extlen);
 
+                    if (c->mux != NULL) {
+                        /* The header is copied, and the key and */
+                        /* value are written from the item. */
+
+                        struct iovec iov[3];
+                        bool sent;
+
+                        iov[0].iov_base = ITEM_data(it_hdr);
+                        iov[0].iov_len  = hdrlen;
+                        iov[1].iov_base = ITEM_key(it);
+                        iov[1].iov_len  = it->nkey;
+                        iov[2].iov_base = ITEM_data(it);
+                        iov[2].iov_len  = it->nbytes - 2;
+
+                        sent = cproxy_mux_send(c, d, iov, 3, 1, it);
+
+                        item_remove(it_hdr);
+
+                        if (sent) {
+                            d->downstream_used_start = 1;
+                            d->downstream_used       = 1;
+
+                            cproxy_start_downstream_timeout(d, c);
+
+                            if (cmd == NREAD_SET &&
+                                cproxy_optimize_set_ascii(d, uc,
+                                                          ITEM_key(it),
+                                                          it->nkey)) {
+                                d->ptd->stats.stats.tot_optimize_sets++;
+                            }
+
+                            return true;
+                        }
+
+                        d->ptd->stats.stats.err_oom++;
+
+                        return false;
+                    }
+
                     if (add_iov(c, ITEM_data(it_hdr), hdrlen) == 0 &&
                         add_iov(c, ITEM_key(it),  it->nkey) == 0 &&
                         add_iov(c, ITEM_data(it), it->nbytes - 2) == 0) {
@@ -1764,10 +1901,10 @@ bool cproxy_forward_a2b_item_downstream(downstream *d, short cmd,
             }
 
             d->ptd->stats.stats.err_oom++;
-            cproxy_close_conn(c);
+            cproxy_close_conn_local(c);
         } else {
             d->ptd->stats.stats.err_downstream_write_prep++;
-            cproxy_close_conn(c);
+            cproxy_close_conn_local(c);
         }
     }
 
@@ -1828,14 +1965,20 @@ bool a2b_not_my_vbucket(conn *uc, conn *c,
                            c->sfd, header->response.opcode, sindex, vbucket, uc->cmd_retries);
         }
 
-        mcs_server_invalid_vbucket(&d->mst, sindex, vbucket);
+        /* A replica refusing a replica read says nothing */
+        /* about who the vbucket's master is. */
+
+        if (uc->cmd_replica <= 0) {
+            mcs_server_invalid_vbucket(&d->mst, sindex, vbucket);
+        }
 
         /* As long as the upstream is still open and we haven't */
         /* retried too many times already. */
 
         max_retries = cproxy_max_retries(d);
 
-        if (uc->cmd_retries < max_retries) {
+        if (uc->cmd_replica <= 0 &&
+            uc->cmd_retries < max_retries) {
             uc->cmd_retries++;
 
             d->upstream_retry++;
@@ -1845,6 +1988,13 @@ bool a2b_not_my_vbucket(conn *uc, conn *c,
             return true;
         }
 
+        if (cproxy_replica_next(d)) {
+            d->upstream_retry++;
+
+            conn_set_state(c, conn_pause);
+            return true;
+        }
+
         if (settings.verbose > 2) {
             moxi_log_write("%d: a2b_not_my_vbucket, "
                            "cmd: %x skipping retry %d >= %d\n",
@@ -1878,7 +2028,21 @@ bool a2b_not_my_vbucket(conn *uc, conn *c,
         cb_assert(header->response.opaque != 0);
 
         key_index = ntohl(header->response.opaque);
-        key = uc->cmd_start + key_index;
+
+        /* When upstreams were squashed, the opaque is an ordinal */
+        /* from the multiget map rather than an offset into the */
+        /* first upstream's command line. */
+
+        if (d->multiget_opaque > 0) {
+            key = multiget_key_for_opaque(d, key_index);
+            if (key == NULL) {
+                conn_set_state(c, conn_new_cmd);
+                return true;
+            }
+        } else {
+            key = uc->cmd_start + key_index;
+        }
+
         key_len = skey_len(key);
 
         /* The key is not NULL or space terminated. */
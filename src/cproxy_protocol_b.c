@@ -33,6 +33,7 @@ void cproxy_process_upstream_binary(conn *c) {
     c->cmd_start      = NULL;
     c->cmd_start_time = msec_current_time;
     c->cmd_retries    = 0;
+    c->cmd_replica    = 0;
 
     int      extlen  = c->binary_header.request.extlen;
     int      keylen  = c->binary_header.request.keylen;
@@ -121,9 +122,7 @@ void cproxy_process_upstream_binary_nread(conn *c) {
                 c->sfd, c->cmd, extlen, keylen, bodylen);
     }
 
-    /* pthread_mutex_lock(&c->thread->stats.mutex); */
-    /* c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++; */
-    /* pthread_mutex_unlock(&c->thread->stats.mutex); */
+    /* THREAD_STATS_ADD(c->thread, slab_stats[it->slabs_clsid].set_cmds, 1); */
 
     proxy_td *ptd = c->extra;
     cb_assert(ptd != NULL);
@@ -283,7 +282,32 @@ void cproxy_binary_uncork_cmds(downstream *d, conn *uc) {
 }
 
 void cproxy_process_downstream_binary(conn *c) {
-    downstream *d = c->extra;
+    downstream *d;
+
+    /* On a shared conn, the response's opaque picks the downstream. */
+
+    if (c->mux != NULL &&
+        cproxy_mux_recv(c)) {
+        return;
+    }
+
+    /* A reply owed to a lost hedge is read and dropped. */
+
+    if (c->skip_replies > 0) {
+        c->skip_replies--;
+
+        if (settings.verbose > 2) {
+            moxi_log_write("<%d cproxy_process_downstream_binary skipping reply, "
+                           "cmd: %x, bodylen: %u\n",
+                           c->sfd, c->cmd, c->binary_header.request.bodylen);
+        }
+
+        c->sbytes = c->binary_header.request.bodylen;
+        conn_set_state(c, conn_swallow);
+        return;
+    }
+
+    d = c->extra;
     cb_assert(d != NULL);
     cb_assert(d->upstream_conn != NULL);
 
@@ -295,7 +319,14 @@ void cproxy_process_downstream_binary(conn *c) {
 }
 
 void cproxy_process_downstream_binary_nread(conn *c) {
-    downstream *d = c->extra;
+    downstream *d;
+
+    if (c->mux != NULL &&
+        cproxy_mux_recv_nread(c)) {
+        return;
+    }
+
+    d = c->extra;
     cb_assert(d != NULL);
     cb_assert(d->upstream_conn != NULL);
 
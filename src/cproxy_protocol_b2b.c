@@ -17,6 +17,11 @@ static protocol_binary_request_noop req_noop = {
     .bytes = {0}
 };
 
+static bool b2b_multiget_corked(conn *uc);
+static bool b2b_broadcast_suffix(downstream *d, conn *uc, int nwrite);
+static void b2b_multiget_fanout(downstream *d, conn *uc, item *it);
+static int b2b_replica_response(conn *uc, item *it);
+
 void cproxy_init_b2b() {
     memset(&req_noop, 0, sizeof(req_noop));
 
@@ -76,6 +81,14 @@ bool cproxy_forward_b2b_downstream(downstream *d) {
         if (key_len > 0) {
             server_index = cproxy_server_index(d, key, key_len, NULL);
             if (server_index < 0) {
+                /* A replica that's unassigned in the vbucket map */
+                /* is skipped for the next one. */
+
+                if (uc->cmd_replica > 0 &&
+                    cproxy_replica_next(d)) {
+                    return cproxy_forward_b2b_downstream(d);
+                }
+
                 return false;
             }
         }
@@ -86,6 +99,14 @@ bool cproxy_forward_b2b_downstream(downstream *d) {
         return true;
     }
 
+    if (nc == 0 &&
+        server_index >= 0 &&
+        cproxy_replica_next(d)) {
+        /* The key's master is down, so try its next replica. */
+
+        return cproxy_forward_b2b_downstream(d);
+    }
+
     if (nc > 0) {
         int i;
         int nconns;
@@ -93,7 +114,8 @@ bool cproxy_forward_b2b_downstream(downstream *d) {
         cb_assert(d->downstream_conns != NULL);
 
         if (d->usec_start == 0 &&
-            d->ptd->behavior_pool.base.time_stats) {
+            (d->ptd->behavior_pool.base.time_stats ||
+             d->ptd->behavior_pool.base.breaker_slow_time > 0)) {
             d->usec_start = usec_now();
         }
 
@@ -101,19 +123,28 @@ bool cproxy_forward_b2b_downstream(downstream *d) {
         for (i = 0; i < nconns; i++) {
             conn *c = d->downstream_conns[i];
             if (c != NULL &&
-                c != NULL_CONN) {
+                c != NULL_CONN &&
+                c->mux == NULL) {
                 cb_assert(c->state == conn_pause);
                 cb_assert(c->item == NULL);
 
                 if (cproxy_prep_conn_for_write(c) == false) {
                     d->ptd->stats.stats.err_downstream_write_prep++;
-                    cproxy_close_conn(c);
+                    cproxy_close_conn_local(c);
 
                     return false;
                 }
             }
         }
 
+        /* A run of quiet gets ended by a no-op is a multiget, which */
+        /* is fanned out like an ascii multiget. */
+
+        if (uc->cmd == PROTOCOL_BINARY_CMD_NOOP &&
+            b2b_multiget_corked(uc)) {
+            return cproxy_forward_b2b_multiget_downstream(d, uc);
+        }
+
         /* Uncork the saved-up quiet binary commands. */
 
         cproxy_binary_uncork_cmds(d, uc);
@@ -135,6 +166,262 @@ bool cproxy_forward_b2b_downstream(downstream *d) {
     return false;
 }
 
+/* Returns true if the corked commands are all quiet gets.
+ */
+static bool b2b_multiget_corked(conn *uc) {
+    bin_cmd *bc;
+
+    for (bc = uc->corked; bc != NULL; bc = bc->next) {
+        protocol_binary_request_header *req;
+
+        if (bc->request_item == NULL) {
+            return false;
+        }
+
+        req = (protocol_binary_request_header *) ITEM_data(bc->request_item);
+        if (req->request.opcode != PROTOCOL_BINARY_CMD_GETQ &&
+            req->request.opcode != PROTOCOL_BINARY_CMD_GETKQ) {
+            return false;
+        }
+    }
+
+    return uc->corked != NULL;
+}
+
+/* The de-duplication map hashes space or null terminated keys, */
+/* which a binary key might contain, so such keys aren't mapped. */
+
+static bool b2b_multiget_key_ok(char *key, int key_len) {
+    return key_len > 0 &&
+           key_len <= KEY_MAX_LENGTH &&
+           memchr(key, ' ', key_len) == NULL &&
+           memchr(key, '\0', key_len) == NULL;
+}
+
+/* Records a GETKQ in the de-duplication map, returning false if
+ * its key was already requested, so that it needn't be sent again.
+ * Only GETKQ's are mapped, as a GETQ hit doesn't carry the key.
+ */
+static bool b2b_multiget_first(downstream *d, conn *uc,
+                               protocol_binary_request_header *req,
+                               char *key, int key_len) {
+    char key_buf[KEY_MAX_LENGTH + 1];
+    multiget_entry *entry;
+    multiget_entry *head;
+    char *map_key;
+
+    if (req->request.opcode != PROTOCOL_BINARY_CMD_GETKQ ||
+        b2b_multiget_key_ok(key, key_len) == false) {
+        return true;
+    }
+
+    if (d->multiget == NULL) {
+        d->multiget = genhash_init_open(128, skeyhash_ops);
+        if (d->multiget == NULL) {
+            return true;
+        }
+    }
+
+    entry = calloc(1, sizeof(multiget_entry));
+    if (entry == NULL) {
+        return true;
+    }
+
+    /* The opaque is kept as sent, in network byte order. */
+
+    entry->upstream_conn = uc;
+    entry->opaque = req->request.opaque;
+    entry->hits = 0;
+
+    memcpy(key_buf, key, key_len);
+    key_buf[key_len] = '\0';
+
+    head = genhash_find(d->multiget, key_buf);
+    if (head != NULL) {
+        entry->next = head->next;
+        head->next = entry;
+
+        return false;
+    }
+
+    map_key = downstream_alloc(d, key_len + 1);
+    if (map_key == NULL) {
+        free(entry);
+        return true;
+    }
+
+    memcpy(map_key, key_buf, key_len + 1);
+
+    entry->next = NULL;
+
+    genhash_update(d->multiget, map_key, entry);
+
+    return true;
+}
+
+/* Forwards the corked quiet gets as one pipeline per server, each
+ * ended by its own no-op.  A repeated GETKQ key is only sent once,
+ * and its hit is copied back to every request for it.
+ */
+bool cproxy_forward_b2b_multiget_downstream(downstream *d, conn *uc) {
+    proxy_td *ptd;
+    int nwrite = 0;
+    int nconns;
+    int i;
+
+    cb_assert(d != NULL);
+    cb_assert(d->downstream_conns != NULL);
+    cb_assert(d->multiget == NULL);
+    cb_assert(uc != NULL);
+    cb_assert(uc->next == NULL);
+    cb_assert(uc->noreply == false);
+    cb_assert(uc->cmd == PROTOCOL_BINARY_CMD_NOOP);
+
+    ptd = d->ptd;
+    cb_assert(ptd != NULL);
+
+    nconns = mcs_server_count(&d->mst);
+
+    while (uc->corked != NULL) {
+        bin_cmd *bc = uc->corked;
+        item *it = bc->request_item;
+        protocol_binary_request_header *req;
+        char *key;
+        int key_len;
+        int vbucket = -1;
+        bool local;
+        conn *c;
+
+        req = (protocol_binary_request_header *) ITEM_data(it);
+        key = ((char *) req) + sizeof(*req) + req->request.extlen;
+        key_len = ntohs(req->request.keylen);
+
+        ptd->stats.stats.tot_multiget_keys++;
+
+        /* A key whose server is down is left unsent, which the */
+        /* quiet get reports as a miss. */
+
+        c = NULL;
+        if (key_len > 0) {
+            c = cproxy_find_downstream_conn_ex(d, key, key_len,
+                                               &local, &vbucket);
+        }
+
+        if (c != NULL) {
+            if (local) {
+                uc->hit_local = true;
+            }
+
+            if (b2b_multiget_first(d, uc, req, key, key_len)) {
+                b2b_forward_item_vbucket(uc, d, it, c, vbucket);
+            } else {
+                ptd->stats.stats.tot_multiget_keys_dedupe++;
+            }
+        }
+
+        uc->corked = bc->next;
+
+        item_remove(bc->request_item);
+        if (bc->response_item != NULL) {
+            item_remove(bc->response_item);
+        }
+
+        free(bc);
+    }
+
+    for (i = 0; i < nconns; i++) {
+        conn *c = d->downstream_conns[i];
+        if (c != NULL &&
+            c != NULL_CONN &&
+            (c->msgused > 1 ||
+             c->msgbytes > 0) &&
+            b2b_forward_item_vbucket(uc, d, uc->item, c, -1) == true) {
+            nwrite++;
+        }
+    }
+
+    if (settings.verbose > 2) {
+        moxi_log_write("%d: b2b multiget nwrite %d out of %d\n",
+                uc->sfd, nwrite, nconns);
+    }
+
+    if (nwrite == 0) {
+        /* No key could be sent, so just the no-op goes out. */
+
+        return cproxy_broadcast_b2b_downstream(d, uc);
+    }
+
+    return b2b_broadcast_suffix(d, uc, nwrite);
+}
+
+/* Copies a multiget hit, just added to the upstream conn, for each
+ * repeated request of its key, with that request's opaque.
+ */
+static void b2b_multiget_fanout(downstream *d, conn *uc, item *it) {
+    protocol_binary_response_header *header;
+    char key_buf[KEY_MAX_LENGTH + 1];
+    multiget_entry *entry;
+    char *key;
+    int key_len;
+
+    header = (protocol_binary_response_header *) ITEM_data(it);
+    if (header->response.opcode != PROTOCOL_BINARY_CMD_GETKQ &&
+        header->response.opcode != PROTOCOL_BINARY_CMD_GETK) {
+        return;
+    }
+
+    key = ITEM_data(it) + sizeof(*header) + header->response.extlen;
+    key_len = ntohs(header->response.keylen);
+
+    if (b2b_multiget_key_ok(key, key_len) == false) {
+        return;
+    }
+
+    memcpy(key_buf, key, key_len);
+    key_buf[key_len] = '\0';
+
+    entry = genhash_find(d->multiget, key_buf);
+    if (entry == NULL) {
+        return;
+    }
+
+    entry->hits++;
+
+    for (entry = entry->next; entry != NULL; entry = entry->next) {
+        item *copy;
+
+        if (entry->upstream_conn != uc) {
+            continue;
+        }
+
+        entry->hits++;
+
+        copy = item_alloc("q", 1, 0, 0, it->nbytes);
+        if (copy == NULL) {
+            d->ptd->stats.stats.err_oom++;
+            return;
+        }
+
+        memcpy(ITEM_data(copy), ITEM_data(it), it->nbytes);
+
+        header = (protocol_binary_response_header *) ITEM_data(copy);
+        header->response.opaque = entry->opaque;
+
+        /* The upstream conn takes over our refcount. */
+
+        if (add_conn_item(uc, copy) == false) {
+            item_remove(copy);
+            d->ptd->stats.stats.err_oom++;
+            return;
+        }
+
+        if (add_iov(uc, ITEM_data(copy), copy->nbytes) != 0) {
+            d->ptd->stats.stats.err_oom++;
+            return;
+        }
+    }
+}
+
 /* A simple command includes a key, for hashing.
  */
 bool cproxy_forward_b2b_simple_downstream(downstream *d, conn *uc) {
@@ -221,6 +508,42 @@ bool b2b_forward_item_vbucket(conn *uc, downstream *d, item *it,
         req->request.reserved = htons(vbucket);
     }
 
+    /* A replica refuses a normal get, so a get that's moved on */
+    /* to a replica is sent as a replica read, whose answer */
+    /* b2b_replica_response() turns back into the client's. */
+
+    if (uc->cmd_replica > 0 &&
+        (req->request.opcode == PROTOCOL_BINARY_CMD_GET ||
+         req->request.opcode == PROTOCOL_BINARY_CMD_GETK)) {
+        req->request.opcode = PROTOCOL_BINARY_CMD_GET_REPLICA;
+    }
+
+    if (c->mux != NULL) {
+        /* The header is copied, so the item's own opaque stays */
+        /* intact for any not-my-vbucket retry. */
+
+        struct iovec iov[2];
+        int iovcnt = 1;
+
+        iov[0].iov_base = ITEM_data(it);
+        iov[0].iov_len  = sizeof(*req);
+
+        if (it->nbytes > (int) sizeof(*req)) {
+            iov[1].iov_base = ITEM_data(it) + sizeof(*req);
+            iov[1].iov_len  = it->nbytes - sizeof(*req);
+            iovcnt = 2;
+        }
+
+        if (cproxy_mux_send(c, d, iov, iovcnt, 1,
+                            iovcnt > 1 ? it : NULL)) {
+            return true;
+        }
+
+        d->ptd->stats.stats.err_oom++;
+
+        return false;
+    }
+
     if (add_conn_item(c, it) == true) {
         /* The caller keeps its refcount, and we need our own. */
 
@@ -242,7 +565,7 @@ bool b2b_forward_item_vbucket(conn *uc, downstream *d, item *it,
     }
 
     d->ptd->stats.stats.err_oom++;
-    cproxy_close_conn(c);
+    cproxy_close_conn_local(c);
 
     return false;
 }
@@ -279,49 +602,60 @@ bool cproxy_broadcast_b2b_downstream(downstream *d, conn *uc) {
     }
 
     if (nwrite > 0) {
-        /* TODO: Handle binary 'stats reset' sub-command. */
-        item *it;
-
-        if (uc->cmd == PROTOCOL_BINARY_CMD_STAT &&
-            d->merger == NULL) {
-            d->merger = genhash_init(128, skeyhash_ops);
-        }
+        return b2b_broadcast_suffix(d, uc, nwrite);
+    }
 
-        it = item_alloc("h", 1, 0, 0,
-                              sizeof(protocol_binary_response_header));
-        if (it != NULL) {
-            protocol_binary_response_header *header =
-                (protocol_binary_response_header *) ITEM_data(it);
+    return false;
+}
 
-            memset(ITEM_data(it), 0, it->nbytes);
+/* Sets up the response that's written to the upstream once all
+ * nwrite downstream conns have answered a broadcast or multiget.
+ */
+static bool b2b_broadcast_suffix(downstream *d, conn *uc, int nwrite) {
+    /* TODO: Handle binary 'stats reset' sub-command. */
+    item *it;
 
-            header->response.magic  = (uint8_t) PROTOCOL_BINARY_RES;
-            header->response.opcode = uc->binary_header.request.opcode;
-            header->response.opaque = uc->opaque;
+    cb_assert(nwrite > 0);
 
-            if (add_conn_item(uc, it)) {
-                d->upstream_suffix     = ITEM_data(it);
-                d->upstream_suffix_len = it->nbytes;
-                d->upstream_status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
-                d->target_host_ident = NULL;
+    if (uc->cmd == PROTOCOL_BINARY_CMD_STAT &&
+        d->merger == NULL) {
+        d->merger = genhash_init(128, skeyhash_ops);
+    }
 
-                if (settings.verbose > 2) {
-                    moxi_log_write("%d: b2b broadcast upstream_suffix", uc->sfd);
-                    cproxy_dump_header(uc->sfd, ITEM_data(it));
-                }
+    it = item_alloc("h", 1, 0, 0,
+                          sizeof(protocol_binary_response_header));
+    if (it != NULL) {
+        protocol_binary_response_header *header =
+            (protocol_binary_response_header *) ITEM_data(it);
 
-                /* TODO: Handle FLUSHQ (quiet binary flush_all). */
+        memset(ITEM_data(it), 0, it->nbytes);
 
-                d->downstream_used_start = nwrite;
-                d->downstream_used       = nwrite;
+        header->response.magic  = (uint8_t) PROTOCOL_BINARY_RES;
+        header->response.opcode = uc->binary_header.request.opcode;
+        header->response.opaque = uc->opaque;
 
-                cproxy_start_downstream_timeout(d, NULL);
+        if (add_conn_item(uc, it)) {
+            d->upstream_suffix     = ITEM_data(it);
+            d->upstream_suffix_len = it->nbytes;
+            d->upstream_status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+            d->target_host_ident = NULL;
 
-                return true;
+            if (settings.verbose > 2) {
+                moxi_log_write("%d: b2b broadcast upstream_suffix", uc->sfd);
+                cproxy_dump_header(uc->sfd, ITEM_data(it));
             }
 
-            item_remove(it);
+            /* TODO: Handle FLUSHQ (quiet binary flush_all). */
+
+            d->downstream_used_start = nwrite;
+            d->downstream_used       = nwrite;
+
+            cproxy_start_downstream_timeout(d, NULL);
+
+            return true;
         }
+
+        item_remove(it);
     }
 
     return false;
@@ -353,6 +687,7 @@ void cproxy_process_b2b_downstream(conn *c) {
     c->cmd_start      = NULL;
     c->cmd_start_time = msec_current_time;
     c->cmd_retries    = 0;
+    c->cmd_replica    = 0;
 
     extlen  = c->binary_header.request.extlen;
     keylen  = c->binary_header.request.keylen;
@@ -402,7 +737,7 @@ void cproxy_process_b2b_downstream(conn *c) {
         }
     } else {
         d->ptd->stats.stats.err_oom++;
-        cproxy_close_conn(c);
+        cproxy_close_conn_local(c);
     }
 }
 
@@ -522,14 +857,20 @@ void cproxy_process_b2b_downstream_nread(conn *c) {
                         sindex, vbucket, uc->cmd_retries);
             }
 
-            mcs_server_invalid_vbucket(&d->mst, sindex, vbucket);
+            /* A replica refusing a replica read says nothing */
+            /* about who the vbucket's master is. */
+
+            if (uc->cmd_replica <= 0) {
+                mcs_server_invalid_vbucket(&d->mst, sindex, vbucket);
+            }
 
             /* As long as the upstream is still open and we haven't */
             /* retried too many times already. */
 
             max_retries = cproxy_max_retries(d);
 
-            if (uc->cmd_retries < max_retries) {
+            if (uc->cmd_replica <= 0 &&
+                uc->cmd_retries < max_retries) {
                 uc->cmd_retries++;
 
                 d->upstream_retry++;
@@ -538,6 +879,12 @@ void cproxy_process_b2b_downstream_nread(conn *c) {
                 goto done;
             }
 
+            if (cproxy_replica_next(d)) {
+                d->upstream_retry++;
+
+                goto done;
+            }
+
             if (settings.verbose > 2) {
                 moxi_log_write("%d: cproxy_process_b2b_downstream_nread not-my-vbucket, "
                         "cmd: %x skipping retry %d >= %d\n",
@@ -560,7 +907,7 @@ void cproxy_process_b2b_downstream_nread(conn *c) {
         if (add_conn_item(uc, it) == true) {
             it->refcount++;
 
-            if (add_iov(uc, ITEM_data(it), it->nbytes) == 0) {
+            if (add_iov(uc, ITEM_data(it), b2b_replica_response(uc, it)) == 0) {
                 /* If we got a quiet response, however, don't change the */
                 /* upstream connection's state (should be in paused state), */
                 /* as we expect the downstream server to provide a */
@@ -571,6 +918,8 @@ void cproxy_process_b2b_downstream_nread(conn *c) {
                     cproxy_update_event_write(d, uc);
 
                     conn_set_state(uc, conn_mwrite);
+                } else if (d->multiget != NULL) {
+                    b2b_multiget_fanout(d, uc, it);
                 }
 
                 goto done;
@@ -587,3 +936,41 @@ void cproxy_process_b2b_downstream_nread(conn *c) {
     }
 }
 
+/* Turns a replica read's response back into the response to the
+ * client's original GET or GETK, returning the number of response
+ * bytes to write upstream.
+ */
+static int b2b_replica_response(conn *uc, item *it) {
+    protocol_binary_response_header *res;
+    char *key;
+    int keylen;
+    int nbytes;
+
+    res = (protocol_binary_response_header *) ITEM_data(it);
+    nbytes = it->nbytes;
+
+    if (res->response.opcode != PROTOCOL_BINARY_CMD_GET_REPLICA) {
+        return nbytes;
+    }
+
+    res->response.opcode = uc->binary_header.request.opcode;
+
+    /* A GET response carries no key, so the value moves up */
+    /* over the key that the replica read returned. */
+
+    keylen = ntohs(res->response.keylen);
+    if (res->response.opcode == PROTOCOL_BINARY_CMD_GET &&
+        keylen > 0) {
+        key = ITEM_data(it) + sizeof(*res) + res->response.extlen;
+
+        memmove(key, key + keylen,
+                nbytes - (key + keylen - ITEM_data(it)));
+
+        res->response.keylen = 0;
+        res->response.bodylen = htonl(ntohl(res->response.bodylen) - keylen);
+
+        nbytes -= keylen;
+    }
+
+    return nbytes;
+}
@@ -408,6 +408,7 @@ void cproxy_reset_stats(proxy_stats *ps) {
     ps->tot_downstream_conn = 0;
     ps->tot_downstream_conn_acquired = 0;
     ps->tot_downstream_conn_released = 0;
+    ps->tot_downstream_conn_mux = 0;
     ps->tot_downstream_released = 0;
     ps->tot_downstream_reserved = 0;
     ps->tot_downstream_reserved_time = 0;
@@ -448,6 +449,16 @@ void cproxy_reset_stats(proxy_stats *ps) {
     ps->tot_multiget_keys = 0;
     ps->tot_multiget_keys_dedupe = 0;
     ps->tot_multiget_bytes_dedupe = 0;
+    ps->tot_multiget_stream = 0;
+    ps->tot_multiget_stream_abort = 0;
+    ps->tot_multiget_batch = 0;
+    ps->tot_multiget_partial = 0;
+    ps->tot_replica_read = 0;
+    ps->tot_hedge_sent = 0;
+    ps->tot_hedge_won = 0;
+    ps->tot_downstream_ejected = 0;
+    ps->tot_downstream_ejected_fail = 0;
+    ps->tot_downstream_ejected_probe = 0;
     ps->tot_optimize_sets = 0;
     ps->err_oom = 0;
     ps->err_upstream_write_prep = 0;
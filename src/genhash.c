@@ -4,6 +4,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
 #include <platform/cbassert.h>
 
@@ -32,6 +34,25 @@ estimate_table_size(int est)
     return rv;
 }
 
+/* Grow the table once the average chain length goes above this. */
+#define GENHASH_MAX_LOAD 1
+
+/* Number of buckets of the previous table that each modifying */
+/* operation migrates while a resize is in progress. */
+#define GENHASH_REHASH_STEPS 4
+
+static int
+next_table_size(size_t size)
+{
+    size_t i=0;
+    for(i=0; i<sizeof(prime_size_table) / sizeof(int); i++) {
+        if((size_t)prime_size_table[i] > size) {
+            return prime_size_table[i];
+        }
+    }
+    return 0;
+}
+
 genhash_t* genhash_init(int est, struct hash_ops ops)
 {
     genhash_t* rv=NULL;
@@ -48,49 +69,357 @@ genhash_t* genhash_init(int est, struct hash_ops ops)
     cb_assert(ops.freeValue != NULL);
 
     size=estimate_table_size(est);
-    rv=calloc(1, sizeof(genhash_t)
-              + (size * sizeof(struct genhash_entry_t *)));
+    rv=calloc(1, sizeof(genhash_t));
+    cb_assert(rv != NULL);
+    rv->buckets=calloc(size, sizeof(struct genhash_entry_t *));
+    cb_assert(rv->buckets != NULL);
+    rv->size=size;
+    rv->ops=ops;
+
+    return rv;
+}
+
+/*
+ * Open addressing tables.
+ *
+ * Entries live inline in a power of two sized array of slots, along
+ * with the full hash of their key, and collisions are resolved by
+ * linear probing with Robin Hood ordering.  A probe stops as soon as
+ * it reaches a slot closer to its home than the key being looked for
+ * would be, and hasheq is only called when the stored hash matches,
+ * so most lookups touch one or two adjacent slots and no entry nodes.
+ *
+ * Keys are unique in an open table.  Storing a key that is already
+ * present replaces its entry instead of shadowing it.
+ */
+
+/* Grow an open table once it is this full (percent). */
+#define GENHASH_OPEN_MAX_LOAD 80
+
+static uint32_t
+open_hash(genhash_t *h, const void *k)
+{
+    uint32_t hv=(uint32_t)h->ops.hashfunc(k);
+
+    /* The slot comes from the low bits, so mix the high bits in. */
+    hv ^= hv >> 16;
+    hv *= 0x85ebca6b;
+    hv ^= hv >> 13;
+    hv *= 0xc2b2ae35;
+    hv ^= hv >> 16;
+
+    return hv;
+}
+
+genhash_t* genhash_init_open(int est, struct hash_ops ops)
+{
+    genhash_t* rv=NULL;
+    size_t size=8;
+    if (est < 1) {
+        return NULL;
+    }
+
+    cb_assert(ops.hashfunc != NULL);
+    cb_assert(ops.hasheq != NULL);
+    cb_assert(ops.dupKey != NULL);
+    cb_assert(ops.dupValue != NULL);
+    cb_assert(ops.freeKey != NULL);
+    cb_assert(ops.freeValue != NULL);
+
+    while(size < (size_t)est) {
+        size <<= 1;
+    }
+
+    rv=calloc(1, sizeof(genhash_t));
     cb_assert(rv != NULL);
+    rv->slots=calloc(size, sizeof(struct genhash_slot_t));
+    cb_assert(rv->slots != NULL);
     rv->size=size;
     rv->ops=ops;
 
     return rv;
 }
 
+static struct genhash_slot_t *
+open_find_slot(genhash_t *h, const void *k)
+{
+    uint32_t hv=open_hash(h, k);
+    size_t mask=h->size - 1;
+    size_t i=hv & mask;
+    uint32_t dist=1;
+
+    for(;;) {
+        struct genhash_slot_t *s=&h->slots[i];
+        if(s->dist < dist) {
+            return NULL;
+        }
+        if(s->hash == hv && h->ops.hasheq(k, s->key)) {
+            return s;
+        }
+        dist++;
+        i=(i + 1) & mask;
+    }
+}
+
+/* Place an entry whose key is known not to be in the table. */
+static void
+open_insert(genhash_t *h, uint32_t hv, void *key, void *value)
+{
+    struct genhash_slot_t cur;
+    size_t mask=h->size - 1;
+    size_t i=hv & mask;
+
+    cur.hash=hv;
+    cur.dist=1;
+    cur.key=key;
+    cur.value=value;
+
+    for(;;) {
+        struct genhash_slot_t *s=&h->slots[i];
+        if(s->dist == 0) {
+            *s=cur;
+            return;
+        }
+        if(s->dist < cur.dist) {
+            /* Take the slot from the richer entry and carry on */
+            /* placing that one instead. */
+            struct genhash_slot_t tmp=*s;
+            *s=cur;
+            cur=tmp;
+        }
+        cur.dist++;
+        i=(i + 1) & mask;
+    }
+}
+
+static void
+open_grow(genhash_t *h)
+{
+    struct genhash_slot_t *old_slots=h->slots;
+    size_t old_size=h->size;
+    size_t i=0;
+
+    h->slots=calloc(old_size * 2, sizeof(struct genhash_slot_t));
+    cb_assert(h->slots != NULL);
+    h->size=old_size * 2;
+
+    for(i=0; i<old_size; i++) {
+        if(old_slots[i].dist != 0) {
+            open_insert(h, old_slots[i].hash,
+                        old_slots[i].key, old_slots[i].value);
+        }
+    }
+
+    free(old_slots);
+}
+
+static void
+open_replace(genhash_t *h, struct genhash_slot_t *s,
+             const void *k, const void *v)
+{
+    void *k2=h->ops.dupKey(k);
+    void *v2=NULL;
+    h->ops.freeKey(s->key);
+    s->key=k2;
+
+    v2=h->ops.dupValue(v);
+    h->ops.freeValue(s->value);
+    s->value=v2;
+}
+
+static enum update_type
+open_store(genhash_t *h, const void *k, const void *v)
+{
+    struct genhash_slot_t *s=open_find_slot(h, k);
+
+    if(s != NULL) {
+        open_replace(h, s, k, v);
+        return MODIFICATION;
+    }
+
+    if((h->count + 1) * 100 > h->size * GENHASH_OPEN_MAX_LOAD) {
+        open_grow(h);
+    }
+
+    open_insert(h, open_hash(h, k), h->ops.dupKey(k), h->ops.dupValue(v));
+    h->count++;
+
+    return NEW;
+}
+
+static int
+open_delete(genhash_t *h, const void *k)
+{
+    struct genhash_slot_t *s=open_find_slot(h, k);
+    size_t mask=h->size - 1;
+    size_t i=0;
+
+    if(s == NULL) {
+        return 0;
+    }
+
+    h->ops.freeKey(s->key);
+    h->ops.freeValue(s->value);
+
+    /* Shift the following displaced entries back by one, so that */
+    /* no tombstones are needed. */
+    i=s - h->slots;
+    for(;;) {
+        size_t next=(i + 1) & mask;
+        if(h->slots[next].dist <= 1) {
+            memset(&h->slots[i], 0, sizeof(struct genhash_slot_t));
+            break;
+        }
+        h->slots[i]=h->slots[next];
+        h->slots[i].dist--;
+        i=next;
+    }
+
+    h->count--;
+
+    return 1;
+}
+
+static void
+open_free_slots(genhash_t *h)
+{
+    size_t i=0;
+    for(i=0; i<h->size; i++) {
+        if(h->slots[i].dist != 0) {
+            h->ops.freeKey(h->slots[i].key);
+            h->ops.freeValue(h->slots[i].value);
+        }
+    }
+}
+
 static void
 free_bucket(genhash_t* h, struct genhash_entry_t* b)
 {
-    if(b != NULL) {
-        free_bucket(h, b->next);
+    while(b != NULL) {
+        struct genhash_entry_t *next=b->next;
         h->ops.freeKey(b->key);
         h->ops.freeValue(b->value);
         free(b);
+        b=next;
     }
 }
 
 void
 genhash_free(genhash_t* h)
 {
-    if(h != NULL) {
+    if(h != NULL && h->slots != NULL) {
+        open_free_slots(h);
+        free(h->slots);
+        free(h);
+    } else if(h != NULL) {
         size_t i=0;
         for(i=0; i<h->size; i++) {
             free_bucket(h, h->buckets[i]);
         }
+        if(h->old_buckets != NULL) {
+            for(i=h->rehash_idx; i<h->old_size; i++) {
+                free_bucket(h, h->old_buckets[i]);
+            }
+            free(h->old_buckets);
+        }
+        free(h->buckets);
         free(h);
     }
 }
 
+/*
+ * Move one bucket of the previous table into the current table.
+ * Migrated entries are appended behind whatever is already in their
+ * new bucket, since anything stored since the resize started is more
+ * recent, and the most recent entry for a key must be found first.
+ */
+static void
+rehash_bucket(genhash_t *h)
+{
+    struct genhash_entry_t *p=h->old_buckets[h->rehash_idx];
+
+    h->old_buckets[h->rehash_idx]=NULL;
+    h->rehash_idx++;
+
+    while(p != NULL) {
+        struct genhash_entry_t *next=p->next;
+        struct genhash_entry_t **tail=NULL;
+        size_t n=h->ops.hashfunc(p->key) % h->size;
+
+        for(tail=&h->buckets[n]; *tail != NULL; tail=&(*tail)->next);
+        p->next=NULL;
+        *tail=p;
+
+        p=next;
+    }
+
+    if(h->rehash_idx >= h->old_size) {
+        free(h->old_buckets);
+        h->old_buckets=NULL;
+        h->old_size=0;
+        h->rehash_idx=0;
+    }
+}
+
+static void
+rehash_step(genhash_t *h)
+{
+    int i=0;
+    for(i=0; i<GENHASH_REHASH_STEPS && h->old_buckets != NULL; i++) {
+        rehash_bucket(h);
+    }
+}
+
+/*
+ * Start an incremental resize when the table is getting too full.
+ * The buckets of the previous table are migrated over the next
+ * modifying operations, rather than all at once, to avoid latency
+ * spikes on large tables.
+ */
+static void
+maybe_grow(genhash_t *h)
+{
+    struct genhash_entry_t **buckets=NULL;
+    int size=0;
+
+    if(h->old_buckets != NULL || h->count <= h->size * GENHASH_MAX_LOAD) {
+        return;
+    }
+
+    size=next_table_size(h->size);
+    if(size <= 0) {
+        return;
+    }
+
+    buckets=calloc(size, sizeof(struct genhash_entry_t *));
+    if(buckets == NULL) {
+        return; /* Just keep using the current, longer chains. */
+    }
+
+    h->old_buckets=h->buckets;
+    h->old_size=h->size;
+    h->rehash_idx=0;
+    h->buckets=buckets;
+    h->size=size;
+}
+
 void
 genhash_store(genhash_t *h, const void* k, const void* v)
 {
-    int n=0;
+    size_t n=0;
     struct genhash_entry_t *p;
 
     cb_assert(h != NULL);
 
+    if(h->slots != NULL) {
+        open_store(h, k, v);
+        return;
+    }
+
+    rehash_step(h);
+
     n=h->ops.hashfunc(k) % h->size;
-    cb_assert(n >= 0);
-    cb_assert(n < (int) h->size);
+    cb_assert(n < h->size);
 
     p=calloc(1, sizeof(struct genhash_entry_t));
     cb_assert(p);
@@ -100,21 +429,31 @@ genhash_store(genhash_t *h, const void* k, const void* v)
 
     p->next=h->buckets[n];
     h->buckets[n]=p;
+
+    h->count++;
+
+    maybe_grow(h);
 }
 
 static struct genhash_entry_t *
 genhash_find_entry(genhash_t *h, const void* k)
 {
-    int n=0;
+    int hv=0;
+    size_t n=0;
     struct genhash_entry_t *p;
 
     cb_assert(h != NULL);
-    n=h->ops.hashfunc(k) % h->size;
-    cb_assert(n >= 0);
-    cb_assert(n < (int) h->size);
+    hv=h->ops.hashfunc(k);
+    n=hv % h->size;
+    cb_assert(n < h->size);
 
-    p=h->buckets[n];
     for(p=h->buckets[n]; p && !h->ops.hasheq(k, p->key); p=p->next);
+
+    if(p == NULL && h->old_buckets != NULL) {
+        n=hv % h->old_size;
+        for(p=h->old_buckets[n]; p && !h->ops.hasheq(k, p->key); p=p->next);
+    }
+
     return p;
 }
 
@@ -124,6 +463,11 @@ genhash_find(genhash_t *h, const void* k)
     struct genhash_entry_t *p;
     void *rv=NULL;
 
+    if(h->slots != NULL) {
+        struct genhash_slot_t *s=open_find_slot(h, k);
+        return s != NULL ? s->value : NULL;
+    }
+
     p=genhash_find_entry(h, k);
 
     if(p) {
@@ -138,6 +482,10 @@ genhash_update(genhash_t* h, const void* k, const void* v)
     struct genhash_entry_t *p;
     enum update_type rv=0;
 
+    if(h->slots != NULL) {
+        return open_store(h, k, v);
+    }
+
     p=genhash_find_entry(h, k);
 
     if(p) {
@@ -167,6 +515,19 @@ genhash_fun_update(genhash_t* h, const void* k,
     struct genhash_entry_t *p;
     enum update_type rv=0;
 
+    if(h->slots != NULL) {
+        struct genhash_slot_t *s=open_find_slot(h, k);
+        void *newValue=upd(k, s != NULL ? s->value : def);
+        if(s != NULL) {
+            open_replace(h, s, k, newValue);
+            rv=MODIFICATION;
+        } else {
+            rv=open_store(h, k, newValue);
+        }
+        fr(newValue);
+        return rv;
+    }
+
     p=genhash_find_entry(h, k);
 
     if(p) {
@@ -192,26 +553,20 @@ genhash_fun_update(genhash_t* h, const void* k,
     return rv;
 }
 
-int
-genhash_delete(genhash_t* h, const void* k)
+static struct genhash_entry_t *
+delete_from_bucket(genhash_t* h, struct genhash_entry_t **bucket,
+                   const void* k)
 {
     struct genhash_entry_t *deleteme=NULL;
-    int n=0;
-    int rv=0;
 
-    cb_assert(h != NULL);
-    n=h->ops.hashfunc(k) % h->size;
-    cb_assert(n >= 0);
-    cb_assert(n < (int) h->size);
-
-    if(h->buckets[n] != NULL) {
+    if(*bucket != NULL) {
         /* Special case the first one */
-        if(h->ops.hasheq(h->buckets[n]->key, k)) {
-            deleteme=h->buckets[n];
-            h->buckets[n]=deleteme->next;
+        if(h->ops.hasheq((*bucket)->key, k)) {
+            deleteme=*bucket;
+            *bucket=deleteme->next;
         } else {
             struct genhash_entry_t *p=NULL;
-            for(p=h->buckets[n]; deleteme==NULL && p->next != NULL; p=p->next) {
+            for(p=*bucket; deleteme==NULL && p->next != NULL; p=p->next) {
                 if(h->ops.hasheq(p->next->key, k)) {
                     deleteme=p->next;
                     p->next=deleteme->next;
@@ -219,10 +574,41 @@ genhash_delete(genhash_t* h, const void* k)
             }
         }
     }
+
+    return deleteme;
+}
+
+int
+genhash_delete(genhash_t* h, const void* k)
+{
+    struct genhash_entry_t *deleteme=NULL;
+    int hv=0;
+    size_t n=0;
+    int rv=0;
+
+    cb_assert(h != NULL);
+
+    if(h->slots != NULL) {
+        return open_delete(h, k);
+    }
+
+    rehash_step(h);
+
+    hv=h->ops.hashfunc(k);
+    n=hv % h->size;
+    cb_assert(n < h->size);
+
+    deleteme=delete_from_bucket(h, &h->buckets[n], k);
+    if(deleteme == NULL && h->old_buckets != NULL) {
+        n=hv % h->old_size;
+        deleteme=delete_from_bucket(h, &h->old_buckets[n], k);
+    }
+
     if(deleteme != NULL) {
         h->ops.freeKey(deleteme->key);
         h->ops.freeValue(deleteme->value);
         free(deleteme);
+        h->count--;
         rv++;
     }
 
@@ -247,11 +633,27 @@ genhash_iter(genhash_t* h,
     struct genhash_entry_t *p=NULL;
     cb_assert(h != NULL);
 
+    if(h->slots != NULL) {
+        for(i=0; i<h->size; i++) {
+            if(h->slots[i].dist != 0) {
+                iterfunc(h->slots[i].key, h->slots[i].value, arg);
+            }
+        }
+        return;
+    }
+
     for(i=0; i<h->size; i++) {
         for(p=h->buckets[i]; p!=NULL; p=p->next) {
             iterfunc(p->key, p->value, arg);
         }
     }
+    if(h->old_buckets != NULL) {
+        for(i=h->rehash_idx; i<h->old_size; i++) {
+            for(p=h->old_buckets[i]; p!=NULL; p=p->next) {
+                iterfunc(p->key, p->value, arg);
+            }
+        }
+    }
 }
 
 int
@@ -260,6 +662,13 @@ genhash_clear(genhash_t *h)
     size_t i = 0;
     cb_assert(h != NULL);
 
+    if(h->slots != NULL) {
+        open_free_slots(h);
+        memset(h->slots, 0, h->size * sizeof(struct genhash_slot_t));
+        h->count = 0;
+        return 0;
+    }
+
     for(i = 0; i < h->size; i++) {
         while(h->buckets[i]) {
             struct genhash_entry_t *p = NULL;
@@ -271,6 +680,18 @@ genhash_clear(genhash_t *h)
         }
     }
 
+    if(h->old_buckets != NULL) {
+        for(i = h->rehash_idx; i < h->old_size; i++) {
+            free_bucket(h, h->old_buckets[i]);
+        }
+        free(h->old_buckets);
+        h->old_buckets = NULL;
+        h->old_size = 0;
+        h->rehash_idx = 0;
+    }
+
+    h->count = 0;
+
     return 0;
 }
 
@@ -285,10 +706,8 @@ count_entries(const void *key, const void *val, void *arg)
 
 int
 genhash_size(genhash_t* h) {
-    int rv=0;
     cb_assert(h != NULL);
-    genhash_iter(h, count_entries, &rv);
-    return rv;
+    return (int)h->count;
 }
 
 int
@@ -304,19 +723,37 @@ void
 genhash_iter_key(genhash_t* h, const void* key,
                  void (*iterfunc)(const void* key, const void* val, void *arg), void *arg)
 {
-    int n=0;
+    int hv=0;
+    size_t n=0;
     struct genhash_entry_t *p=NULL;
 
     cb_assert(h != NULL);
-    n=h->ops.hashfunc(key) % h->size;
-    cb_assert(n >= 0);
-    cb_assert(n < (int) h->size);
+
+    if(h->slots != NULL) {
+        struct genhash_slot_t *s=open_find_slot(h, key);
+        if(s != NULL) {
+            iterfunc(s->key, s->value, arg);
+        }
+        return;
+    }
+
+    hv=h->ops.hashfunc(key);
+    n=hv % h->size;
+    cb_assert(n < h->size);
 
     for(p=h->buckets[n]; p!=NULL; p=p->next) {
         if(h->ops.hasheq(key, p->key)) {
             iterfunc(p->key, p->value, arg);
         }
     }
+    if(h->old_buckets != NULL) {
+        n=hv % h->old_size;
+        for(p=h->old_buckets[n]; p!=NULL; p=p->next) {
+            if(h->ops.hasheq(key, p->key)) {
+                iterfunc(p->key, p->value, arg);
+            }
+        }
+    }
 }
 
 int
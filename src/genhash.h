@@ -74,6 +74,9 @@ enum update_type {
 /**
  * Create a new generic hashtable.
  *
+ * The table grows as entries are added, migrating a few buckets at a
+ * time on later stores and deletes, so est only sets the initial size.
+ *
  * @param est the estimated number of items to store (must be > 0)
  * @param ops the key and value operations
  *
@@ -81,6 +84,23 @@ enum update_type {
  */
 genhash_t* genhash_init(int est, struct hash_ops ops);
 
+/**
+ * Create a new open addressing hashtable.
+ *
+ * An open table keeps its entries and their hashes inline in one
+ * array, which makes lookups cheaper than in a chained table at the
+ * cost of a full copy when it grows.  Keys are unique in an open
+ * table: genhash_store() replaces an existing entry for the key
+ * rather than adding another one.  All other genhash functions work
+ * the same on either kind of table.
+ *
+ * @param est the estimated number of items to store (must be > 0)
+ * @param ops the key and value operations
+ *
+ * @return the new genhash_t or NULL if one cannot be created
+ */
+genhash_t* genhash_init_open(int est, struct hash_ops ops);
+
 /**
  * Free a gen hash.
  *
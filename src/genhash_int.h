@@ -10,8 +10,42 @@ struct genhash_entry_t {
     struct genhash_entry_t *next;
 };
 
+/**
+ * \private
+ * A slot of an open addressing table, see genhash_init_open().
+ */
+struct genhash_slot_t {
+    /** Mixed hash of the key, compared before calling hasheq */
+    uint32_t hash;
+    /** Distance from the key's home slot plus one, 0 if the slot is empty */
+    uint32_t dist;
+    /** The key for this entry */
+    void *key;
+    /** The value for this entry */
+    void *value;
+};
+
 struct _genhash {
+    /** Number of buckets in the current table */
     size_t size;
+    /** Number of entries in both tables */
+    size_t count;
     struct hash_ops ops;
-    struct genhash_entry_t *buckets[];
+    /** The current table, where all new entries go */
+    struct genhash_entry_t **buckets;
+    /**
+     * The previous, smaller table while a resize is in progress,
+     * otherwise NULL.  Its buckets are migrated into the current
+     * table a few at a time by each modifying operation.
+     */
+    struct genhash_entry_t **old_buckets;
+    /** Number of buckets in the previous table */
+    size_t old_size;
+    /** Next bucket of the previous table to be migrated */
+    size_t rehash_idx;
+    /**
+     * The slots of an open addressing table, otherwise NULL.  An
+     * open table has size slots (a power of two) and no buckets.
+     */
+    struct genhash_slot_t *slots;
 };
@@ -85,6 +85,44 @@ static size_t item_make_header(const uint8_t nkey, const int flags, const int nb
     return sizeof(item) + nkey + *nsuffix + nbytes;
 }
 
+/* Max bytes of free items that each thread keeps for reuse, */
+/* with MOXI_ITEM_MALLOC, set by the item_cache_max behavior. */
+/* 0 disables the freelists. */
+size_t item_cache_max = 1048576;
+
+#ifdef MOXI_ITEM_MALLOC
+/* Returns the freelist size class for an item, or -1 if too big. */
+static int item_cache_class(size_t ntotal) {
+    int clsid = 0;
+    size_t size = ITEM_CACHE_SIZE_MIN;
+    while (size < ntotal && clsid < ITEM_CACHE_CLASSES) {
+        size <<= 1;
+        clsid++;
+    }
+    return clsid < ITEM_CACHE_CLASSES ? clsid : -1;
+}
+
+static void item_cache_free(item *it) {
+    /* slabs_clsid is otherwise unused with malloc'ed items, */
+    /* so it records the size class + 1, or 0 if uncachable. */
+    if (it->slabs_clsid > 0 && item_cache_max > 0) {
+        item_cache *ic = thread_item_cache();
+        if (ic != NULL) {
+            int clsid = it->slabs_clsid - 1;
+            size_t size = (size_t) ITEM_CACHE_SIZE_MIN << clsid;
+            if (ic->bytes + size <= item_cache_max) {
+                it->next = ic->free[clsid];
+                ic->free[clsid] = it;
+                ic->bytes += size;
+                return;
+            }
+            ic->overflows++;
+        }
+    }
+    free(it);
+}
+#endif
+
 /*@null@*/
 item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_time_t exptime, const int nbytes) {
     uint8_t nsuffix;
@@ -95,10 +133,30 @@ item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_tim
     }
 
 #ifdef MOXI_ITEM_MALLOC
-    item *itx = malloc(ntotal);
+    item *itx = NULL;
+    int clsid = item_cache_class(ntotal);
+    if (clsid >= 0) {
+        item_cache *ic = item_cache_max > 0 ? thread_item_cache() : NULL;
+        if (ic != NULL) {
+            itx = ic->free[clsid];
+            if (itx != NULL) {
+                ic->free[clsid] = itx->next;
+                ic->bytes -= (size_t) ITEM_CACHE_SIZE_MIN << clsid;
+                ic->hits++;
+            } else {
+                ic->misses++;
+            }
+        }
+        if (itx == NULL) {
+            /* Round up, so whichever thread frees it can reuse it. */
+            itx = malloc((size_t) ITEM_CACHE_SIZE_MIN << clsid);
+        }
+    } else {
+        itx = malloc(ntotal);
+    }
     if (itx != NULL) {
         itx->refcount = 1;
-        itx->slabs_clsid = 0;
+        itx->slabs_clsid = (uint8_t) (clsid + 1);
         itx->next = 0;
         itx->prev = 0;
         itx->h_next = 0;
@@ -232,7 +290,7 @@ void item_free(item *it) {
     cb_assert(it->refcount > 0);
     it->refcount--;
     if (it->refcount == 0) {
-        free(it);
+        item_cache_free(it);
     }
 #else
     size_t ntotal = ITEM_ntotal(it);
@@ -1,5 +1,6 @@
 /* See items.c */
 void item_init(void);
+extern size_t item_cache_max;
 uint64_t get_cas_id(void);
 
 /*@null@*/
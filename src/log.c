@@ -20,6 +20,7 @@
 #include <platform/cbassert.h>
 
 #include "log.h"
+#include "atomics.h"
 #ifdef HAVE_VALGRIND_VALGRIND_H
 #include <valgrind/valgrind.h>
 #endif
@@ -30,8 +31,51 @@
 
 #define MAX_LOGBUF_LEN 1000
 
+#define LOG_RINGS      64  /* Threads past this many write directly. */
+#define LOG_RING_SLOTS 256 /* Messages a ring holds before it drops. */
+#define LOG_IDLE_MSECS 1000 /* How long an idle logger waits between */
+                            /* checks for a log_cycle_wanted. */
+
 extern volatile uint64_t msec_current_time;
 
+/* Once log_error_start() runs, a thread formats each message into */
+/* a slot of its own ring, and a logger thread does the write() or */
+/* syslog().  Each ring has one producer, its thread, and one */
+/* consumer, whoever holds log_drain_lock, so neither side locks. */
+/* A full ring drops the message and counts it, rather than make */
+/* the thread wait on the log. */
+
+typedef struct {
+    int  len;
+    char buf[MAX_LOGBUF_LEN + 10];
+} log_slot;
+
+typedef struct {
+    uint64_t head;     /* Next slot to fill, written by the producer. */
+    uint64_t tail;     /* Next slot to drain, written by the consumer. */
+    uint64_t dropped;  /* Written by the producer. */
+    uint64_t dropped_reported;
+    log_slot slots[LOG_RING_SLOTS];
+} log_ring;
+
+static void *log_rings[LOG_RINGS];
+static int log_rings_claimed; /* May run past LOG_RINGS. */
+
+static void *log_async; /* The moxi_log being drained, once started. */
+
+static cb_thread_t log_tid;
+static cb_mutex_t log_drain_lock;
+static cb_mutex_t log_wake_lock;
+static cb_cond_t log_wake_cond;
+static int log_idle;         /* Set while the logger waits. */
+static int log_cycle_wanted; /* The logger reopens the file. */
+
+static THREAD_LOCAL log_ring *log_my_ring;
+static THREAD_LOCAL bool log_my_ring_tried;
+
+static int log_cycle(moxi_log *mlog);
+static void log_wake(void);
+
 /**
  * open the errorlog
  *
@@ -45,6 +89,10 @@ extern volatile uint64_t msec_current_time;
 int log_error_open(moxi_log *mlog) {
     cb_assert(mlog);
 
+    if (!mlog->base_ts) {
+        mlog->base_ts = time(NULL);
+    }
+
     if (mlog->log_mode == ERRORLOG_FILE) {
         const char *logfile = mlog->log_file;
 
@@ -71,13 +119,30 @@ int log_error_open(moxi_log *mlog) {
     return 0;
 }
 
+/**
+ * cycle the errorlog
+ *
+ * with a logger thread, it does the cycle, so the fd it writes
+ * isn't closed under it, and it finds the flag within
+ * LOG_IDLE_MSECS, as this runs in a signal handler that may have
+ * interrupted a log_error_write() or the logger itself
+ */
+int log_error_cycle(moxi_log *mlog) {
+    if (atomic_load_ptr(&log_async) == mlog) {
+        atomic_xchg_int(&log_cycle_wanted, 1);
+        return 0;
+    }
+
+    return log_cycle(mlog);
+}
+
 /**
  * open the errorlog
  *
  * if the open failed, report to the user and die
  * if no filename is given, use syslog instead
  */
-int log_error_cycle(moxi_log *mlog) {
+static int log_cycle(moxi_log *mlog) {
     /* only cycle if we are not in syslog-mode */
 
     if (mlog->log_mode == ERRORLOG_FILE) {
@@ -156,30 +221,38 @@ void mappend_log_int(char *logbuf, int *logbuf_used, int num) {
     mappend_log(logbuf, logbuf_used, buf);
 }
 
-int log_error_write(moxi_log *mlog, const char *filename, unsigned int line,
-                    const char *fmt, ...) {
-    va_list ap;
-    static char ts_debug_str[255];
+/*
+ * Formats a message, with its timestamp and source line, into
+ * logbuf, which holds MAX_LOGBUF_LEN + 10 bytes.
+ * @return the formatted length
+ */
+static int log_format(moxi_log *mlog, char *logbuf,
+                      const char *filename, unsigned int line,
+                      const char *fmt, va_list ap) {
+    /* Per thread, as every logging thread formats. */
+    static THREAD_LOCAL char ts_debug_str[255];
+    static THREAD_LOCAL time_t last_generated_debug_ts;
 
-    char logbuf[MAX_LOGBUF_LEN + 10]; /* scratch buffer */
     int  logbuf_used = 0;             /* length of scratch buffer */
     time_t cur_ts = 0;
 
-    logbuf_used = 0;
-
     switch(mlog->log_mode) {
         case ERRORLOG_FILE:
         case ERRORLOG_STDERR:
             /* cache the generated timestamp */
-            if (!mlog->base_ts) {
-                mlog->base_ts = time(NULL);
-            }
             cur_ts = mlog->base_ts + (msec_current_time/1000);
 
-            if (cur_ts != mlog->last_generated_debug_ts) {
+            if (cur_ts != last_generated_debug_ts) {
+                struct tm tm;
+
                 memset(ts_debug_str, 0, sizeof(ts_debug_str));
-                strftime(ts_debug_str, 254, "%Y-%m-%d %H:%M:%S", localtime(&(cur_ts)));
-                mlog->last_generated_debug_ts = cur_ts;
+#ifdef WIN32
+                localtime_s(&tm, &cur_ts);
+#else
+                localtime_r(&cur_ts, &tm);
+#endif
+                strftime(ts_debug_str, 254, "%Y-%m-%d %H:%M:%S", &tm);
+                last_generated_debug_ts = cur_ts;
             }
 
             mappend_log(logbuf, &logbuf_used, ts_debug_str);
@@ -201,10 +274,8 @@ int log_error_write(moxi_log *mlog, const char *filename, unsigned int line,
 
     cb_assert(logbuf_used < MAX_LOGBUF_LEN);
 
-    va_start(ap, fmt);
     logbuf_used +=
         vsnprintf((logbuf + logbuf_used), (MAX_LOGBUF_LEN - logbuf_used - 1), fmt, ap);
-    va_end(ap);
 
     /* vsprintf returns total string length, so no buffer overflow is
      * possible, but we can shoot logbuf_used past MAX_LOGBUF_LEN */
@@ -219,6 +290,10 @@ int log_error_write(moxi_log *mlog, const char *filename, unsigned int line,
     cb_assert(logbuf_used < MAX_LOGBUF_LEN);
     logbuf[logbuf_used] = '\0';
 
+    return logbuf_used;
+}
+
+static void log_emit(moxi_log *mlog, const char *logbuf, int logbuf_used) {
     switch(mlog->log_mode) {
         case ERRORLOG_FILE:
             (void)write(mlog->fd, logbuf, logbuf_used);
@@ -232,9 +307,235 @@ int log_error_write(moxi_log *mlog, const char *filename, unsigned int line,
             break;
 #endif
     }
+}
+
+static void log_emitf(moxi_log *mlog, const char *filename,
+                      unsigned int line, const char *fmt, ...) {
+    char logbuf[MAX_LOGBUF_LEN + 10];
+    int  logbuf_used;
+    va_list ap;
+
+    va_start(ap, fmt);
+    logbuf_used = log_format(mlog, logbuf, filename, line, fmt, ap);
+    va_end(ap);
+
+    log_emit(mlog, logbuf, logbuf_used);
+}
+
+/*
+ * Returns the calling thread's ring, claiming one the first time,
+ * or NULL once they're all claimed.
+ */
+static log_ring *log_thread_ring(void) {
+    int i;
+
+    if (log_my_ring == NULL && !log_my_ring_tried) {
+        log_my_ring_tried = true;
+
+        i = atomic_add_int(&log_rings_claimed, 1);
+        if (i < LOG_RINGS) {
+            log_my_ring = calloc(1, sizeof(log_ring));
+            if (log_my_ring != NULL) {
+                atomic_store_ptr(&log_rings[i], log_my_ring);
+            }
+        }
+    }
+
+    return log_my_ring;
+}
+
+static void log_wake(void) {
+    if (atomic_load_int(&log_idle) &&
+        atomic_xchg_int(&log_idle, 0)) {
+        cb_mutex_enter(&log_wake_lock);
+        cb_cond_signal(&log_wake_cond);
+        cb_mutex_exit(&log_wake_lock);
+    }
+}
+
+static bool log_pending(void) {
+    log_ring *r;
+    int i;
+
+    if (atomic_load_int(&log_cycle_wanted)) {
+        return true;
+    }
+
+    for (i = 0; i < LOG_RINGS; i++) {
+        r = atomic_load_ptr(&log_rings[i]);
+        if (r != NULL &&
+            (atomic_load_u64(&r->head) != atomic_load_u64(&r->tail) ||
+             atomic_load_u64(&r->dropped) !=
+             atomic_load_u64(&r->dropped_reported))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Writes out whatever the rings hold.  Only the holder of
+ * log_drain_lock consumes.
+ * @return the number of messages written
+ */
+static int log_drain(moxi_log *mlog) {
+    log_ring *r;
+    uint64_t head;
+    uint64_t dropped;
+    int n = 0;
+    int i;
+
+    cb_mutex_enter(&log_drain_lock);
+
+    if (atomic_xchg_int(&log_cycle_wanted, 0)) {
+        log_cycle(mlog);
+    }
+
+    for (i = 0; i < LOG_RINGS; i++) {
+        r = atomic_load_ptr(&log_rings[i]);
+        if (r == NULL) {
+            continue;
+        }
+
+        head = atomic_load_u64(&r->head);
+        while (r->tail != head) {
+            log_slot *slot = &r->slots[r->tail % LOG_RING_SLOTS];
+
+            log_emit(mlog, slot->buf, slot->len);
+            atomic_store_u64(&r->tail, r->tail + 1);
+            n++;
+        }
+
+        dropped = atomic_load_u64(&r->dropped);
+        if (dropped != r->dropped_reported) {
+            log_emitf(mlog, __FILE__, __LINE__,
+                      "log ring %d dropped %llu messages\n", i,
+                      (unsigned long long) (dropped - r->dropped_reported));
+            atomic_store_u64(&r->dropped_reported, dropped);
+            n++;
+        }
+    }
+
+    cb_mutex_exit(&log_drain_lock);
+
+    return n;
+}
+
+static void log_thread(void *arg) {
+    moxi_log *mlog = arg;
+
+    while (true) {
+        if (log_drain(mlog) > 0) {
+            continue;
+        }
+
+        /* A producer that sees log_idle signals, and one that */
+        /* published before we set it is seen by log_pending(). */
+        /* A log_error_cycle() doesn't signal, so the wait is timed. */
+
+        cb_mutex_enter(&log_wake_lock);
+        atomic_xchg_int(&log_idle, 1);
+        if (!log_pending()) {
+            cb_cond_timedwait(&log_wake_cond, &log_wake_lock,
+                              LOG_IDLE_MSECS);
+        }
+        atomic_xchg_int(&log_idle, 0);
+        cb_mutex_exit(&log_wake_lock);
+    }
+}
+
+/* So an exit() doesn't lose what's still in the rings. */
+static void log_flush_at_exit(void) {
+    moxi_log *mlog = atomic_load_ptr(&log_async);
+
+    if (mlog != NULL &&
+        !cb_thread_equal(cb_thread_self(), log_tid)) {
+        log_drain(mlog);
+    }
+}
+
+/**
+ * start the logger thread
+ *
+ * must run after any fork, as the thread doesn't survive it
+ */
+int log_error_start(moxi_log *mlog) {
+    cb_assert(mlog);
+
+    if (atomic_load_ptr(&log_async) != NULL) {
+        return 0;
+    }
+
+    cb_mutex_initialize(&log_drain_lock);
+    cb_mutex_initialize(&log_wake_lock);
+    cb_cond_initialize(&log_wake_cond);
+
+    if (cb_create_thread(&log_tid, log_thread, mlog, 1) != 0) {
+        return -1;
+    }
+
+    atexit(log_flush_at_exit);
+
+    atomic_store_ptr(&log_async, mlog);
 
     return 0;
 }
 
+/* Messages dropped because a ring was full. */
+uint64_t log_error_dropped(void) {
+    uint64_t dropped = 0;
+    log_ring *r;
+    int i;
+
+    for (i = 0; i < LOG_RINGS; i++) {
+        r = atomic_load_ptr(&log_rings[i]);
+        if (r != NULL) {
+            dropped += atomic_load_u64(&r->dropped);
+        }
+    }
 
+    return dropped;
+}
+
+int log_error_write(moxi_log *mlog, const char *filename, unsigned int line,
+                    const char *fmt, ...) {
+    va_list ap;
+    log_ring *r = NULL;
+
+    char logbuf[MAX_LOGBUF_LEN + 10]; /* scratch buffer */
+    int  logbuf_used = 0;             /* length of scratch buffer */
 
+    if (atomic_load_ptr(&log_async) == mlog) {
+        r = log_thread_ring();
+    }
+
+    if (r != NULL) {
+        uint64_t head = r->head;
+        log_slot *slot;
+
+        if (head - atomic_load_u64(&r->tail) >= LOG_RING_SLOTS) {
+            atomic_store_u64(&r->dropped, r->dropped + 1);
+            return 0;
+        }
+
+        slot = &r->slots[head % LOG_RING_SLOTS];
+
+        va_start(ap, fmt);
+        slot->len = log_format(mlog, slot->buf, filename, line, fmt, ap);
+        va_end(ap);
+
+        atomic_store_u64(&r->head, head + 1);
+        log_wake();
+
+        return 0;
+    }
+
+    va_start(ap, fmt);
+    logbuf_used = log_format(mlog, logbuf, filename, line, fmt, ap);
+    va_end(ap);
+
+    log_emit(mlog, logbuf, logbuf_used);
+
+    return 0;
+}
@@ -7,6 +7,7 @@
 #define _LOG_H_
 
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 
 /*
@@ -29,7 +30,6 @@ struct moxi_log {
     char *log_file;     /* if log file is specified */
     int use_syslog;     /* set if syslog is being used */
     time_t base_ts;     /* base timestamp */
-    time_t last_generated_debug_ts;
 };
 
 typedef struct moxi_log moxi_log;
@@ -38,6 +38,8 @@ int log_error_open(moxi_log *);
 int log_error_close(moxi_log *);
 int log_error_write(moxi_log *, const char *filename, unsigned int line, const char *fmt, ...);
 int log_error_cycle(moxi_log *);
+int log_error_start(moxi_log *);
+uint64_t log_error_dropped(void);
 
 #ifndef MAIN_CHECK
 extern moxi_log *ml;
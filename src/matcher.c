@@ -6,15 +6,215 @@
 #include <errno.h>
 #include <platform/cbassert.h>
 #include "matcher.h"
+#include "atomics.h"
+
+/* A trie node, for one byte of one or more patterns.  The children */
+/* of a node are a sibling list, sorted by byte. */
+
+typedef struct {
+    int           child;   /* Index of first child node, or -1. */
+    int           sibling; /* Index of next sibling node, or -1. */
+    int           pattern; /* Index of pattern ending here, or -1. */
+    unsigned char c;
+} matcher_node;
+
+struct matcher_trie {
+    int           nodes_num; /* Node 0 is the root, with no byte. */
+    int           nodes_max;
+    matcher_node *nodes;
+
+    /* Statistics, as rows of slots, each holding a hit counter per */
+    /* pattern plus a miss counter.  Rows are padded to a cache line */
+    /* so that threads don't share one. */
+
+    int       slots;
+    int       stride;
+    uint64_t *counts;
+
+    uint64_t      gen;  /* The matcher's gen when retired. */
+    matcher_trie *next; /* Next in the matcher's retired list. */
+};
+
+#define MATCHER_STRIDE_ALIGN 8 /* uint64_t's per 64-byte cache line. */
 
 void matcher_add(matcher *m, char *pattern);
 
-void matcher_init(matcher *m, bool multithreaded) {
+static void matcher_trie_free(matcher_trie *t) {
+    if (t != NULL) {
+        free(t->nodes);
+        free(t->counts);
+        free(t);
+    }
+}
+
+/* Returns the index of a new node, or -1 on failure to alloc.
+ */
+static int matcher_trie_node(matcher_trie *t, unsigned char c) {
+    matcher_node *n;
+
+    if (t->nodes_num >= t->nodes_max) {
+        int nmax = (t->nodes_max * 2) + 16;
+        matcher_node *nnodes = realloc(t->nodes, nmax * sizeof(matcher_node));
+        if (nnodes == NULL) {
+            return -1;
+        }
+
+        t->nodes_max = nmax;
+        t->nodes     = nnodes;
+    }
+
+    n = &t->nodes[t->nodes_num];
+    n->child   = -1;
+    n->sibling = -1;
+    n->pattern = -1;
+    n->c       = c;
+
+    return t->nodes_num++;
+}
+
+static bool matcher_trie_add(matcher_trie *t, char *pattern, int index) {
+    int curr = 0;
+    int i;
+
+    for (i = 0; pattern[i] != '\0'; i++) {
+        unsigned char c = (unsigned char) pattern[i];
+
+        /* Nodes are only referred to by index, since */
+        /* matcher_trie_node() may move them. */
+
+        int prev = -1;
+        int next = t->nodes[curr].child;
+
+        while (next >= 0 && t->nodes[next].c < c) {
+            prev = next;
+            next = t->nodes[next].sibling;
+        }
+
+        if (next < 0 || t->nodes[next].c != c) {
+            int n = matcher_trie_node(t, c);
+            if (n < 0) {
+                return false;
+            }
+
+            t->nodes[n].sibling = next;
+
+            if (prev < 0) {
+                t->nodes[curr].child = n;
+            } else {
+                t->nodes[prev].sibling = n;
+            }
+
+            next = n;
+        }
+
+        curr = next;
+    }
+
+    if (curr > 0) {
+        t->nodes[curr].pattern = index;
+    }
+
+    return true;
+}
+
+/* Compiles the patterns into a new trie, or returns NULL.
+ */
+static matcher_trie *matcher_trie_build(char **patterns, int patterns_num,
+                                        int slots) {
+    matcher_trie *t;
+    int i;
+
+    if (patterns == NULL || patterns_num <= 0) {
+        return NULL;
+    }
+
+    t = calloc(1, sizeof(matcher_trie));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    t->slots  = slots > 1 ? slots : 1;
+    t->stride = ((patterns_num + 1 + MATCHER_STRIDE_ALIGN - 1) /
+                 MATCHER_STRIDE_ALIGN) * MATCHER_STRIDE_ALIGN;
+    t->counts = calloc((size_t) t->slots * t->stride, sizeof(uint64_t));
+
+    if (t->counts == NULL ||
+        matcher_trie_node(t, '\0') != 0) {
+        matcher_trie_free(t);
+        return NULL;
+    }
+
+    for (i = 0; i < patterns_num; i++) {
+        cb_assert(patterns[i]);
+
+        if (!matcher_trie_add(t, patterns[i], i)) {
+            matcher_trie_free(t);
+            return NULL;
+        }
+    }
+
+    return t;
+}
+
+/** Assuming caller has m->lock already.
+ */
+static void matcher_publish(matcher *m, matcher_trie *t) {
+    matcher_trie *prev = m->trie;
+
+    atomic_store_ptr(&m->trie, t);
+
+    if (prev != NULL) {
+        if (m->lock == NULL) {
+            /* Only the calling thread checks an unshared matcher. */
+
+            matcher_trie_free(prev);
+        } else {
+            prev->gen  = m->gen;
+            prev->next = m->retired;
+            m->retired = prev;
+        }
+    }
+}
+
+/* Sets the gen that later retired tries are stamped with, and frees
+ * the retired tries stamped before safe_gen, as every checking thread
+ * has since passed a quiescent point.
+ */
+void matcher_reclaim(matcher *m, uint64_t gen, uint64_t safe_gen) {
+    matcher_trie **prev;
+
+    cb_assert(m);
+
+    if (m->lock) {
+        cb_mutex_enter(m->lock);
+    }
+
+    m->gen = gen;
+
+    prev = &m->retired;
+    while (*prev != NULL) {
+        matcher_trie *t = *prev;
+        if (t->gen < safe_gen) {
+            *prev = t->next;
+            matcher_trie_free(t);
+        } else {
+            prev = &t->next;
+        }
+    }
+
+    if (m->lock) {
+        cb_mutex_exit(m->lock);
+    }
+}
+
+void matcher_init(matcher *m, int slots) {
     cb_assert(m);
 
     memset(m, 0, sizeof(matcher));
 
-    if (multithreaded) {
+    m->slots = slots > 1 ? slots : 1;
+
+    if (slots > 1) {
         m->lock = malloc(sizeof(cb_mutex_t));
         if (m->lock != NULL) {
             cb_mutex_initialize(m->lock);
@@ -44,6 +244,15 @@ void matcher_start(matcher *m, char *spec) {
                 }
             }
             free(copy);
+
+            if (m->patterns_num > 0) {
+                matcher_trie *t = matcher_trie_build(m->patterns,
+                                                     m->patterns_num,
+                                                     m->slots);
+                if (t != NULL) {
+                    matcher_publish(m, t);
+                }
+            }
         }
     }
 
@@ -53,21 +262,9 @@ void matcher_start(matcher *m, char *spec) {
 }
 
 bool matcher_started(matcher *m) {
-    bool rv;
-
     cb_assert(m);
 
-    if (m->lock) {
-        cb_mutex_enter(m->lock);
-    }
-
-    rv = m->patterns != NULL && m->patterns_num > 0;
-
-    if (m->lock) {
-        cb_mutex_exit(m->lock);
-    }
-
-    return rv;
+    return atomic_load_ptr(&m->trie) != NULL;
 }
 
 void matcher_stop(matcher *m) {
@@ -90,13 +287,7 @@ void matcher_stop(matcher *m) {
     free(m->patterns);
     m->patterns = NULL;
 
-    free(m->lengths);
-    m->lengths = NULL;
-
-    free(m->hits);
-    m->hits = NULL;
-
-    m->misses = 0;
+    matcher_publish(m, NULL);
 
     if (m->lock) {
         cb_mutex_exit(m->lock);
@@ -113,16 +304,14 @@ matcher *matcher_clone(matcher *m, matcher *copy) {
     cb_assert(m->patterns_num <= m->patterns_max);
 
     cb_assert(copy);
-    matcher_init(copy, m->lock != NULL);
+    matcher_init(copy, m->slots);
 
     copy->patterns_max = m->patterns_num; /* Optimize copy's array size. */
     copy->patterns_num = m->patterns_num;
 
     if (copy->patterns_max > 0) {
         copy->patterns = calloc(copy->patterns_max, sizeof(char *));
-        copy->lengths  = calloc(copy->patterns_max, sizeof(int));
-        copy->hits     = calloc(copy->patterns_max, sizeof(uint64_t));
-        if (copy->patterns != NULL && copy->lengths != NULL && copy->hits != NULL) {
+        if (copy->patterns != NULL) {
             int i;
             for (i = 0; i < copy->patterns_num; i++) {
                 cb_assert(m->patterns[i]);
@@ -130,10 +319,15 @@ matcher *matcher_clone(matcher *m, matcher *copy) {
                 if (copy->patterns[i] == NULL) {
                     goto fail;
                 }
+            }
 
-                copy->lengths[i] = m->lengths[i];
+            /* Note we don't copy statistics. */
 
-                /* Note we don't copy statistics. */
+            copy->trie = matcher_trie_build(copy->patterns,
+                                            copy->patterns_num,
+                                            copy->slots);
+            if (copy->trie == NULL) {
+                goto fail;
             }
 
             if (m->lock)
@@ -169,20 +363,10 @@ void matcher_add(matcher *m, char *pattern) {
     if (m->patterns_num >= m->patterns_max) {
         int    nmax = (m->patterns_num * 2) + 4; /* 4 is slop when 0. */
         char **npatterns = realloc(m->patterns, nmax * sizeof(char *));
-        int   *nlengths  = realloc(m->lengths,  nmax * sizeof(int));
-        uint64_t *nhits  = realloc(m->hits,     nmax * sizeof(uint64_t));
-        if (npatterns != NULL &&
-            nlengths != NULL &&
-            nhits != NULL) {
+        if (npatterns != NULL) {
             m->patterns_max = nmax;
             m->patterns     = npatterns;
-            m->lengths      = nlengths;
-            m->hits         = nhits;
         } else {
-            free(npatterns);
-            free(nlengths);
-            free(nhits);
-
             return; /* Failed to alloc. */
         }
     }
@@ -191,49 +375,96 @@ void matcher_add(matcher *m, char *pattern) {
 
     m->patterns[m->patterns_num] = strdup(pattern);
     if (m->patterns[m->patterns_num] != NULL) {
-        m->lengths[m->patterns_num] = strlen(pattern);
         m->patterns_num++;
     }
 }
 
 bool matcher_check(matcher *m, char *str, int str_len,
                    bool default_when_unstarted) {
+    return matcher_check_ex(m, 0, str, str_len, default_when_unstarted);
+}
+
+/* Checks str against the patterns, counting hits in the given slot,
+ * which should be the index of the calling thread.
+ */
+bool matcher_check_ex(matcher *m, int slot, char *str, int str_len,
+                      bool default_when_unstarted) {
+    matcher_trie *t;
+    uint64_t *counts;
     bool found = false;
+    int curr;
+    int i;
+
+    cb_assert(m);
+
+    t = atomic_load_ptr(&m->trie);
+    if (t == NULL) {
+        return default_when_unstarted;
+    }
+
+    if (slot < 0 || slot >= t->slots) {
+        slot = 0;
+    }
+
+    counts = t->counts + ((size_t) slot * t->stride);
+
+    /* Every pattern along the path is a prefix of str. */
+
+    curr = t->nodes[0].child;
+
+    for (i = 0; i < str_len && curr >= 0; i++) {
+        unsigned char c = (unsigned char) str[i];
+
+        while (curr >= 0 && t->nodes[curr].c < c) {
+            curr = t->nodes[curr].sibling;
+        }
+
+        if (curr < 0 || t->nodes[curr].c != c) {
+            break;
+        }
+
+        if (t->nodes[curr].pattern >= 0) {
+            counts[t->nodes[curr].pattern]++;
+            found = true;
+        }
+
+        curr = t->nodes[curr].child;
+    }
+
+    if (!found) {
+        counts[t->stride - 1]++;
+    }
+
+    return found;
+}
+
+/* Returns the hits of a pattern, summed across slots, where a pattern
+ * of -1 instead returns the misses.
+ */
+uint64_t matcher_hits(matcher *m, int pattern) {
+    matcher_trie *t;
+    uint64_t rv = 0;
+
     cb_assert(m);
 
     if (m->lock) {
         cb_mutex_enter(m->lock);
     }
 
-    if (m->patterns != NULL && m->patterns_num > 0) {
+    t = m->trie;
+    if (t != NULL &&
+        pattern < m->patterns_num) {
         int i;
-        cb_assert(m->patterns_num <= m->patterns_max);
+        int x = pattern >= 0 ? pattern : t->stride - 1;
 
-        for (i = 0; i < m->patterns_num; i++) {
-            int n;
-            cb_assert(m->patterns);
-            cb_assert(m->lengths);
-            cb_assert(m->hits);
-
-            n = m->lengths[i];
-            if (n <= str_len) {
-                if (strncmp(str, m->patterns[i], n) == 0) {
-                    m->hits[i]++;
-                    found = true;
-                }
-            }
-        }
-
-        if (!found) {
-            m->misses++;
+        for (i = 0; i < t->slots; i++) {
+            rv += t->counts[(size_t) i * t->stride + x];
         }
-    } else {
-        found = default_when_unstarted;
     }
 
     if (m->lock) {
         cb_mutex_exit(m->lock);
     }
 
-    return found;
+    return rv;
 }
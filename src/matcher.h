@@ -7,30 +7,43 @@
 #include <stdbool.h>
 #include <platform/platform.h>
 
+typedef struct matcher_trie matcher_trie;
+
 typedef struct {
-    /* We have a simple implementation currently that */
-    /* only supports simple string prefix matching, O(N^2). */
+    /* We only support simple string prefix matching.  The patterns */
+    /* are compiled by matcher_start() into a trie that's immutable */
+    /* once published, so matcher_check() walks it without locking. */
+    /* The lock only serializes start/stop/clone. */
 
     cb_mutex_t *lock;
 
+    int slots; /* Number of hit counter slots, one per checking thread. */
+
     int patterns_max; /* Size of patterns array, may be 0. */
     int patterns_num; /* Number of active patterns, <= patterns_max. */
     char **patterns;  /* May be NULL. */
-    int   *lengths;   /* May be NULL, same size as patterns array. */
 
-    /* Statistics. */
+    matcher_trie *trie;    /* May be NULL, when unstarted. */
 
-    uint64_t *hits;   /* May be NULL, same size as patterns array. */
-    uint64_t  misses;
+    /* Replaced tries, which a lock-free check might still be walking. */
+    /* When shared, each is stamped with the owner's gen as it's */
+    /* retired, and freed by matcher_reclaim() once every checking */
+    /* thread has passed a quiescent point after that gen. */
+
+    matcher_trie *retired;
+    uint64_t      gen;
 } matcher;
 
-void     matcher_init(matcher *m, bool multithreaded);
+void     matcher_init(matcher *m, int slots);
 void     matcher_start(matcher *m, char *spec);
 bool     matcher_started(matcher *m);
 void     matcher_stop(matcher *m);
 matcher *matcher_clone(matcher *m, matcher *copy);
 bool     matcher_check(matcher *m, char *str, int str_len,
                        bool default_when_unstarted);
+bool     matcher_check_ex(matcher *m, int slot, char *str, int str_len,
+                          bool default_when_unstarted);
+uint64_t matcher_hits(matcher *m, int pattern);
+void     matcher_reclaim(matcher *m, uint64_t gen, uint64_t safe_gen);
 
 #endif /* MATCHER_H */
-
@@ -53,6 +53,9 @@ void     lvb_free_data(mcs_st *ptr);
 bool     lvb_stable_update(mcs_st *curr_version, mcs_st *next_version);
 uint32_t lvb_key_hash(mcs_st *ptr, const char *key, size_t key_length,
                       int *vbucket);
+int      lvb_key_replica(mcs_st *ptr, const char *key, size_t key_length,
+                         int replica, int *vbucket);
+uint32_t lvb_replica_count(mcs_st *ptr);
 void     lvb_server_invalid_vbucket(mcs_st *ptr, int server_index,
                                     int vbucket);
 
@@ -144,6 +147,24 @@ uint32_t mcs_key_hash(mcs_st *ptr, const char *key, size_t key_length,
     return 0;
 }
 
+/* Returns the server index of a key's replica, or -1 if the
+ * server list has no such replica, as with libmemcached.
+ */
+int mcs_key_replica(mcs_st *ptr, const char *key, size_t key_length,
+                    int replica, int *vbucket) {
+    if (ptr->kind == MCS_KIND_LIBVBUCKET) {
+        return lvb_key_replica(ptr, key, key_length, replica, vbucket);
+    }
+    return -1;
+}
+
+uint32_t mcs_replica_count(mcs_st *ptr) {
+    if (ptr->kind == MCS_KIND_LIBVBUCKET) {
+        return lvb_replica_count(ptr);
+    }
+    return 0;
+}
+
 void mcs_server_invalid_vbucket(mcs_st *ptr, int server_index,
                                 int vbucket) {
     if (ptr->kind == MCS_KIND_LIBVBUCKET) {
@@ -300,6 +321,40 @@ uint32_t lvb_key_hash(mcs_st *ptr, const char *key, size_t key_length,
     return (uint32_t) vbucket_get_master(vch, v);
 }
 
+int lvb_key_replica(mcs_st *ptr, const char *key, size_t key_length,
+                    int replica, int *vbucket) {
+    VBUCKET_CONFIG_HANDLE vch;
+    int v;
+
+    cb_assert(ptr->kind == MCS_KIND_LIBVBUCKET);
+    cb_assert(ptr->data != NULL);
+
+    vch = (VBUCKET_CONFIG_HANDLE) ptr->data;
+
+    if (replica < 0 ||
+        replica >= vbucket_config_get_num_replicas(vch)) {
+        return -1;
+    }
+
+    v = vbucket_get_vbucket_by_key(vch, key, key_length);
+    if (vbucket != NULL) {
+        *vbucket = v;
+    }
+
+    return vbucket_get_replica(vch, v, replica);
+}
+
+uint32_t lvb_replica_count(mcs_st *ptr) {
+    int n;
+
+    cb_assert(ptr->kind == MCS_KIND_LIBVBUCKET);
+    cb_assert(ptr->data != NULL);
+
+    n = vbucket_config_get_num_replicas((VBUCKET_CONFIG_HANDLE) ptr->data);
+
+    return n > 0 ? (uint32_t) n : 0;
+}
+
 void lvb_server_invalid_vbucket(mcs_st *ptr, int server_index,
                                 int vbucket) {
     VBUCKET_CONFIG_HANDLE vch;
@@ -56,6 +56,11 @@ mcs_server_st *mcs_server_index(mcs_st *ptr, int i);
 
 uint32_t mcs_key_hash(mcs_st *ptr, const char *key, size_t key_length, int *vbucket);
 
+int mcs_key_replica(mcs_st *ptr, const char *key, size_t key_length,
+                    int replica, int *vbucket);
+
+uint32_t mcs_replica_count(mcs_st *ptr);
+
 void mcs_server_invalid_vbucket(mcs_st *ptr, int server_index, int vbucket);
 
 void mcs_server_st_quit(mcs_server_st *ptr, uint8_t io_death);
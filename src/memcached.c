@@ -13,6 +13,9 @@
  *      Anatoly Vorobey <mellon@pobox.com>
  *      Brad Fitzpatrick <brad@danga.com>
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* For recvmmsg() and sendmmsg(). */
+#endif
 #include "memcached.h"
 #include <sys/stat.h>
 #include <signal.h>
@@ -36,6 +39,7 @@
 #include "agent.h"
 #include "stdin_check.h"
 #include "log.h"
+#include "strscan.h"
 
 int IS_UDP(enum network_transport protocol) {
     return protocol == udp_transport;
@@ -106,6 +110,7 @@ static void set_current_time(void);  /* update the global variable holding
                               (to avoid 64 bit time_t) */
 
 static void conn_free(conn *c);
+static void udp_batch_disown(conn *c);
 
 /** exported globals **/
 struct stats stats;
@@ -136,7 +141,8 @@ conn_funcs conn_funcs_default = {
     .conn_pause                  = NULL,
     .conn_realtime               = realtime,
     .conn_binary_command_magic   = PROTOCOL_BINARY_REQ,
-    .conn_state_change           = NULL
+    .conn_state_change           = NULL,
+    .conn_nread_progress         = NULL
 };
 
 #ifdef MAIN_CHECK
@@ -217,6 +223,7 @@ static void settings_init(void) {
     settings.reqs_per_event = 20;
     settings.backlog = 1024;
     settings.binding_protocol = negotiating_prot;
+    settings.reuseport = false;
 }
 
 /*
@@ -452,6 +459,8 @@ conn *conn_new(const SOCKET sfd, enum conn_states init_state,
     c->write_and_go = init_state;
     c->write_and_free = 0;
     c->item = 0;
+    c->stream_item = 0;
+    c->mux = 0;
 
     c->noreply = false;
 
@@ -466,14 +475,19 @@ conn *conn_new(const SOCKET sfd, enum conn_states init_state,
     c->cmd_start = NULL;
     c->cmd_start_time = 0;
     c->cmd_retries = 0;
+    c->cmd_replica = 0;
     c->corked = NULL;
     c->host_ident = NULL;
     c->peer_host = NULL;
     c->peer_protocol = 0;
     c->peer_port = 0;
     c->update_diag = NULL;
+    c->auth_pending = 0;
+    c->skip_replies = 0;
+    c->close_local = false;
 
     c->extra = extra;
+    c->thread = NULL;
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
@@ -537,6 +551,7 @@ void conn_free(conn *c) {
         MEMCACHED_CONN_DESTROY(c);
         if (c->hdrbuf)
             free(c->hdrbuf);
+        udp_batch_disown(c);
         if (c->msglist)
             free(c->msglist);
         if (c->rbuf)
@@ -667,7 +682,8 @@ const char *state_text(enum conn_states state) {
                                        "conn_closing",
                                        "conn_mwrite",
                                        "conn_pause",
-                                       "conn_connecting" };
+                                       "conn_connecting",
+                                       "conn_authenticating" };
     return statenames[state];
 }
 
@@ -870,9 +886,7 @@ void complete_nread_ascii(conn *c) {
     int comm = c->cmd;
     enum store_item_type ret;
 
-    cb_mutex_enter(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
-    cb_mutex_exit(&c->thread->stats.mutex);
+    THREAD_STATS_ADD(c->thread, slab_stats[it->slabs_clsid].set_cmds, 1);
 
     if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
         out_string(c, "CLIENT_ERROR bad data chunk");
@@ -1181,13 +1195,11 @@ static void complete_incr_bin(conn *c) {
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, 0);
     } else {
 
-        cb_mutex_enter(&c->thread->stats.mutex);
         if (c->cmd == PROTOCOL_BINARY_CMD_INCREMENT) {
-            c->thread->stats.incr_misses++;
+            THREAD_STATS_ADD(c->thread, incr_misses, 1);
         } else {
-            c->thread->stats.decr_misses++;
+            THREAD_STATS_ADD(c->thread, decr_misses, 1);
         }
-        cb_mutex_exit(&c->thread->stats.mutex);
 
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
     }
@@ -1200,9 +1212,7 @@ static void complete_update_bin(conn *c) {
 
     item *it = c->item;
 
-    cb_mutex_enter(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[it->slabs_clsid].set_cmds++;
-    cb_mutex_exit(&c->thread->stats.mutex);
+    THREAD_STATS_ADD(c->thread, slab_stats[it->slabs_clsid].set_cmds, 1);
 
     /* We don't actually receive the trailing two characters in the bin
      * protocol, so we're going to just set them here */
@@ -1285,10 +1295,8 @@ static void process_bin_get(conn *c) {
         uint16_t keylen = 0;
         uint32_t bodylen = sizeof(rsp->message.body) + (it->nbytes - 2);
 
-        cb_mutex_enter(&c->thread->stats.mutex);
-        c->thread->stats.get_cmds++;
-        c->thread->stats.slab_stats[it->slabs_clsid].get_hits++;
-        cb_mutex_exit(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread, get_cmds, 1);
+        THREAD_STATS_ADD(c->thread, slab_stats[it->slabs_clsid].get_hits, 1);
 
         MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
                               it->nbytes, ITEM_get_cas(it));
@@ -1316,10 +1324,8 @@ static void process_bin_get(conn *c) {
         /* Remember this command so we can garbage collect it later */
         c->item = it;
     } else {
-        cb_mutex_enter(&c->thread->stats.mutex);
-        c->thread->stats.get_cmds++;
-        c->thread->stats.get_misses++;
-        cb_mutex_exit(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread, get_cmds, 1);
+        THREAD_STATS_ADD(c->thread, get_misses, 1);
 
         MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
 
@@ -1921,9 +1927,7 @@ static void process_bin_flush(conn *c) {
     }
     item_flush_expired();
 
-    cb_mutex_enter(&c->thread->stats.mutex);
-    c->thread->stats.flush_cmds++;
-    cb_mutex_exit(&c->thread->stats.mutex);
+    THREAD_STATS_ADD(c->thread, flush_cmds, 1);
 
     write_bin_response(c, NULL, 0, 0, 0);
 }
@@ -2049,24 +2053,18 @@ enum store_item_type do_store_item(item *it, int comm, conn *c) {
         if(old_it == NULL) {
             /* LRU expired */
             stored = NOT_FOUND;
-            cb_mutex_enter(&c->thread->stats.mutex);
-            c->thread->stats.cas_misses++;
-            cb_mutex_exit(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread, cas_misses, 1);
         }
         else if (ITEM_get_cas(it) == ITEM_get_cas(old_it)) {
             /* cas validates */
             /* it and old_it may belong to different classes. */
             /* I'm updating the stats for the one that's getting pushed out */
-            cb_mutex_enter(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[old_it->slabs_clsid].cas_hits++;
-            cb_mutex_exit(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread, slab_stats[old_it->slabs_clsid].cas_hits, 1);
 
             item_replace(old_it, it);
             stored = STORED;
         } else {
-            cb_mutex_enter(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[old_it->slabs_clsid].cas_badval++;
-            cb_mutex_exit(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread, slab_stats[old_it->slabs_clsid].cas_badval, 1);
 
             if(settings.verbose > 1) {
                 moxi_log_write("CAS:  failure: expected %llu, got %llu\n",
@@ -2175,25 +2173,20 @@ size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens)
 
     cb_assert(command != NULL && tokens != NULL && max_tokens > 1);
 
-    for (s = e = command; ntokens < max_tokens - 1; ++e) {
-        if (*e == ' ') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-                *e = '\0';
-            }
-            s = e + 1;
+    s = e = command;
+    while (ntokens < max_tokens - 1) {
+        s = strscan_skip_spaces(s);
+        e = strscan_token_end(s);
+        if (s != e) {
+            tokens[ntokens].value = s;
+            tokens[ntokens].length = e - s;
+            ntokens++;
         }
-        else if (*e == '\0') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-            }
-
+        if (*e == '\0') {
             break; /* string end */
         }
+        *e = '\0';
+        s = ++e;
     }
 
     /*
@@ -2382,6 +2375,11 @@ void server_stats(ADD_STAT add_stats, void *c, const char *prefix) {
     APPEND_PREFIX_STAT("listen_disabled_num", "%llu", (unsigned long long)stats.listen_disabled_num);
     APPEND_PREFIX_STAT("threads", "%d", settings.num_threads);
     APPEND_PREFIX_STAT("conn_yields", "%llu", (unsigned long long)thread_stats.conn_yields);
+    APPEND_PREFIX_STAT("log_dropped", "%llu", (unsigned long long)log_error_dropped());
+    APPEND_PREFIX_STAT("udp_recv_batches", "%llu", (unsigned long long)thread_stats.udp_recv_batches);
+    APPEND_PREFIX_STAT("udp_recv_msgs", "%llu", (unsigned long long)thread_stats.udp_recv_msgs);
+    APPEND_PREFIX_STAT("udp_send_batches", "%llu", (unsigned long long)thread_stats.udp_send_batches);
+    APPEND_PREFIX_STAT("udp_send_msgs", "%llu", (unsigned long long)thread_stats.udp_send_msgs);
 
     STATS_UNLOCK();
 }
@@ -2505,13 +2503,11 @@ static void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool r
             nkey = key_token->length;
 
             if(nkey > KEY_MAX_LENGTH) {
-                cb_mutex_enter(&c->thread->stats.mutex);
-                c->thread->stats.get_cmds   += stats_get_cmds;
-                c->thread->stats.get_misses += stats_get_misses;
+                THREAD_STATS_ADD(c->thread, get_cmds, stats_get_cmds);
+                THREAD_STATS_ADD(c->thread, get_misses, stats_get_misses);
                 for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-                    c->thread->stats.slab_stats[sid].get_hits += stats_get_hits[sid];
+                    THREAD_STATS_ADD(c->thread, slab_stats[sid].get_hits, stats_get_hits[sid]);
                 }
-                cb_mutex_exit(&c->thread->stats.mutex);
                 out_string(c, "CLIENT_ERROR bad command line format");
                 return;
             }
@@ -2560,13 +2556,11 @@ static void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool r
 
                   suffix = cache_alloc(c->thread->suffix_cache);
                   if (suffix == NULL) {
-                    cb_mutex_enter(&c->thread->stats.mutex);
-                    c->thread->stats.get_cmds   += stats_get_cmds;
-                    c->thread->stats.get_misses += stats_get_misses;
+                    THREAD_STATS_ADD(c->thread, get_cmds, stats_get_cmds);
+                    THREAD_STATS_ADD(c->thread, get_misses, stats_get_misses);
                     for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-                        c->thread->stats.slab_stats[sid].get_hits += stats_get_hits[sid];
+                        THREAD_STATS_ADD(c->thread, slab_stats[sid].get_hits, stats_get_hits[sid]);
                     }
-                    cb_mutex_exit(&c->thread->stats.mutex);
                     out_string(c, "SERVER_ERROR out of memory making CAS suffix");
                     item_remove(it);
                     return;
@@ -2652,13 +2646,11 @@ static void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool r
         c->msgcurr = 0;
     }
 
-    cb_mutex_enter(&c->thread->stats.mutex);
-    c->thread->stats.get_cmds   += stats_get_cmds;
-    c->thread->stats.get_misses += stats_get_misses;
+    THREAD_STATS_ADD(c->thread, get_cmds, stats_get_cmds);
+    THREAD_STATS_ADD(c->thread, get_misses, stats_get_misses);
     for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-        c->thread->stats.slab_stats[sid].get_hits += stats_get_hits[sid];
+        THREAD_STATS_ADD(c->thread, slab_stats[sid].get_hits, stats_get_hits[sid]);
     }
-    cb_mutex_exit(&c->thread->stats.mutex);
 
     return;
 }
@@ -2771,13 +2763,11 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
 
     it = item_get(key, nkey);
     if (!it) {
-        cb_mutex_enter(&c->thread->stats.mutex);
         if (incr) {
-            c->thread->stats.incr_misses++;
+            THREAD_STATS_ADD(c->thread, incr_misses, 1);
         } else {
-            c->thread->stats.decr_misses++;
+            THREAD_STATS_ADD(c->thread, decr_misses, 1);
         }
-        cb_mutex_exit(&c->thread->stats.mutex);
 
         out_string(c, "NOT_FOUND");
         return;
@@ -2832,13 +2822,11 @@ enum delta_result_type do_add_delta(conn *c, item *it, const bool incr,
         MEMCACHED_COMMAND_DECR(c->sfd, ITEM_key(it), it->nkey, value);
     }
 
-    cb_mutex_enter(&c->thread->stats.mutex);
     if (incr) {
-        c->thread->stats.slab_stats[it->slabs_clsid].incr_hits++;
+        THREAD_STATS_ADD(c->thread, slab_stats[it->slabs_clsid].incr_hits, 1);
     } else {
-        c->thread->stats.slab_stats[it->slabs_clsid].decr_hits++;
+        THREAD_STATS_ADD(c->thread, slab_stats[it->slabs_clsid].decr_hits, 1);
     }
-    cb_mutex_exit(&c->thread->stats.mutex);
 
     snprintf(buf, INCR_MAX_STORAGE_LEN, "%llu", (unsigned long long)value);
     res = (int)strlen(buf);
@@ -2889,17 +2877,13 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
     if (it) {
         MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
 
-        cb_mutex_enter(&c->thread->stats.mutex);
-        c->thread->stats.slab_stats[it->slabs_clsid].delete_hits++;
-        cb_mutex_exit(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread, slab_stats[it->slabs_clsid].delete_hits, 1);
 
         item_unlink(it);
         item_remove(it);      /* release our reference */
         out_string(c, "DELETED");
     } else {
-        cb_mutex_enter(&c->thread->stats.mutex);
-        c->thread->stats.delete_misses++;
-        cb_mutex_exit(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread, delete_misses, 1);
 
         out_string(c, "NOT_FOUND");
     }
@@ -2998,9 +2982,7 @@ void process_command(conn *c, char *command) {
 
         set_noreply_maybe(c, tokens, ntokens);
 
-        cb_mutex_enter(&c->thread->stats.mutex);
-        c->thread->stats.flush_cmds++;
-        cb_mutex_exit(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread, flush_cmds, 1);
 
         if(ntokens == (c->noreply ? 3 : 2)) {
             settings.oldest_live = current_time - 1;
@@ -3261,6 +3243,128 @@ int try_read_command(conn *c) {
     return 1;
 }
 
+#ifdef HAVE_RECVMMSG
+/*
+ * The datagrams drained by one recvmmsg(), which the state machine
+ * then takes one at a time, as if each came from its own recvfrom().
+ * There's one per worker thread, as its UDP conns take turns reading,
+ * and it's refilled only once its owner has taken every datagram.
+ */
+struct udp_batch {
+    conn *owner; /* the conn whose socket the datagrams came from */
+    int count; /* datagrams received */
+    int next;  /* next datagram to hand out, <= count */
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    struct sockaddr addrs[UDP_BATCH_SIZE];
+    char bufs[UDP_BATCH_SIZE][UDP_READ_BUFFER_SIZE];
+};
+#endif
+
+/*
+ * True if a UDP conn has received datagrams that it hasn't yet
+ * processed, and so shouldn't wait on the socket for more.
+ */
+static bool udp_batch_pending(conn *c) {
+#ifdef HAVE_RECVMMSG
+    struct udp_batch *b = c->thread != NULL ? c->thread->udp_batch : NULL;
+
+    return b != NULL &&
+           b->owner == c &&
+           b->next < b->count;
+#else
+    (void)c;
+    return false;
+#endif
+}
+
+/*
+ * Drops any datagrams a going-away conn left in its thread's batch.
+ */
+static void udp_batch_disown(conn *c) {
+#ifdef HAVE_RECVMMSG
+    struct udp_batch *b = c->thread != NULL ? c->thread->udp_batch : NULL;
+
+    if (b != NULL && b->owner == c) {
+        b->owner = NULL;
+        b->count = 0;
+        b->next = 0;
+    }
+#else
+    (void)c;
+#endif
+}
+
+/*
+ * Copies the next UDP datagram into c->rbuf, refilling the thread's
+ * batch with a single recvmmsg() when it's empty.  Falls back to
+ * recvfrom() when there's no batch, or while it holds another conn's
+ * datagrams.
+ * @return the datagram length, or -1 if none
+ */
+static int udp_recv(conn *c) {
+#ifdef HAVE_RECVMMSG
+    struct udp_batch *b = NULL;
+    int i;
+    int len;
+
+    if (c->thread != NULL) {
+        b = c->thread->udp_batch;
+        if (b == NULL) {
+            b = c->thread->udp_batch =
+                (struct udp_batch *)calloc(1, sizeof(*b));
+        }
+    }
+
+    if (b != NULL && b->owner != c && b->next < b->count) {
+        b = NULL;
+    }
+
+    if (b != NULL) {
+        if (b->next >= b->count) {
+            for (i = 0; i < UDP_BATCH_SIZE; i++) {
+                b->iovs[i].iov_base = b->bufs[i];
+                b->iovs[i].iov_len = sizeof(b->bufs[i]);
+
+                memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+                b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+                b->msgs[i].msg_hdr.msg_iovlen = 1;
+                b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+                b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+            }
+
+            b->owner = c;
+            b->next = 0;
+            b->count = recvmmsg(c->sfd, b->msgs, UDP_BATCH_SIZE, 0, NULL);
+            if (b->count <= 0) {
+                b->count = 0;
+                return -1;
+            }
+
+            THREAD_STATS_ADD(c->thread, udp_recv_batches, 1);
+            THREAD_STATS_ADD(c->thread, udp_recv_msgs, b->count);
+        }
+
+        i = b->next++;
+
+        len = (int)b->msgs[i].msg_len;
+        if (len > c->rsize) {
+            len = c->rsize;
+        }
+        memcpy(c->rbuf, b->bufs[i], len);
+
+        c->request_addr = b->addrs[i];
+        c->request_addr_size = b->msgs[i].msg_hdr.msg_namelen;
+
+        return len;
+    }
+#endif
+
+    c->request_addr_size = sizeof(c->request_addr);
+    return recvfrom(c->sfd, c->rbuf, c->rsize,
+                    0, &c->request_addr, &c->request_addr_size);
+}
+
 /*
  * read a UDP request.
  */
@@ -3269,15 +3373,11 @@ static enum try_read_result try_read_udp(conn *c) {
 
     cb_assert(c != NULL);
 
-    c->request_addr_size = sizeof(c->request_addr);
-    res = recvfrom(c->sfd, c->rbuf, c->rsize,
-                   0, &c->request_addr, &c->request_addr_size);
+    res = udp_recv(c);
     if (res > 8) {
         unsigned char *buf = (unsigned char *)c->rbuf;
 
-        cb_mutex_enter(&c->thread->stats.mutex);
-        c->thread->stats.bytes_read += res;
-        cb_mutex_exit(&c->thread->stats.mutex);
+        THREAD_STATS_ADD(c->thread, bytes_read, res);
 
         add_bytes_read(c, res);
 
@@ -3339,9 +3439,7 @@ static enum try_read_result try_read_network(conn *c) {
         cb_assert(avail > 0);
         res = recv(c->sfd, c->rbuf + c->rbytes, avail, 0);
         if (res > 0) {
-            cb_mutex_enter(&c->thread->stats.mutex);
-            c->thread->stats.bytes_read += res;
-            cb_mutex_exit(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread, bytes_read, res);
 
             add_bytes_read(c, res);
 
@@ -3433,6 +3531,58 @@ void do_accept_new_conns(const bool do_accept) {
  *   TRANSMIT_SOFT_ERROR Can't write any more right now.
  *   TRANSMIT_HARD_ERROR Can't write (c->state is set to conn_closing)
  */
+#ifdef HAVE_SENDMMSG
+/*
+ * Sends up to UDP_BATCH_SIZE of a UDP reply's remaining datagrams
+ * with one sendmmsg().  A datagram goes out whole or not at all, so
+ * each sent msg is simply marked done.
+ */
+static enum transmit_result transmit_udp_batch(conn *c) {
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    int n = c->msgused - c->msgcurr;
+    int res;
+    int i;
+
+    if (n > UDP_BATCH_SIZE) {
+        n = UDP_BATCH_SIZE;
+    }
+
+    for (i = 0; i < n; i++) {
+        msgs[i].msg_hdr = c->msglist[c->msgcurr + i];
+        msgs[i].msg_len = 0;
+    }
+
+    res = sendmmsg(c->sfd, msgs, n, 0);
+    if (res > 0) {
+        THREAD_STATS_ADD(c->thread, udp_send_batches, 1);
+        THREAD_STATS_ADD(c->thread, udp_send_msgs, res);
+
+        for (i = 0; i < res; i++) {
+            THREAD_STATS_ADD(c->thread, bytes_written, msgs[i].msg_len);
+            c->msglist[c->msgcurr + i].msg_iovlen = 0;
+        }
+        c->msgcurr += res;
+        return TRANSMIT_INCOMPLETE;
+    }
+
+    if (res == -1 && is_blocking(errno)) {
+        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+            if (settings.verbose > 0)
+                moxi_log_write("Couldn't update event\n");
+            conn_set_state(c, conn_closing);
+            return TRANSMIT_HARD_ERROR;
+        }
+        return TRANSMIT_SOFT_ERROR;
+    }
+
+    if (settings.verbose > 0)
+        perror("Failed to write, and not due to blocking");
+
+    conn_set_state(c, conn_read);
+    return TRANSMIT_HARD_ERROR;
+}
+#endif
+
 static enum transmit_result transmit(conn *c) {
     cb_assert(c != NULL);
 
@@ -3441,6 +3591,11 @@ static enum transmit_result transmit(conn *c) {
         /* Finished writing the current msg; advance to the next. */
         c->msgcurr++;
     }
+#ifdef HAVE_SENDMMSG
+    if (IS_UDP(c->transport) && c->msgused - c->msgcurr > 1) {
+        return transmit_udp_batch(c);
+    }
+#endif
     if (c->msgcurr < c->msgused) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
@@ -3457,9 +3612,7 @@ static enum transmit_result transmit(conn *c) {
         error = errno;
 #endif
         if (res > 0) {
-            cb_mutex_enter(&c->thread->stats.mutex);
-            c->thread->stats.bytes_written += res;
-            cb_mutex_exit(&c->thread->stats.mutex);
+            THREAD_STATS_ADD(c->thread, bytes_written, res);
 
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
@@ -3552,15 +3705,28 @@ void drive_machine(conn *c) {
                 break;
             }
 
-            dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
-                              DATA_BUFFER_SIZE,
-                              c->protocol,
-                              tcp_transport,
-                              c->funcs, c->extra);
+            /* A worker's own SO_REUSEPORT listener keeps its */
+            /* accepted conns, rather than dispatching them. */
+
+            if (c->thread != NULL) {
+                dispatch_conn_new_local(c->thread, sfd, conn_new_cmd,
+                                        EV_READ | EV_PERSIST,
+                                        DATA_BUFFER_SIZE,
+                                        c->protocol,
+                                        tcp_transport,
+                                        c->funcs, c->extra);
+            } else {
+                dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                                  DATA_BUFFER_SIZE,
+                                  c->protocol,
+                                  tcp_transport,
+                                  c->funcs, c->extra);
+            }
             stop = true;
             break;
 
         case conn_connecting:
+        case conn_authenticating:
             if (c->funcs->conn_connect != NULL) {
                 if (c->funcs->conn_connect(c) == true) {
                     stop = true;
@@ -3580,7 +3746,12 @@ void drive_machine(conn *c) {
             }
 
             conn_set_state(c, conn_read);
-            stop = true;
+
+            /* Datagrams already received won't wake us again. */
+
+            if (!udp_batch_pending(c)) {
+                stop = true;
+            }
             break;
 
         case conn_read:
@@ -3618,10 +3789,8 @@ void drive_machine(conn *c) {
             if (IS_DOWNSTREAM(c->protocol) || nreqs >= 0) {
                 reset_cmd_handler(c);
             } else {
-                cb_mutex_enter(&c->thread->stats.mutex);
-                c->thread->stats.conn_yields++;
-                cb_mutex_exit(&c->thread->stats.mutex);
-                if (c->rbytes > 0) {
+                THREAD_STATS_ADD(c->thread, conn_yields, 1);
+                if (c->rbytes > 0 || udp_batch_pending(c)) {
                     /* We have already read in data into the input buffer,
                        so libevent will most likely not signal read events
                        on the socket (unless more data is available. As a
@@ -3690,6 +3859,9 @@ void drive_machine(conn *c) {
                     conn_set_state(c, conn_closing);
                     break;
                 }
+                if (c->funcs->conn_nread_progress != NULL) {
+                    c->funcs->conn_nread_progress(c);
+                }
                 stop = true;
                 break;
             }
@@ -3730,9 +3902,7 @@ void drive_machine(conn *c) {
 #endif
 
             if (res > 0) {
-                cb_mutex_enter(&c->thread->stats.mutex);
-                c->thread->stats.bytes_read += res;
-                cb_mutex_exit(&c->thread->stats.mutex);
+                THREAD_STATS_ADD(c->thread, bytes_read, res);
                 add_bytes_read(c, res);
                 c->sbytes -= res;
                 break;
@@ -3856,9 +4026,7 @@ void drive_machine(conn *c) {
 
 void add_bytes_read(conn *c, int bytes_read) {
     cb_assert(c != NULL);
-    cb_mutex_enter(&c->thread->stats.mutex);
-    c->thread->stats.bytes_read += bytes_read;
-    cb_mutex_exit(&c->thread->stats.mutex);
+    THREAD_STATS_ADD(c->thread, bytes_read, bytes_read);
 }
 
 static void event_handler(evutil_socket_t fd, short which, void *arg) {
@@ -4094,6 +4262,135 @@ int server_socket(int port, enum network_transport transport,
     return success == 0;
 }
 
+#ifdef SO_REUSEPORT
+/*
+ * Creates a listening TCP socket on ai that shares its port with
+ * the other workers' listeners through SO_REUSEPORT.
+ */
+static SOCKET new_socket_reuseport(struct addrinfo *ai) {
+    struct linger ling = {0, 0};
+    int flags = 1;
+    SOCKET sfd;
+
+    if ((sfd = new_socket(ai)) == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+
+#ifdef IPV6_V6ONLY
+    if (ai->ai_family == AF_INET6 &&
+        setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags)) != 0) {
+        closesocket(sfd);
+        return INVALID_SOCKET;
+    }
+#endif
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags)) != 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        closesocket(sfd);
+        return INVALID_SOCKET;
+    }
+
+    if (setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags)) != 0)
+        perror("setsockopt");
+    if (setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling)) != 0)
+        perror("setsockopt");
+    if (setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags)) != 0)
+        perror("setsockopt");
+
+    if (bind(sfd, ai->ai_addr, ai->ai_addrlen) == SOCKET_ERROR ||
+        listen(sfd, settings.backlog) == SOCKET_ERROR) {
+        closesocket(sfd);
+        return INVALID_SOCKET;
+    }
+
+    return sfd;
+}
+#endif
+
+/**
+ * Like server_socket(), but gives each worker thread its own
+ * listener on port, through SO_REUSEPORT, so the kernel spreads
+ * new conns across the workers, which accept them themselves.
+ * Returns the number of listeners, or 0 if that isn't possible,
+ * in which case the caller should fall back to server_socket().
+ */
+int server_socket_workers(int port, enum network_transport transport,
+                          enum protocol prot,
+                          conn_funcs *funcs, void *extra) {
+#ifdef SO_REUSEPORT
+    struct addrinfo *ai;
+    struct addrinfo *next;
+    struct addrinfo hints = { .ai_flags = AI_PASSIVE,
+                              .ai_family = AF_UNSPEC };
+    char port_buf[NI_MAXSERV];
+    int nworkers = settings.num_threads - 1;
+    int listening = 0;
+    SOCKET *sfds;
+
+    if (port <= 0 ||
+        nworkers <= 0 ||
+        IS_UDP(transport)) {
+        return 0;
+    }
+
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf(port_buf, sizeof(port_buf), "%d", port);
+    if (getaddrinfo(settings.inter, port_buf, &hints, &ai) != 0) {
+        return 0;
+    }
+
+    sfds = calloc(nworkers, sizeof(SOCKET));
+    if (sfds == NULL) {
+        freeaddrinfo(ai);
+        return 0;
+    }
+
+    for (next = ai; next; next = next->ai_next) {
+        int n;
+
+        /* Either every worker gets a listener on an address, or */
+        /* none do, so no worker is left out of the spread. */
+
+        for (n = 0; n < nworkers; n++) {
+            sfds[n] = new_socket_reuseport(next);
+            if (sfds[n] == INVALID_SOCKET) {
+                break;
+            }
+        }
+
+        if (n < nworkers) {
+            while (n-- > 0) {
+                closesocket(sfds[n]);
+            }
+            continue;
+        }
+
+        for (n = 0; n < nworkers; n++) {
+            dispatch_conn_new_to_thread(n + 1, sfds[n], conn_listening,
+                                        EV_READ | EV_PERSIST, 1,
+                                        prot, transport, funcs, extra);
+            listening++;
+        }
+    }
+
+    free(sfds);
+    freeaddrinfo(ai);
+
+    return listening;
+#else
+    (void)port;
+    (void)transport;
+    (void)prot;
+    (void)funcs;
+    (void)extra;
+
+    return 0;
+#endif
+}
+
 static SOCKET new_socket_unix(void) {
     SOCKET sfd;
 
@@ -4272,6 +4569,9 @@ static void usage(char **argv) {
            "              starvation (default: 20)\n");
     printf("-b            set the backlog queue limit (default: 1024)\n");
     printf("-B            binding protocol - one of ascii, binary, or auto (default)\n");
+    printf("-A            accept proxy connections on every worker thread, each\n"
+           "              with its own SO_REUSEPORT listener, instead of only on\n"
+           "              the dispatch thread\n");
     printf("-Y <y|n>      exit when stdin closes (default: n)\n");
 #ifdef HAVE_SYS_UN_H
     printf("-s <file>     UNIX socket path to listen on (disables network support)\n");
@@ -4345,6 +4645,32 @@ static void usage(char **argv) {
            b->auth_timeout.tv_usec / 1000);
     printf("      Millisecs before moxi will timeout a SASL auth attempt.\n"
            "      0 means no timeout.\n");
+    printf("  multiget_squash=%d\n", b->multiget_squash);
+    printf("      When 1, concurrent ascii gets from different clients that are\n"
+           "      waiting for a downstream are squashed into one downstream\n"
+           "      request, de-duplicating their keys.  0 means no squashing.\n");
+    printf("  multiget_batch_max=%d\n", b->multiget_batch_max);
+    printf("      Max number of waiting single-key ascii gets, whose keys live on\n"
+           "      the same server, that are batched into one downstream request.\n"
+           "      0 or 1 means no batching.\n");
+    printf("  multiget_batch_delay=%ld\n",
+           b->multiget_batch_delay.tv_sec * 1000 +
+           b->multiget_batch_delay.tv_usec / 1000);
+    printf("      Millisecs a single-key get may wait for more gets to batch\n"
+           "      with, when multiget_batch_max is on.  0 means no waiting.\n");
+    printf("  replica_read=%d\n", b->replica_read);
+    printf("      When 1, a single-key get whose vbucket master times out, is\n"
+           "      unreachable or keeps answering not-my-vbucket is re-issued\n"
+           "      to the vbucket's replicas, in order.  0 means no replica reads.\n");
+    printf("  hedge_max_pct=%d\n", b->hedge_max_pct);
+    printf("      Max percentage of single-key ascii gets that may also be sent\n"
+           "      to the key's first replica when slow, with the first answer\n"
+           "      going to the client.  0 means no hedging.\n");
+    printf("  hedge_delay=%ld\n",
+           b->hedge_delay.tv_sec * 1000 +
+           b->hedge_delay.tv_usec / 1000);
+    printf("      Millisecs to wait for an answer before hedging a get.  0 means\n"
+           "      use the observed p95 downstream time, which needs time_stats.\n");
     printf("  connect_max_errors=%d\n", b->connect_max_errors);
     printf("      Max number of errors per host:port:bucket per worker thread\n"
            "      before moxi blacklists an unresponsive host:port:bucket.\n"
@@ -4353,11 +4679,34 @@ static void usage(char **argv) {
     printf("      Millisecs that a host:port:bucket will be blacklisted\n"
            "      before moxi tries again to contact the host:port:bucket.\n"
            "      0 means blacklisting is disabled.\n");
+    printf("  breaker_max_failures=%u\n", b->breaker_max_failures);
+    printf("      Number of failed or slow requests in a row, per\n"
+           "      host:port:bucket per worker thread, before moxi ejects the\n"
+           "      host:port:bucket and fails requests to it fast.\n"
+           "      0 means ejection is disabled.\n");
+    printf("  breaker_slow_time=%u\n", b->breaker_slow_time);
+    printf("      Millisecs after which a request counts as failed for\n"
+           "      ejection.  0 means only errors and timeouts count.\n");
+    printf("  breaker_eject_time=%u\n", b->breaker_eject_time);
+    printf("      Millisecs that an ejected host:port:bucket is failed fast\n"
+           "      before moxi lets one probe request through to it.\n");
+    printf("  item_cache_max=%u\n", b->item_cache_max);
+    printf("      Max bytes of freed items that each worker thread keeps\n"
+           "      for reuse, to avoid malloc/free of proxied values.\n"
+           "      0 means items are always malloc'ed and freed.\n");
+    printf("  cut_through_min=%u\n", b->cut_through_min);
+    printf("      Min bytes of a get value before moxi starts writing it to\n"
+           "      clients while it's still arriving from the downstream server.\n"
+           "      0 means values are always read fully before being written.\n");
     printf("  downstream_conn_max=%d\n", b->downstream_conn_max);
     printf("      Max number of downstream conns moxi will open per worker thread\n"
            "      to a host:port:bucket.  If downstream_conn_max is reached,\n"
            "      requests go onto the tail of a downstream conn queue.\n"
            "      0 means no limit.\n");
+    printf("  downstream_conn_mux=%d\n", b->downstream_conn_mux);
+    printf("      Max number of simple binary requests moxi will have in flight\n"
+           "      at once on one shared downstream conn per worker thread to a\n"
+           "      host:port:bucket.  0 means downstream conns are not shared.\n");
     printf("  downstream_conn_queue_timeout=%ld\n",
            b->downstream_conn_queue_timeout.tv_sec * 1000 +
            b->downstream_conn_queue_timeout.tv_usec / 1000);
@@ -4717,6 +5066,7 @@ int main (int argc, char **argv) {
           "Y:"  /* exit when stdin closes, for windows compatibility */
           "O:"  /* log file name */
           "X"   /* run in mcmux compatiblity mode */
+          "A"   /* accept on every worker, with SO_REUSEPORT */
         ))) {
         switch (c) {
         case 'a':
@@ -4859,6 +5209,9 @@ int main (int argc, char **argv) {
         case 'X' :
             settings.enable_mcmux_mode = true;
             break;
+        case 'A' :
+            settings.reuseport = true;
+            break;
 
         default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
@@ -4985,6 +5338,13 @@ int main (int argc, char **argv) {
     }
 #endif
 
+#ifndef MAIN_CHECK
+    /* The logger thread wouldn't survive daemonize()'s fork. */
+    if (log_error_start(ml) != 0) {
+        moxi_log_write("failed to start the logger thread, logging synchronously\n");
+    }
+#endif
+
     /* lock paged memory if needed */
     if (lock_memory) {
 #ifdef HAVE_MLOCKALL
@@ -15,6 +15,7 @@
 #include <platform/platform.h>
 
 #include "work.h"
+#include "atomics.h"
 #include "genhash.h"
 
 #include "protocol_binary.h"
@@ -30,6 +31,7 @@
 #define UDP_READ_BUFFER_SIZE 65536
 #define UDP_MAX_PAYLOAD_SIZE 1400
 #define UDP_HEADER_SIZE 8
+#define UDP_BATCH_SIZE 16 /* Datagrams per recvmmsg() or sendmmsg(). */
 #define MAX_SENDBUF_SIZE (256 * 1024 * 1024)
 
 /* Port values */
@@ -155,6 +157,7 @@ enum conn_states {
     conn_mwrite,     /**< writing out many items sequentially */
     conn_pause,      /**< waiting for asynchronous event */
     conn_connecting, /**< the socket is in connecting state*/
+    conn_authenticating, /**< waiting for downstream auth/bucket replies */
     conn_max_state   /**< Max state value (used for assertion) */
 };
 
@@ -234,10 +237,11 @@ struct slab_stats {
 };
 
 /**
- * Stats stored per-thread.
+ * Stats stored per-thread.  Each is only written by its owning
+ * thread, with THREAD_STATS_ADD(), and read by other threads with
+ * THREAD_STATS_GET(), so neither side takes a lock.
  */
 struct thread_stats {
-    cb_mutex_t        mutex;
     uint64_t          get_cmds;
     uint64_t          get_misses;
     uint64_t          delete_misses;
@@ -248,9 +252,23 @@ struct thread_stats {
     uint64_t          bytes_written;
     uint64_t          flush_cmds;
     uint64_t          conn_yields; /* # of yields for connections (-R option)*/
+    uint64_t          udp_recv_batches; /* # of recvmmsg() calls that got data */
+    uint64_t          udp_recv_msgs;
+    uint64_t          udp_send_batches; /* # of sendmmsg() calls that sent data */
+    uint64_t          udp_send_msgs;
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
 };
 
+/* A single writer needs no locked add, only a load and store that */
+/* can't tear, so a concurrent reader sees either the old or new value. */
+
+#define THREAD_STATS_GET(v) atomic_load_u64_relaxed(&(v))
+#define THREAD_STATS_SET(v, n) atomic_store_u64_relaxed(&(v), (n))
+
+#define THREAD_STATS_ADD(t, field, n) \
+    THREAD_STATS_SET((t)->stats.field, \
+                     THREAD_STATS_GET((t)->stats.field) + (n))
+
 /**
  * Global stats.
  */
@@ -310,6 +328,7 @@ struct settings {
     enum protocol binding_protocol;
     int backlog;
     bool enable_mcmux_mode; /* enable mcmux compatiblity mode, disables libvbucket/libmemcached support */
+    bool reuseport;         /* each worker accepts on its own SO_REUSEPORT listener */
 };
 
 extern struct stats stats;
@@ -352,17 +371,37 @@ struct bin_cmd {
     bin_cmd *next;
 };
 
+/* Power of two size classes, from ITEM_CACHE_SIZE_MIN up, that */
+/* MOXI_ITEM_MALLOC items are rounded up to so they can be reused. */
+
+#define ITEM_CACHE_SIZE_MIN 128
+#define ITEM_CACHE_CLASSES  7
+
+/**
+ * Per-thread freelists of items, to skip malloc/free for the values
+ * that moxi proxies when MOXI_ITEM_MALLOC is defined.  Only touched
+ * by the owning thread, except for racy reads of the stats.
+ */
+typedef struct {
+    item    *free[ITEM_CACHE_CLASSES]; /* Chained through item->next. */
+    uint64_t bytes;     /* Bytes held on the freelists. */
+    uint64_t hits;      /* Allocations served from a freelist. */
+    uint64_t misses;    /* Cachable allocations that had to malloc. */
+    uint64_t overflows; /* Frees that went to free(), as the lists were full. */
+} item_cache;
+
 typedef struct {
     cb_thread_t thread_id;        /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
-    struct event notify_event;  /* listen event for notify pipe */
-    SOCKET notify_receive_fd;      /* receiving end of notify pipe */
-    SOCKET notify_send_fd;         /* sending end of notify pipe */
     struct thread_stats stats;  /* Stats generated by this thread */
-    struct conn_queue *new_conn_queue; /* queue of new connections to handle */
+    struct thread_stats stats_reset; /* stats as of the last stats reset */
     cache_t *suffix_cache;      /* suffix cache */
-    work_queue *work_queue;
+    work_queue *work_queue;     /* new connections and cross-thread work */
     genhash_t *conn_hash;       /* per thread connection hash, keyed by host_ident */
+    item_cache item_cache;      /* per thread freelists of malloc'ed items */
+    struct conn *listen_conn;   /* SO_REUSEPORT listeners this thread accepts on */
+    int listen_paused;          /* Set while listen_conn is paused, out of fds */
+    struct udp_batch *udp_batch; /* recvmmsg() buffers, shared by this thread's UDP conns */
 } LIBEVENT_THREAD;
 
 /**
@@ -383,6 +422,7 @@ struct conn_funcs {
     void (*conn_pause)(conn *c);
     rel_time_t (*conn_realtime)(const time_t exptime);
     void (*conn_state_change)(conn *c, enum conn_states next_state);
+    void (*conn_nread_progress)(conn *c);
 
     /* PROTOCOL_BINARY_REQ/RES */
     uint8_t conn_binary_command_magic;
@@ -422,6 +462,17 @@ struct conn {
 
     void   *item;     /* for commands set/add/replace  */
 
+    /* Proxy cut-through: an item whose value is still being nread */
+    /* by a downstream conn while already queued for writing on an */
+    /* upstream conn.  Set on both conns. */
+
+    void   *stream_item;
+
+    /* Proxy downstream conn shared by many downstreams, with their */
+    /* binary requests pipelined and matched up again by opaque. */
+
+    void   *mux;
+
     /* data for the swallow state */
     int    sbytes;    /* how many bytes to swallow */
 
@@ -482,6 +533,7 @@ struct conn {
     char     *cmd_start;      /* Pointer into rbuf, snapshot of rcurr. */
     uint64_t  cmd_start_time; /* Snapshot of usec_now or msec_current_time. */
     int       cmd_retries;
+    int       cmd_replica;    /* 0 for the master, else replica # + 1. */
 
     bool      hit_local;
     bool      cmd_unpaused;
@@ -496,6 +548,15 @@ struct conn {
     int peer_port;
 
     const char *update_diag;
+
+    int auth_pending; /* Downstream auth/bucket replies still expected */
+                      /* during the conn_authenticating state. */
+
+    int skip_replies; /* Downstream replies to drop before the next one, */
+                      /* such as those owed to lost hedges. */
+
+    bool close_local; /* Closed for a reason of moxi's own, which */
+                      /* isn't counted against the server. */
 };
 
 extern conn *listen_conn;
@@ -563,6 +624,10 @@ const char *state_text(enum conn_states state);
 extern int daemonize(int nochdir, int noclose);
 #endif
 
+int server_socket_workers(int port,
+                          enum network_transport transport,
+                          enum protocol prot,
+                          conn_funcs *funcs, void *extra);
 int server_socket(int port,
                   enum network_transport transport,
                   FILE *portnum_file);
@@ -594,6 +659,7 @@ void write_bin_error(conn *c, protocol_binary_response_status err, int swallow);
 void thread_init(int nthreads, struct event_base *main_base);
 int  thread_index(cb_thread_t thread_id);
 LIBEVENT_THREAD *thread_by_index(int i);
+item_cache *thread_item_cache(void);
 
 int  dispatch_event_add(int thread, conn *c);
 
@@ -611,6 +677,14 @@ void dispatch_conn_new_to_thread(int tid, SOCKET sfd, enum conn_states init_stat
                                  enum network_transport transport,
                                  conn_funcs *funcs, void *extra);
 
+void dispatch_conn_new_local(LIBEVENT_THREAD *me, SOCKET sfd,
+                             enum conn_states init_state,
+                             int event_flags,
+                             int read_buffer_size,
+                             enum protocol prot,
+                             enum network_transport transport,
+                             conn_funcs *funcs, void *extra);
+
 /* Lock wrappers for cache functions that are called from main loop. */
 enum delta_result_type add_delta(conn *c, item *item, const int incr,
                                  const int64_t delta, char *buf);
@@ -635,6 +709,7 @@ void STATS_UNLOCK(void);
 void threadlocal_stats_reset(void);
 void threadlocal_stats_aggregate(struct thread_stats *stats);
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out);
+void item_cache_stats_aggregate(item_cache *out);
 
 /* Stat processing functions */
 void append_stat(const char *name, ADD_STAT add_stats, void *c,
@@ -151,6 +151,9 @@ extern "C"
     PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET = 0x45,
     /* End TAP */
 
+    /* Read of a key from a replica vbucket, answered like a GETK. */
+    PROTOCOL_BINARY_CMD_GET_REPLICA = 0x83,
+
     PROTOCOL_BINARY_CMD_EVICT_KEY = 0x93,
 
     /* getl/unl command */
@@ -0,0 +1,101 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include <stdint.h>
+
+/* The vector scans read the aligned bytes around a string, which
+ * ASan reports as overflows, so sanitized builds use the scalar loop.
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define STRSCAN_SCALAR 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define STRSCAN_SCALAR 1
+#endif
+#endif
+
+#if defined(__AVX2__) && !defined(STRSCAN_SCALAR)
+#include <immintrin.h>
+#elif defined(__SSE2__) && !defined(STRSCAN_SCALAR)
+#include <emmintrin.h>
+#endif
+
+#include "strscan.h"
+
+#if defined(__GNUC__)
+#define STRSCAN_CTZ(x) __builtin_ctz(x)
+#else
+static int strscan_ctz(unsigned int x) {
+    int n = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+}
+#define STRSCAN_CTZ(x) strscan_ctz(x)
+#endif
+
+#if defined(__AVX2__) && !defined(STRSCAN_SCALAR)
+
+char *strscan_token_end(const char *s) {
+    const __m256i spaces = _mm256_set1_epi8(' ');
+    const __m256i zeros = _mm256_setzero_si256();
+    uintptr_t off = (uintptr_t) s & 31;
+    const char *p = s - off;
+    unsigned int mask;
+
+    /* Aligned loads never cross a page boundary, so reading the bytes
+     * around s that aren't ours is safe; just mask them off.
+     */
+    for (;;) {
+        __m256i v = _mm256_load_si256((const __m256i *) p);
+        mask = (unsigned int)
+            _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, spaces),
+                                                 _mm256_cmpeq_epi8(v, zeros)));
+        if (off > 0) {
+            mask &= ~0U << off;
+            off = 0;
+        }
+        if (mask != 0) {
+            return (char *) (p + STRSCAN_CTZ(mask));
+        }
+        p += 32;
+    }
+}
+
+#elif defined(__SSE2__) && !defined(STRSCAN_SCALAR)
+
+char *strscan_token_end(const char *s) {
+    const __m128i spaces = _mm_set1_epi8(' ');
+    const __m128i zeros = _mm_setzero_si128();
+    uintptr_t off = (uintptr_t) s & 15;
+    const char *p = s - off;
+    unsigned int mask;
+
+    /* See the AVX2 variant. */
+    for (;;) {
+        __m128i v = _mm_load_si128((const __m128i *) p);
+        mask = (unsigned int)
+            _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, spaces),
+                                           _mm_cmpeq_epi8(v, zeros)));
+        if (off > 0) {
+            mask &= ~0U << off;
+            off = 0;
+        }
+        if (mask != 0) {
+            return (char *) (p + STRSCAN_CTZ(mask));
+        }
+        p += 16;
+    }
+}
+
+#else
+
+char *strscan_token_end(const char *s) {
+    while (*s != ' ' && *s != '\0') {
+        s++;
+    }
+    return (char *) s;
+}
+
+#endif
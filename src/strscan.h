@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#ifndef STRSCAN_H
+#define STRSCAN_H 1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Returns a pointer to the first ' ' or '\0' at or after s, so the
+ * token starting at s is [s, result).  This is the inner loop of the
+ * ascii request tokenizers, which see multiget lines of hundreds of
+ * keys.
+ *
+ * Uses AVX2 or SSE2 when the compiler targets them, else a scalar
+ * loop.  The vector paths only issue aligned loads, so they may read
+ * past the terminator but never into the next page.
+ */
+char *strscan_token_end(const char *s);
+
+/**
+ * Returns a pointer to the first byte at or after s that is not a
+ * ' '.  Runs of spaces are short, so this is always scalar.
+ */
+static inline char *strscan_skip_spaces(const char *s) {
+    while (*s == ' ') {
+        s++;
+    }
+    return (char *) s;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STRSCAN_H */
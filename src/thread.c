@@ -29,15 +29,6 @@ struct conn_queue_item {
     CQ_ITEM          *next;
 };
 
-/* A connection queue. */
-typedef struct conn_queue CQ;
-struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    cb_mutex_t lock;
-    cb_cond_t  cond;
-};
-
 /* Lock for cache operations (item_*, assoc_*) */
 cb_mutex_t cache_lock;
 
@@ -52,11 +43,17 @@ static CQ_ITEM *cqi_freelist;
 static cb_mutex_t cqi_freelist_lock;
 
 /*
- * Each libevent instance has a wakeup pipe, which other threads
- * can use to signal that they've put a new connection on its queue.
+ * Each libevent instance has a work_queue, which other threads
+ * can use to hand it new connections and other work.
  */
 static LIBEVENT_THREAD *threads;
 
+/*
+ * The calling thread's own entry in threads, set as each of our
+ * libevent threads starts, so hot paths needn't search for it.
+ */
+static THREAD_LOCAL LIBEVENT_THREAD *thread_me;
+
 /*
  * Number of threads that have finished setting themselves up.
  */
@@ -65,54 +62,6 @@ static cb_mutex_t init_lock;
 static cb_cond_t init_cond;
 
 
-static void thread_libevent_process(evutil_socket_t fd, short which, void *arg);
-
-/*
- * Initializes a connection queue.
- */
-static void cq_init(CQ *cq) {
-    cb_mutex_initialize(&cq->lock);
-    cb_cond_initialize(&cq->cond);
-    cq->head = NULL;
-    cq->tail = NULL;
-}
-
-/*
- * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
- * Returns the item, or NULL if no item is available
- */
-static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *cq_item;
-
-    cb_mutex_enter(&cq->lock);
-    cq_item = cq->head;
-    if (NULL != cq_item) {
-        cq->head = cq_item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
-    }
-    cb_mutex_exit(&cq->lock);
-
-    return cq_item;
-}
-
-/*
- * Adds an item to a connection queue.
- */
-static void cq_push(CQ *cq, CQ_ITEM *cq_item) {
-    cq_item->next = NULL;
-
-    cb_mutex_enter(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = cq_item;
-    else
-        cq->tail->next = cq_item;
-    cq->tail = cq_item;
-    cb_cond_signal(&cq->cond);
-    cb_mutex_exit(&cq->lock);
-}
-
 /*
  * Returns a fresh connection queue item.
  */
@@ -181,13 +130,72 @@ void initialize_conn_lock(void)
     cb_mutex_initialize(&conn_lock);
 }
 
+/*
+ * Pauses or resumes a worker's own SO_REUSEPORT listeners, shrinking
+ * the backlog of a paused one like do_accept_new_conns() does, as the
+ * kernel still hashes new connections to it.
+ */
+static void thread_listen(LIBEVENT_THREAD *me, const bool do_accept) {
+    conn *c;
+
+    for (c = me->listen_conn; c != NULL; c = c->next) {
+        update_event(c, do_accept ? EV_READ | EV_PERSIST : 0);
+        if (listen(c->sfd, do_accept ? settings.backlog : 0) != 0) {
+            perror("listen");
+        }
+    }
+}
+
+/*
+ * Resumes a worker's paused listeners.  This is called from the
+ * worker's work_queue.
+ */
+static void thread_listen_resume(void *data0, void *data1) {
+    (void)data1;
+    thread_listen(data0, true);
+}
+
 /*
  * Sets whether or not we accept new connections.
  */
 void accept_new_conns(const bool do_accept) {
+    LIBEVENT_THREAD *me = thread_me;
+    int i;
+
     cb_mutex_enter(&conn_lock);
     do_accept_new_conns(do_accept);
     cb_mutex_exit(&conn_lock);
+
+    if (!settings.reuseport) {
+        return;
+    }
+
+    /* A worker's own listeners are only touched by that worker, */
+    /* so one that runs out of fds pauses only its own.  But the */
+    /* fd limit is process-wide, so a close on any thread resumes */
+    /* every paused worker, through its work_queue. */
+
+    if (!do_accept) {
+        if (me != NULL && me != &threads[0]) {
+            atomic_xchg_int(&me->listen_paused, 1);
+            thread_listen(me, false);
+        }
+        return;
+    }
+
+    for (i = 1; i < settings.num_threads; i++) {
+        LIBEVENT_THREAD *t = &threads[i];
+
+        if (atomic_load_int(&t->listen_paused) &&
+            atomic_xchg_int(&t->listen_paused, 0)) {
+            if (t == me) {
+                thread_listen(me, true);
+            } else if (!work_send(t->work_queue,
+                                  thread_listen_resume, t, NULL)) {
+                atomic_xchg_int(&t->listen_paused, 1);
+            }
+        }
+    }
 }
 /****************************** LIBEVENT THREADS *****************************/
 
@@ -203,33 +211,17 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         }
     }
 
-    /* Listen for notifications from other threads */
-    event_set(&me->notify_event, me->notify_receive_fd,
-              EV_READ | EV_PERSIST, thread_libevent_process, me);
-    event_base_set(me->base, &me->notify_event);
-
-    if (event_add(&me->notify_event, 0) == -1) {
-        moxi_log_write("Can't monitor libevent notify pipe\n");
-        exit(1);
-    }
-
-    me->new_conn_queue = malloc(sizeof(struct conn_queue));
-    if (me->new_conn_queue == NULL) {
-        perror("Failed to allocate memory for connection queue");
-        exit(EXIT_FAILURE);
-    }
-    cq_init(me->new_conn_queue);
-
-    /* TODO: Merge new_conn_queue with work_queue. */
-
+    /* Listen for new connections and work from other threads */
     me->work_queue = calloc(1, sizeof(work_queue));
     if (me->work_queue == NULL) {
         perror("Failed to allocate memory for work queue");
         exit(EXIT_FAILURE);
     }
-    work_queue_init(me->work_queue, me->base);
+    if (!work_queue_init(me->work_queue, me->base)) {
+        moxi_log_write("Can't monitor libevent notify pipe\n");
+        exit(1);
+    }
 
-    cb_mutex_initialize(&me->stats.mutex);
     me->suffix_cache = cache_create("suffix", SUFFIX_SIZE, sizeof(char*),
                                     NULL, NULL);
     if (me->suffix_cache == NULL) {
@@ -237,7 +229,7 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         exit(EXIT_FAILURE);
     }
 
-    me->conn_hash = genhash_init(512, strhash_ops);
+    me->conn_hash = genhash_init_open(512, strhash_ops);
     if (me->conn_hash == NULL) {
         moxi_log_write("Failed to create connection hash\n");
         exit(EXIT_FAILURE);
@@ -255,6 +247,7 @@ static void worker_libevent(void *arg) {
      * all threads have finished initializing.
      */
     me->thread_id = cb_thread_self();
+    thread_me = me;
 #ifndef WIN32
     if (settings.verbose > 1)
         moxi_log_write("worker_libevent thread_id %ld\n", (long)me->thread_id);
@@ -270,46 +263,69 @@ static void worker_libevent(void *arg) {
 
 
 /*
- * Processes an incoming "handle a new connection" item. This is called when
- * input arrives on the libevent wakeup pipe.
+ * Processes an incoming "handle a new connection" item. This is called
+ * from the thread's work_queue.
  */
-static void thread_libevent_process(evutil_socket_t fd, short which, void *arg) {
-    LIBEVENT_THREAD *me = arg;
-    CQ_ITEM *cq_item;
-    char buf[1];
+static void thread_conn_new(void *data0, void *data1) {
+    LIBEVENT_THREAD *me = data0;
+    CQ_ITEM *cq_item = data1;
 
-    (void)which;
+    if (NULL != cq_item) {
+        dispatch_conn_new_local(me, cq_item->sfd, cq_item->init_state,
+                                cq_item->event_flags,
+                                cq_item->read_buffer_size,
+                                cq_item->protocol,
+                                cq_item->transport,
+                                cq_item->funcs, cq_item->extra);
+        cqi_free(cq_item);
+    }
+}
 
-    if (recv(fd, buf, 1, 0) != 1) {
-        if (settings.verbose > 0) {
-            moxi_log_write("Can't read from libevent pipe\n");
+/*
+ * Makes the conn for a socket on the calling worker thread, either
+ * for a dispatched socket or one the worker accepted itself.
+ */
+void dispatch_conn_new_local(LIBEVENT_THREAD *me, SOCKET sfd,
+                             enum conn_states init_state,
+                             int event_flags,
+                             int read_buffer_size,
+                             enum protocol prot,
+                             enum network_transport transport,
+                             conn_funcs *funcs, void *extra) {
+    bool listening = (init_state == conn_listening);
+    conn *c;
+
+    /* Like a listen thread listener, a worker's listener gets its */
+    /* funcs only after conn_new(), so their conn_init isn't run. */
+
+    c = conn_new(sfd, init_state, event_flags,
+                 read_buffer_size,
+                 transport,
+                 me->base,
+                 listening ? NULL : funcs,
+                 listening ? NULL : extra);
+    if (c == NULL) {
+        if (IS_UDP(transport)) {
+            moxi_log_write("Can't listen for events on UDP socket\n");
+            exit(1);
+        } else {
+            if (settings.verbose > 0) {
+                moxi_log_write("Can't listen for events on fd %d\n",
+                    sfd);
+            }
+            closesocket(sfd);
         }
+        return;
     }
 
-    cq_item = cq_pop(me->new_conn_queue);
+    c->protocol = prot;
+    c->thread = me;
 
-    if (NULL != cq_item) {
-        conn *c = conn_new(cq_item->sfd, cq_item->init_state, cq_item->event_flags,
-                           cq_item->read_buffer_size,
-                           cq_item->transport,
-                           me->base,
-                           cq_item->funcs, cq_item->extra);
-        if (c == NULL) {
-            if (IS_UDP(cq_item->transport)) {
-                moxi_log_write("Can't listen for events on UDP socket\n");
-                exit(1);
-            } else {
-                if (settings.verbose > 0) {
-                    moxi_log_write("Can't listen for events on fd %d\n",
-                        cq_item->sfd);
-                }
-                closesocket(cq_item->sfd);
-            }
-        } else {
-            c->protocol = cq_item->protocol;
-            c->thread = me;
-        }
-        cqi_free(cq_item);
+    if (listening) {
+        c->funcs = funcs;
+        c->extra = extra;
+        c->next = me->listen_conn;
+        me->listen_conn = c;
     }
 }
 
@@ -363,11 +379,11 @@ void dispatch_conn_new_to_thread(int tid, SOCKET sfd, enum conn_states init_stat
     cq_item->funcs = funcs;
     cq_item->extra = extra;
 
-    cq_push(thread->new_conn_queue, cq_item);
-
     MEMCACHED_CONN_DISPATCH(sfd, thread->thread_id);
-    if (send(thread->notify_send_fd, "", 1, 0) != 1) {
+    if (!work_send(thread->work_queue, thread_conn_new, thread, cq_item)) {
         perror("Writing to thread notify pipe");
+        cqi_free(cq_item);
+        closesocket(sfd);
     }
 }
 
@@ -392,6 +408,14 @@ LIBEVENT_THREAD *thread_by_index(int i) {
     return &threads[i];
 }
 
+/*
+ * Returns the item freelists of the calling thread, or NULL when
+ * not called from one of our libevent threads.
+ */
+item_cache *thread_item_cache(void) {
+    return thread_me != NULL ? &thread_me->item_cache : NULL;
+}
+
 /********************************* ITEM ACCESS *******************************/
 
 /*
@@ -550,85 +574,123 @@ void STATS_UNLOCK() {
     cb_mutex_exit(&stats_lock);
 }
 
+/*
+ * Copies thread t's stats with untorn loads, while t keeps counting.
+ */
+static void threadlocal_stats_snapshot(LIBEVENT_THREAD *t,
+                                       struct thread_stats *out) {
+    int sid;
+
+    out->get_cmds = THREAD_STATS_GET(t->stats.get_cmds);
+    out->get_misses = THREAD_STATS_GET(t->stats.get_misses);
+    out->delete_misses = THREAD_STATS_GET(t->stats.delete_misses);
+    out->incr_misses = THREAD_STATS_GET(t->stats.incr_misses);
+    out->decr_misses = THREAD_STATS_GET(t->stats.decr_misses);
+    out->cas_misses = THREAD_STATS_GET(t->stats.cas_misses);
+    out->bytes_read = THREAD_STATS_GET(t->stats.bytes_read);
+    out->bytes_written = THREAD_STATS_GET(t->stats.bytes_written);
+    out->flush_cmds = THREAD_STATS_GET(t->stats.flush_cmds);
+    out->conn_yields = THREAD_STATS_GET(t->stats.conn_yields);
+    out->udp_recv_batches = THREAD_STATS_GET(t->stats.udp_recv_batches);
+    out->udp_recv_msgs = THREAD_STATS_GET(t->stats.udp_recv_msgs);
+    out->udp_send_batches = THREAD_STATS_GET(t->stats.udp_send_batches);
+    out->udp_send_msgs = THREAD_STATS_GET(t->stats.udp_send_msgs);
+
+    for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
+        struct slab_stats *in = &t->stats.slab_stats[sid];
+
+        out->slab_stats[sid].set_cmds = THREAD_STATS_GET(in->set_cmds);
+        out->slab_stats[sid].get_hits = THREAD_STATS_GET(in->get_hits);
+        out->slab_stats[sid].delete_hits = THREAD_STATS_GET(in->delete_hits);
+        out->slab_stats[sid].incr_hits = THREAD_STATS_GET(in->incr_hits);
+        out->slab_stats[sid].decr_hits = THREAD_STATS_GET(in->decr_hits);
+        out->slab_stats[sid].cas_hits = THREAD_STATS_GET(in->cas_hits);
+        out->slab_stats[sid].cas_badval = THREAD_STATS_GET(in->cas_badval);
+    }
+}
+
+/*
+ * Only the owning thread writes its stats, so a reset doesn't zero
+ * them, which could race with that thread's next add.  It instead
+ * records them as the new baseline that aggregates subtract.
+ */
 void threadlocal_stats_reset(void) {
-    int ii, sid;
-    for (ii = 0; ii < settings.num_threads; ++ii) {
-        cb_mutex_enter(&threads[ii].stats.mutex);
-
-        threads[ii].stats.get_cmds = 0;
-        threads[ii].stats.get_misses = 0;
-        threads[ii].stats.delete_misses = 0;
-        threads[ii].stats.incr_misses = 0;
-        threads[ii].stats.decr_misses = 0;
-        threads[ii].stats.cas_misses = 0;
-        threads[ii].stats.bytes_read = 0;
-        threads[ii].stats.bytes_written = 0;
-        threads[ii].stats.flush_cmds = 0;
-        threads[ii].stats.conn_yields = 0;
-
-        for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-            threads[ii].stats.slab_stats[sid].set_cmds = 0;
-            threads[ii].stats.slab_stats[sid].get_hits = 0;
-            threads[ii].stats.slab_stats[sid].delete_hits = 0;
-            threads[ii].stats.slab_stats[sid].incr_hits = 0;
-            threads[ii].stats.slab_stats[sid].decr_hits = 0;
-            threads[ii].stats.slab_stats[sid].cas_hits = 0;
-            threads[ii].stats.slab_stats[sid].cas_badval = 0;
-        }
+    int ii;
+
+    cb_mutex_enter(&stats_lock);
 
-        cb_mutex_exit(&threads[ii].stats.mutex);
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        threadlocal_stats_snapshot(&threads[ii], &threads[ii].stats_reset);
     }
+
+    cb_mutex_exit(&stats_lock);
 }
 
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats) {
+    struct thread_stats snap;
+    struct thread_stats *base;
     int ii, sid;
-    /* The struct contains a mutex, so I should probably not memset it.. */
-    thread_stats->get_cmds = 0;
-    thread_stats->get_misses = 0;
-    thread_stats->delete_misses = 0;
-    thread_stats->incr_misses = 0;
-    thread_stats->decr_misses = 0;
-    thread_stats->cas_misses = 0;
-    thread_stats->bytes_written = 0;
-    thread_stats->bytes_read = 0;
-    thread_stats->flush_cmds = 0;
-    thread_stats->conn_yields = 0;
-
-    memset(thread_stats->slab_stats, 0,
-           sizeof(struct slab_stats) * MAX_NUMBER_OF_SLAB_CLASSES);
+
+    memset(thread_stats, 0, sizeof(*thread_stats));
+
+    cb_mutex_enter(&stats_lock);
 
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        cb_mutex_enter(&threads[ii].stats.mutex);
-
-        thread_stats->get_cmds += threads[ii].stats.get_cmds;
-        thread_stats->get_misses += threads[ii].stats.get_misses;
-        thread_stats->delete_misses += threads[ii].stats.delete_misses;
-        thread_stats->decr_misses += threads[ii].stats.decr_misses;
-        thread_stats->incr_misses += threads[ii].stats.incr_misses;
-        thread_stats->cas_misses += threads[ii].stats.cas_misses;
-        thread_stats->bytes_read += threads[ii].stats.bytes_read;
-        thread_stats->bytes_written += threads[ii].stats.bytes_written;
-        thread_stats->flush_cmds += threads[ii].stats.flush_cmds;
-        thread_stats->conn_yields += threads[ii].stats.conn_yields;
+        threadlocal_stats_snapshot(&threads[ii], &snap);
+        base = &threads[ii].stats_reset;
+
+        thread_stats->get_cmds += snap.get_cmds - base->get_cmds;
+        thread_stats->get_misses += snap.get_misses - base->get_misses;
+        thread_stats->delete_misses +=
+            snap.delete_misses - base->delete_misses;
+        thread_stats->decr_misses += snap.decr_misses - base->decr_misses;
+        thread_stats->incr_misses += snap.incr_misses - base->incr_misses;
+        thread_stats->cas_misses += snap.cas_misses - base->cas_misses;
+        thread_stats->bytes_read += snap.bytes_read - base->bytes_read;
+        thread_stats->bytes_written +=
+            snap.bytes_written - base->bytes_written;
+        thread_stats->flush_cmds += snap.flush_cmds - base->flush_cmds;
+        thread_stats->conn_yields += snap.conn_yields - base->conn_yields;
+        thread_stats->udp_recv_batches +=
+            snap.udp_recv_batches - base->udp_recv_batches;
+        thread_stats->udp_recv_msgs += snap.udp_recv_msgs - base->udp_recv_msgs;
+        thread_stats->udp_send_batches +=
+            snap.udp_send_batches - base->udp_send_batches;
+        thread_stats->udp_send_msgs += snap.udp_send_msgs - base->udp_send_msgs;
 
         for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-            thread_stats->slab_stats[sid].set_cmds +=
-                threads[ii].stats.slab_stats[sid].set_cmds;
-            thread_stats->slab_stats[sid].get_hits +=
-                threads[ii].stats.slab_stats[sid].get_hits;
-            thread_stats->slab_stats[sid].delete_hits +=
-                threads[ii].stats.slab_stats[sid].delete_hits;
-            thread_stats->slab_stats[sid].decr_hits +=
-                threads[ii].stats.slab_stats[sid].decr_hits;
-            thread_stats->slab_stats[sid].incr_hits +=
-                threads[ii].stats.slab_stats[sid].incr_hits;
-            thread_stats->slab_stats[sid].cas_hits +=
-                threads[ii].stats.slab_stats[sid].cas_hits;
-            thread_stats->slab_stats[sid].cas_badval +=
-                threads[ii].stats.slab_stats[sid].cas_badval;
+            struct slab_stats *out = &thread_stats->slab_stats[sid];
+            struct slab_stats *now = &snap.slab_stats[sid];
+            struct slab_stats *was = &base->slab_stats[sid];
+
+            out->set_cmds += now->set_cmds - was->set_cmds;
+            out->get_hits += now->get_hits - was->get_hits;
+            out->delete_hits += now->delete_hits - was->delete_hits;
+            out->decr_hits += now->decr_hits - was->decr_hits;
+            out->incr_hits += now->incr_hits - was->incr_hits;
+            out->cas_hits += now->cas_hits - was->cas_hits;
+            out->cas_badval += now->cas_badval - was->cas_badval;
         }
+    }
+
+    cb_mutex_exit(&stats_lock);
+}
 
-        cb_mutex_exit(&threads[ii].stats.mutex);
+/*
+ * Sums the item freelist stats of all threads.  The per-thread stats
+ * are only written by their owning threads, so this is a racy, but
+ * good enough, snapshot.
+ */
+void item_cache_stats_aggregate(item_cache *out) {
+    int ii;
+
+    memset(out, 0, sizeof(*out));
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        out->bytes += threads[ii].item_cache.bytes;
+        out->hits += threads[ii].item_cache.hits;
+        out->misses += threads[ii].item_cache.misses;
+        out->overflows += threads[ii].item_cache.overflows;
     }
 }
 
@@ -654,34 +716,6 @@ void slab_stats_aggregate(struct thread_stats *thread_stats, struct slab_stats *
     }
 }
 
-static bool create_notification_pipe(LIBEVENT_THREAD *me) {
-    int j;
-    SOCKET notify[2];
-    if (evutil_socketpair(SOCKETPAIR_AF, SOCK_STREAM, 0,
-        (void*)notify) == SOCKET_ERROR) {
-        moxi_log_write("Failed to create notification pipe");
-        return false;
-    }
-
-    for (j = 0; j < 2; ++j) {
-        int flags = 1;
-        setsockopt(notify[j], IPPROTO_TCP,
-                   TCP_NODELAY, (void *)&flags, sizeof(flags));
-        setsockopt(notify[j], SOL_SOCKET,
-                   SO_REUSEADDR, (void *)&flags, sizeof(flags));
-
-        if (evutil_make_socket_nonblocking(notify[j]) == -1) {
-            moxi_log_write("Failed to enable non-blocking");
-            return false;
-        }
-    }
-
-    me->notify_receive_fd = notify[0];
-    me->notify_send_fd = notify[1];
-
-    return true;
-}
-
 /*
  * Initializes the thread subsystem, creating various worker threads.
  *
@@ -708,12 +742,9 @@ void thread_init(int nthreads, struct event_base *main_base) {
 
     threads[0].base = main_base;
     threads[0].thread_id = cb_thread_self();
+    thread_me = &threads[0];
 
     for (i = 0; i < nthreads; i++) {
-        if (!create_notification_pipe(&threads[i])) {
-            exit(1);
-        }
-
         setup_thread(&threads[i]);
     }
 
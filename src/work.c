@@ -7,13 +7,27 @@
 #include <platform/cbassert.h>
 #include <unistd.h>
 #include <event.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #include "work.h"
+#include "atomics.h"
 #include "log.h"
 
 #undef WORK_DEBUG
 
 
 static bool create_notification_pipe(work_queue *me) {
+#ifdef HAVE_SYS_EVENTFD_H
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd >= 0) {
+        me->recv_fd = efd;
+        me->send_fd = efd;
+        return true;
+    }
+    /* Fall back to a socketpair. */
+#endif
+
     int j;
     SOCKET notify[2];
     if (evutil_socketpair(SOCKETPAIR_AF, SOCK_STREAM, 0,
@@ -41,6 +55,54 @@ static bool create_notification_pipe(work_queue *me) {
     return true;
 }
 
+/* Wakes the receiving thread, retrying when interrupted.  A full
+ * socketpair means a wakeup is already pending, which is as good.
+ */
+static bool work_notify(work_queue *m) {
+    int i;
+
+    for (i = 0; i < 10; i++) {
+#ifdef HAVE_SYS_EVENTFD_H
+        if (m->send_fd == m->recv_fd) {
+            uint64_t one = 1;
+            if (write(m->send_fd, &one, sizeof(one)) == sizeof(one)) {
+                return true;
+            }
+        } else
+#endif
+        if (send(m->send_fd, "", 1, 0) == 1) {
+            return true;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        }
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+static void work_notify_drain(work_queue *m) {
+#ifdef HAVE_SYS_EVENTFD_H
+    if (m->send_fd == m->recv_fd) {
+        uint64_t count;
+        if (read(m->recv_fd, &count, sizeof(count)) != sizeof(count)) {
+#ifdef WORK_DEBUG
+            moxi_log_write("unexpected work_recv read value\n");
+#endif
+        }
+        return;
+    }
+#endif
+    char buf[64];
+    while (recv(m->recv_fd, buf, sizeof(buf), 0) > 0) {
+        /* There's at most one byte per wakeup, but drain anyway. */
+    }
+}
+
 /** A work queue is a mechanism to allow thread-to-thread
  *  communication in a libevent-based, multithreaded system.
  *
@@ -48,6 +110,12 @@ static bool create_notification_pipe(work_queue *me) {
  *  should be libevent-based, with a processing loop handled by
  *  libevent.
  *
+ *  Senders push onto a lock-free list, and only the sender that
+ *  finds no wakeup outstanding pokes the receiver's eventfd (or
+ *  socketpair, where there's no eventfd), so a burst of sends, like
+ *  a stats scrape fanning out to every worker, costs one syscall
+ *  per receiver rather than one per item.
+ *
  *  Use work_queue_init() to initialize a work_queue structure,
  *  where the work_queue structure memory is owned by the caller.
  *
@@ -58,14 +126,13 @@ bool work_queue_init(work_queue *m, struct event_base *event_base) {
 
     memset(m, 0, sizeof(work_queue));
 
-    cb_mutex_initialize(&m->work_lock);
-
     m->work_head = NULL;
-    m->work_tail = NULL;
+    m->notified = 0;
 
     m->num_items = 0;
     m->tot_sends = 0;
     m->tot_recvs = 0;
+    m->tot_notifies = 0;
 
     m->event_base = event_base;
     cb_assert(m->event_base != NULL);
@@ -102,9 +169,11 @@ bool work_queue_init(work_queue *m, struct event_base *event_base) {
 
 /** Use work_send() to place work on another thread's work queue.
  *  The receiving thread will invoke the given function with
- *  the given callback data.
+ *  the given callback data.  Safe to call from any number of
+ *  threads concurrently.
  *
- *  Returns true on success.
+ *  Returns true once the work is queued, after which it belongs to
+ *  the receiving thread, or false if it couldn't be queued.
  */
 bool work_send(work_queue *m,
                void (*func)(void *data0, void *data1),
@@ -115,47 +184,51 @@ bool work_send(work_queue *m,
     cb_assert(m->event_base != NULL);
     cb_assert(func != NULL);
 
-    bool rv = false;
-
     /* TODO: Add a free-list of work_items. */
 
     work_item *w = calloc(1, sizeof(work_item));
-    if (w != NULL) {
-        w->func  = func;
-        w->data0 = data0;
-        w->data1 = data1;
-        w->next  = NULL;
-
-        cb_mutex_enter(&m->work_lock);
-
-        if (m->work_tail != NULL)
-            m->work_tail->next = w;
-        m->work_tail = w;
-        if (m->work_head == NULL)
-            m->work_head = w;
+    if (w == NULL) {
+        return false;
+    }
 
-        if (send(m->send_fd, "", 1, 0) == 1) {
-            m->num_items++;
-            m->tot_sends++;
+    w->func  = func;
+    w->data0 = data0;
+    w->data1 = data1;
+
+    do {
+        w->next = m->work_head;
+    } while (!atomic_cas_ptr(&m->work_head, w->next, w));
+
+    atomic_add_u64_relaxed(&m->num_items, 1);
+    atomic_add_u64_relaxed(&m->tot_sends, 1);
+
+    /* The item is visible before we look at the notified flag, so
+     * either the receiver hasn't cleared the flag yet and will see
+     * the item when it drains, or we're the ones to wake it.
+     */
+    if (atomic_xchg_int(&m->notified, 1) == 0) {
+        atomic_add_u64_relaxed(&m->tot_notifies, 1);
+
+        if (!work_notify(m)) {
+            /* The item is already queued and may even be running, */
+            /* so it can't be taken back.  Let the next send try */
+            /* the wakeup again. */
+            atomic_xchg_int(&m->notified, 0);
+            moxi_log_write("work_send notify failed: %s\n", strerror(errno));
+        }
+    }
 
 #ifdef WORK_DEBUG
-            moxi_log_write("work_send %x %x %x %d %d %d %llu %llu\n",
-                    (int) cb_thread_self(),
-                    (int) m,
-                    (int) m->event_base,
-                    m->send_fd, m->recv_fd,
-                    m->work_head != NULL,
-                    m->num_items,
-                    m->tot_sends);
+    moxi_log_write("work_send %x %x %x %d %d %llu %llu\n",
+            (int) cb_thread_self(),
+            (int) m,
+            (int) m->event_base,
+            m->send_fd, m->recv_fd,
+            m->num_items,
+            m->tot_sends);
 #endif
 
-            rv = true;
-        }
-
-        cb_mutex_exit(&m->work_lock);
-    }
-
-    return rv;
+    return true;
 }
 
 /** Called by libevent, on the receiving thread, when
@@ -172,27 +245,16 @@ void work_recv(evutil_socket_t fd, short which, void *arg) {
 
     work_item *curr = NULL;
     work_item *next = NULL;
+    work_item *fifo = NULL;
 
-    char buf[1];
-
-    /* The lock area includes the read() for safety, */
-    /* as the pipe acts like a cond variable. */
-
-    cb_mutex_enter(&m->work_lock);
-
-    int readrv = recv(fd, buf, 1, 0);
-    cb_assert(readrv == 1);
-    if (readrv != 1) {
-#ifdef WORK_DEBUG
-        /* Perhaps libevent called us in incorrect way. */
+    work_notify_drain(m);
 
-        moxi_log_write("unexpected work_recv read value\n");
-#endif
-    }
+    /* Clear the flag before taking the list, so a send that races
+     * with us either lands in this batch or sends a fresh wakeup.
+     */
+    atomic_xchg_int(&m->notified, 0);
 
-    curr = m->work_head;
-    m->work_head = NULL;
-    m->work_tail = NULL;
+    curr = atomic_xchg_ptr(&m->work_head, NULL);
 
 #ifdef WORK_DEBUG
     moxi_log_write("work_recv %x %x %x %d %d %d %llu %llu %d\n",
@@ -206,25 +268,28 @@ void work_recv(evutil_socket_t fd, short which, void *arg) {
             fd);
 #endif
 
-    cb_mutex_exit(&m->work_lock);
-
-    uint64_t num_items = 0;
+    /* The list is newest first; reverse it to run in send order. */
 
     while (curr != NULL) {
         next = curr->next;
-        num_items++;
-        curr->func(curr->data0, curr->data1);
-        free(curr);
+        curr->next = fifo;
+        fifo = curr;
         curr = next;
     }
 
-    if (num_items > 0) {
-        cb_mutex_enter(&m->work_lock);
+    uint64_t num_items = 0;
 
-        m->tot_recvs += num_items;
-        m->num_items -= num_items;
+    while (fifo != NULL) {
+        next = fifo->next;
+        num_items++;
+        fifo->func(fifo->data0, fifo->data1);
+        free(fifo);
+        fifo = next;
+    }
 
-        cb_mutex_exit(&m->work_lock);
+    if (num_items > 0) {
+        atomic_add_u64_relaxed(&m->tot_recvs, num_items);
+        atomic_add_u64_relaxed(&m->num_items, -(int64_t) num_items);
     }
 }
 
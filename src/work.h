@@ -23,20 +23,19 @@ struct work_item {
 };
 
 struct work_queue {
-    SOCKET send_fd; /* Pipe to notify thread. */
-    SOCKET recv_fd;
+    SOCKET send_fd; /* Eventfd or pipe to notify thread. */
+    SOCKET recv_fd; /* Same as send_fd when it's an eventfd. */
 
-    work_item *work_head;
-    work_item *work_tail;
+    work_item *work_head; /* Lock-free push list, newest first. */
+    int        notified;  /* Non-zero while a wakeup is outstanding. */
 
     uint64_t num_items; /* Current number of items in queue. */
     uint64_t tot_sends;
     uint64_t tot_recvs;
+    uint64_t tot_notifies; /* Sends that had to wake the receiver. */
 
     struct event_base *event_base;
     struct event       event;
-
-    cb_mutex_t work_lock;
 };
 
 struct work_collect {
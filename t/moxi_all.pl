@@ -38,7 +38,18 @@ go('fanout', 'binary');
 
 print "------------------------------------ ascii\n";
 
-my $res = system("./t/moxi_mock.pl ascii");
+my $res = system("./t/moxi_mock.pl ascii ascii \"\" ./t/moxi_mock.cfg" .
+                 " multiget_squash=1,cut_through_min=32");
+if ($res != 0) {
+  print "exit: $res\n";
+  exit($res);
+}
+
+print "------------------------------------ ascii batch\n";
+
+my $res = system("./t/moxi_mock.pl ascii ascii" .
+                 " TestProxyAscii.testMultiGetBatch ./t/moxi_mock.cfg" .
+                 " multiget_batch_max=4,multiget_batch_delay=500");
 if ($res != 0) {
   print "exit: $res\n";
   exit($res);
@@ -100,3 +111,88 @@ if ($res != 0) {
 }
 
 
+
+sleep(1);
+
+print "------------------------------------ mux\n";
+
+my $cmd = "./t/moxi_mock.pl moxi_mock_mux binary \"\" ./t/moxi_mock.cfg" .
+                 " downstream_max=0,downstream_conn_mux=4," .
+                   "downstream_timeout=1000,downstream_retry=0";
+print($cmd . "\n");
+my $res = system($cmd);
+if ($res != 0) {
+  print "exit: $res\n";
+  exit($res);
+}
+
+sleep(1);
+
+print "------------------------------------ hedge\n";
+
+my $cmd = "./t/moxi_mock.pl moxi_mock_hedge binary \"\" ./t/moxi_mock_hedge.cfg" .
+                 " hedge_max_pct=100,hedge_delay=2000,breaker_max_failures=1";
+print($cmd . "\n");
+my $res = system($cmd);
+if ($res != 0) {
+  print "exit: $res\n";
+  exit($res);
+}
+
+sleep(1);
+
+print "------------------------------------ replica read\n";
+
+my $cmd = "./t/moxi_mock.pl moxi_mock_replica binary \"\" ./t/moxi_mock_replica.cfg" .
+                 " replica_read=1";
+print($cmd . "\n");
+my $res = system($cmd);
+if ($res != 0) {
+  print "exit: $res\n";
+  exit($res);
+}
+
+sleep(1);
+
+print "------------------------------------ partial multiget\n";
+
+my $cmd = "./t/moxi_mock.pl moxi_mock_partial binary \"\" ./t/moxi_mock_partial.cfg" .
+                 " downstream_timeout=1000,downstream_retry=0";
+print($cmd . "\n");
+my $res = system($cmd);
+if ($res != 0) {
+  print "exit: $res\n";
+  exit($res);
+}
+
+sleep(1);
+
+print "------------------------------------ rest streaming\n";
+
+my $cmd = "./t/moxi_mock.pl moxi_mock_rest binary \"\"" .
+                 " url=http://127.0.0.1:4567/pools/default/bucketsStreaming/default" .
+                 " usr=TheUser,pwd=ThePassword,port_listen=11333," .
+                   "downstream_timeout=0," .
+                   "downstream_conn_queue_timeout=0,wait_queue_timeout=0," .
+                   "connect_timeout=5000,auth_timeout=0," .
+                   "connect_max_errors=0,connect_retry_interval=0,";
+print($cmd . "\n");
+my $res = system($cmd);
+if ($res != 0) {
+  print "exit: $res\n";
+  exit($res);
+}
+
+sleep(1);
+
+print "------------------------------------ breaker\n";
+
+my $cmd = "./t/moxi_mock.pl moxi_mock_breaker ascii \"\" ./t/moxi_mock.cfg" .
+                 " downstream_retry=0,breaker_max_failures=1," .
+                   "breaker_eject_time=2000";
+print($cmd . "\n");
+my $res = system($cmd);
+if ($res != 0) {
+  print "exit: $res\n";
+  exit($res);
+}
@@ -12,7 +12,8 @@
 #  ./t/moxi_mock.pl ascii
 #  ./t/moxi_mock.pl ascii ascii TestProxyAscii.testBasicQuit
 #
-# Alternative command-line...
+# Alternative command-line, where moxi-Z-param comes after, and so
+# can override, the default behaviors...
 #
 #  ./t/moxi_mock.pl [mock_test] [downstream_protocol] [test_name] \
 #     [moxi-z-param] [moxi-Z-param] [rest/http-server-params]
@@ -56,9 +57,10 @@ if ($restargs ne '...NONE...') {
 my $childargs =
       " -z " . $little_z .
       " -p 0 -U 0 -v -t 1" .
-      " -Z \"" . $big_Z .
+      " -Z \"" .
             "downstream_max=1,downstream_conn_max=0," .
-            "downstream_protocol=" . $downstream_protocol . "\"";
+            "downstream_protocol=" . $downstream_protocol . "," .
+            $big_Z . "\"";
 if ($< == 0) {
    $childargs .= " -u root";
 }
@@ -17,7 +17,8 @@ import moxi_mock_server
 # Or, if you're using the vbucket-aware moxi...
 #
 #   ./moxi -z ./t/moxi_mock.cfg -p 0 -U 0 -vvv -t 1
-#          -Z downstream_max=1,downstream_conn_max=0,downstream_protocol=ascii
+#          -Z downstream_max=1,downstream_conn_max=0,downstream_protocol=ascii,
+#             multiget_squash=1,cut_through_min=32
 #
 # Then...
 #
@@ -301,6 +302,140 @@ class TestProxyAscii(moxi_mock_server.ProxyClientBase):
         self.mock_send('END\r\n', 0)
         self.client_recv('VALUE client1 0 10\r\n0123456789\r\nEND\r\n', 1)
 
+    def client_recv_all(self, what, idx=0):
+        """Test the client gets what, even if it's across several recv's"""
+        s = ''
+        i = 0
+        while len(s) < len(what) and i < 10:
+            self.clients[idx].settimeout(1)
+            try:
+                x = self.clients[idx].recv(1024)
+            except socket.timeout:
+                x = None
+            self.clients[idx].settimeout(None)
+            if x == '':
+                break
+            if x:
+                s = s + x
+            i = i + 1
+        self.assertEqual(s, what)
+
+    def client_closed(self, idx=0):
+        self.clients[idx].settimeout(5)
+        try:
+            x = self.clients[idx].recv(1024)
+        except socket.timeout:
+            x = None
+        except socket.error:
+            x = ''
+        self.clients[idx].settimeout(None)
+        return x == ''
+
+    def corkSquash(self, key):
+        """Test gets of key by clients 1 and 2 are squashed into one"""
+
+        # Assuming proxy's downstream_max is 1, number of threads
+        # is 1, and multiget_squash=1 and cut_through_min=32.
+
+        self.client_connect(0)
+        self.client_connect(1)
+        self.client_connect(2)
+
+        self.client_send('get cork0\r\n', 0)
+        self.mock_recv('get cork0\r\n', 0)
+
+        self.client_send('get ' + key + '\r\n', 1)
+        self.client_send('get ' + key + '\r\n', 2)
+
+        self.wait(10)
+
+        self.mock_send('END\r\n', 0)
+        self.client_recv('END\r\n', 0)
+
+        self.mock_recv('get ' + key + '\r\n', 0)
+
+    def testCutThroughSplitValue(self):
+        """Test a big value reaches squashed clients as it arrives"""
+        self.corkSquash('big0')
+
+        v = '0123456789' * 4
+
+        self.mock_send('VALUE big0 0 40\r\n' + v[:15], 0)
+        self.wait(10)
+
+        # The first part is already passed through, before the
+        # rest of the value arrives.
+
+        self.client_recv_all('VALUE big0 0 40\r\n' + v[:15], 1)
+        self.client_recv_all('VALUE big0 0 40\r\n' + v[:15], 2)
+
+        self.mock_send(v[15:30], 0)
+        self.wait(10)
+        self.mock_send(v[30:] + '\r\nEND\r\n', 0)
+
+        self.client_recv_all(v[15:] + '\r\nEND\r\n', 1)
+        self.client_recv_all(v[15:] + '\r\nEND\r\n', 2)
+
+    def testCutThroughServerCloseInValue(self):
+        """Test a server close mid big value closes the squashed clients"""
+        self.corkSquash('big1')
+
+        v = '0123456789' * 4
+
+        self.mock_send('VALUE big1 0 40\r\n' + v[:15], 0)
+        self.wait(10)
+
+        self.client_recv_all('VALUE big1 0 40\r\n' + v[:15], 1)
+        self.client_recv_all('VALUE big1 0 40\r\n' + v[:15], 2)
+
+        # The clients already have part of the value, so there's
+        # no END that could be sent to them instead.
+
+        self.mock_close()
+
+        self.assertTrue(self.client_closed(1))
+        self.assertTrue(self.client_closed(2))
+
+    def batching(self):
+        """Returns true if moxi holds single-key gets to batch them"""
+        self.client_connect(0)
+        self.client_send('stats proxy behaviors\r\n', 0)
+
+        s = ''
+        while not s.endswith('END\r\n'):
+            x = self.clients[0].recv(1024)
+            self.assertTrue(len(x) > 0)
+            s = s + x
+
+        m = re.search(r':multiget_batch_max (\d+)\r\n', s)
+        d = re.search(r':multiget_batch_delay (\d+)\r\n', s)
+        return (m is not None and int(m.group(1)) > 1 and
+                d is not None and int(d.group(1)) > 0)
+
+    def testMultiGetBatch(self):
+        """Test single-key gets by two clients go down as one multiget"""
+
+        # Only runs against a moxi started with multiget_batch_max
+        # and multiget_batch_delay, such as by moxi_all.pl.
+
+        if not self.batching():
+            return
+
+        self.client_connect(1)
+
+        self.client_send('get a0\r\n', 0)
+        self.client_send('get b1\r\n', 1)
+
+        self.mock_recv('get a0 b1\r\n', 0)
+        self.mock_send('VALUE a0 0 2\r\na0\r\n' +
+                       'VALUE b1 0 2\r\nb1\r\n' +
+                       'END\r\n', 0)
+
+        # Each client only sees the values for its own key.
+
+        self.client_recv_all('VALUE a0 0 2\r\na0\r\nEND\r\n', 0)
+        self.client_recv_all('VALUE b1 0 2\r\nb1\r\nEND\r\n', 1)
+
     # Dedupe of keys is disabled for now in vbucket-aware moxi.
     #
     def TODO_testGetSquash(self):
@@ -161,6 +161,71 @@ class TestProxyBinary(moxi_mock_server.ProxyClientBase):
         self.mock_send(get_res)
         self.client_recv(get_res)
 
+    def testAuthDoesNotBlock(self):
+        """Test a slow AUTH reply doesn't hold up other clients"""
+        self.client_connect(0)
+        self.client_connect(1)
+
+        self.client_send("get keyNotThere0\r\n", 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_SASL_AUTH,
+                                    key='PLAIN',
+                                    val="\0TheUser\0ThePassword"))
+
+        # With only one worker thread, the other client is served
+        # while moxi still waits for the AUTH reply.
+
+        self.client_send("version\r\n", 1)
+        self.client_recv("VERSION .*\r\n", 1)
+
+        self.mock_send(self.packRes(memcacheConstants.CMD_SASL_AUTH,
+                                    status=0,
+                                    val='Authenticated'))
+
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='keyNotThere0'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK,
+                                    status=memcacheConstants.ERR_NOT_FOUND,
+                                    key='keyNotThere0'))
+        self.client_recv("END\r\n", 0)
+
+    def testAuthSplitReply(self):
+        """Test an AUTH reply that arrives over several writes"""
+        self.client_connect()
+
+        self.client_send("get keyNotThere0\r\n")
+        self.mock_recv(self.packReq(memcacheConstants.CMD_SASL_AUTH,
+                                    key='PLAIN',
+                                    val="\0TheUser\0ThePassword"))
+
+        r = self.packRes(memcacheConstants.CMD_SASL_AUTH,
+                         status=0,
+                         val='Authenticated')
+        self.mock_send(r[0:10])
+        self.wait(10)
+        self.mock_send(r[10:30])
+        self.wait(10)
+        self.mock_send(r[30:])
+
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='keyNotThere0'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETK,
+                                    status=memcacheConstants.ERR_NOT_FOUND,
+                                    key='keyNotThere0'))
+        self.client_recv("END\r\n")
+
+    def testAuthFailed(self):
+        """Test a failed AUTH fails the request, not the proxy"""
+        self.client_connect()
+
+        self.client_send("get keyNotThere0\r\n")
+        self.mock_recv(self.packReq(memcacheConstants.CMD_SASL_AUTH,
+                                    key='PLAIN',
+                                    val="\0TheUser\0ThePassword"))
+        self.mock_send(self.packRes(memcacheConstants.CMD_SASL_AUTH,
+                                    status=memcacheConstants.ERR_AUTH_ERROR))
+        self.client_recv("(END|SERVER_ERROR.*)\r\n")
+
+        self.client_send("version\r\n")
+        self.client_recv("VERSION .*\r\n")
+
 if __name__ == '__main__':
     unittest.main()
 
@@ -259,6 +259,29 @@ class TestProxyBinary(moxi_mock_server.ProxyClientBase):
                                     val='0123456789') +
             self.packRes(memcacheConstants.CMD_NOOP))
 
+    def testMultiGetValueDedupe(self):
+        """Test a repeated GETKQ key is sent downstream once"""
+        self.client_connect()
+        self.client_send(self.packReq(memcacheConstants.CMD_GETKQ, key='someVal0', opaque=4) +
+                         self.packReq(memcacheConstants.CMD_GETKQ, key='someVal0', opaque=13) +
+                         self.packReq(memcacheConstants.CMD_GETKQ, key='someVal1', opaque=7) +
+                         self.packReq(memcacheConstants.CMD_NOOP))
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETKQ, key='someVal0', opaque=4) +
+                       self.packReq(memcacheConstants.CMD_GETKQ, key='someVal1', opaque=7) +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETKQ, key='someVal0', opaque=4,
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='0123456789'))
+        self.mock_send(self.packRes(memcacheConstants.CMD_NOOP))
+        self.client_recv(
+            self.packRes(memcacheConstants.CMD_GETKQ, key='someVal0', opaque=4,
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='0123456789') +
+            self.packRes(memcacheConstants.CMD_GETKQ, key='someVal0', opaque=13,
+                                    extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                                    val='0123456789') +
+            self.packRes(memcacheConstants.CMD_NOOP))
+
     def testGetEmptyValue(self):
         """Test the proxy handles empty VALUE response"""
         self.client_connect()
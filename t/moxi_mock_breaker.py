@@ -0,0 +1,68 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+
+import moxi_mock_server
+
+# Tests of the circuit breaker, which ejects a server after failed
+# requests, fails requests to it fast, and later probes it back in.
+#
+# Before you run moxi_mock_breaker.py, start a moxi like...
+#
+#   ./moxi -z ./t/moxi_mock.cfg -p 0 -U 0 -vvv -t 1
+#          -Z downstream_max=1,downstream_conn_max=0,downstream_protocol=ascii,
+#             downstream_retry=0,breaker_max_failures=1,breaker_eject_time=2000
+#
+# Then...
+#
+#   python ./t/moxi_mock_breaker.py
+#
+# ----------------------------------
+
+class TestProxyBreaker(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def getOk(self, key):
+        self.client_send('get ' + key + '\r\n')
+        self.mock_recv('get ' + key + '\r\n')
+        self.mock_send('VALUE ' + key + ' 0 10\r\n0123456789\r\nEND\r\n')
+        self.client_recv('VALUE ' + key + ' 0 10\r\n0123456789\r\nEND\r\n')
+
+    def testEjectAndProbe(self):
+        """Test an ejected server fails fast, then is probed back in"""
+        self.client_connect()
+        self.getOk('warm')
+
+        # The server closing mid-request is a failure, which is
+        # enough to eject it.
+
+        self.client_send('get k1\r\n')
+        self.mock_recv('get k1\r\n')
+        self.mock_close()
+        self.client_recv('(END|SERVER_ERROR.*)\r\n')
+
+        # While ejected, requests fail without reaching the server.
+
+        self.client_send('get k2\r\n')
+        self.client_recv('(END|SERVER_ERROR.*)\r\n')
+        self.assertTrue(self.mock_quiet())
+        self.assertEqual(len(self.mock_server().sessions), 0)
+
+        # Once breaker_eject_time passes, a probe goes through, and
+        # its success closes the breaker.
+
+        self.wait(250)
+
+        self.getOk('k3')
+        self.getOk('k4')
+
+        self.assertEqual(len(self.mock_server().sessions), 1)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,158 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Tests of hedged gets, with a 2nd fake memcached server that holds
+# the replica vbuckets.  In moxi_mock_hedge.cfg, key hedge0 is in
+# vbucket 0, whose master is on port 11311 and replica on 11312,
+# and key warm0 is in vbucket 1, the other way around.
+#
+# Before you run moxi_mock_hedge.py, start a moxi like...
+#
+#   ./moxi -z ./t/moxi_mock_hedge.cfg -p 0 -U 0 -vvv -t 1 -O stderr
+#          -Z downstream_max=1,downstream_conn_max=0,downstream_protocol=binary,
+#             hedge_max_pct=100,hedge_delay=2000,breaker_max_failures=1
+#
+# Then...
+#
+#   python ./t/moxi_mock_hedge.py
+#
+# ----------------------------------
+
+CMD_GET_REPLICA = 0x83
+
+g_replica_server = moxi_mock_server.MockServer(11312)
+g_replica_server.start()
+time.sleep(1)
+
+class TestProxyHedge(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def tearDown(self):
+        moxi_mock_server.ProxyClientBase.tearDown(self)
+        g_replica_server.closeSessions()
+
+    def replica_session(self):
+        i = 1
+        while len(g_replica_server.sessions) <= 0 and i < 5:
+            time.sleep(i)
+            i = i * 2
+        return g_replica_server.sessions[0]
+
+    def replica_send(self, what):
+        self.replica_session().client.send(what)
+
+    def replica_recv(self, what):
+        session = self.replica_session()
+        i = 1
+        while len(session.received) <= 0 and i < 5:
+            time.sleep(i)
+            i = i * 2
+        self.assertTrue(len(session.received) > 0)
+        self.assertEqual(session.received.pop(0), what)
+
+    def getRes(self, cmd, key, val, opaque=0):
+        return self.packRes(cmd, key=key, opaque=opaque,
+                            extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                            val=val)
+
+    def warmReplica(self):
+        """Hedges only go over an idle conn, so open one to the replica"""
+        self.client_connect(0)
+        self.client_send('get warm0\r\n', 0)
+        self.replica_recv(self.packReq(memcacheConstants.CMD_GETK,
+                                       reserved=1, key='warm0', opaque=1))
+        self.replica_send(self.getRes(memcacheConstants.CMD_GETK,
+                                      'warm0', '0123456789', opaque=1))
+        self.client_recv('VALUE warm0 0 10\r\n0123456789\r\nEND\r\n', 0)
+
+    def testHedgeWins(self):
+        """Test the replica's answer wins when the master is slow"""
+        self.warmReplica()
+
+        self.client_send('get hedge0\r\n', 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='hedge0'))
+
+        self.wait(250)
+        self.replica_recv(self.packReq(CMD_GET_REPLICA, key='hedge0'))
+        self.replica_send(self.getRes(CMD_GET_REPLICA, 'hedge0', 'fromReplica'))
+        self.client_recv('VALUE hedge0 0 11\r\nfromReplica\r\nEND\r\n', 0)
+
+        # The slow master's conn lost, but stays open, and its late
+        # reply is dropped before the reply to the next get.
+
+        self.mock_send(self.getRes(memcacheConstants.CMD_GETK,
+                                   'hedge0', 'fromMaster'))
+        self.wait(10)
+        self.assertTrue(self.mock_session(0).client is not None)
+
+        self.client_send('get hedge0\r\n', 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='hedge0'))
+        self.mock_send(self.getRes(memcacheConstants.CMD_GETK,
+                                   'hedge0', 'fresh'))
+        self.client_recv('VALUE hedge0 0 5\r\nfresh\r\nEND\r\n', 0)
+
+        self.assertEqual(len(self.mock_server().sessions), 1)
+
+    def testMasterWins(self):
+        """Test a losing replica isn't counted as failing"""
+        self.warmReplica()
+
+        self.client_send('get hedge0\r\n', 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='hedge0'))
+
+        self.wait(250)
+        self.replica_recv(self.packReq(CMD_GET_REPLICA, key='hedge0'))
+        self.mock_send(self.getRes(memcacheConstants.CMD_GETK,
+                                   'hedge0', 'fromMaster'))
+        self.client_recv('VALUE hedge0 0 10\r\nfromMaster\r\nEND\r\n', 0)
+
+        self.replica_send(self.getRes(CMD_GET_REPLICA, 'hedge0', 'fromReplica'))
+        self.wait(10)
+
+        # With breaker_max_failures=1, a failure charged to the
+        # replica would eject it, and fail this get.
+
+        self.client_send('get warm0\r\n', 0)
+        self.replica_recv(self.packReq(memcacheConstants.CMD_GETK,
+                                       reserved=1, key='warm0', opaque=1))
+        self.replica_send(self.getRes(memcacheConstants.CMD_GETK,
+                                      'warm0', '0123456789', opaque=1))
+        self.client_recv('VALUE warm0 0 10\r\n0123456789\r\nEND\r\n', 0)
+
+        self.assertEqual(len(g_replica_server.sessions), 1)
+
+    def testHedgeRefused(self):
+        """Test the master's answer is used when the replica refuses"""
+        self.warmReplica()
+
+        self.client_send('get hedge0\r\n', 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='hedge0'))
+
+        self.wait(250)
+        self.replica_recv(self.packReq(CMD_GET_REPLICA, key='hedge0'))
+        self.replica_send(self.packRes(CMD_GET_REPLICA,
+                                       status=memcacheConstants.ERR_NOT_MY_VBUCKET))
+        self.wait(10)
+
+        self.mock_send(self.getRes(memcacheConstants.CMD_GETK,
+                                   'hedge0', 'fromMaster'))
+        self.client_recv('VALUE hedge0 0 10\r\nfromMaster\r\nEND\r\n', 0)
+
+if __name__ == '__main__':
+    unittest.main()
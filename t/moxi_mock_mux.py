@@ -0,0 +1,165 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Tests of requests from several clients pipelined over one shared,
+# or mux, downstream conn.
+#
+# Before you run moxi_mock_mux.py, start a moxi like...
+#
+#   ./moxi -z ./t/moxi_mock.cfg -p 0 -U 0 -vvv -t 1 -O stderr
+#          -Z downstream_max=0,downstream_conn_max=0,downstream_protocol=binary,
+#             downstream_conn_mux=4,downstream_timeout=1000,downstream_retry=0
+#
+# Then...
+#
+#   python ./t/moxi_mock_mux.py
+#
+# ----------------------------------
+
+class TestProxyMux(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def getRes(self, key, opaque=0, val='0123456789'):
+        return self.packRes(memcacheConstants.CMD_GETK, key=key, opaque=opaque,
+                            extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                            val=val)
+
+    def warmUp(self):
+        """The first conn released to the pool becomes the mux conn"""
+        self.client_connect(0)
+        self.client_send('get warm\r\n', 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='warm'))
+        self.mock_send(self.getRes('warm'))
+        self.client_recv('VALUE warm 0 10\r\n0123456789\r\nEND\r\n', 0)
+
+    def testOpaqueRewriteAndRestore(self):
+        """Test the mock sees seq's as opaques, and clients get theirs back"""
+        self.client_connect(0)
+        self.client_send(self.packReq(memcacheConstants.CMD_GETK, key='warm',
+                                      opaque=0x11), 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='warm',
+                                    opaque=0x11))
+        self.mock_send(self.getRes('warm', opaque=0x11))
+        self.client_recv(self.getRes('warm', opaque=0x11), 0)
+
+        self.client_connect(1)
+
+        self.client_send(self.packReq(memcacheConstants.CMD_GETK, key='k1',
+                                      opaque=0x22), 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='k1',
+                                    opaque=0))
+        self.client_send(self.packReq(memcacheConstants.CMD_GETK, key='k2',
+                                      opaque=0x33), 1)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='k2',
+                                    opaque=1))
+
+        self.mock_send(self.getRes('k1', opaque=0))
+        self.client_recv(self.getRes('k1', opaque=0x22), 0)
+        self.mock_send(self.getRes('k2', opaque=1))
+        self.client_recv(self.getRes('k2', opaque=0x33), 1)
+
+        self.assertEqual(len(self.mock_server().sessions), 1)
+
+    def testRequestQueuedWhileReading(self):
+        """Test a request waits until the response being read is done"""
+        self.warmUp()
+        self.client_connect(1)
+
+        self.client_send('get k1\r\n', 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='k1',
+                                    opaque=0))
+
+        r = self.getRes('k1', opaque=0)
+        self.mock_send(r[:-5])
+        self.wait(10)
+
+        self.client_send('get k2\r\n', 1)
+        self.wait(10)
+        self.assertTrue(self.mock_quiet())
+
+        self.mock_send(r[-5:])
+        self.client_recv('VALUE k1 0 10\r\n0123456789\r\nEND\r\n', 0)
+
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='k2',
+                                    opaque=1))
+        self.mock_send(self.getRes('k2', opaque=1))
+        self.client_recv('VALUE k2 0 10\r\n0123456789\r\nEND\r\n', 1)
+
+    def testDetachedResponsesDropped(self):
+        """Test timed out requests don't cost the conn"""
+        self.warmUp()
+        self.client_connect(1)
+        self.client_connect(2)
+
+        # The 1st request is sent, then times out, and its late
+        # response is read and dropped.
+
+        self.client_send('get k1\r\n', 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='k1',
+                                    opaque=0))
+        self.client_recv('SERVER_ERROR proxy downstream timeout.*\r\n', 0)
+
+        r = self.getRes('k1', opaque=0)
+        self.mock_send(r[:-5])
+        self.wait(10)
+
+        # The 2nd request is queued behind that response, and times
+        # out before it's sent, so a NOOP goes in its place.
+
+        self.client_send('get k2\r\n', 1)
+        self.wait(10)
+        self.assertTrue(self.mock_quiet())
+        self.client_recv('SERVER_ERROR proxy downstream timeout.*\r\n', 1)
+
+        self.mock_send(r[-5:])
+        self.mock_recv(self.packReq(memcacheConstants.CMD_NOOP, opaque=1))
+        self.mock_send(self.packRes(memcacheConstants.CMD_NOOP, opaque=1))
+
+        # The same conn still serves the next request.
+
+        self.client_send('get k3\r\n', 2)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='k3',
+                                    opaque=2))
+        self.mock_send(self.getRes('k3', opaque=2))
+        self.client_recv('VALUE k3 0 10\r\n0123456789\r\nEND\r\n', 2)
+
+        self.assertEqual(len(self.mock_server().sessions), 1)
+
+    def testOutOfOrderResponseCloses(self):
+        """Test a response with an unexpected opaque closes the conn"""
+        self.warmUp()
+        self.client_connect(1)
+
+        self.client_send('get k1\r\n', 0)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='k1',
+                                    opaque=0))
+        self.client_send('get k2\r\n', 1)
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETK, key='k2',
+                                    opaque=1))
+
+        self.mock_send(self.getRes('k2', opaque=1))
+
+        self.client_recv('SERVER_ERROR proxy downstream closed.*\r\n', 0)
+        self.client_recv('SERVER_ERROR proxy downstream closed.*\r\n', 1)
+
+        self.wait(10)
+        self.assertTrue(self.mock_session(0).client is None)
+
+if __name__ == '__main__':
+    unittest.main()
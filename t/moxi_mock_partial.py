@@ -0,0 +1,163 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Tests of ascii multigets fanned out to two fake memcached servers,
+# where one of them is slow or errors, and the hits from the other
+# are still returned.  In moxi_mock_partial.cfg, key hedge0 is in
+# vbucket 0, on port 11311, and key warm0 is in vbucket 1, on 11312.
+#
+# Before you run moxi_mock_partial.py, start a moxi like...
+#
+#   ./moxi -z ./t/moxi_mock_partial.cfg -p 0 -U 0 -vvv -t 1 -O stderr
+#          -Z downstream_max=1,downstream_conn_max=0,downstream_protocol=binary,
+#             downstream_timeout=1000,downstream_retry=0
+#
+# Then...
+#
+#   python ./t/moxi_mock_partial.py
+#
+# ----------------------------------
+
+g_other_server = moxi_mock_server.MockServer(11312)
+g_other_server.start()
+time.sleep(1)
+
+class TestProxyPartial(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def tearDown(self):
+        moxi_mock_server.ProxyClientBase.tearDown(self)
+        g_other_server.closeSessions()
+
+    def other_session(self):
+        i = 1
+        while len(g_other_server.sessions) <= 0 and i < 5:
+            time.sleep(i)
+            i = i * 2
+        return g_other_server.sessions[0]
+
+    def other_send(self, what):
+        self.other_session().client.send(what)
+
+    def other_recv(self, what):
+        session = self.other_session()
+        i = 1
+        while len(session.received) <= 0 and i < 5:
+            time.sleep(i)
+            i = i * 2
+        self.assertTrue(len(session.received) > 0)
+        self.assertEqual(session.received.pop(0), what)
+
+    def getRes(self, key, val, opaque):
+        return self.packRes(memcacheConstants.CMD_GETK, key=key, opaque=opaque,
+                            extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                            val=val)
+
+    def partials(self):
+        """Returns moxi's tot_multiget_partial stat"""
+        self.client_connect(1)
+        self.client_send('stats proxy\r\n', 1)
+
+        s = ''
+        while not s.endswith('END\r\n'):
+            x = self.clients[1].recv(4096)
+            self.assertTrue(len(x) > 0)
+            s = s + x
+
+        self.client_close(1)
+
+        m = re.search(r':tot_multiget_partial (\d+)\r\n', s)
+        self.assertTrue(m is not None)
+        return int(m.group(1))
+
+    def multiget(self):
+        """Sends a multiget whose keys are on both servers"""
+        self.client_connect(0)
+        self.client_send('get hedge0 warm0\r\n', 0)
+
+        # The opaque of each key is its offset in the request.
+
+        self.mock_recv(self.packReq(memcacheConstants.CMD_GETKQ,
+                                    key='hedge0', opaque=4) +
+                       self.packReq(memcacheConstants.CMD_NOOP))
+        self.other_recv(self.packReq(memcacheConstants.CMD_GETKQ,
+                                     reserved=1, key='warm0', opaque=11) +
+                        self.packReq(memcacheConstants.CMD_NOOP))
+
+    def testTimeoutKeepsHits(self):
+        """Test a multiget keeps its hits when a server is too slow"""
+        before = self.partials()
+
+        self.multiget()
+
+        self.mock_send(self.getRes('hedge0', '0123456789', 4) +
+                       self.packRes(memcacheConstants.CMD_NOOP))
+
+        # The other server never answers, so once downstream_timeout
+        # passes, its key is a miss instead of a SERVER_ERROR.
+
+        self.client_recv('VALUE hedge0 0 10\r\n0123456789\r\nEND\r\n', 0)
+
+        self.assertEqual(self.partials(), before + 1)
+
+        # The server that answered keeps its conn.
+
+        self.assertTrue(self.mock_session(0).client is not None)
+        self.assertEqual(len(self.mock_server().sessions), 1)
+
+    def testErrorKeepsHits(self):
+        """Test a multiget keeps its hits when a server errors on a key"""
+        before = self.partials()
+
+        self.multiget()
+
+        # An error other than a miss used to trip an assert, and is
+        # now a miss.
+
+        self.mock_send(self.packRes(memcacheConstants.CMD_GETKQ,
+                                    status=memcacheConstants.ERR_EBUSY,
+                                    opaque=4) +
+                       self.packRes(memcacheConstants.CMD_NOOP))
+        self.other_send(self.getRes('warm0', '0123456789', 11) +
+                        self.packRes(memcacheConstants.CMD_NOOP))
+
+        self.client_recv('VALUE warm0 0 10\r\n0123456789\r\nEND\r\n', 0)
+
+        self.assertEqual(self.partials(), before + 1)
+
+    def testAllHitsNotPartial(self):
+        """Test a multiget answered by every server isn't partial"""
+        before = self.partials()
+
+        self.multiget()
+
+        self.mock_send(self.getRes('hedge0', '0123456789', 4) +
+                       self.packRes(memcacheConstants.CMD_NOOP))
+        self.other_send(self.getRes('warm0', 'abcdefghij', 11) +
+                        self.packRes(memcacheConstants.CMD_NOOP))
+
+        self.client_recv('(VALUE hedge0 0 10\r\n0123456789\r\n' +
+                         'VALUE warm0 0 10\r\nabcdefghij\r\n|' +
+                         'VALUE warm0 0 10\r\nabcdefghij\r\n' +
+                         'VALUE hedge0 0 10\r\n0123456789\r\n)END\r\n', 0)
+
+        self.assertEqual(self.partials(), before)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,84 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Tests of replica reads, where nothing listens on port 11399, so
+# the master of every vbucket in moxi_mock_replica.cfg is down.
+# Key hedge0 is in vbucket 0, whose 1st replica is on port 11311,
+# and key warm0 is in vbucket 1, whose 1st replica is unassigned
+# and whose 2nd replica is on port 11311.
+#
+# Before you run moxi_mock_replica.py, start a moxi like...
+#
+#   ./moxi -z ./t/moxi_mock_replica.cfg -p 0 -U 0 -vvv -t 1 -O stderr
+#          -Z downstream_max=1,downstream_conn_max=0,downstream_protocol=binary,
+#             replica_read=1
+#
+# Then...
+#
+#   python ./t/moxi_mock_replica.py
+#
+# ----------------------------------
+
+CMD_GET_REPLICA = 0x83
+
+class TestProxyReplica(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def getRes(self, cmd, key, val, opaque=0):
+        return self.packRes(cmd, key=key, opaque=opaque,
+                            extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                            val=val)
+
+    def testReplicaRead(self):
+        """Test a get whose master is down is read from its replica"""
+        self.client_connect()
+        self.client_send('get hedge0\r\n')
+        self.mock_recv(self.packReq(CMD_GET_REPLICA, key='hedge0'))
+        self.mock_send(self.getRes(CMD_GET_REPLICA, 'hedge0', 'fromReplica'))
+        self.client_recv('VALUE hedge0 0 11\r\nfromReplica\r\nEND\r\n')
+
+    def testReplicaUnassigned(self):
+        """Test an unassigned replica is skipped for the next one"""
+        self.client_connect()
+        self.client_send('get warm0\r\n')
+        self.mock_recv(self.packReq(CMD_GET_REPLICA, reserved=1,
+                                    key='warm0', opaque=1))
+        self.mock_send(self.getRes(CMD_GET_REPLICA, 'warm0', 'fromReplica',
+                                   opaque=1))
+        self.client_recv('VALUE warm0 0 11\r\nfromReplica\r\nEND\r\n')
+
+    def testReplicaMiss(self):
+        """Test a replica's miss is the client's miss"""
+        self.client_connect()
+        self.client_send('get hedge0\r\n')
+        self.mock_recv(self.packReq(CMD_GET_REPLICA, key='hedge0'))
+        self.mock_send(self.packRes(CMD_GET_REPLICA,
+                                    status=memcacheConstants.ERR_NOT_FOUND))
+        self.client_recv('END\r\n')
+
+    def testBinaryReplicaRead(self):
+        """Test a binary GET read from a replica gets a GET response"""
+        self.client_connect()
+        self.client_send(self.packReq(memcacheConstants.CMD_GET, key='hedge0'))
+        self.mock_recv(self.packReq(CMD_GET_REPLICA, key='hedge0'))
+        self.mock_send(self.getRes(CMD_GET_REPLICA, 'hedge0', 'fromReplica'))
+        self.client_recv(self.getRes(memcacheConstants.CMD_GET, '', 'fromReplica'))
+
+if __name__ == '__main__':
+    unittest.main()
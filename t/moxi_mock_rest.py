@@ -0,0 +1,175 @@
+import sys
+import string
+import socket
+import select
+import unittest
+import threading
+import time
+import re
+import struct
+
+from memcacheConstants import REQ_MAGIC_BYTE, RES_MAGIC_BYTE
+from memcacheConstants import REQ_PKT_FMT, RES_PKT_FMT, MIN_RECV_PACKET
+from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
+
+import memcacheConstants
+
+import moxi_mock_server
+
+# Tests of configs streamed by a REST server over one long-lived
+# http connection, each config followed by END_OF_CONFIG, where the
+# test decides how the stream is cut up into sends.
+#
+# Before you run moxi_mock_rest.py, start a moxi like...
+#
+#   ./moxi -z url=http://127.0.0.1:4567/pools/default/bucketsStreaming/default \
+#          -p 0 -U 0 -vvv -t 1 -O stderr \
+#          -Z usr=TheUser,pwd=ThePassword,port_listen=11333, \
+#             downstream_max=1,downstream_conn_max=0,downstream_protocol=binary
+#
+# Then...
+#
+#   python ./t/moxi_mock_rest.py
+#
+# ----------------------------------
+
+END_OF_CONFIG = "\n\n\n\n"
+
+def config(port):
+    return ('{"name": "TheUser", "saslPassword": "ThePassword",' +
+            ' "vBucketServerMap": {"hashAlgorithm": "CRC", "numReplicas": 0,' +
+            ' "serverList": ["127.0.0.1:' + str(port) + '"],' +
+            ' "vBucketMap": [[0]]}}')
+
+# A fake REST server, which only accepts and holds on to the http
+# connections, leaving what's streamed over them up to the test.
+#
+class MockRestServer(threading.Thread):
+    def __init__(self, port):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.port    = port
+        self.streams = []
+
+    def run(self):
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind(('', self.port))
+        server.listen(5)
+
+        while True:
+            client, address = server.accept()
+            self.streams.append(client)
+
+g_rest_server = MockRestServer(4567)
+g_rest_server.start()
+
+g_other_server = moxi_mock_server.MockServer(11312)
+g_other_server.start()
+time.sleep(1)
+
+class TestProxyRest(moxi_mock_server.ProxyClientBase):
+    def __init__(self, x):
+        moxi_mock_server.ProxyClientBase.__init__(self, x)
+
+    def tearDown(self):
+        moxi_mock_server.ProxyClientBase.tearDown(self)
+        g_other_server.closeSessions()
+
+    def stream_open(self):
+        """Waits out moxi's backoff for its http request, then answers"""
+        i = 1
+        while len(g_rest_server.streams) <= 0 and i < 16:
+            time.sleep(i)
+            i = i * 2
+        self.assertTrue(len(g_rest_server.streams) > 0)
+
+        s = g_rest_server.streams.pop(0)
+        req = ''
+        while req.find("\r\n\r\n") < 0:
+            data = s.recv(1024)
+            self.assertTrue(len(data) > 0)
+            req = req + data
+        self.assertTrue(req.startswith(
+                "GET /pools/default/bucketsStreaming/default "))
+
+        s.send("HTTP/1.1 200 OK\r\n" +
+               "Content-Type: application/json\r\n" +
+               "Connection: close\r\n\r\n")
+        return s
+
+    def stream_send(self, s, what):
+        s.send(what)
+        self.wait(50)
+
+    def getRes(self, key):
+        return self.packRes(memcacheConstants.CMD_GETK, key=key,
+                            extraHeader=struct.pack(memcacheConstants.GET_RES_FMT, 0),
+                            val='0123456789')
+
+    def expectGet(self, server, key):
+        """Test a get of key goes to server, after its first auth"""
+        self.client_send('get ' + key + '\r\n')
+
+        i = 1
+        while len(server.sessions) <= 0 and i < 5:
+            time.sleep(i)
+            i = i * 2
+        session = server.sessions[0]
+
+        expect = [self.packReq(memcacheConstants.CMD_SASL_AUTH, key='PLAIN',
+                               val="\0TheUser\0ThePassword"),
+                  self.packReq(memcacheConstants.CMD_GETK, key=key)]
+        for x in expect:
+            i = 1
+            while len(session.received) <= 0 and i < 5:
+                time.sleep(i)
+                i = i * 2
+            self.assertTrue(len(session.received) > 0)
+            self.assertEqual(session.received.pop(0), x)
+
+            if x is expect[0]:
+                session.client.send(self.packRes(memcacheConstants.CMD_SASL_AUTH,
+                                                 status=0, val='Authenticated'))
+
+        session.client.send(self.getRes(key))
+        self.client_recv('VALUE ' + key + ' 0 10\r\n0123456789\r\nEND\r\n')
+
+    def testStreamedConfigs(self):
+        """Test each streamed config is used as soon as it's complete"""
+        s = self.stream_open()
+        self.client_connect()
+
+        # The END_OF_CONFIG of the 1st config straddles two sends,
+        # and the 2nd send also starts the 2nd config.
+
+        a = config(moxi_mock_server.g_mock_server_port)
+        b = config(11312)
+
+        self.stream_send(s, a + END_OF_CONFIG[:2])
+        self.stream_send(s, END_OF_CONFIG[2:] + b[:20])
+        self.expectGet(self.mock_server(), 'kA')
+
+        # The rest of the 2nd config comes with a trailing partial
+        # config, and then the REST server closes the stream.  The
+        # partial config is bad JSON, so the 2nd config stays.
+
+        self.stream_send(s, b[20:] + END_OF_CONFIG + a[:30])
+        self.expectGet(g_other_server, 'kB')
+
+        s.close()
+        self.wait(50)
+
+        self.client_send('get kC\r\n')
+        session = g_other_server.sessions[0]
+        i = 1
+        while len(session.received) <= 0 and i < 5:
+            time.sleep(i)
+            i = i * 2
+        self.assertEqual(session.received.pop(0),
+                         self.packReq(memcacheConstants.CMD_GETK, key='kC'))
+        session.client.send(self.getRes('kC'))
+        self.client_recv('VALUE kC 0 10\r\n0123456789\r\nEND\r\n')
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,58 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+
+use Test::More tests => 2;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+use IO::Select;
+
+# With -A, each worker accepts on its own SO_REUSEPORT listener, and
+# pauses it when accept() runs out of fds.  Under a low fd limit the
+# workers run out, and once the conns close, every worker should
+# accept again, whichever worker the closes happened on.  The -c is
+# below the limit, so it isn't raised.
+
+unless ($ENV{MOXI_TEST_NOFILE}) {
+    $ENV{MOXI_TEST_NOFILE} = 48;
+    exec("sh", "-c", "ulimit -n 48 && exec \"\$0\" \"\$\@\"", $^X, $0)
+        or die "Can't exec under ulimit: $!\n";
+}
+
+my $server = new_memcached('-A -t 4 -c 32');
+
+sub answers {
+    my ($sock, $timeout) = @_;
+    print $sock "version\r\n";
+    return 0 unless IO::Select->new($sock)->can_read($timeout);
+    my $line = <$sock>;
+    return defined($line) && $line =~ /^VERSION /;
+}
+
+my @socks;
+foreach my $i (1..40) {
+    my $sock = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$server->{port}",
+                                     Timeout => 1);
+    last unless $sock;
+    push(@socks, $sock);
+}
+ok(scalar(@socks) > 0, "Made conns up to the fd limit");
+
+my $waiting = grep { !answers($_, 0.5) } @socks;
+diag("$waiting of " . scalar(@socks) . " conns waited to be accepted");
+
+close($_) foreach @socks;
+@socks = ();
+sleep(1);
+
+my $answered = 0;
+foreach my $i (1..30) {
+    my $sock = $server->new_sock;
+    if ($sock) {
+        $answered++ if answers($sock, 2);
+        close($sock);
+    }
+}
+is($answered, 30, "Every worker accepts again after the conns close");
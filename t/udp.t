@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 use strict;
-use Test::More tests => 48;
+use Test::More tests => 57;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -60,6 +60,59 @@ for my $prot (::IS_ASCII,::IS_BINARY) {
     udp_delete_test($prot,45,"aval$prot","0");
 }
 
+# Several requests sent back to back may be read with one recvmmsg(),
+# and each still gets its own reply.
+my $stats = mem_stats($sock);
+my $msgs_before = $stats->{udp_recv_msgs};
+
+foreach my $i (1..5) {
+    my $pkt = pack("nnnn", 200 + $i, 0, 1, 0) . "get foo\r\n";
+    send($usock, $pkt, 0) or die "Can't send : $!\n";
+}
+
+my %replies = ();
+foreach my $i (1..5) {
+    my $rin = '';
+    vec($rin, fileno($usock), 1) = 1;
+    last unless select(my $rout = $rin, undef, undef, 1.5);
+
+    my $res;
+    $usock->recv($res, 1500, 0);
+    my ($resid) = unpack("nnnn", substr($res, 0, 8));
+    $replies{$resid} = substr($res, 8);
+}
+
+foreach my $i (1..5) {
+    is($replies{200 + $i}, "VALUE foo 0 6\r\nfooval\r\nEND\r\n",
+       "back to back request " . (200 + $i) . " got its reply");
+}
+
+$stats = mem_stats($sock);
+SKIP: {
+    skip "no recvmmsg()", 1 unless $stats->{udp_recv_batches} > 0;
+    cmp_ok($stats->{udp_recv_msgs} - $msgs_before, '>=', 5,
+           "udp_recv_msgs counts every datagram of a batch");
+}
+
+# A reply bigger than one datagram may go out with one sendmmsg().
+my $send_msgs_before = $stats->{udp_send_msgs};
+
+my $datagrams = send_udp_request($usock, 46, "get bval0\r\n");
+ok($datagrams && keys(%$datagrams) > 1, "big reply spans several datagrams");
+my $big = "";
+foreach my $seq (sort { $a <=> $b } keys %$datagrams) {
+    $big .= substr($datagrams->{$seq}, 8);
+}
+is($big, "VALUE bval0 0 4096\r\n" . ("abcd" x 1024) . "\r\nEND\r\n",
+   "big reply reassembles from its datagrams");
+
+$stats = mem_stats($sock);
+SKIP: {
+    skip "no sendmmsg()", 1 unless $stats->{udp_send_batches} > 0;
+    cmp_ok($stats->{udp_send_msgs} - $send_msgs_before, '>=',
+           keys(%$datagrams), "udp_send_msgs counts every datagram of a batch");
+}
+
 sub udp_set_test {
     my ($protocol, $req_id, $key, $value, $flags, $exp) = @_;
     my $req = "";
@@ -0,0 +1,190 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Compares chained and open addressing genhash tables on the access
+ * patterns of the proxy's hot maps: short lived multiget de-dupe
+ * tables of ~100 keys per request, and large long lived front cache
+ * maps.  Keys are drawn from a zipf distribution, like real traffic.
+ *
+ * Usage: moxi_genhash_bench [num_keys]
+ */
+
+#include "src/config.h"
+#include <platform/cbassert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include <src/genhash.h>
+
+#define MULTIGET_KEYS 100
+#define MULTIGET_REQUESTS 20000
+#define CACHE_LOOKUPS 2000000
+
+static int str_eq(const void *a, const void *b) {
+    return strcmp(a, b) == 0;
+}
+
+static void *noop_dup(const void *a) {
+    return (void *)a;
+}
+
+static void noop_free(void *a) {
+    (void)a;
+}
+
+static struct hash_ops bench_ops = {
+    .hashfunc = genhash_string_hash,
+    .hasheq = str_eq,
+    .dupKey = noop_dup,
+    .dupValue = noop_dup,
+    .freeKey = noop_free,
+    .freeValue = noop_free
+};
+
+typedef genhash_t *(*init_func)(int est, struct hash_ops ops);
+
+static char **keys;
+static double *zipf_cdf;
+static int num_keys = 1000000;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void setup(void) {
+    double sum = 0.0;
+    int i;
+
+    keys = calloc(num_keys, sizeof(char *));
+    zipf_cdf = calloc(num_keys, sizeof(double));
+    cb_assert(keys != NULL && zipf_cdf != NULL);
+
+    for (i = 0; i < num_keys; i++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "user:%08d:profile", i);
+        keys[i] = strdup(buf);
+        cb_assert(keys[i] != NULL);
+
+        sum += 1.0 / pow(i + 1, 0.99);
+        zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < num_keys; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+static int zipf_key(void) {
+    double r = (double)rand() / RAND_MAX;
+    int lo = 0;
+    int hi = num_keys - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < r) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void count_cb(const void *key, const void *val, void *arg) {
+    (void)key;
+    (void)val;
+    (*(int *)arg)++;
+}
+
+static double bench_multiget(init_func init, int *picks) {
+    double start = now();
+    int r, i, n = 0;
+
+    for (r = 0; r < MULTIGET_REQUESTS; r++) {
+        genhash_t *h = init(128, bench_ops);
+        int *p = picks + r * MULTIGET_KEYS;
+
+        for (i = 0; i < MULTIGET_KEYS; i++) {
+            char *k = keys[p[i]];
+            if (genhash_find(h, k) == NULL) {
+                genhash_update(h, k, k);
+            }
+        }
+        for (i = 0; i < MULTIGET_KEYS; i++) {
+            cb_assert(genhash_find(h, keys[p[i]]) != NULL);
+        }
+        for (i = 0; i < MULTIGET_KEYS; i++) {
+            genhash_delete(h, keys[p[i]]);
+        }
+        genhash_iter(h, count_cb, &n);
+        genhash_free(h);
+    }
+
+    return (now() - start) * 1e9 / (MULTIGET_REQUESTS * MULTIGET_KEYS);
+}
+
+static double bench_cache(init_func init, int *picks, double *fill_ns) {
+    genhash_t *h = init(128, bench_ops);
+    double start = now();
+    int i, hits = 0;
+
+    /* Cache every other key, so about half of the lookups miss. */
+    for (i = 0; i < num_keys; i += 2) {
+        genhash_update(h, keys[i], keys[i]);
+    }
+    *fill_ns = (now() - start) * 1e9 / (num_keys / 2);
+
+    start = now();
+    for (i = 0; i < CACHE_LOOKUPS; i++) {
+        if (genhash_find(h, keys[picks[i]]) != NULL) {
+            hits++;
+        }
+    }
+    start = (now() - start) * 1e9 / CACHE_LOOKUPS;
+
+    cb_assert(hits > 0);
+    genhash_free(h);
+    return start;
+}
+
+int main(int argc, char **argv) {
+    int *multiget_picks;
+    int *cache_picks;
+    double fill_ns;
+    int i;
+
+    if (argc > 1) {
+        num_keys = atoi(argv[1]);
+        cb_assert(num_keys > 0);
+    }
+
+    setup();
+
+    multiget_picks = calloc(MULTIGET_REQUESTS * MULTIGET_KEYS, sizeof(int));
+    cache_picks = calloc(CACHE_LOOKUPS, sizeof(int));
+    cb_assert(multiget_picks != NULL && cache_picks != NULL);
+
+    for (i = 0; i < MULTIGET_REQUESTS * MULTIGET_KEYS; i++) {
+        multiget_picks[i] = zipf_key();
+    }
+    for (i = 0; i < CACHE_LOOKUPS; i++) {
+        cache_picks[i] = zipf_key();
+    }
+
+    printf("keys %d, zipf s=0.99\n", num_keys);
+    printf("multiget (%d keys/request), ns per key\n", MULTIGET_KEYS);
+    printf("  chained\t%.1f\n", bench_multiget(genhash_init, multiget_picks));
+    printf("  open\t\t%.1f\n", bench_multiget(genhash_init_open, multiget_picks));
+
+    printf("cache lookups (50%% hit), ns per lookup\n");
+    printf("  chained\t%.1f", bench_cache(genhash_init, cache_picks, &fill_ns));
+    printf("\t(fill %.1f)\n", fill_ns);
+    printf("  open\t\t%.1f", bench_cache(genhash_init_open, cache_picks, &fill_ns));
+    printf("\t(fill %.1f)\n", fill_ns);
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "src/config.h"
+#include <platform/cbassert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <src/genhash.h>
+
+static int str_eq(const void *a, const void *b) {
+    return strcmp(a, b) == 0;
+}
+
+static void *str_dup(const void *a) {
+    return strdup(a);
+}
+
+static struct hash_ops str_ops = {
+    .hashfunc = genhash_string_hash,
+    .hasheq = str_eq,
+    .dupKey = str_dup,
+    .dupValue = str_dup,
+    .freeKey = free,
+    .freeValue = free
+};
+
+static void count_cb(const void *key, const void *val, void *arg) {
+    (void)key;
+    (void)val;
+    (*(int *)arg)++;
+}
+
+static void testGrow(genhash_t *h) {
+    char key[32];
+    char val[32];
+    int i;
+    int n = 0;
+
+    cb_assert(h != NULL);
+
+    for (i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(val, sizeof(val), "val-%d", i);
+        genhash_store(h, key, val);
+        cb_assert(genhash_size(h) == i + 1);
+    }
+
+    for (i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(val, sizeof(val), "val-%d", i);
+        cb_assert(strcmp(genhash_find(h, key), val) == 0);
+    }
+
+    genhash_iter(h, count_cb, &n);
+    cb_assert(n == 10000);
+
+    for (i = 0; i < 10000; i += 2) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        cb_assert(genhash_delete(h, key) == 1);
+        cb_assert(genhash_find(h, key) == NULL);
+    }
+    cb_assert(genhash_size(h) == 5000);
+
+    for (i = 1; i < 10000; i += 2) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        cb_assert(genhash_find(h, key) != NULL);
+    }
+
+    genhash_clear(h);
+    cb_assert(genhash_size(h) == 0);
+    cb_assert(genhash_find(h, "key-1") == NULL);
+
+    genhash_free(h);
+}
+
+static void testDuplicates(void) {
+    genhash_t *h;
+    char key[32];
+    char val[32];
+    int i;
+
+    h = genhash_init(1, str_ops);
+    cb_assert(h != NULL);
+
+    /* Keep storing the same keys while the table resizes underneath, */
+    /* the most recently stored value must always be the one found. */
+    for (i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i % 100);
+        snprintf(val, sizeof(val), "val-%d", i);
+        genhash_store(h, key, val);
+        cb_assert(strcmp(genhash_find(h, key), val) == 0);
+
+        snprintf(key, sizeof(key), "other-%d", i);
+        genhash_store(h, key, val);
+    }
+
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        snprintf(val, sizeof(val), "val-%d", 4900 + i);
+        cb_assert(strcmp(genhash_find(h, key), val) == 0);
+        cb_assert(genhash_size_for_key(h, key) == 50);
+    }
+
+    cb_assert(genhash_delete_all(h, "key-7") == 50);
+    cb_assert(genhash_find(h, "key-7") == NULL);
+    cb_assert(genhash_size(h) == 5000 + 5000 - 50);
+
+    genhash_free(h);
+}
+
+static void testOpenReplace(void) {
+    genhash_t *h;
+    char key[32];
+    char val[32];
+    int i;
+
+    h = genhash_init_open(1, str_ops);
+    cb_assert(h != NULL);
+
+    /* Keys are unique in an open table, stores replace. */
+    for (i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i % 100);
+        snprintf(val, sizeof(val), "val-%d", i);
+        genhash_store(h, key, val);
+        cb_assert(strcmp(genhash_find(h, key), val) == 0);
+        cb_assert(genhash_size_for_key(h, key) == 1);
+    }
+    cb_assert(genhash_size(h) == 100);
+
+    cb_assert(genhash_update(h, "key-1", "x") == MODIFICATION);
+    cb_assert(genhash_update(h, "new", "y") == NEW);
+    cb_assert(strcmp(genhash_find(h, "key-1"), "x") == 0);
+    cb_assert(genhash_size(h) == 101);
+
+    cb_assert(genhash_delete_all(h, "key-7") == 1);
+    cb_assert(genhash_delete(h, "key-7") == 0);
+    cb_assert(genhash_size(h) == 100);
+
+    /* Deleting must not lose entries displaced past the hole. */
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        cb_assert((genhash_find(h, key) == NULL) == (i == 7));
+    }
+
+    genhash_free(h);
+}
+
+int main(void) {
+    testGrow(genhash_init(1, str_ops));
+    testGrow(genhash_init_open(1, str_ops));
+    testDuplicates();
+    testOpenReplace();
+    return 0;
+}
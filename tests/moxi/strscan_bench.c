@@ -0,0 +1,151 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Compares the byte at a time token scan that the ascii request
+ * tokenizers used to do with strscan_token_end(), over multiget
+ * request lines shaped like proxy traffic: "get" followed by tens to
+ * hundreds of 10-60 byte keys.
+ *
+ * Usage: moxi_strscan_bench [keys_per_line]
+ */
+
+#include "src/config.h"
+#include <platform/cbassert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <src/strscan.h>
+
+#define NUM_LINES 64
+#define ITERATIONS 2000
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static char *slow_token_end(char *s) {
+    while (*s != ' ' && *s != '\0') {
+        s++;
+    }
+    return s;
+}
+
+static char *make_line(int num_keys) {
+    static const char alpha[] = "abcdefghijklmnopqrstuvwxyz0123456789:_";
+    char *line = malloc(num_keys * 64 + 8);
+    char *p = line;
+    int i;
+    int j;
+
+    cb_assert(line != NULL);
+
+    p += sprintf(p, "get");
+    for (i = 0; i < num_keys; i++) {
+        int key_len = 10 + rand() % 51;
+        *p++ = ' ';
+        for (j = 0; j < key_len; j++) {
+            *p++ = alpha[rand() % (sizeof(alpha) - 1)];
+        }
+    }
+    *p = '\0';
+
+    return line;
+}
+
+static size_t count_slow(char **lines, size_t *bytes) {
+    size_t ntokens = 0;
+    int i;
+
+    for (i = 0; i < NUM_LINES; i++) {
+        char *s = lines[i];
+        char *e;
+        for (;;) {
+            while (*s == ' ') {
+                s++;
+            }
+            e = slow_token_end(s);
+            if (s == e) {
+                break;
+            }
+            ntokens++;
+            s = e;
+        }
+        *bytes += s - lines[i];
+    }
+
+    return ntokens;
+}
+
+static size_t count_fast(char **lines, size_t *bytes) {
+    size_t ntokens = 0;
+    int i;
+
+    for (i = 0; i < NUM_LINES; i++) {
+        char *s = lines[i];
+        char *e;
+        for (;;) {
+            s = strscan_skip_spaces(s);
+            e = strscan_token_end(s);
+            if (s == e) {
+                break;
+            }
+            ntokens++;
+            s = e;
+        }
+        *bytes += s - lines[i];
+    }
+
+    return ntokens;
+}
+
+static void bench(const char *name,
+                  size_t (*fn)(char **, size_t *),
+                  char **lines) {
+    size_t ntokens = 0;
+    size_t bytes = 0;
+    double start = now();
+    double secs;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        ntokens += fn(lines, &bytes);
+    }
+
+    secs = now() - start;
+
+    printf("%-8s %10zu tokens %8.1f MB %8.3f secs %8.1f MB/s\n",
+           name, ntokens, bytes / 1048576.0, secs,
+           bytes / 1048576.0 / secs);
+}
+
+int main(int argc, char **argv) {
+    int num_keys = argc > 1 ? atoi(argv[1]) : 100;
+    char *lines[NUM_LINES];
+    size_t b0 = 0;
+    size_t b1 = 0;
+    int i;
+
+    cb_assert(num_keys > 0);
+
+    srand(42);
+    for (i = 0; i < NUM_LINES; i++) {
+        lines[i] = make_line(num_keys);
+    }
+
+    cb_assert(count_slow(lines, &b0) == count_fast(lines, &b1));
+    cb_assert(b0 == b1);
+
+    printf("%d lines of get + %d keys\n", NUM_LINES, num_keys);
+    bench("scalar", count_slow, lines);
+    bench("strscan", count_fast, lines);
+
+    for (i = 0; i < NUM_LINES; i++) {
+        free(lines[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "src/config.h"
+#include <platform/cbassert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <src/strscan.h>
+
+static const char *slow_token_end(const char *s) {
+    while (*s != ' ' && *s != '\0') {
+        s++;
+    }
+    return s;
+}
+
+/* Every token length crossing every load alignment. */
+static void testAlignments(void) {
+    char buf[256];
+    int off;
+    int len;
+
+    for (off = 0; off < 64; off++) {
+        for (len = 0; len < 150; len++) {
+            char *s = buf + off;
+
+            memset(buf, 'x', sizeof(buf));
+            s[len] = ' ';
+            s[len + 1] = '\0';
+            cb_assert(strscan_token_end(s) == s + len);
+
+            s[len] = '\0';
+            cb_assert(strscan_token_end(s) == s + len);
+        }
+    }
+}
+
+/* Leading bytes before s that match must be ignored. */
+static void testLeadingBytes(void) {
+    char buf[128];
+    int off;
+
+    for (off = 1; off < 64; off++) {
+        memset(buf, ' ', sizeof(buf));
+        buf[off - 1] = '\0';
+        memcpy(buf + off, "key", 3);
+        cb_assert(strscan_token_end(buf + off) == buf + off + 3);
+    }
+}
+
+static void testCommandLine(void) {
+    const char *line = "get  a bb   ccc dddd";
+    const char *p = line;
+    int ntokens = 0;
+
+    while (*(p = strscan_skip_spaces(p)) != '\0') {
+        const char *e = strscan_token_end(p);
+        cb_assert(e == slow_token_end(p));
+        ntokens++;
+        p = e;
+    }
+
+    cb_assert(ntokens == 5);
+    cb_assert(strscan_skip_spaces("") == strscan_token_end(""));
+}
+
+int main(void) {
+    testAlignments();
+    testLeadingBytes();
+    testCommandLine();
+    return 0;
+}